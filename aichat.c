@@ -1,10 +1,28 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <curl/curl.h>
 
@@ -12,435 +30,5130 @@
 
 #include "aichat.h"
 
+static_assert (sizeof (struct aichat_ledger_header) == AICHAT_LEDGER_RECORD_SIZE, "the ledger header must be as large as a record");
+static_assert (sizeof (struct aichat_ledger_record) == AICHAT_LEDGER_RECORD_SIZE, "ledger records must be AICHAT_LEDGER_RECORD_SIZE bytes");
+static_assert (AICHAT_STORE_KEY_LENGTH == AICHAT_CACHE_KEY_LENGTH, "runs in the message store are named with the hash of cache entries");
+
 struct
-aichat_api_call_state
+aichat_cassette_entry
 {
-  json_object  *object;
-  json_tokener *tokener;
+  char *request;
+  unsigned long int request_length;
+
+  char *response;
+  unsigned long int response_length;
 };
 
-static char *
-aichat_session_current_buffer_position (struct aichat_session *session)
+struct
+aichat_client
 {
-  return session->buffer + (AICHAT_SESSION_BUFFER_SIZE - session->buffer_remaining);
-}
+  CURL   *curl;
+  CURLSH *share;
 
-static bool
-aichat_session_can_accomodate (struct aichat_session *session, const char *text)
-{
-  // we need enough space to add the text and a null terminator
-  return session->buffer_remaining >= strlen (text) + 1;
-}
+  char *url;
+  char *ca_file;
 
-void
-aichat_session_initialize (struct aichat_session *session)
-{
-  session->message_count = 0;
-  session->buffer_remaining = AICHAT_SESSION_BUFFER_SIZE;
+  // responses are kept here when the cache is enabled, see aichat_client_set_cache
+  char *cache_directory;
+  unsigned long int cache_max_size;
+  long int cache_ttl;
 
-  session->model = AICHAT_MODEL_GPT_3_5_TURBO;
-  session->temperature = 0.7;
-}
+  // exchanges are appended to the cassette when recording and served from it when replaying
+  enum aichat_cassette_mode cassette_mode;
+  char *cassette_path;
+  struct aichat_cassette_entry *cassette;
+  unsigned long int cassette_count;
 
-int
-aichat_session_initialize_from_json_file (struct aichat_session *session, FILE *file)
+  // a file descriptor of the ledger opened for appending, -1 without a ledger
+  int ledger;
+
+  // see aichat_client_set_retry_policy, the random state spreads out the retries of many clients
+  unsigned int max_retries;
+  double retry_base_delay;
+  double retry_max_delay;
+  uint64_t random_state;
+
+  struct aichat_rate_limits rate_limits;
+
+  // the token bucket shared with other processes, NULL without a scheduler
+  int scheduler_fd;
+  struct aichat_scheduler_bucket *scheduler;
+  long int requests_per_minute;
+  long int tokens_per_minute;
+
+  // see aichat_client_set_hedging, the multi handle and the second easy handle are created by the first
+  // request that may be hedged
+  double hedge_delay;
+  double hedge_percentile;
+  double hedge_samples [AICHAT_HEDGE_SAMPLES];
+  unsigned int hedge_sample_count;
+  unsigned int hedge_sample_next;
+  CURLM *multi;
+  CURL *hedge_curl;
+};
+
+// the file behind the scheduler, updated in place under flock
+struct
+aichat_scheduler_bucket
 {
-  aichat_session_initialize (session);
+  char magic [8];
+  uint32_t version;
+  uint32_t size;
 
-  char *buffer = NULL;
-  long unsigned int current_size = 0;
+  double requests;
+  double tokens;
+
+  // when the bucket was last refilled, CLOCK_MONOTONIC is the same for every process
+  double updated;
+};
 
-  FILE *buffer_file = open_memstream (&buffer, &current_size);
+struct
+aichat_api_call_state
+{
+  json_object  *object;
+  json_tokener *tokener;
 
-  char c = fgetc (file);
+  // streaming responses arrive as server-sent events, one chat completion chunk per event
+  aichat_stream_callback stream_callback;
+  void *stream_userdata;
 
-  while (c != EOF)
-  {
-    fputc (c, buffer_file);
-    c = fgetc (file);
-  }
+  bool started;
+  bool streaming;
+  bool stream_done;
+  int  stream_error;
 
-  fflush (buffer_file);
+  char *line;
+  unsigned long int line_length;
+  unsigned long int line_capacity;
 
-  json_object *object = json_tokener_parse (buffer);
-  fclose (buffer_file); free (buffer);
+  char *event;
+  unsigned long int event_length;
+  unsigned long int event_capacity;
 
-  if (object == NULL)
-  {
-    return -AICHAT_ERROR_JSON_PARSE;
-  }
+  FILE *content_file;
+  char *content;
+  unsigned long int content_length;
 
-  json_object *messages = json_object_object_get (object, "messages");
+  int prompt_tokens;
+  int completion_tokens;
 
-  if (messages == NULL) goto aichat_session_initialize_from_json_file_error;
+  // set once a part of a streamed response was handed to the stream callback, it cannot be taken back
+  bool delivered;
 
-  int message_count = json_object_array_length (messages);
+  // the status of the response, 0 until its status line arrived
+  long int status;
 
-  for (int i = 0; i < message_count; i++)
-  {
-    json_object *message = json_object_array_get_idx (messages, i);
+  // points at the first of two hedged requests whose successful response started, NULL when not hedging
+  struct aichat_api_call_state **race;
 
-    if (message == NULL) goto aichat_session_initialize_from_json_file_error;
+  // what the headers of the response said about the rate limits
+  struct aichat_rate_limits limits;
 
-    json_object *role    = json_object_object_get (message, "role");
-    json_object *content = json_object_object_get (message, "content");
+  // the response exactly as it was received, only kept while recording a cassette
+  bool recording;
+  char *recorded;
+  unsigned long int recorded_length;
+  unsigned long int recorded_capacity;
+};
 
-    if (role == NULL || content == NULL) goto aichat_session_initialize_from_json_file_error;
+static void
+aichat_rate_limits_clear (struct aichat_rate_limits *limits)
+{
+  limits->limit_requests = -1;
+  limits->limit_tokens = -1;
+  limits->remaining_requests = -1;
+  limits->remaining_tokens = -1;
+  limits->reset_requests = -1;
+  limits->reset_tokens = -1;
+  limits->retry_after = -1;
+  limits->received = 0;
+}
 
-    const char *role_string = json_object_get_string (role);
-    const char *content_string = json_object_get_string (content);
+struct aichat_client *
+aichat_client_initialize (void)
+{
+  struct aichat_client *client = calloc (1, sizeof (struct aichat_client));
 
-    if (role_string == NULL || content_string == NULL) goto aichat_session_initialize_from_json_file_error;
+  if (client == NULL)
+    return NULL;
 
-    enum aichat_role role_enum;
+  client->ledger = -1;
+  client->scheduler_fd = -1;
+  client->max_retries = AICHAT_DEFAULT_MAX_RETRIES;
+  client->retry_base_delay = AICHAT_DEFAULT_RETRY_BASE_DELAY;
+  client->retry_max_delay = AICHAT_DEFAULT_RETRY_MAX_DELAY;
+  client->random_state = ((uint64_t) time (NULL) << 20) ^ ((uint64_t) getpid () << 40) ^ (uintptr_t) client ^ 1;
+  aichat_rate_limits_clear (&client->rate_limits);
 
-    if (strcmp (role_string, "user") == 0)
-    {
-      role_enum = AICHAT_ROLE_USER;
-    }
-    else if (strcmp (role_string, "system") == 0)
-    {
-      role_enum = AICHAT_ROLE_SYSTEM;
-    }
-    else if (strcmp (role_string, "assistant") == 0)
-    {
-      role_enum = AICHAT_ROLE_ASSISTANT;
-    }
-    else goto aichat_session_initialize_from_json_file_error;
-   
-    int result = aichat_session_add_message (session, role_enum, content_string);
+  client->curl = curl_easy_init ();
+  client->share = curl_share_init ();
 
-    if (result < 0)
-    {
-      return result;
-    }
+  if (client->curl == NULL || client->share == NULL || aichat_client_set_base_url (client, AICHAT_DEFAULT_BASE_URL) < 0)
+  {
+    aichat_client_free (client);
+    return NULL;
   }
 
-  json_object_put (object);
-  return 0;
+  // share resolved addresses, TLS sessions and open connections between all requests made by this client
+  curl_share_setopt (client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt (client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
 
-aichat_session_initialize_from_json_file_error:
-  json_object_put (object);
-  return -AICHAT_ERROR_JSON_PARSE;
+  return client;
 }
 
-
-int
-aichat_session_add_message (struct aichat_session *session, enum aichat_role role, const char *text)
+void
+aichat_client_free (struct aichat_client *client)
 {
-  if (session->message_count >= AICHAT_SESSION_MAX_MESSAGES)
-    return -AICHAT_ERROR_SESSION_FULL;
-  
-  // including the null terminator we need to have space for the message
-  if (aichat_session_can_accomodate (session, text) == false)
-    return -AICHAT_ERROR_SESSION_BUFFER_FULL;
+  if (client == NULL)
+    return;
 
-  struct aichat_message *message = &session->messages[session->message_count];
-  message->role = role;
-  message->text = aichat_session_current_buffer_position (session);
+  // the easy handles must let go of the share before the share can be cleaned up
+  if (client->multi)
+    curl_multi_cleanup (client->multi);
 
-  // make sure to include the null terminator
-  strcpy (message->text, text); // this will copy the null terminator as well
-  session->buffer_remaining -= strlen (text) + 1; // +1 for the null terminator
-  session->message_count++; // increment the message count
+  if (client->curl)
+    curl_easy_cleanup (client->curl);
 
-  return 0;
+  if (client->hedge_curl)
+    curl_easy_cleanup (client->hedge_curl);
+
+  if (client->share)
+    curl_share_cleanup (client->share);
+
+  free (client->url);
+  free (client->ca_file);
+  free (client->cache_directory);
+  aichat_client_set_cassette (client, NULL, AICHAT_CASSETTE_OFF);
+  aichat_client_set_ledger (client, NULL);
+  aichat_client_set_scheduler (client, NULL, 0, 0);
+  free (client);
 }
 
 int
-aichat_session_add_message_from_file (struct aichat_session *session, enum aichat_role role, FILE *file)
+aichat_client_set_base_url (struct aichat_client *client, const char *base_url)
 {
-  if (session->message_count >= AICHAT_SESSION_MAX_MESSAGES)
-    return -AICHAT_ERROR_SESSION_FULL;
-
-  struct aichat_message *message = &session->messages[session->message_count];
-  message->role = role;
-  message->text = aichat_session_current_buffer_position (session);
-
-  unsigned int read = fread (message->text, 1, session->buffer_remaining, file);
+  unsigned long int length = strlen (base_url);
 
-  if (ferror (file) != 0)
-    return -AICHAT_ERROR_IO;
+  // allow the base url to be given with or without a trailing slash
+  while (length > 0 && base_url[length - 1] == '/')
+    length--;
 
-  if (read == session->buffer_remaining)
-    return -AICHAT_ERROR_SESSION_BUFFER_FULL;
+  char *url = NULL;
 
-  message->text[read] = '\0';
+  if (asprintf (&url, "%.*s/chat/completions", (int) length, base_url) < 0)
+    return -AICHAT_ERROR_MEMORY;
 
-  session->buffer_remaining -= read + 1;
-  session->message_count++;
+  free (client->url);
+  client->url = url;
 
   return 0;
 }
 
 int
-aichat_session_print_last_message (struct aichat_session *session, FILE *file)
+aichat_client_set_ca_file (struct aichat_client *client, const char *ca_file)
 {
-  if (session->message_count == 0)
-    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+  char *copy = NULL;
 
-  struct aichat_message *message = &session->messages[session->message_count - 1];
+  if (ca_file && (copy = strdup (ca_file)) == NULL)
+    return -AICHAT_ERROR_MEMORY;
 
-  fprintf (file, "%s", message->text);
+  free (client->ca_file);
+  client->ca_file = copy;
 
   return 0;
 }
 
 int
-aichat_session_remove_last_message (struct aichat_session *session)
+aichat_client_set_cache (struct aichat_client *client, const char *directory, unsigned long int max_size, long int ttl)
 {
-  if (session->message_count == 0)
-    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+  char *copy = NULL;
 
-  struct aichat_message *message = &session->messages[session->message_count - 1];
+  if (directory)
+  {
+    if (mkdir (directory, 0700) < 0 && errno != EEXIST)
+      return -AICHAT_ERROR_IO;
 
-  session->buffer_remaining += strlen (message->text) + 1;
-  session->message_count--;
+    if ((copy = strdup (directory)) == NULL)
+      return -AICHAT_ERROR_MEMORY;
+  }
+
+  free (client->cache_directory);
+  client->cache_directory = copy;
+  client->cache_max_size = max_size;
+  client->cache_ttl = ttl;
 
   return 0;
 }
 
-static json_object *
-aichat_message_to_json_object (struct aichat_message *message)
+static int
+aichat_cassette_load (struct aichat_client *client, FILE *file)
 {
-  json_object *jobj = json_object_new_object();
+  char *line = NULL;
+  size_t line_capacity = 0;
+  unsigned long int capacity = 0;
+  int error = 0;
 
-  switch (message->role)
+  while (getline (&line, &line_capacity, file) >= 0)
   {
-    case AICHAT_ROLE_SYSTEM:
-      json_object_object_add (jobj, "role", json_object_new_string ("system"));
-      break;
-    case AICHAT_ROLE_USER:
-      json_object_object_add (jobj, "role", json_object_new_string ("user"));
+    if (strspn (line, " \t\r\n") == strlen (line))
+      continue;
+
+    json_object *jentry = json_tokener_parse (line);
+    json_object *jrequest, *jresponse;
+
+    if (jentry == NULL || json_object_object_get_ex (jentry, "request", &jrequest) == false ||
+        json_object_object_get_ex (jentry, "response", &jresponse) == false)
+    {
+      json_object_put (jentry);
+      error = -AICHAT_ERROR_JSON_PARSE;
       break;
-    case AICHAT_ROLE_ASSISTANT:
-      json_object_object_add (jobj, "role", json_object_new_string ("assistant"));
+    }
+
+    if (client->cassette_count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 16;
+      struct aichat_cassette_entry *larger = realloc (client->cassette, capacity * sizeof (struct aichat_cassette_entry));
+
+      if (larger == NULL)
+      {
+        json_object_put (jentry);
+        error = -AICHAT_ERROR_MEMORY;
+        break;
+      }
+
+      client->cassette = larger;
+    }
+
+    struct aichat_cassette_entry *entry = &client->cassette[client->cassette_count];
+
+    entry->request_length = json_object_get_string_len (jrequest);
+    entry->response_length = json_object_get_string_len (jresponse);
+    entry->request = strdup (json_object_get_string (jrequest));
+    entry->response = strdup (json_object_get_string (jresponse));
+    json_object_put (jentry);
+
+    if (entry->request == NULL || entry->response == NULL)
+    {
+      free (entry->request);
+      free (entry->response);
+      error = -AICHAT_ERROR_MEMORY;
       break;
-  }
+    }
 
-  json_object_object_add (jobj, "content", json_object_new_string (message->text));
-  return jobj;
-}
+    client->cassette_count++;
+  }
 
-char *
-aichat_message_to_json (struct aichat_message *message, unsigned long int *length)
-{
+  free (line);
 
-  json_object *jobj = aichat_message_to_json_object (message);
-  char *json = strdup (json_object_to_json_string_length (jobj, JSON_C_TO_STRING_PLAIN, length));
+  if (error == 0 && ferror (file))
+    error = -AICHAT_ERROR_IO;
 
-  json_object_put (jobj);
-  return json;
+  return error;
 }
 
-static json_object *
-aichat_session_to_json_object (struct aichat_session *session)
+int
+aichat_client_set_cassette (struct aichat_client *client, const char *path, enum aichat_cassette_mode mode)
 {
-  json_object *jobj = json_object_new_object();
+  for (unsigned long int i = 0; i < client->cassette_count; i++)
+  {
+    free (client->cassette[i].request);
+    free (client->cassette[i].response);
+  }
 
-  const char *model_string = session->model == AICHAT_MODEL_GPT_3_5_TURBO ? "gpt-3.5-turbo" : "gpt-3.5-turbo-16k";
-  json_object_object_add (jobj, "model", json_object_new_string (model_string));
+  free (client->cassette);
+  free (client->cassette_path);
 
-  json_object_object_add (jobj, "temperature", json_object_new_double (session->temperature));
+  client->cassette = NULL;
+  client->cassette_count = 0;
+  client->cassette_path = NULL;
+  client->cassette_mode = AICHAT_CASSETTE_OFF;
 
-  json_object *jmsgs = json_object_new_array ();
+  if (mode == AICHAT_CASSETTE_OFF || path == NULL)
+    return 0;
 
-  for (unsigned int i = 0; i < session->message_count; i++)
+  if ((client->cassette_path = strdup (path)) == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  if (mode == AICHAT_CASSETTE_REPLAY)
   {
-    json_object *jmsg = aichat_message_to_json_object (&session->messages[i]);
-    json_object_array_add (jmsgs, jmsg);
-  }
+    FILE *file = fopen (path, "r");
 
-  json_object_object_add (jobj, "messages", jmsgs);
+    if (file == NULL)
+      return -AICHAT_ERROR_IO;
 
-  return jobj;
+    int error = aichat_cassette_load (client, file);
+    fclose (file);
+
+    if (error < 0)
+    {
+      aichat_client_set_cassette (client, NULL, AICHAT_CASSETTE_OFF);
+      return error;
+    }
+  }
+
+  client->cassette_mode = mode;
+  return 0;
 }
 
 int
-aichat_session_write_to_json_file (struct aichat_session *session, FILE *file)
+aichat_client_set_retry_policy (struct aichat_client *client, unsigned int max_retries, double base_delay, double max_delay)
 {
-  json_object *jobj = aichat_session_to_json_object (session);
-  fprintf (file, "%s", json_object_to_json_string_ext (jobj, JSON_C_TO_STRING_PRETTY));
-  json_object_put (jobj);
+  client->max_retries = max_retries;
+  client->retry_base_delay = base_delay > 0 ? base_delay : 0;
+  client->retry_max_delay = max_delay > client->retry_base_delay ? max_delay : client->retry_base_delay;
+
   return 0;
 }
 
-char *
-aichat_session_to_json (struct aichat_session *session, unsigned long int *length)
+void
+aichat_client_get_rate_limits (struct aichat_client *client, struct aichat_rate_limits *limits)
 {
-  json_object *jobj = aichat_session_to_json_object (session);
-  char *json = strdup (json_object_to_json_string_length (jobj, JSON_C_TO_STRING_PLAIN, length));
-
-  json_object_put (jobj);
-  return json;
+  *limits = client->rate_limits;
 }
 
-
-unsigned long int
-aichat_api_call_write_callback (char *buffer, unsigned long int size, unsigned long int n, void *userdata)
+double
+aichat_client_rate_limit_delay (struct aichat_client *client)
 {
-  /* calculate the real size of the incoming buffer */
-  unsigned long int realsize = size * n;
-  
-  struct aichat_api_call_state *state = (struct aichat_api_call_state *) userdata;
+  struct aichat_rate_limits *limits = &client->rate_limits;
+  double delay = limits->retry_after;
 
-  /* parse the received data */
-  state->object = json_tokener_parse_ex (state->tokener, buffer, realsize);
+  if (limits->remaining_requests == 0 && limits->reset_requests > delay)
+    delay = limits->reset_requests;
 
-  /* check for errors */
-  enum json_tokener_error jerr = json_tokener_get_error (state->tokener);
-  if (jerr != json_tokener_success && jerr != json_tokener_continue) {
-      return 0; /* tell libcurl to stop the download */
-  }
+  if (limits->remaining_tokens == 0 && limits->reset_tokens > delay)
+    delay = limits->reset_tokens;
 
-  return realsize;
+  delay -= aichat_now () - limits->received;
+  return delay > 0 ? delay : 0;
 }
 
-struct aichat_api_call_state *
-aichat_api_call_state_initialize (void)
+int
+aichat_client_set_ledger (struct aichat_client *client, const char *path)
 {
-  struct aichat_api_call_state *state = malloc (sizeof (struct aichat_api_call_state));
-  state->tokener = json_tokener_new ();
-  state->object = NULL;
-  return state;
-}
+  if (client->ledger >= 0)
+    close (client->ledger);
 
-void
-aichat_api_call_state_free (struct aichat_api_call_state *state)
-{
-  json_tokener_free (state->tokener);
-  json_object_put (state->object);
-  free (state);
-}
+  client->ledger = -1;
 
-char *
-aichat_api_call_state_resolve (struct aichat_api_call_state *state, struct aichat_api_call_results *results)
-{
-  enum json_tokener_error jerr = json_tokener_get_error (state->tokener);
+  if (path == NULL)
+    return 0;
 
-  if (jerr != json_tokener_success)
-  {
-    results->error = AICHAT_ERROR_JSON_PARSE;
-    return NULL;
-  }
+  int fd = open (path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
 
-  // check if the response is an error
-  json_object *jerror = NULL;
-  if (json_object_object_get_ex (state->object, "error", &jerror))
+  if (fd < 0)
+    return -AICHAT_ERROR_IO;
+
+  // whoever finds the ledger empty writes the header, everybody else waits for it and checks it
+  struct aichat_ledger_header header;
+  int error = 0;
+
+  if (flock (fd, LOCK_EX) != 0)
   {
-    results->error = AICHAT_ERROR_API_ERROR;
-    return NULL;
+    close (fd);
+    return -AICHAT_ERROR_IO;
   }
 
-  // otherwise extract .usage.prompt_tokens, .usage.completion_tokens and store in results
-  json_object *jusage = NULL;
-  if (json_object_object_get_ex (state->object, "usage", &jusage))
-  {
-    json_object *jprompt_tokens = NULL;
-    json_object *jcompletion_tokens = NULL;
+  ssize_t size = pread (fd, &header, sizeof (header), 0);
 
-    if (json_object_object_get_ex (jusage, "prompt_tokens", &jprompt_tokens))
-    {
-      results->prompt_tokens = json_object_get_int (jprompt_tokens);
-    }
+  if (size == 0)
+  {
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, AICHAT_LEDGER_MAGIC, sizeof (header.magic));
+    header.version = AICHAT_LEDGER_VERSION;
+    header.record_size = AICHAT_LEDGER_RECORD_SIZE;
 
-    if (json_object_object_get_ex (jusage, "completion_tokens", &jcompletion_tokens))
-    {
-      results->completion_tokens = json_object_get_int (jcompletion_tokens);
-    }
+    if (write (fd, &header, sizeof (header)) != sizeof (header))
+      error = -AICHAT_ERROR_IO;
   }
-
-  // extract the response from .choices[0].message.content and return a strdup of it
-  json_object *jchoices = NULL;
-  if (json_object_object_get_ex (state->object, "choices", &jchoices))
+  else if (size < 0)
   {
-    json_object *jchoice = json_object_array_get_idx (jchoices, 0);
-    json_object *jmessage = NULL;
-    if (json_object_object_get_ex (jchoice, "message", &jmessage))
-    {
-      json_object *jcontent = NULL;
-      if (json_object_object_get_ex (jmessage, "content", &jcontent))
-      {
-        const char *content = json_object_get_string (jcontent);
-        results->error = 0;
-        return strdup (content);
-      }
-    }
+    error = -AICHAT_ERROR_IO;
+  }
+  else if (size != sizeof (header) || memcmp (header.magic, AICHAT_LEDGER_MAGIC, sizeof (header.magic)) != 0 ||
+           header.version != AICHAT_LEDGER_VERSION || header.record_size != AICHAT_LEDGER_RECORD_SIZE)
+  {
+    error = -AICHAT_ERROR_LEDGER_FORMAT;
   }
 
-  // if we get here, something went wrong so return NULL and set error
-  results->error = AICHAT_ERROR_API_RESPONSE;
-  return NULL;
-}
-
-char *
-aichat_api_call_do (const char *data, unsigned long int data_strlen, const char *key, struct aichat_api_call_results *results)
-{
-  // now we need to send the json to the api using curl printing the response to stdout
-  CURL *curl = curl_easy_init ();
+  flock (fd, LOCK_UN);
 
-  if (curl == NULL)
+  if (error < 0)
   {
-    results->error = AICHAT_ERROR_CURL_INITIALIZATION;
-    return NULL;
+    close (fd);
+    return error;
   }
 
-  struct aichat_api_call_state *state = aichat_api_call_state_initialize ();
+  client->ledger = fd;
+  return 0;
+}
 
-  // set the appropriate headers
-  struct curl_slist *headers = NULL;
-  headers = curl_slist_append (headers, "Content-Type: application/json");
-  headers = curl_slist_append (headers, "Accept: application/json");
+int
+aichat_client_set_hedging (struct aichat_client *client, double delay, double percentile)
+{
+  client->hedge_delay = delay > 0 ? delay : 0;
+  client->hedge_percentile = percentile > 0 && percentile < 100 ? percentile : 0;
+  client->hedge_sample_count = 0;
+  client->hedge_sample_next = 0;
 
-  if (key)
-  {
+  return 0;
+}
+
+static bool
+aichat_client_hedging (struct aichat_client *client)
+{
+  return client && (client->hedge_delay > 0 || client->hedge_percentile > 0);
+}
+
+int
+aichat_client_set_scheduler (struct aichat_client *client, const char *path, long int requests_per_minute, long int tokens_per_minute)
+{
+  if (client->scheduler)
+    munmap (client->scheduler, sizeof (struct aichat_scheduler_bucket));
+
+  if (client->scheduler_fd >= 0)
+    close (client->scheduler_fd);
+
+  client->scheduler = NULL;
+  client->scheduler_fd = -1;
+  client->requests_per_minute = requests_per_minute > 0 ? requests_per_minute : 0;
+  client->tokens_per_minute = tokens_per_minute > 0 ? tokens_per_minute : 0;
+
+  if (path == NULL)
+    return 0;
+
+  int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if (fd < 0)
+    return -AICHAT_ERROR_IO;
+
+  // whoever finds the file empty fills it in, an empty bucket that was never updated is refilled on first use
+  struct aichat_scheduler_bucket bucket;
+  struct stat status;
+  int error = 0;
+
+  if (flock (fd, LOCK_EX) != 0 || fstat (fd, &status) != 0)
+  {
+    close (fd);
+    return -AICHAT_ERROR_IO;
+  }
+
+  if (status.st_size == 0)
+  {
+    memset (&bucket, 0, sizeof (bucket));
+    memcpy (bucket.magic, AICHAT_SCHEDULER_MAGIC, sizeof (bucket.magic));
+    bucket.version = AICHAT_SCHEDULER_VERSION;
+    bucket.size = sizeof (bucket);
+
+    if (pwrite (fd, &bucket, sizeof (bucket), 0) != sizeof (bucket))
+      error = -AICHAT_ERROR_IO;
+  }
+  else if (status.st_size != sizeof (bucket) || pread (fd, &bucket, sizeof (bucket), 0) != sizeof (bucket) ||
+           memcmp (bucket.magic, AICHAT_SCHEDULER_MAGIC, sizeof (bucket.magic)) != 0 ||
+           bucket.version != AICHAT_SCHEDULER_VERSION || bucket.size != sizeof (bucket))
+  {
+    error = -AICHAT_ERROR_SCHEDULER_FORMAT;
+  }
+
+  flock (fd, LOCK_UN);
+
+  void *mapping = error < 0 ? MAP_FAILED : mmap (NULL, sizeof (bucket), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (mapping == MAP_FAILED)
+  {
+    close (fd);
+    return error < 0 ? error : -AICHAT_ERROR_IO;
+  }
+
+  client->scheduler_fd = fd;
+  client->scheduler = mapping;
+  return 0;
+}
+
+// the bucket holds a minute worth of requests and tokens and refills at that rate, must be called under the lock
+static void
+aichat_scheduler_refill (struct aichat_client *client, double now)
+{
+  struct aichat_scheduler_bucket *bucket = client->scheduler;
+  double elapsed = now - bucket->updated;
+
+  // the clock starts over after a reboot, a bucket that survived it is full again
+  if (elapsed < 0 || bucket->updated == 0)
+    elapsed = 60;
+
+  bucket->requests += elapsed * client->requests_per_minute / 60;
+  bucket->tokens += elapsed * client->tokens_per_minute / 60;
+  bucket->updated = now;
+
+  if (bucket->requests > client->requests_per_minute)
+    bucket->requests = client->requests_per_minute;
+
+  if (bucket->tokens > client->tokens_per_minute)
+    bucket->tokens = client->tokens_per_minute;
+}
+
+static int
+aichat_scheduler_lock (struct aichat_client *client)
+{
+  while (flock (client->scheduler_fd, LOCK_EX) != 0)
+  {
+    if (errno != EINTR)
+      return -AICHAT_ERROR_IO;
+  }
+
+  return 0;
+}
+
+// takes a request and the tokens out of the bucket when they are there and sets wait to 0, otherwise to
+// the seconds until they will be. A request larger than the bucket only waits for a full bucket.
+static int
+aichat_scheduler_try_acquire (struct aichat_client *client, long int tokens, double *wait)
+{
+  *wait = 0;
+
+  if (client == NULL || client->scheduler == NULL)
+    return 0;
+
+  struct aichat_scheduler_bucket *bucket = client->scheduler;
+
+  if (aichat_scheduler_lock (client) < 0)
+    return -AICHAT_ERROR_IO;
+
+  aichat_scheduler_refill (client, aichat_now ());
+
+  if (client->requests_per_minute > 0 && bucket->requests < 1)
+    *wait = (1 - bucket->requests) * 60 / client->requests_per_minute;
+
+  if (client->tokens_per_minute > 0)
+  {
+    double needed = tokens < client->tokens_per_minute ? tokens : client->tokens_per_minute;
+
+    if (bucket->tokens < needed && (needed - bucket->tokens) * 60 / client->tokens_per_minute > *wait)
+      *wait = (needed - bucket->tokens) * 60 / client->tokens_per_minute;
+  }
+
+  if (*wait == 0)
+  {
+    if (client->requests_per_minute > 0)
+      bucket->requests -= 1;
+
+    if (client->tokens_per_minute > 0)
+      bucket->tokens -= tokens;
+  }
+
+  flock (client->scheduler_fd, LOCK_UN);
+  return 0;
+}
+
+static void aichat_sleep (double seconds);
+
+// waits for the scheduler and adds how long that took to queue_time
+static int
+aichat_scheduler_acquire (struct aichat_client *client, long int tokens, double *queue_time)
+{
+  double start = aichat_now ();
+  double wait;
+  int error;
+
+  while ((error = aichat_scheduler_try_acquire (client, tokens, &wait)) == 0 && wait > 0)
+    aichat_sleep (wait);
+
+  *queue_time += aichat_now () - start;
+  return error;
+}
+
+// replaces the estimated tokens of a request with those it actually used, an overdraft delays later requests.
+// When the bucket cannot be locked it keeps the estimate, which only holds back later requests.
+static int
+aichat_scheduler_settle (struct aichat_client *client, long int estimated_tokens, long int used_tokens)
+{
+  if (client == NULL || client->scheduler == NULL || client->tokens_per_minute == 0)
+    return 0;
+
+  if (aichat_scheduler_lock (client) < 0)
+    return -AICHAT_ERROR_IO;
+
+  client->scheduler->tokens += estimated_tokens - used_tokens;
+
+  if (client->scheduler->tokens > client->tokens_per_minute)
+    client->scheduler->tokens = client->tokens_per_minute;
+
+  flock (client->scheduler_fd, LOCK_UN);
+  return 0;
+}
+
+// a failed request that reported no usage is assumed to have used nothing, a successful one its estimate
+static int
+aichat_scheduler_settle_results (struct aichat_client *client, long int estimated_tokens, struct aichat_api_call_results *results)
+{
+  long int used_tokens = results->prompt_tokens + results->completion_tokens;
+
+  if (used_tokens > 0 || results->error != 0)
+    return aichat_scheduler_settle (client, estimated_tokens, used_tokens);
+
+  return 0;
+}
+
+// the name of a cache entry is a 128 bit hash of the endpoint and the request body built from two unrelated
+// 64 bit hashes, the same request sent to another endpoint such as a mock server is another entry
+static void
+aichat_cache_key (const char *endpoint, const char *data, unsigned long int length, char key [AICHAT_CACHE_KEY_LENGTH + 1])
+{
+  uint64_t fnv = 14695981039346656037ULL;
+  uint64_t mix = 0x9E3779B97F4A7C15ULL ^ length;
+
+  // the terminating zero of the endpoint keeps it apart from the body
+  for (const char *c = endpoint; c; c = *c ? c + 1 : NULL)
+  {
+    fnv = (fnv ^ (unsigned char) *c) * 1099511628211ULL;
+    mix = (mix + (unsigned char) *c) * 0xFF51AFD7ED558CCDULL;
+    mix ^= mix >> 32;
+  }
+
+  for (unsigned long int i = 0; i < length; i++)
+  {
+    unsigned char c = data[i];
+
+    fnv = (fnv ^ c) * 1099511628211ULL;
+    mix = (mix + c) * 0xFF51AFD7ED558CCDULL;
+    mix ^= mix >> 32;
+  }
+
+  snprintf (key, AICHAT_CACHE_KEY_LENGTH + 1, "%016" PRIx64 "%016" PRIx64, fnv, mix);
+}
+
+static char *
+aichat_cache_entry_path (struct aichat_client *client, const char *key)
+{
+  char *path = NULL;
+
+  if (asprintf (&path, "%s/%s", client->cache_directory, key) < 0)
+    return NULL;
+
+  return path;
+}
+
+// The total size of the entries is kept in the file .size of the cache, so that storing a response only has to
+// list the cache once it is full. The file is locked while it is updated by the processes sharing the cache.
+// Returns a descriptor of the locked file, or -1.
+static int
+aichat_cache_size_lock (struct aichat_client *client)
+{
+  char *path = NULL;
+
+  if (asprintf (&path, "%s/.size", client->cache_directory) < 0)
+    return -1;
+
+  int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  free (path);
+
+  if (fd >= 0 && flock (fd, LOCK_EX) != 0)
+  {
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// adds delta to the total size of the cache and returns the new total, or -1 when the total is not known yet
+static int64_t
+aichat_cache_account (struct aichat_client *client, int64_t delta)
+{
+  int fd = aichat_cache_size_lock (client);
+  int64_t total = -1;
+
+  if (fd < 0)
+    return -1;
+
+  if (pread (fd, &total, sizeof (total), 0) == sizeof (total) && total >= 0)
+  {
+    // the total is only a hint, an entry that was removed by hand is found again by the next eviction
+    total = total + delta > 0 ? total + delta : 0;
+
+    if (pwrite (fd, &total, sizeof (total), 0) != sizeof (total))
+      total = -1;
+  }
+  else
+    total = -1;
+
+  close (fd);
+  return total;
+}
+
+// returns a copy of the cached response to the request with the given key, or NULL when there is none
+static char *
+aichat_cache_lookup (struct aichat_client *client, const char *key, struct aichat_api_call_results *results)
+{
+  char *path = aichat_cache_entry_path (client, key);
+
+  if (path == NULL)
+    return NULL;
+
+  char *content = NULL;
+  json_object *jentry = json_object_from_file (path);
+  json_object *jcreated, *jcontent, *jprompt_tokens, *jcompletion_tokens;
+
+  if (jentry == NULL || json_object_object_get_ex (jentry, "created", &jcreated) == false ||
+      json_object_object_get_ex (jentry, "content", &jcontent) == false ||
+      json_object_object_get_ex (jentry, "prompt_tokens", &jprompt_tokens) == false ||
+      json_object_object_get_ex (jentry, "completion_tokens", &jcompletion_tokens) == false)
+    goto aichat_cache_lookup_done;
+
+  if (client->cache_ttl > 0 && json_object_get_int64 (jcreated) + client->cache_ttl < (int64_t) time (NULL))
+  {
+    struct stat file_stat;
+
+    if (stat (path, &file_stat) == 0 && remove (path) == 0)
+      aichat_cache_account (client, -file_stat.st_size);
+
+    goto aichat_cache_lookup_done;
+  }
+
+  content = strdup (json_object_get_string (jcontent));
+
+  if (content)
+  {
+    results->prompt_tokens = json_object_get_int (jprompt_tokens);
+    results->completion_tokens = json_object_get_int (jcompletion_tokens);
+    results->cached = 1;
+
+    // the modification time of an entry is the time it was last used, the least recently used are evicted first
+    utimensat (AT_FDCWD, path, NULL, 0);
+  }
+
+aichat_cache_lookup_done:
+  json_object_put (jentry);
+  free (path);
+  return content;
+}
+
+#define AICHAT_CACHE_EVICT_PERCENT 90
+
+struct
+aichat_cache_file
+{
+  char *name;
+  struct timespec used;
+  unsigned long int size;
+};
+
+static int
+aichat_cache_file_compare (const void *a, const void *b)
+{
+  const struct aichat_cache_file *first = a, *second = b;
+  if (first->used.tv_sec != second->used.tv_sec)
+    return (first->used.tv_sec > second->used.tv_sec) - (first->used.tv_sec < second->used.tv_sec);
+
+  return (first->used.tv_nsec > second->used.tv_nsec) - (first->used.tv_nsec < second->used.tv_nsec);
+}
+
+// removes the least recently used entries until the cache is no larger than AICHAT_CACHE_EVICT_PERCENT of its
+// maximum size, so that the cache is listed once every so many stores rather than on every store once it is full,
+// and records the total size that is left
+static void
+aichat_cache_evict (struct aichat_client *client)
+{
+  int size_fd = aichat_cache_size_lock (client);
+  DIR *directory = opendir (client->cache_directory);
+
+  if (directory == NULL)
+  {
+    if (size_fd >= 0)
+      close (size_fd);
+
+    return;
+  }
+
+  struct aichat_cache_file *files = NULL;
+  unsigned long int count = 0, capacity = 0, total = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir (directory)) != NULL)
+  {
+    struct stat file_stat;
+
+    // entries that are being written start with a dot
+    if (entry->d_name[0] == '.' || fstatat (dirfd (directory), entry->d_name, &file_stat, 0) != 0 || S_ISREG (file_stat.st_mode) == false)
+      continue;
+
+    if (count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 256;
+      struct aichat_cache_file *larger = realloc (files, capacity * sizeof (struct aichat_cache_file));
+
+      if (larger == NULL)
+        goto aichat_cache_evict_done;
+
+      files = larger;
+    }
+
+    files[count].name = strdup (entry->d_name);
+#ifdef __APPLE__
+    files[count].used = file_stat.st_mtimespec;
+#else
+    files[count].used = file_stat.st_mtim;
+#endif
+    files[count].size = file_stat.st_size;
+
+    if (files[count].name == NULL)
+      goto aichat_cache_evict_done;
+
+    total += files[count++].size;
+  }
+
+  if (total > client->cache_max_size)
+  {
+    unsigned long int target = client->cache_max_size / 100 * AICHAT_CACHE_EVICT_PERCENT;
+
+    qsort (files, count, sizeof (struct aichat_cache_file), aichat_cache_file_compare);
+
+    for (unsigned long int i = 0; i < count && total > target; i++)
+    {
+      if (unlinkat (dirfd (directory), files[i].name, 0) == 0)
+        total -= files[i].size;
+    }
+  }
+
+  int64_t recorded = total;
+
+  // without a recorded total the next store lists the cache again
+  if (size_fd >= 0 && pwrite (size_fd, &recorded, sizeof (recorded), 0) != sizeof (recorded))
+    unlinkat (dirfd (directory), ".size", 0);
+
+aichat_cache_evict_done:
+  for (unsigned long int i = 0; i < count; i++)
+    free (files[i].name);
+
+  if (size_fd >= 0)
+    close (size_fd);
+
+  free (files);
+  closedir (directory);
+}
+
+// failing to store a response is not an error, the response is simply not cached
+static void
+aichat_cache_store (struct aichat_client *client, const char *key, const char *content, struct aichat_api_call_results *results)
+{
+  char *path = aichat_cache_entry_path (client, key);
+  char *temporary_path = NULL;
+
+  if (path == NULL || asprintf (&temporary_path, "%s/.%s.XXXXXX", client->cache_directory, key) < 0)
+  {
+    free (path);
+    return;
+  }
+
+  int fd = mkstemp (temporary_path);
+  FILE *file = fd >= 0 ? fdopen (fd, "w") : NULL;
+
+  if (file == NULL)
+  {
+    if (fd >= 0) close (fd);
+    goto aichat_cache_store_error;
+  }
+
+  json_object *jentry = json_object_new_object ();
+  json_object_object_add (jentry, "created", json_object_new_int64 (time (NULL)));
+  json_object_object_add (jentry, "content", json_object_new_string (content));
+  json_object_object_add (jentry, "prompt_tokens", json_object_new_int (results->prompt_tokens));
+  json_object_object_add (jentry, "completion_tokens", json_object_new_int (results->completion_tokens));
+
+  int written = fputs (json_object_to_json_string_ext (jentry, JSON_C_TO_STRING_PLAIN), file);
+  json_object_put (jentry);
+
+  struct stat new_stat, old_stat;
+
+  if (fclose (file) != 0 || written < 0 || stat (temporary_path, &new_stat) != 0)
+    goto aichat_cache_store_error;
+
+  // an entry that is replaced no longer counts towards the size of the cache
+  if (stat (path, &old_stat) != 0)
+    old_stat.st_size = 0;
+
+  if (rename (temporary_path, path) != 0)
+    goto aichat_cache_store_error;
+
+  free (path);
+  free (temporary_path);
+
+  if (client->cache_max_size > 0)
+  {
+    int64_t total = aichat_cache_account (client, (int64_t) new_stat.st_size - old_stat.st_size);
+
+    if (total < 0 || (uint64_t) total > client->cache_max_size)
+      aichat_cache_evict (client);
+  }
+
+  return;
+
+aichat_cache_store_error:
+  remove (temporary_path);
+  free (path);
+  free (temporary_path);
+}
+
+static CURL *
+aichat_client_prepare_handle (struct aichat_client *client, CURL *curl)
+{
+  // a reset keeps the connection, DNS and TLS session caches of the handle intact
+  curl_easy_reset (curl);
+
+  curl_easy_setopt (curl, CURLOPT_SHARE, client->share);
+  curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+  if (client->ca_file)
+    curl_easy_setopt (curl, CURLOPT_CAINFO, client->ca_file);
+
+  return curl;
+}
+
+struct
+aichat_session_chunk
+{
+  struct aichat_session_chunk *previous;
+  struct aichat_session_chunk *next;
+
+  unsigned long int size;
+  unsigned long int used;
+
+  char data [];
+};
+
+// returns space for at least size bytes at the end of the current chunk without committing it,
+// chunks after the current one are always empty and are reused before new ones are allocated
+static char *
+aichat_session_reserve (struct aichat_session *session, unsigned long int size)
+{
+  struct aichat_session_chunk *chunk = session->current_chunk;
+
+  if (chunk && chunk->size - chunk->used >= size)
+    return chunk->data + chunk->used;
+
+  if (chunk && chunk->next && chunk->next->size >= size)
+  {
+    session->current_chunk = chunk->next;
+    session->current_chunk->used = 0;
+    return session->current_chunk->data;
+  }
+
+  // grow geometrically so that the number of chunks stays logarithmic in the size of the session
+  unsigned long int chunk_size = chunk ? chunk->size * 2 : AICHAT_SESSION_CHUNK_SIZE;
+
+  if (chunk_size > AICHAT_SESSION_MAX_CHUNK_SIZE)
+    chunk_size = AICHAT_SESSION_MAX_CHUNK_SIZE;
+
+  while (chunk_size < size)
+    chunk_size *= 2;
+
+  struct aichat_session_chunk *new_chunk = malloc (sizeof (struct aichat_session_chunk) + chunk_size);
+
+  if (new_chunk == NULL)
+    return NULL;
+
+  new_chunk->size = chunk_size;
+  new_chunk->used = 0;
+  new_chunk->previous = chunk;
+  new_chunk->next = chunk ? chunk->next : NULL;
+
+  if (new_chunk->next)
+    new_chunk->next->previous = new_chunk;
+
+  if (chunk)
+    chunk->next = new_chunk;
+  else
+    session->first_chunk = new_chunk;
+
+  session->current_chunk = new_chunk;
+  return new_chunk->data;
+}
+
+static struct aichat_message *
+aichat_session_reserve_message (struct aichat_session *session)
+{
+  if (session->message_count == session->message_capacity)
+  {
+    unsigned int capacity = session->message_capacity ? session->message_capacity * 2 : 16;
+    struct aichat_message *messages = realloc (session->messages, capacity * sizeof (struct aichat_message));
+
+    if (messages == NULL)
+      return NULL;
+
+    session->messages = messages;
+    session->message_capacity = capacity;
+  }
+
+  return &session->messages[session->message_count];
+}
+
+// the words of a message as pairs of a hash and the number of times it occurs, sorted by the hash
+struct
+aichat_message_terms
+{
+  uint32_t *terms;
+  unsigned int count;
+  unsigned int length; // the number of words in the message
+};
+
+// drops the words of the messages from the first one on, they are hashed again when they are needed
+static void
+aichat_session_forget_terms (struct aichat_session *session, unsigned int first)
+{
+  for (unsigned int i = first; i < session->message_terms_count; i++)
+    free (session->message_terms[i].terms);
+
+  if (first < session->message_terms_count)
+    session->message_terms_count = first;
+}
+
+void
+aichat_session_initialize (struct aichat_session *session)
+{
+  session->messages = NULL;
+  session->message_count = 0;
+  session->message_capacity = 0;
+
+  session->first_chunk = NULL;
+  session->current_chunk = NULL;
+
+  session->model = AICHAT_MODEL_GPT_3_5_TURBO;
+  session->temperature = 0.7;
+
+  session->stream_callback = NULL;
+  session->stream_userdata = NULL;
+
+  session->client = NULL;
+  session->tokenizer = NULL;
+  session->name = NULL;
+
+  session->cache_bypass = false;
+
+  session->max_prompt_tokens = 0;
+  session->reserved_completion_tokens = AICHAT_DEFAULT_RESERVED_COMPLETION_TOKENS;
+
+  session->context_recent_turns = 0;
+  session->context_relevant_messages = 0;
+
+  session->summary = (struct aichat_message) { .role = AICHAT_ROLE_SYSTEM, .text = NULL, .length = 0 };
+  session->summary_messages = 0;
+  session->summary_unsaved = false;
+
+  session->compact_threshold = 0;
+  session->compact_keep_turns = AICHAT_DEFAULT_COMPACT_KEEP_TURNS;
+  session->compact_retry_tokens = 0;
+
+  session->choices = 1;
+
+  session->alternatives = NULL;
+  session->alternative_count = 0;
+  session->alternative_capacity = 0;
+
+  session->request_body = NULL;
+  session->request_body_capacity = 0;
+
+  session->context = NULL;
+  session->context_count = 0;
+  session->context_capacity = 0;
+
+  session->message_terms = NULL;
+  session->message_terms_count = 0;
+  session->message_terms_capacity = 0;
+
+  session->base[0] = '\0';
+  session->base_messages = 0;
+
+  session->journal = false;
+  session->journal_records = 0;
+  session->journal_size = 0;
+}
+
+void
+aichat_session_reset (struct aichat_session *session)
+{
+  aichat_session_forget_terms (session, 0);
+
+  // keep the allocated chunks and message slots around for the next use of the session
+  session->message_count = 0;
+  session->alternative_count = 0;
+  session->context_count = 0;
+  session->summary_messages = 0;
+  session->summary_unsaved = false;
+  session->compact_retry_tokens = 0;
+  session->base_messages = 0;
+  session->current_chunk = session->first_chunk;
+
+  if (session->current_chunk)
+    session->current_chunk->used = 0;
+}
+
+void
+aichat_session_free (struct aichat_session *session)
+{
+  struct aichat_session_chunk *chunk = session->first_chunk;
+
+  while (chunk)
+  {
+    struct aichat_session_chunk *next = chunk->next;
+    free (chunk);
+    chunk = next;
+  }
+
+  aichat_session_forget_terms (session, 0);
+
+  free (session->messages);
+  free (session->alternatives);
+  free (session->request_body);
+  free (session->context);
+  free (session->message_terms);
+
+  session->messages = NULL;
+  session->message_count = 0;
+  session->message_capacity = 0;
+
+  session->alternatives = NULL;
+  session->alternative_count = 0;
+  session->alternative_capacity = 0;
+
+  session->summary_messages = 0;
+  session->summary_unsaved = false;
+  session->base_messages = 0;
+
+  session->request_body = NULL;
+  session->request_body_capacity = 0;
+
+  session->context = NULL;
+  session->context_count = 0;
+  session->context_capacity = 0;
+
+  session->message_terms = NULL;
+  session->message_terms_capacity = 0;
+
+  session->first_chunk = NULL;
+  session->current_chunk = NULL;
+}
+
+// turns the reserved message slot and the text at the end of the current chunk into the last message
+static void
+aichat_session_commit_message (struct aichat_session *session, enum aichat_role role, char *text, unsigned long int length)
+{
+  struct aichat_message *message = &session->messages[session->message_count];
+
+  text[length] = '\0';
+
+  message->role = role;
+  message->text = text;
+  message->length = length;
+
+  session->current_chunk->used += length + 1;
+  session->message_count++;
+}
+
+static int
+aichat_session_add_message_length (struct aichat_session *session, enum aichat_role role, const char *text, unsigned long int length)
+{
+  struct aichat_message *message = aichat_session_reserve_message (session);
+
+  if (message == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  // including the null terminator we need to have space for the message
+  char *buffer = aichat_session_reserve (session, length + 1);
+
+  if (buffer == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  memcpy (buffer, text, length);
+  aichat_session_commit_message (session, role, buffer, length);
+
+  return 0;
+}
+
+int
+aichat_session_add_message (struct aichat_session *session, enum aichat_role role, const char *text)
+{
+  return aichat_session_add_message_length (session, role, text, strlen (text));
+}
+
+// drops the alternatives of the message at index message and of every message after it
+static void
+aichat_session_drop_alternatives (struct aichat_session *session, unsigned int message)
+{
+  while (session->alternative_count > 0 && session->alternatives[session->alternative_count - 1].message >= message)
+    session->alternative_count--;
+}
+
+// a slot for the next alternative, which belongs to the last message with alternatives or to one after it
+static struct aichat_alternative *
+aichat_session_reserve_alternative (struct aichat_session *session)
+{
+  if (session->alternative_count == session->alternative_capacity)
+  {
+    unsigned int capacity = session->alternative_capacity ? session->alternative_capacity * 2 : 4;
+    struct aichat_alternative *alternatives = realloc (session->alternatives, capacity * sizeof (struct aichat_alternative));
+
+    if (alternatives == NULL)
+      return NULL;
+
+    session->alternatives = alternatives;
+    session->alternative_capacity = capacity;
+  }
+
+  return &session->alternatives[session->alternative_count];
+}
+
+// like aichat_session_commit_message, but for the slot of the next alternative
+static void
+aichat_session_commit_alternative (struct aichat_session *session, unsigned int message, char *text, unsigned long int length)
+{
+  struct aichat_alternative *alternative = &session->alternatives[session->alternative_count];
+
+  text[length] = '\0';
+
+  alternative->message = message;
+  alternative->text = text;
+  alternative->length = length;
+
+  session->current_chunk->used += length + 1;
+  session->alternative_count++;
+}
+
+struct aichat_alternative *
+aichat_session_get_alternatives (struct aichat_session *session, unsigned int message, unsigned int *count)
+{
+  unsigned int end = session->alternative_count;
+
+  // the alternatives that are looked at most are those of the last message
+  while (end > 0 && session->alternatives[end - 1].message > message)
+    end--;
+
+  unsigned int start = end;
+
+  while (start > 0 && session->alternatives[start - 1].message == message)
+    start--;
+
+  *count = end - start;
+  return end > start ? &session->alternatives[start] : NULL;
+}
+
+int
+aichat_session_add_alternative (struct aichat_session *session, const char *text, unsigned long int length)
+{
+  if (session->message_count == 0)
+    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+
+  if (aichat_session_reserve_alternative (session) == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  char *copy = aichat_session_reserve (session, length + 1);
+
+  if (copy == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  memcpy (copy, text, length);
+  aichat_session_commit_alternative (session, session->message_count - 1, copy, length);
+  return 0;
+}
+
+int
+aichat_session_set_summary (struct aichat_session *session, const char *text, unsigned long int length, unsigned int messages)
+{
+  if (messages == 0 || messages > session->message_count)
+    return -AICHAT_ERROR_NOTHING_TO_COMPACT;
+
+  char *copy = aichat_session_reserve (session, length + 1);
+
+  if (copy == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  memcpy (copy, text, length);
+  copy[length] = '\0';
+  session->current_chunk->used += length + 1;
+
+  session->summary.text = copy;
+  session->summary.length = length;
+  session->summary_messages = messages;
+  session->summary_unsaved = true;
+
+  return 0;
+}
+
+int
+aichat_session_add_message_from_file (struct aichat_session *session, enum aichat_role role, FILE *file)
+{
+  struct aichat_message *message = aichat_session_reserve_message (session);
+
+  if (message == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  // read straight into the free space of the current chunk and move to a larger one when it runs out
+  unsigned long int length = 0;
+  char *text = aichat_session_reserve (session, 1);
+
+  if (text == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  while (true)
+  {
+    struct aichat_session_chunk *chunk = session->current_chunk;
+    unsigned long int available = chunk->size - chunk->used;
+
+    if (length + 1 == available)
+    {
+      char *larger = aichat_session_reserve (session, available * 2);
+
+      if (larger == NULL)
+        return -AICHAT_ERROR_MEMORY;
+
+      memcpy (larger, text, length);
+      text = larger;
+      continue;
+    }
+
+    unsigned long int read = fread (text + length, 1, available - 1 - length, file);
+    length += read;
+
+    if (read == 0)
+      break;
+  }
+
+  if (ferror (file) != 0)
+    return -AICHAT_ERROR_IO;
+
+  aichat_session_commit_message (session, role, text, length);
+
+  return 0;
+}
+
+// Session files are read with a small purpose-built JSON reader rather than
+// json-c. The file is mapped into memory and read in a single pass, and the
+// text of every message is unescaped exactly once, straight from the mapping
+// into the session chunks. Unescaping never makes a string longer, so the raw
+// length of a string is always enough room for its text.
+
+#define AICHAT_JSON_MAX_DEPTH 64
+
+struct
+aichat_json_reader
+{
+  const char *cursor;
+  const char *end;
+};
+
+static void
+aichat_json_skip_whitespace (struct aichat_json_reader *reader)
+{
+  while (reader->cursor < reader->end && (*reader->cursor == ' ' || *reader->cursor == '\n' || *reader->cursor == '\r' || *reader->cursor == '\t'))
+    reader->cursor++;
+}
+
+static bool
+aichat_json_expect (struct aichat_json_reader *reader, char c)
+{
+  aichat_json_skip_whitespace (reader);
+
+  if (reader->cursor < reader->end && *reader->cursor == c)
+  {
+    reader->cursor++;
+    return true;
+  }
+
+  return false;
+}
+
+// finds the extent of the string at the cursor without unescaping it
+// checks eight bytes at a time, a byte below 0x20 sets its top bit in (x - 0x20...) & ~x
+static bool
+aichat_json_has_control_character (const char *text, unsigned long int length)
+{
+  const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+  unsigned long int i = 0;
+
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t x;
+    memcpy (&x, text + i, 8);
+
+    if ((x - 0x20 * ones) & ~x & highs)
+      return true;
+  }
+
+  for (; i < length; i++)
+  {
+    if ((unsigned char) text[i] < 0x20)
+      return true;
+  }
+
+  return false;
+}
+
+static bool
+aichat_json_read_string (struct aichat_json_reader *reader, const char **start, unsigned long int *length)
+{
+  if (aichat_json_expect (reader, '"') == false)
+    return false;
+
+  const char *begin = reader->cursor;
+  const char *search = begin;
+
+  while (true)
+  {
+    const char *quote = memchr (search, '"', reader->end - search);
+
+    if (quote == NULL)
+      return false;
+
+    // the quote is escaped when it follows an odd number of backslashes
+    const char *backslashes = quote;
+
+    while (backslashes > begin && backslashes[-1] == '\\')
+      backslashes--;
+
+    if (((quote - backslashes) & 1) == 0)
+    {
+      // control characters must be escaped, json-c rejects them and so does this reader
+      if (aichat_json_has_control_character (begin, quote - begin))
+        return false;
+
+      *start = begin;
+      *length = quote - begin;
+      reader->cursor = quote + 1;
+      return true;
+    }
+
+    search = quote + 1;
+  }
+}
+
+static bool
+aichat_json_equals (const char *start, unsigned long int length, const char *string)
+{
+  return length == strlen (string) && memcmp (start, string, length) == 0;
+}
+
+static bool
+aichat_json_is_literal_character (char c)
+{
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' || c == '.' || c == 'E';
+}
+
+static const char *
+aichat_json_skip_digits (const char *cursor, const char *end)
+{
+  while (cursor < end && *cursor >= '0' && *cursor <= '9')
+    cursor++;
+
+  return cursor;
+}
+
+// checks the number grammar of RFC 8259: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool
+aichat_json_is_number (const char *cursor, const char *end)
+{
+  if (cursor < end && *cursor == '-')
+    cursor++;
+
+  if (cursor < end && *cursor == '0')
+    cursor++;
+  else if (cursor < end && *cursor >= '1' && *cursor <= '9')
+    cursor = aichat_json_skip_digits (cursor, end);
+  else
+    return false;
+
+  if (cursor < end && *cursor == '.')
+  {
+    const char *digits = ++cursor;
+
+    cursor = aichat_json_skip_digits (cursor, end);
+
+    if (cursor == digits)
+      return false;
+  }
+
+  if (cursor < end && (*cursor == 'e' || *cursor == 'E'))
+  {
+    cursor++;
+
+    if (cursor < end && (*cursor == '+' || *cursor == '-'))
+      cursor++;
+
+    const char *digits = cursor;
+
+    cursor = aichat_json_skip_digits (cursor, end);
+
+    if (cursor == digits)
+      return false;
+  }
+
+  return cursor == end;
+}
+
+// finds the extent of the number, true, false or null at the cursor
+static bool
+aichat_json_read_literal (struct aichat_json_reader *reader, const char **start, unsigned long int *length)
+{
+  aichat_json_skip_whitespace (reader);
+
+  *start = reader->cursor;
+
+  while (reader->cursor < reader->end && aichat_json_is_literal_character (*reader->cursor))
+    reader->cursor++;
+
+  *length = reader->cursor - *start;
+
+  if (aichat_json_equals (*start, *length, "true") || aichat_json_equals (*start, *length, "false")
+      || aichat_json_equals (*start, *length, "null"))
+    return true;
+
+  return aichat_json_is_number (*start, reader->cursor);
+}
+
+static bool
+aichat_json_skip_value (struct aichat_json_reader *reader, int depth)
+{
+  const char *start;
+  unsigned long int length;
+
+  if (depth > AICHAT_JSON_MAX_DEPTH)
+    return false;
+
+  if (aichat_json_expect (reader, '{'))
+  {
+    if (aichat_json_expect (reader, '}'))
+      return true;
+
+    do
+    {
+      if (aichat_json_read_string (reader, &start, &length) == false || aichat_json_expect (reader, ':') == false)
+        return false;
+
+      if (aichat_json_skip_value (reader, depth + 1) == false)
+        return false;
+    }
+    while (aichat_json_expect (reader, ','));
+
+    return aichat_json_expect (reader, '}');
+  }
+
+  if (aichat_json_expect (reader, '['))
+  {
+    if (aichat_json_expect (reader, ']'))
+      return true;
+
+    do
+    {
+      if (aichat_json_skip_value (reader, depth + 1) == false)
+        return false;
+    }
+    while (aichat_json_expect (reader, ','));
+
+    return aichat_json_expect (reader, ']');
+  }
+
+  if (reader->cursor < reader->end && *reader->cursor == '"')
+    return aichat_json_read_string (reader, &start, &length);
+
+  return aichat_json_read_literal (reader, &start, &length);
+}
+
+static int
+aichat_json_hex4 (const char *hex)
+{
+  int value = 0;
+
+  for (int i = 0; i < 4; i++)
+  {
+    char c = hex[i];
+    value <<= 4;
+
+    if (c >= '0' && c <= '9')      value |= c - '0';
+    else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+    else return -1;
+  }
+
+  return value;
+}
+
+// unescapes the raw string into destination, which needs room for length bytes, and returns the new length
+static long int
+aichat_json_unescape (char *destination, const char *source, unsigned long int length)
+{
+  char *output = destination;
+  const char *end = source + length;
+
+  while (source < end)
+  {
+    // copy everything up to the next escape sequence in one go
+    const char *backslash = memchr (source, '\\', end - source);
+    unsigned long int run = (backslash ? backslash : end) - source;
+
+    memcpy (output, source, run);
+    output += run;
+    source += run;
+
+    if (backslash == NULL)
+      break;
+
+    if (end - source < 2)
+      return -1;
+
+    char c = source[1];
+    source += 2;
+
+    switch (c)
+    {
+      case '"': case '\\': case '/': *output++ = c; break;
+      case 'b': *output++ = '\b'; break;
+      case 'f': *output++ = '\f'; break;
+      case 'n': *output++ = '\n'; break;
+      case 'r': *output++ = '\r'; break;
+      case 't': *output++ = '\t'; break;
+      case 'u':
+      {
+        if (end - source < 4)
+          return -1;
+
+        long int codepoint = aichat_json_hex4 (source);
+        source += 4;
+
+        // a null character would end the message early
+        if (codepoint <= 0)
+          return -1;
+
+        // characters outside the basic multilingual plane are escaped as a surrogate pair
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF && end - source >= 6 && source[0] == '\\' && source[1] == 'u')
+        {
+          long int low = aichat_json_hex4 (source + 2);
+
+          if (low >= 0xDC00 && low <= 0xDFFF)
+          {
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+            source += 6;
+          }
+        }
+
+        // a lone surrogate has no UTF-8 encoding, json-c replaces it like this
+        if (codepoint >= 0xD800 && codepoint <= 0xDFFF)
+          codepoint = 0xFFFD;
+
+        if (codepoint < 0x80)
+        {
+          *output++ = codepoint;
+        }
+        else if (codepoint < 0x800)
+        {
+          *output++ = 0xC0 | (codepoint >> 6);
+          *output++ = 0x80 | (codepoint & 0x3F);
+        }
+        else if (codepoint < 0x10000)
+        {
+          *output++ = 0xE0 | (codepoint >> 12);
+          *output++ = 0x80 | ((codepoint >> 6) & 0x3F);
+          *output++ = 0x80 | (codepoint & 0x3F);
+        }
+        else
+        {
+          *output++ = 0xF0 | (codepoint >> 18);
+          *output++ = 0x80 | ((codepoint >> 12) & 0x3F);
+          *output++ = 0x80 | ((codepoint >> 6) & 0x3F);
+          *output++ = 0x80 | (codepoint & 0x3F);
+        }
+
+        break;
+      }
+      default:
+        return -1;
+    }
+  }
+
+  return output - destination;
+}
+
+static bool
+aichat_json_read_role (const char *start, unsigned long int length, enum aichat_role *role)
+{
+  if (aichat_json_equals (start, length, "user"))           *role = AICHAT_ROLE_USER;
+  else if (aichat_json_equals (start, length, "system"))    *role = AICHAT_ROLE_SYSTEM;
+  else if (aichat_json_equals (start, length, "assistant")) *role = AICHAT_ROLE_ASSISTANT;
+  else return false;
+
+  return true;
+}
+
+static bool
+aichat_json_read_count (struct aichat_json_reader *reader, unsigned long int *count)
+{
+  const char *value;
+  unsigned long int length;
+
+  if (aichat_json_read_literal (reader, &value, &length) == false || length == 0 || length > 9)
+    return false;
+
+  *count = 0;
+
+  for (unsigned long int i = 0; i < length; i++)
+  {
+    if (value[i] < '0' || value[i] > '9')
+      return false;
+
+    *count = *count * 10 + (value[i] - '0');
+  }
+
+  return true;
+}
+
+// reads a summary of the messages it follows, {"messages":<count>,"content":<text>}
+static int
+aichat_session_read_json_summary (struct aichat_session *session, struct aichat_json_reader *reader)
+{
+  const char *content = NULL, *key;
+  unsigned long int content_length = 0, key_length;
+  unsigned long int messages = 0;
+  bool found_messages = false;
+
+  if (aichat_json_expect (reader, '{') == false)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  if (aichat_json_expect (reader, '}') == false)
+  {
+    do
+    {
+      if (aichat_json_read_string (reader, &key, &key_length) == false || aichat_json_expect (reader, ':') == false)
+        return -AICHAT_ERROR_JSON_PARSE;
+
+      bool valid;
+
+      if (aichat_json_equals (key, key_length, "content"))       valid = aichat_json_read_string (reader, &content, &content_length);
+      else if (aichat_json_equals (key, key_length, "messages")) valid = found_messages = aichat_json_read_count (reader, &messages);
+      else                                                       valid = aichat_json_skip_value (reader, 1);
+
+      if (valid == false)
+        return -AICHAT_ERROR_JSON_PARSE;
+    }
+    while (aichat_json_expect (reader, ','));
+
+    if (aichat_json_expect (reader, '}') == false)
+      return -AICHAT_ERROR_JSON_PARSE;
+  }
+
+  if (content == NULL || found_messages == false || messages > session->message_count)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  char *text = aichat_session_reserve (session, content_length + 1);
+
+  if (text == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  long int length = aichat_json_unescape (text, content, content_length);
+
+  if (length < 0)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  text[length] = '\0';
+  session->current_chunk->used += length + 1;
+
+  session->summary.text = text;
+  session->summary.length = length;
+  session->summary_messages = messages;
+  session->summary_unsaved = false;
+
+  return 0;
+}
+
+// reads a message, in a journal a record may instead remove messages from the end of the session or summarize them
+static int
+aichat_session_read_json_message (struct aichat_session *session, struct aichat_json_reader *reader, bool journal)
+{
+  const char *role = NULL, *content = NULL, *key;
+  unsigned long int role_length = 0, content_length = 0, key_length;
+  unsigned long int remove = 0;
+  bool found_remove = false;
+  struct aichat_json_reader alternatives = { NULL, NULL };
+  struct aichat_json_reader summary = { NULL, NULL };
+
+  if (aichat_json_expect (reader, '{') == false)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  if (aichat_json_expect (reader, '}') == false)
+  {
+    do
+    {
+      if (aichat_json_read_string (reader, &key, &key_length) == false || aichat_json_expect (reader, ':') == false)
+        return -AICHAT_ERROR_JSON_PARSE;
+
+      bool valid;
+
+      if (aichat_json_equals (key, key_length, "role"))         valid = aichat_json_read_string (reader, &role, &role_length);
+      else if (aichat_json_equals (key, key_length, "content")) valid = aichat_json_read_string (reader, &content, &content_length);
+      else if (journal && aichat_json_equals (key, key_length, "remove"))
+        valid = found_remove = aichat_json_read_count (reader, &remove);
+      else if (journal && aichat_json_equals (key, key_length, "summary"))
+      {
+        summary.cursor = reader->cursor;
+        valid = aichat_json_skip_value (reader, 1);
+        summary.end = reader->cursor;
+      }
+      else if (aichat_json_equals (key, key_length, "alternatives"))
+      {
+        // the alternatives are read once the message they belong to is there
+        alternatives.cursor = reader->cursor;
+        valid = aichat_json_skip_value (reader, 1);
+        alternatives.end = reader->cursor;
+      }
+      else                                                      valid = aichat_json_skip_value (reader, 1);
+
+      if (valid == false)
+        return -AICHAT_ERROR_JSON_PARSE;
+    }
+    while (aichat_json_expect (reader, ','));
+
+    if (aichat_json_expect (reader, '}') == false)
+      return -AICHAT_ERROR_JSON_PARSE;
+  }
+
+  if (summary.cursor != NULL)
+  {
+    if (role != NULL || content != NULL || alternatives.cursor != NULL || found_remove)
+      return -AICHAT_ERROR_JSON_PARSE;
+
+    return aichat_session_read_json_summary (session, &summary);
+  }
+
+  if (found_remove)
+  {
+    if (role != NULL || content != NULL || alternatives.cursor != NULL || remove > session->message_count)
+      return -AICHAT_ERROR_JSON_PARSE;
+
+    while (remove-- > 0)
+      aichat_session_remove_last_message (session);
+
+    return 0;
+  }
+
+  enum aichat_role role_enum;
+
+  if (role == NULL || content == NULL || aichat_json_read_role (role, role_length, &role_enum) == false)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  if (aichat_session_reserve_message (session) == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  char *text = aichat_session_reserve (session, content_length + 1);
+
+  if (text == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  long int length = aichat_json_unescape (text, content, content_length);
+
+  if (length < 0)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  aichat_session_commit_message (session, role_enum, text, length);
+
+  if (alternatives.cursor == NULL)
+    return 0;
+
+  if (aichat_json_expect (&alternatives, '[') == false)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  aichat_session_drop_alternatives (session, session->message_count - 1);
+
+  if (aichat_json_expect (&alternatives, ']'))
+    return 0;
+
+  do
+  {
+    const char *alternative;
+    unsigned long int alternative_length;
+
+    if (aichat_json_read_string (&alternatives, &alternative, &alternative_length) == false)
+      return -AICHAT_ERROR_JSON_PARSE;
+
+    if (aichat_session_reserve_alternative (session) == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    char *unescaped = aichat_session_reserve (session, alternative_length + 1);
+
+    if (unescaped == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    length = aichat_json_unescape (unescaped, alternative, alternative_length);
+
+    if (length < 0)
+      return -AICHAT_ERROR_JSON_PARSE;
+
+    aichat_session_commit_alternative (session, session->message_count - 1, unescaped, length);
+  }
+  while (aichat_json_expect (&alternatives, ','));
+
+  return aichat_json_expect (&alternatives, ']') ? 0 : -AICHAT_ERROR_JSON_PARSE;
+}
+
+// the records of a journal follow its header, one per line
+static int
+aichat_session_read_journal_records (struct aichat_session *session, struct aichat_json_reader *reader, const char *data)
+{
+  // every record ends with a newline, anything after the last one is an append that was cut short
+  while (reader->end > reader->cursor && reader->end[-1] != '\n')
+    reader->end--;
+
+  while (true)
+  {
+    aichat_json_skip_whitespace (reader);
+
+    if (reader->cursor == reader->end)
+      break;
+
+    int result = aichat_session_read_json_message (session, reader, true);
+
+    if (result < 0)
+      return result;
+
+    session->journal_records++;
+  }
+
+  session->journal = true;
+  session->journal_size = reader->end - data;
+
+  return 0;
+}
+
+// A message store is a directory of runs of messages, each a file named after
+// the hash of its content: {"parent":{"key":<name>,"messages":<count>},
+// "messages":[...]}. The parent is another run and how many of the messages it
+// leads to, counted from the very first, come before the messages of the run.
+// A session is based on a run in the same way, so a
+// session forked from any message of another only has to name the run and
+// count, and neither session is affected by what happens to the other later.
+
+// the deepest chain of runs that is followed before the store is taken to be damaged
+#define AICHAT_STORE_MAX_DEPTH 4096
+
+// reads {"key":<name>,"messages":<count>}, a reference to the first messages of a run
+static bool
+aichat_store_read_reference (struct aichat_json_reader *reader, char key [AICHAT_STORE_KEY_LENGTH + 1], unsigned long int *messages)
+{
+  const char *name = NULL, *field;
+  unsigned long int name_length = 0, field_length;
+  bool found_messages = false;
+
+  if (aichat_json_expect (reader, '{') == false || aichat_json_expect (reader, '}'))
+    return false;
+
+  do
+  {
+    if (aichat_json_read_string (reader, &field, &field_length) == false || aichat_json_expect (reader, ':') == false)
+      return false;
+
+    bool valid;
+
+    if (aichat_json_equals (field, field_length, "key"))           valid = aichat_json_read_string (reader, &name, &name_length);
+    else if (aichat_json_equals (field, field_length, "messages")) valid = found_messages = aichat_json_read_count (reader, messages);
+    else                                                           valid = aichat_json_skip_value (reader, 1);
+
+    if (valid == false)
+      return false;
+  }
+  while (aichat_json_expect (reader, ','));
+
+  if (aichat_json_expect (reader, '}') == false || name == NULL || found_messages == false || name_length != AICHAT_STORE_KEY_LENGTH)
+    return false;
+
+  // the name ends up in a path, it must be nothing but the hash
+  for (unsigned long int i = 0; i < name_length; i++)
+  {
+    if ((name[i] < '0' || name[i] > '9') && (name[i] < 'a' || name[i] > 'f'))
+      return false;
+  }
+
+  memcpy (key, name, AICHAT_STORE_KEY_LENGTH);
+  key[AICHAT_STORE_KEY_LENGTH] = '\0';
+  return true;
+}
+
+// adds the first count messages of the run named key and its ancestors to the session
+static int
+aichat_store_load (struct aichat_session *session, const char *store, const char *key, unsigned long int count, unsigned int depth)
+{
+  if (store == NULL || depth > AICHAT_STORE_MAX_DEPTH)
+    return -AICHAT_ERROR_STORE;
+
+  char *path = NULL;
+
+  if (asprintf (&path, "%s/%s", store, key) < 0)
+    return -AICHAT_ERROR_MEMORY;
+
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  free (path);
+
+  struct stat file_stat;
+
+  if (fd < 0 || fstat (fd, &file_stat) != 0 || file_stat.st_size == 0)
+  {
+    if (fd >= 0) close (fd);
+    return -AICHAT_ERROR_STORE;
+  }
+
+  void *mapping = mmap (NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (mapping == MAP_FAILED)
+    return -AICHAT_ERROR_IO;
+
+  struct aichat_json_reader reader = { .cursor = mapping, .end = (const char *) mapping + file_stat.st_size };
+  unsigned long int target = session->message_count + count;
+  int result = -AICHAT_ERROR_JSON_PARSE;
+
+  const char *field;
+  unsigned long int field_length;
+
+  if (aichat_json_expect (&reader, '{') == false || aichat_json_expect (&reader, '}'))
+    goto aichat_store_load_done;
+
+  do
+  {
+    if (aichat_json_read_string (&reader, &field, &field_length) == false || aichat_json_expect (&reader, ':') == false)
+      goto aichat_store_load_done;
+
+    if (aichat_json_equals (field, field_length, "parent"))
+    {
+      char parent [AICHAT_STORE_KEY_LENGTH + 1];
+      unsigned long int parent_messages;
+
+      if (session->message_count + count != target || aichat_store_read_reference (&reader, parent, &parent_messages) == false)
+        goto aichat_store_load_done;
+
+      // a session based on the start of the parent needs nothing from this run
+      if ((result = aichat_store_load (session, store, parent, parent_messages < count ? parent_messages : count, depth + 1)) < 0 || session->message_count == target)
+        goto aichat_store_load_done;
+
+      result = -AICHAT_ERROR_JSON_PARSE;
+    }
+    else if (aichat_json_equals (field, field_length, "messages"))
+    {
+      if (aichat_json_expect (&reader, '[') == false)
+        goto aichat_store_load_done;
+
+      if (aichat_json_expect (&reader, ']') == false)
+      {
+        do
+        {
+          int error = session->message_count < target ? aichat_session_read_json_message (session, &reader, false) :
+                                                        aichat_json_skip_value (&reader, 1) ? 0 : -AICHAT_ERROR_JSON_PARSE;
+
+          if (error < 0)
+          {
+            result = error;
+            goto aichat_store_load_done;
+          }
+        }
+        while (aichat_json_expect (&reader, ','));
+
+        if (aichat_json_expect (&reader, ']') == false)
+          goto aichat_store_load_done;
+      }
+    }
+    else if (aichat_json_skip_value (&reader, 1) == false)
+    {
+      goto aichat_store_load_done;
+    }
+  }
+  while (aichat_json_expect (&reader, ','));
+
+  // a run that is shorter than what is based on it is as good as missing
+  if (aichat_json_expect (&reader, '}'))
+    result = session->message_count == target ? 0 : -AICHAT_ERROR_STORE;
+
+aichat_store_load_done:
+  munmap (mapping, file_stat.st_size);
+  return result;
+}
+
+// maps a file for reading, NULL for an empty file or when it cannot be mapped
+static void *
+aichat_map_file (int fd, unsigned long int *size)
+{
+  struct stat file_stat;
+
+  if (fstat (fd, &file_stat) != 0 || file_stat.st_size == 0)
+    return NULL;
+
+  void *mapping = mmap (NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  *size = file_stat.st_size;
+  return mapping == MAP_FAILED ? NULL : mapping;
+}
+
+// the reference under the member name at the top of the object that starts the data. Runs and sessions are
+// written with it before their messages, so the search stops there.
+static int
+aichat_store_find_reference (const char *data, unsigned long int size, const char *name, char key [AICHAT_STORE_KEY_LENGTH + 1], unsigned long int *messages)
+{
+  struct aichat_json_reader reader = { .cursor = data, .end = data + size };
+  const char *field;
+  unsigned long int field_length;
+
+  if (aichat_json_expect (&reader, '{') == false)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  if (aichat_json_expect (&reader, '}'))
+    return 0;
+
+  do
+  {
+    if (aichat_json_read_string (&reader, &field, &field_length) == false || aichat_json_expect (&reader, ':') == false)
+      return -AICHAT_ERROR_JSON_PARSE;
+
+    if (aichat_json_equals (field, field_length, name))
+      return aichat_store_read_reference (&reader, key, messages) ? 1 : -AICHAT_ERROR_JSON_PARSE;
+
+    if (aichat_json_equals (field, field_length, "messages"))
+      return 0;
+
+    if (aichat_json_skip_value (&reader, 1) == false)
+      return -AICHAT_ERROR_JSON_PARSE;
+  }
+  while (aichat_json_expect (&reader, ','));
+
+  return 0;
+}
+
+int
+aichat_session_read_base (FILE *file, char base [AICHAT_STORE_KEY_LENGTH + 1], unsigned int *base_messages)
+{
+  unsigned long int size, messages;
+  void *mapping = aichat_map_file (fileno (file), &size);
+
+  if (mapping == NULL)
+    return -AICHAT_ERROR_IO;
+
+  int result = aichat_store_find_reference (mapping, size, "base", base, &messages);
+  munmap (mapping, size);
+
+  *base_messages = result > 0 ? messages : 0;
+  return result;
+}
+
+long int
+aichat_store_lineage (const char *store, const char *key, unsigned int messages, struct aichat_store_run *runs, unsigned int capacity)
+{
+  char current [AICHAT_STORE_KEY_LENGTH + 1];
+  unsigned long int count = 0;
+
+  memcpy (current, key, sizeof (current));
+
+  // the chain is followed from the last run back to the first and turned around at the end
+  for (unsigned int depth = 0; messages > 0; depth++)
+  {
+    char *path = NULL;
+
+    if (depth > AICHAT_STORE_MAX_DEPTH || asprintf (&path, "%s/%s", store, current) < 0)
+      return -AICHAT_ERROR_STORE;
+
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    free (path);
+
+    if (fd < 0)
+      return -AICHAT_ERROR_STORE;
+
+    unsigned long int size, parent_messages = 0;
+    char parent [AICHAT_STORE_KEY_LENGTH + 1];
+    void *mapping = aichat_map_file (fd, &size);
+    close (fd);
+
+    if (mapping == NULL)
+      return -AICHAT_ERROR_STORE;
+
+    int found = aichat_store_find_reference (mapping, size, "parent", parent, &parent_messages);
+    munmap (mapping, size);
+
+    if (found < 0)
+      return found;
+
+    if (found == 0 || parent_messages < messages)
+    {
+      if (count < capacity)
+      {
+        memcpy (runs[count].key, current, sizeof (current));
+        runs[count].messages = messages;
+      }
+
+      count++;
+    }
+
+    if (found == 0)
+      break;
+
+    memcpy (current, parent, sizeof (current));
+    messages = parent_messages < messages ? parent_messages : messages;
+  }
+
+  unsigned long int written = count < capacity ? count : capacity;
+
+  for (unsigned long int i = 0; i < written / 2; i++)
+  {
+    struct aichat_store_run run = runs[i];
+    runs[i] = runs[written - 1 - i];
+    runs[written - 1 - i] = run;
+  }
+
+  return count;
+}
+
+static int
+aichat_store_compare_runs (const void *a, const void *b)
+{
+  return strcmp (((const struct aichat_store_run *) a)->key, ((const struct aichat_store_run *) b)->key);
+}
+
+// adds the run key and every run before it to reached, a run that is gone ends the chain early
+static int
+aichat_store_mark (const char *store, const char *key, struct aichat_store_run **reached, unsigned long int *count, unsigned long int *capacity)
+{
+  char current [AICHAT_STORE_KEY_LENGTH + 1];
+
+  memcpy (current, key, sizeof (current));
+
+  for (unsigned int depth = 0; ; depth++)
+  {
+    if (depth > AICHAT_STORE_MAX_DEPTH)
+      return -AICHAT_ERROR_STORE;
+
+    if (*count == *capacity)
+    {
+      unsigned long int larger_capacity = *capacity ? 2 * *capacity : 256;
+      struct aichat_store_run *larger = realloc (*reached, larger_capacity * sizeof (struct aichat_store_run));
+
+      if (larger == NULL)
+        return -AICHAT_ERROR_MEMORY;
+
+      *reached = larger;
+      *capacity = larger_capacity;
+    }
+
+    memcpy ((*reached)[(*count)++].key, current, sizeof (current));
+
+    char *path = NULL;
+
+    if (asprintf (&path, "%s/%s", store, current) < 0)
+      return -AICHAT_ERROR_MEMORY;
+
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    free (path);
+
+    if (fd < 0)
+      return errno == ENOENT ? 0 : -AICHAT_ERROR_STORE;
+
+    unsigned long int size, parent_messages;
+    char parent [AICHAT_STORE_KEY_LENGTH + 1];
+    void *mapping = aichat_map_file (fd, &size);
+    close (fd);
+
+    if (mapping == NULL)
+      return -AICHAT_ERROR_STORE;
+
+    int found = aichat_store_find_reference (mapping, size, "parent", parent, &parent_messages);
+    munmap (mapping, size);
+
+    if (found <= 0)
+      return found;
+
+    memcpy (current, parent, sizeof (current));
+  }
+}
+
+long int
+aichat_store_collect (const char *store, const struct aichat_store_run *bases, unsigned long int count)
+{
+  struct aichat_store_run *reached = NULL;
+  unsigned long int reached_count = 0, reached_capacity = 0;
+  long int removed = 0;
+
+  // nothing is removed unless every chain could be followed to its end
+  for (unsigned long int i = 0; i < count; i++)
+  {
+    int error = aichat_store_mark (store, bases[i].key, &reached, &reached_count, &reached_capacity);
+
+    if (error < 0)
+    {
+      free (reached);
+      return error;
+    }
+  }
+
+  qsort (reached, reached_count, sizeof (struct aichat_store_run), aichat_store_compare_runs);
+
+  DIR *directory = opendir (store);
+
+  if (directory == NULL)
+  {
+    free (reached);
+    return errno == ENOENT ? 0 : -AICHAT_ERROR_IO;
+  }
+
+  struct dirent *entry;
+  struct aichat_store_run run;
+
+  while ((entry = readdir (directory)) != NULL)
+  {
+    // runs that are being written start with a dot
+    if (entry->d_name[0] == '.' || strlen (entry->d_name) != AICHAT_STORE_KEY_LENGTH)
+      continue;
+
+    memcpy (run.key, entry->d_name, sizeof (run.key));
+
+    if (bsearch (&run, reached, reached_count, sizeof (struct aichat_store_run), aichat_store_compare_runs) == NULL &&
+        unlinkat (dirfd (directory), entry->d_name, 0) == 0)
+      removed++;
+  }
+
+  closedir (directory);
+  free (reached);
+  return removed;
+}
+
+static json_object *
+aichat_store_reference_to_json_object (const char *key, unsigned int messages)
+{
+  json_object *jobj = json_object_new_object ();
+
+  json_object_object_add (jobj, "key", json_object_new_string (key));
+  json_object_object_add (jobj, "messages", json_object_new_int (messages));
+
+  return jobj;
+}
+
+static int
+aichat_session_read_json (struct aichat_session *session, const char *data, unsigned long int size, const char *store)
+{
+  struct aichat_json_reader reader = { .cursor = data, .end = data + size };
+  struct aichat_json_reader summary = { NULL, NULL };
+
+  const char *key, *value;
+  unsigned long int key_length, value_length;
+  bool found_messages = false;
+  bool journal = false;
+
+  session->journal = false;
+  session->journal_records = 0;
+  session->journal_size = 0;
+
+  if (aichat_json_expect (&reader, '{') == false)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  if (aichat_json_expect (&reader, '}') == false)
+  {
+    do
+    {
+      if (aichat_json_read_string (&reader, &key, &key_length) == false || aichat_json_expect (&reader, ':') == false)
+        return -AICHAT_ERROR_JSON_PARSE;
+
+      if (aichat_json_equals (key, key_length, "messages"))
+      {
+        if (aichat_json_expect (&reader, '[') == false)
+          return -AICHAT_ERROR_JSON_PARSE;
+
+        if (aichat_json_expect (&reader, ']') == false)
+        {
+          do
+          {
+            int result = aichat_session_read_json_message (session, &reader, false);
+
+            if (result < 0)
+              return result;
+          }
+          while (aichat_json_expect (&reader, ','));
+
+          if (aichat_json_expect (&reader, ']') == false)
+            return -AICHAT_ERROR_JSON_PARSE;
+        }
+
+        found_messages = true;
+      }
+      else if (aichat_json_equals (key, key_length, "journal"))
+      {
+        unsigned long int version;
+
+        if (aichat_json_read_count (&reader, &version) == false || version != AICHAT_JOURNAL_VERSION)
+          return -AICHAT_ERROR_JSON_PARSE;
+
+        journal = true;
+      }
+      else if (aichat_json_equals (key, key_length, "model"))
+      {
+        if (aichat_json_read_string (&reader, &value, &value_length) == false)
+          return -AICHAT_ERROR_JSON_PARSE;
+
+        if (aichat_json_equals (value, value_length, "gpt-3.5-turbo"))     session->model = AICHAT_MODEL_GPT_3_5_TURBO;
+        if (aichat_json_equals (value, value_length, "gpt-3.5-turbo-16k")) session->model = AICHAT_MODEL_GPT_3_5_TURBO_16K;
+      }
+      else if (aichat_json_equals (key, key_length, "temperature"))
+      {
+        // the mapping is not null terminated so the number is copied before it is converted
+        char number [64];
+
+        if (aichat_json_read_literal (&reader, &value, &value_length) == false || value_length >= sizeof (number))
+          return -AICHAT_ERROR_JSON_PARSE;
+
+        memcpy (number, value, value_length);
+        number[value_length] = '\0';
+        session->temperature = strtod (number, NULL);
+      }
+      else if (aichat_json_equals (key, key_length, "base"))
+      {
+        // the messages of the base come before those of the session
+        unsigned long int base_messages;
+
+        if (session->message_count > 0 || aichat_store_read_reference (&reader, session->base, &base_messages) == false)
+          return -AICHAT_ERROR_JSON_PARSE;
+
+        int result = aichat_store_load (session, store, session->base, base_messages, 0);
+
+        if (result < 0)
+          return result;
+
+        session->base_messages = base_messages;
+      }
+      else if (aichat_json_equals (key, key_length, "summary"))
+      {
+        // the summary is read once the messages it summarizes are there
+        summary.cursor = reader.cursor;
+
+        if (aichat_json_skip_value (&reader, 1) == false)
+          return -AICHAT_ERROR_JSON_PARSE;
+
+        summary.end = reader.cursor;
+      }
+      else if (aichat_json_skip_value (&reader, 1) == false)
+      {
+        return -AICHAT_ERROR_JSON_PARSE;
+      }
+    }
+    while (aichat_json_expect (&reader, ','));
+
+    if (aichat_json_expect (&reader, '}') == false)
+      return -AICHAT_ERROR_JSON_PARSE;
+  }
+
+  // a journal has a record for its summary instead
+  if (journal && summary.cursor != NULL)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  if (journal)
+    return aichat_session_read_journal_records (session, &reader, data);
+
+  if (summary.cursor != NULL)
+  {
+    int result = aichat_session_read_json_summary (session, &summary);
+
+    if (result < 0)
+      return result;
+  }
+
+  // only whitespace may follow the session
+  aichat_json_skip_whitespace (&reader);
+
+  if (found_messages == false || reader.cursor != reader.end)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  return 0;
+}
+
+int
+aichat_session_initialize_from_json_file (struct aichat_session *session, FILE *file)
+{
+  return aichat_session_initialize_from_json_file_in_store (session, file, NULL);
+}
+
+int
+aichat_session_initialize_from_json_file_in_store (struct aichat_session *session, FILE *file, const char *store)
+{
+  aichat_session_initialize (session);
+
+  struct stat file_stat;
+  int fd = fileno (file);
+  int result;
+
+  // regular files are mapped and read in place
+  if (fstat (fd, &file_stat) == 0 && S_ISREG (file_stat.st_mode) && file_stat.st_size > 0 && ftell (file) == 0)
+  {
+    void *mapping = mmap (NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mapping != MAP_FAILED)
+    {
+      madvise (mapping, file_stat.st_size, MADV_SEQUENTIAL);
+
+      result = aichat_session_read_json (session, mapping, file_stat.st_size, store);
+      munmap (mapping, file_stat.st_size);
+
+      if (result < 0)
+        aichat_session_free (session);
+
+      return result;
+    }
+  }
+
+  // everything else, such as a pipe on stdin, is read in large blocks first
+  char *buffer = NULL;
+  unsigned long int size = 0;
+  unsigned long int capacity = 0;
+
+  while (true)
+  {
+    if (size == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 65536;
+      char *larger = realloc (buffer, capacity);
+
+      if (larger == NULL)
+      {
+        free (buffer);
+        return -AICHAT_ERROR_MEMORY;
+      }
+
+      buffer = larger;
+    }
+
+    unsigned long int read = fread (buffer + size, 1, capacity - size, file);
+    size += read;
+
+    if (read == 0)
+      break;
+  }
+
+  if (ferror (file) != 0)
+  {
+    free (buffer);
+    return -AICHAT_ERROR_IO;
+  }
+
+  result = aichat_session_read_json (session, buffer, size, store);
+  free (buffer);
+
+  if (result < 0)
+    aichat_session_free (session);
+
+  return result;
+}
+
+int
+aichat_session_count_prompt_tokens (struct aichat_session *session)
+{
+  if (session->tokenizer == NULL)
+    return -AICHAT_ERROR_NO_TOKENIZER;
+
+  // every message is wrapped in a few tokens that mark its start and role, and the reply is primed with a few more
+  long int count = AICHAT_TOKENS_PER_REPLY;
+
+  for (unsigned int i = 0; i < session->message_count; i++)
+  {
+    struct aichat_message *message = &session->messages[i];
+    const char *role = message->role == AICHAT_ROLE_SYSTEM ? "system" : message->role == AICHAT_ROLE_USER ? "user" : "assistant";
+
+    long int role_count = aichat_tokenizer_count_cached (session->tokenizer, role, strlen (role));
+    long int text_count = aichat_tokenizer_count_cached (session->tokenizer, message->text, message->length);
+
+    if (role_count < 0) return role_count;
+    if (text_count < 0) return text_count;
+
+    count += AICHAT_TOKENS_PER_MESSAGE + role_count + text_count;
+  }
+
+  return count;
+}
+
+int
+aichat_session_print_last_message (struct aichat_session *session, FILE *file)
+{
+  if (session->message_count == 0)
+    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+
+  struct aichat_message *message = &session->messages[session->message_count - 1];
+
+  fprintf (file, "%s", message->text);
+
+  return 0;
+}
+
+int
+aichat_session_remove_last_message (struct aichat_session *session)
+{
+  if (session->message_count == 0)
+    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+
+  struct aichat_message *message = &session->messages[session->message_count - 1];
+  struct aichat_session_chunk *chunk = session->current_chunk;
+
+  aichat_session_drop_alternatives (session, session->message_count - 1);
+
+  aichat_session_forget_terms (session, session->message_count - 1);
+
+  // the text of the last message is the last allocation unless it could not be rolled back before
+  if (message->text + message->length + 1 == chunk->data + chunk->used)
+  {
+    chunk->used -= message->length + 1;
+
+    if (chunk->used == 0 && chunk->previous)
+      session->current_chunk = chunk->previous;
+  }
+
+  session->message_count--;
+
+  // a summary cannot stand in for messages that are gone
+  if (session->message_count < session->summary_messages)
+  {
+    session->summary_messages = 0;
+    session->summary_unsaved = false;
+  }
+
+  // the run in the store keeps the message, the session is just based on fewer of its messages
+  if (session->message_count < session->base_messages)
+    session->base_messages = session->message_count;
+
+  return 0;
+}
+
+int
+aichat_session_pick_alternative (struct aichat_session *session, unsigned int index)
+{
+  if (session->message_count == 0)
+    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+
+  unsigned int count;
+  struct aichat_alternative *alternatives = aichat_session_get_alternatives (session, session->message_count - 1, &count);
+
+  if (index >= count)
+    return -AICHAT_ERROR_NO_ALTERNATIVE;
+
+  // the message shares the text of the alternative, nothing is copied
+  struct aichat_message *message = &session->messages[session->message_count - 1];
+
+  message->text = alternatives[index].text;
+  message->length = alternatives[index].length;
+
+  // runs in the store never change, a message that does is saved with the session instead
+  if (session->base_messages == session->message_count)
+    session->base_messages--;
+
+  aichat_session_forget_terms (session, session->message_count - 1);
+
+  return 0;
+}
+
+static json_object *
+aichat_message_to_json_object (struct aichat_message *message)
+{
+  json_object *jobj = json_object_new_object();
+
+  switch (message->role)
+  {
+    case AICHAT_ROLE_SYSTEM:
+      json_object_object_add (jobj, "role", json_object_new_string ("system"));
+      break;
+    case AICHAT_ROLE_USER:
+      json_object_object_add (jobj, "role", json_object_new_string ("user"));
+      break;
+    case AICHAT_ROLE_ASSISTANT:
+      json_object_object_add (jobj, "role", json_object_new_string ("assistant"));
+      break;
+  }
+
+  json_object_object_add (jobj, "content", json_object_new_string (message->text));
+  return jobj;
+}
+
+char *
+aichat_message_to_json (struct aichat_message *message, unsigned long int *length)
+{
+
+  json_object *jobj = aichat_message_to_json_object (message);
+  char *json = strdup (json_object_to_json_string_length (jobj, JSON_C_TO_STRING_PLAIN, length));
+
+  json_object_put (jobj);
+  return json;
+}
+
+// the message at index as it is saved, with its alternatives, which are never sent to the API
+static json_object *
+aichat_session_message_to_saved_json_object (struct aichat_session *session, unsigned int index)
+{
+  json_object *jobj = aichat_message_to_json_object (&session->messages[index]);
+  unsigned int count;
+  struct aichat_alternative *alternatives = aichat_session_get_alternatives (session, index, &count);
+
+  if (count > 0)
+  {
+    json_object *jalternatives = json_object_new_array ();
+
+    for (unsigned int i = 0; i < count; i++)
+      json_object_array_add (jalternatives, json_object_new_string_len (alternatives[i].text, alternatives[i].length));
+
+    json_object_object_add (jobj, "alternatives", jalternatives);
+  }
+
+  return jobj;
+}
+
+static json_object *
+aichat_session_summary_to_json_object (struct aichat_session *session)
+{
+  json_object *jobj = json_object_new_object ();
+
+  json_object_object_add (jobj, "messages", json_object_new_int (session->summary_messages));
+  json_object_object_add (jobj, "content", json_object_new_string_len (session->summary.text, session->summary.length));
+
+  return jobj;
+}
+
+const char *
+aichat_model_to_string (enum aichat_model model)
+{
+  return model == AICHAT_MODEL_GPT_3_5_TURBO ? "gpt-3.5-turbo" : "gpt-3.5-turbo-16k";
+}
+
+static json_object *
+aichat_session_to_json_object (struct aichat_session *session)
+{
+  json_object *jobj = json_object_new_object();
+
+  json_object_object_add (jobj, "model", json_object_new_string (aichat_model_to_string (session->model)));
+
+  json_object_object_add (jobj, "temperature", json_object_new_double (session->temperature));
+
+  if (session->base_messages > 0)
+    json_object_object_add (jobj, "base", aichat_store_reference_to_json_object (session->base, session->base_messages));
+
+  json_object *jmsgs = json_object_new_array ();
+
+  for (unsigned int i = session->base_messages; i < session->message_count; i++)
+    json_object_array_add (jmsgs, aichat_session_message_to_saved_json_object (session, i));
+
+  json_object_object_add (jobj, "messages", jmsgs);
+
+  if (session->summary_messages > 0)
+    json_object_object_add (jobj, "summary", aichat_session_summary_to_json_object (session));
+
+  return jobj;
+}
+
+int
+aichat_session_write_to_json_file (struct aichat_session *session, FILE *file)
+{
+  json_object *jobj = aichat_session_to_json_object (session);
+  fprintf (file, "%s", json_object_to_json_string_ext (jobj, JSON_C_TO_STRING_PRETTY));
+  json_object_put (jobj);
+
+  session->summary_unsaved = false;
+  return 0;
+}
+
+static int
+aichat_journal_write_record (FILE *file, json_object *jobj)
+{
+  int written = fprintf (file, "%s\n", json_object_to_json_string_ext (jobj, JSON_C_TO_STRING_PLAIN));
+  json_object_put (jobj);
+
+  return written < 0 ? -AICHAT_ERROR_IO : 0;
+}
+
+static int
+aichat_journal_write_messages (struct aichat_session *session, FILE *file, unsigned int first_message)
+{
+  // the messages of the base are in the store
+  if (first_message < session->base_messages)
+    first_message = session->base_messages;
+
+  for (unsigned int i = first_message; i < session->message_count; i++)
+  {
+    if (aichat_journal_write_record (file, aichat_session_message_to_saved_json_object (session, i)) < 0)
+      return -AICHAT_ERROR_IO;
+
+    session->journal_records++;
+  }
+
+  // a new summary follows the messages it summarizes
+  if (session->summary_unsaved && session->summary_messages > 0)
+  {
+    json_object *jrecord = json_object_new_object ();
+    json_object_object_add (jrecord, "summary", aichat_session_summary_to_json_object (session));
+
+    if (aichat_journal_write_record (file, jrecord) < 0)
+      return -AICHAT_ERROR_IO;
+
+    session->journal_records++;
+    session->summary_unsaved = false;
+  }
+
+  if (fflush (file) != 0)
+    return -AICHAT_ERROR_IO;
+
+  session->journal_size = ftell (file);
+
+  return 0;
+}
+
+int
+aichat_session_write_to_journal_file (struct aichat_session *session, FILE *file)
+{
+  json_object *jheader = json_object_new_object ();
+
+  json_object_object_add (jheader, "journal", json_object_new_int (AICHAT_JOURNAL_VERSION));
+  json_object_object_add (jheader, "model", json_object_new_string (aichat_model_to_string (session->model)));
+  json_object_object_add (jheader, "temperature", json_object_new_double (session->temperature));
+
+  if (session->base_messages > 0)
+    json_object_object_add (jheader, "base", aichat_store_reference_to_json_object (session->base, session->base_messages));
+
+  if (aichat_journal_write_record (file, jheader) < 0)
+    return -AICHAT_ERROR_IO;
+
+  session->journal = true;
+  session->journal_records = 0;
+  session->summary_unsaved = session->summary_messages > 0;
+
+  return aichat_journal_write_messages (session, file, 0);
+}
+
+int
+aichat_session_append_to_journal_file (struct aichat_session *session, FILE *file, unsigned int removed, unsigned int first_message)
+{
+  if (session->journal == false)
+    return -AICHAT_ERROR_NOT_IMPLEMENTED;
+
+  // drop whatever is left of an append that was cut short before writing after it
+  if (fflush (file) != 0 || ftruncate (fileno (file), session->journal_size) != 0 || fseek (file, session->journal_size, SEEK_SET) != 0)
+    return -AICHAT_ERROR_IO;
+
+  if (removed > 0)
+  {
+    json_object *jremove = json_object_new_object ();
+    json_object_object_add (jremove, "remove", json_object_new_int (removed));
+
+    if (aichat_journal_write_record (file, jremove) < 0)
+      return -AICHAT_ERROR_IO;
+
+    session->journal_records++;
+  }
+
+  return aichat_journal_write_messages (session, file, first_message);
+}
+
+// whether the run at path holds exactly data, the key of a run is not collision-resistant so it is not trusted alone
+static int
+aichat_store_compare (const char *path, const char *data, unsigned long int length)
+{
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  struct stat status;
+
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -AICHAT_ERROR_IO;
+
+  if (fstat (fd, &status) != 0)
+  {
+    close (fd);
+    return -AICHAT_ERROR_IO;
+  }
+
+  char buffer [16384];
+  unsigned long int offset = 0;
+  int result = (unsigned long int) status.st_size == length ? 1 : -AICHAT_ERROR_STORE_COLLISION;
+
+  while (result > 0 && offset < length)
+  {
+    ssize_t chunk = read (fd, buffer, sizeof (buffer));
+
+    if (chunk < 0 && errno == EINTR)
+      continue;
+
+    if (chunk < 0)
+      result = -AICHAT_ERROR_IO;
+    else if (chunk == 0 || (unsigned long int) chunk > length - offset || memcmp (buffer, data + offset, chunk) != 0)
+      result = -AICHAT_ERROR_STORE_COLLISION;
+    else
+      offset += chunk;
+  }
+
+  close (fd);
+  return result;
+}
+
+// runs are written under a temporary name and renamed, a run that is already there must have the same content
+static int
+aichat_store_write (const char *store, const char *key, const char *data, unsigned long int length)
+{
+  char *path = NULL;
+  char *temporary_path = NULL;
+
+  if (asprintf (&path, "%s/%s", store, key) < 0)
+    return -AICHAT_ERROR_MEMORY;
+
+  int existing = aichat_store_compare (path, data, length);
+
+  if (existing != 0)
+  {
+    free (path);
+    return existing < 0 ? existing : 0;
+  }
+
+  if (asprintf (&temporary_path, "%s/.%s.XXXXXX", store, key) < 0)
+  {
+    free (path);
+    return -AICHAT_ERROR_MEMORY;
+  }
+
+  int fd = mkstemp (temporary_path);
+  bool written = fd >= 0;
+
+  for (unsigned long int offset = 0; written && offset < length; )
+  {
+    ssize_t chunk = write (fd, data + offset, length - offset);
+
+    if (chunk < 0 && errno == EINTR)
+      continue;
+
+    written = chunk > 0;
+    offset += written ? chunk : 0;
+  }
+
+  // sessions that are based on the run are only saved once it is there to stay
+  written = written && fsync (fd) == 0;
+
+  if (fd >= 0 && close (fd) != 0)
+    written = false;
+
+  if (written && rename (temporary_path, path) != 0)
+    written = false;
+
+  if (written == false && fd >= 0)
+    remove (temporary_path);
+
+  free (path);
+  free (temporary_path);
+  return written ? 0 : -AICHAT_ERROR_IO;
+}
+
+int
+aichat_session_freeze (struct aichat_session *session, const char *store)
+{
+  if (session->base_messages == session->message_count)
+    return 0;
+
+  json_object *jrun = json_object_new_object ();
+
+  if (session->base_messages > 0)
+    json_object_object_add (jrun, "parent", aichat_store_reference_to_json_object (session->base, session->base_messages));
+
+  json_object *jmsgs = json_object_new_array ();
+
+  for (unsigned int i = session->base_messages; i < session->message_count; i++)
+    json_object_array_add (jmsgs, aichat_session_message_to_saved_json_object (session, i));
+
+  json_object_object_add (jrun, "messages", jmsgs);
+
+  size_t length;
+  const char *json = json_object_to_json_string_length (jrun, JSON_C_TO_STRING_PLAIN, &length);
+  char key [AICHAT_STORE_KEY_LENGTH + 1];
+
+  aichat_cache_key (NULL, json, length, key);
+  int result = aichat_store_write (store, key, json, length);
+  json_object_put (jrun);
+
+  if (result < 0)
+    return result;
+
+  memcpy (session->base, key, sizeof (key));
+  session->base_messages = session->message_count;
+
+  return 0;
+}
+
+bool
+aichat_session_journal_needs_compaction (struct aichat_session *session)
+{
+  // compact once the records that no longer describe a live message outnumber the ones that do
+  unsigned int live = session->message_count - session->base_messages;
+  unsigned int garbage = session->journal_records > live ? session->journal_records - live : 0;
+  return session->journal && garbage > live && garbage >= AICHAT_JOURNAL_MIN_GARBAGE;
+}
+
+static int
+aichat_model_context_window (enum aichat_model model)
+{
+  return model == AICHAT_MODEL_GPT_3_5_TURBO ? 4096 : 16384;
+}
+
+// the tokens a message takes up in the prompt, estimated from its length when the session has no tokenizer
+static long int
+aichat_session_message_tokens (struct aichat_session *session, struct aichat_message *message)
+{
+  if (session->tokenizer)
+  {
+    long int count = aichat_tokenizer_count_cached (session->tokenizer, message->text, message->length);
+
+    // every role is a single token
+    if (count >= 0)
+      return AICHAT_TOKENS_PER_MESSAGE + 1 + count;
+  }
+
+  // tokens are rarely shorter than 3 characters on average, so this overestimates rather than underestimates
+  return AICHAT_TOKENS_PER_MESSAGE + 1 + (message->length + 2) / 3;
+}
+
+// The messages of a request. The system messages at the start are always
+// sent, the last message is what the response is asked for and is sent even
+// when it does not fit, and the messages before it are sent for as far back as
+// the prompt budget allows, or back to the summary of the session, which is
+// sent in place of the messages before it. With context_recent_turns set the newest messages
+// stop after that many turns, and the older messages whose words match the last
+// message best are sent along with them while they fit. Their words are hashed
+// once and kept in the session, so a long conversation is only ranked, not
+// read again, on every turn.
+
+static int
+aichat_compare_hashes (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// words are runs of letters, digits and bytes of multibyte characters with ASCII letters lowercased, the
+// messages up to the one at index are hashed when they have not been yet. NULL when memory runs out.
+static struct aichat_message_terms *
+aichat_session_message_terms (struct aichat_session *session, unsigned int index)
+{
+  if (index < session->message_terms_count)
+    return &session->message_terms[index];
+
+  if (session->message_count > session->message_terms_capacity)
+  {
+    struct aichat_message_terms *terms = realloc (session->message_terms, session->message_count * sizeof (struct aichat_message_terms));
+
+    if (terms == NULL)
+      return NULL;
+
+    session->message_terms = terms;
+    session->message_terms_capacity = session->message_count;
+  }
+
+  uint32_t *hashes = NULL;
+  unsigned long int hash_capacity = 0;
+
+  while (session->message_terms_count <= index)
+  {
+    struct aichat_message *message = &session->messages[session->message_terms_count];
+    unsigned long int hash_count = 0;
+    uint32_t hash = 2166136261u;
+    bool in_word = false;
+
+    for (unsigned long int i = 0; i <= message->length; i++)
+    {
+      unsigned char c = i < message->length ? (unsigned char) message->text[i] : ' ';
+
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80)
+      {
+        hash = (hash ^ (c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c)) * 16777619u;
+        in_word = true;
+        continue;
+      }
+
+      if (in_word)
+      {
+        if (hash_count == hash_capacity)
+        {
+          unsigned long int capacity = hash_capacity ? hash_capacity * 2 : 256;
+          uint32_t *grown = realloc (hashes, capacity * sizeof (uint32_t));
+
+          if (grown == NULL)
+          {
+            free (hashes);
+            return NULL;
+          }
+
+          hashes = grown;
+          hash_capacity = capacity;
+        }
+
+        hashes[hash_count++] = hash;
+      }
+
+      hash = 2166136261u;
+      in_word = false;
+    }
+
+    qsort (hashes, hash_count, sizeof (uint32_t), aichat_compare_hashes);
+
+    unsigned int distinct = 0;
+
+    for (unsigned long int i = 0; i < hash_count; i++)
+      distinct += i == 0 || hashes[i] != hashes[i - 1];
+
+    struct aichat_message_terms *terms = &session->message_terms[session->message_terms_count];
+    terms->terms = distinct ? malloc (distinct * 2 * sizeof (uint32_t)) : NULL;
+    terms->count = distinct;
+    terms->length = hash_count;
+
+    if (distinct && terms->terms == NULL)
+    {
+      free (hashes);
+      return NULL;
+    }
+
+    for (unsigned long int i = 0, term = 0; i < hash_count; i++)
+    {
+      if (i > 0 && hashes[i] == hashes[i - 1])
+      {
+        terms->terms[term * 2 - 1]++;
+        continue;
+      }
+
+      terms->terms[term * 2] = hashes[i];
+      terms->terms[term * 2 + 1] = 1;
+      term++;
+    }
+
+    session->message_terms_count++;
+  }
+
+  free (hashes);
+  return &session->message_terms[index];
+}
+
+struct
+aichat_ranked_message
+{
+  double score;
+  unsigned int index;
+};
+
+static int
+aichat_compare_ranked_messages (const void *a, const void *b)
+{
+  const struct aichat_ranked_message *x = a, *y = b;
+
+  if (x->score != y->score)
+    return x->score > y->score ? -1 : 1;
+
+  // the newer of two equally relevant messages comes first
+  return x->index > y->index ? -1 : x->index < y->index;
+}
+
+static int
+aichat_compare_indexes (const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return x < y ? -1 : x > y;
+}
+
+// ranks the messages from prefix up to first against the last message with BM25 and writes the indexes of the
+// exchanges of up to context_relevant_messages of the best ones that fit the budget to selected, in the order
+// of the session. Returns how many messages were selected, none when memory runs out.
+static unsigned int
+aichat_session_select_relevant (struct aichat_session *session, unsigned int prefix, unsigned int first, long int budget, long int used, unsigned int *selected)
+{
+  unsigned int candidate_count = first - prefix;
+  struct aichat_message_terms *query = aichat_session_message_terms (session, session->message_count - 1);
+
+  if (query == NULL || query->count == 0 || candidate_count == 0)
+    return 0;
+
+  // every message before the last one has been hashed along with it
+  struct aichat_message_terms *candidates = &session->message_terms[prefix];
+  struct aichat_ranked_message *ranked = malloc (candidate_count * sizeof (struct aichat_ranked_message));
+  unsigned int *frequencies = calloc (query->count, sizeof (unsigned int));
+
+  if (ranked == NULL || frequencies == NULL)
+  {
+    free (ranked);
+    free (frequencies);
+    return 0;
+  }
+
+  // how many of the messages each word of the last message occurs in, and how long they are on average
+  double total_length = 0;
+
+  for (unsigned int c = 0; c < candidate_count; c++)
+  {
+    total_length += candidates[c].length;
+
+    for (unsigned int q = 0, t = 0; q < query->count && t < candidates[c].count; )
+    {
+      if (candidates[c].terms[t * 2] < query->terms[q * 2])
+        t++;
+      else if (candidates[c].terms[t * 2] > query->terms[q * 2])
+        q++;
+      else
+        frequencies[q++]++, t++;
+    }
+  }
+
+  const double k1 = 1.2, b = 0.75;
+  double average_length = total_length > 0 ? total_length / candidate_count : 1;
+  unsigned int ranked_count = 0;
+
+  for (unsigned int c = 0; c < candidate_count; c++)
+  {
+    double score = 0;
+    double norm = k1 * (1 - b + b * candidates[c].length / average_length);
+
+    for (unsigned int q = 0, t = 0; q < query->count && t < candidates[c].count; )
+    {
+      if (candidates[c].terms[t * 2] < query->terms[q * 2])
+        t++;
+      else if (candidates[c].terms[t * 2] > query->terms[q * 2])
+        q++;
+      else
+      {
+        double frequency = candidates[c].terms[t * 2 + 1];
+        double weight = log (1 + (candidate_count - frequencies[q] + 0.5) / (frequencies[q] + 0.5));
+
+        score += weight * frequency * (k1 + 1) / (frequency + norm);
+        q++, t++;
+      }
+    }
+
+    if (score > 0)
+      ranked[ranked_count++] = (struct aichat_ranked_message) { .score = score, .index = prefix + c };
+  }
+
+  qsort (ranked, ranked_count, sizeof (struct aichat_ranked_message), aichat_compare_ranked_messages);
+
+  // a question is sent with its answer and an answer with its question, an exchange that does not fit makes
+  // room for a shorter one further down
+  unsigned int selected_count = 0;
+
+  for (unsigned int r = 0, hits = 0; r < ranked_count && hits < session->context_relevant_messages; r++)
+  {
+    unsigned int start = ranked[r].index, end = ranked[r].index + 1;
+
+    if (session->messages[start].role == AICHAT_ROLE_ASSISTANT && start > prefix && session->messages[start - 1].role == AICHAT_ROLE_USER)
+      start--;
+    else if (session->messages[start].role == AICHAT_ROLE_USER && end < first && session->messages[end].role == AICHAT_ROLE_ASSISTANT)
+      end++;
+
+    bool taken = false;
+
+    for (unsigned int j = 0; j < selected_count && taken == false; j++)
+      taken = selected[j] == start;
+
+    if (taken)
+      continue;
+
+    long int tokens = 0;
+
+    for (unsigned int i = start; i < end; i++)
+      tokens += aichat_session_message_tokens (session, &session->messages[i]);
+
+    if (used + tokens > budget)
+      continue;
+
+    used += tokens;
+    hits++;
+
+    for (unsigned int i = start; i < end; i++)
+      selected[selected_count++] = i;
+  }
+
+  qsort (selected, selected_count, sizeof (unsigned int), aichat_compare_indexes);
+
+  free (ranked);
+  free (frequencies);
+  return selected_count;
+}
+
+// the message an entry of session->context stands for
+static struct aichat_message *
+aichat_session_context_message (struct aichat_session *session, unsigned int index)
+{
+  return index == AICHAT_CONTEXT_SUMMARY ? &session->summary : &session->messages[index];
+}
+
+// writes the indexes of the messages that are sent to session->context in the order they are sent and returns
+// how many there are, AICHAT_CONTEXT_SUMMARY stands for the summary. The messages that are left out stay in
+// the session.
+static long int
+aichat_session_select_context (struct aichat_session *session)
+{
+  unsigned int count = session->message_count;
+
+  // one more for the summary
+  if (count + 1 > session->context_capacity)
+  {
+    unsigned int *context = realloc (session->context, (count + 1) * sizeof (unsigned int));
+
+    if (context == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    session->context = context;
+    session->context_capacity = count + 1;
+  }
+
+  unsigned int *context = session->context;
+  unsigned int prefix = 0;
+
+  while (prefix < count && session->messages[prefix].role == AICHAT_ROLE_SYSTEM)
+  {
+    context[prefix] = prefix;
+    prefix++;
+  }
+
+  // the summary takes the place of the messages it summarizes, as long as there is a message after them
+  unsigned int sent = prefix;
+  unsigned int start = prefix;
+
+  if (session->summary_messages > prefix && session->summary_messages < count)
+  {
+    context[sent++] = AICHAT_CONTEXT_SUMMARY;
+    start = session->summary_messages;
+  }
+
+  unsigned int first = start;
+
+  if (start < count && (session->max_prompt_tokens >= 0 || session->context_recent_turns > 0))
+  {
+    long int budget = session->max_prompt_tokens;
+
+    if (budget == 0)
+      budget = aichat_model_context_window (session->model) - session->reserved_completion_tokens;
+    else if (budget < 0)
+      budget = LONG_MAX;
+
+    long int used = AICHAT_TOKENS_PER_REPLY;
+
+    for (unsigned int i = 0; i < sent; i++)
+      used += aichat_session_message_tokens (session, aichat_session_context_message (session, context[i]));
+
+    first = count - 1;
+    used += aichat_session_message_tokens (session, &session->messages[first]);
+
+    // a turn starts with a user message
+    unsigned int turns = session->messages[first].role == AICHAT_ROLE_USER;
+
+    while (first > start && (session->context_recent_turns == 0 || turns < session->context_recent_turns))
+    {
+      long int tokens = aichat_session_message_tokens (session, &session->messages[first - 1]);
+
+      if (used + tokens > budget)
+        break;
+
+      used += tokens;
+      first--;
+      turns += session->messages[first].role == AICHAT_ROLE_USER;
+    }
+
+    // an answer is not sent without the question it answers
+    while (first < count - 1 && first > start && session->messages[first].role == AICHAT_ROLE_ASSISTANT)
+      used -= aichat_session_message_tokens (session, &session->messages[first++]);
+
+    if (session->context_recent_turns > 0 && session->context_relevant_messages > 0)
+      sent += aichat_session_select_relevant (session, start, first, budget, used, context + sent);
+  }
+
+  for (unsigned int i = first; i < count; i++)
+    context[sent++] = i;
+
+  return sent;
+}
+
+long int
+aichat_session_estimate_tokens (struct aichat_session *session)
+{
+  long int tokens = AICHAT_TOKENS_PER_REPLY;
+
+  for (unsigned int i = 0; i < session->message_count; i++)
+    tokens += aichat_session_message_tokens (session, &session->messages[i]);
+
+  return tokens;
+}
+
+// the prompt tokens of the last request body built for the session, estimated from the messages it was built
+// from rather than by selecting them again
+static long int
+aichat_session_prompt_tokens (struct aichat_session *session)
+{
+  long int tokens = AICHAT_TOKENS_PER_REPLY;
+
+  for (unsigned int i = 0; i < session->context_count; i++)
+    tokens += aichat_session_message_tokens (session, aichat_session_context_message (session, session->context[i]));
+
+  return tokens;
+}
+
+// Request bodies are written by hand rather than through json-c. The body is
+// built in a buffer that belongs to the session and is reused from one request
+// to the next, and the text of every message is escaped straight from the
+// session chunks into it, so each byte is copied once. Runs of characters that
+// need no escaping are found 16 bytes at a time when SSE2 is available.
+//
+// The output is byte for byte what json-c writes with JSON_C_TO_STRING_PLAIN,
+// including the escaped slashes and the 17 significant digits of the
+// temperature, so that cache keys and recorded cassettes stay valid.
+
+// makes room for size more bytes after length, the buffer keeps its memory between requests
+static char *
+aichat_request_reserve (struct aichat_session *session, unsigned long int length, unsigned long int size)
+{
+  if (length + size > session->request_body_capacity)
+  {
+    unsigned long int capacity = session->request_body_capacity ? session->request_body_capacity : 4096;
+
+    while (length + size > capacity)
+      capacity *= 2;
+
+    char *body = realloc (session->request_body, capacity);
+
+    if (body == NULL)
+      return NULL;
+
+    session->request_body = body;
+    session->request_body_capacity = capacity;
+  }
+
+  return session->request_body + length;
+}
+
+static bool
+aichat_request_append (struct aichat_session *session, unsigned long int *length, const char *data, unsigned long int size)
+{
+  char *destination = aichat_request_reserve (session, *length, size);
+
+  if (destination == NULL)
+    return false;
+
+  memcpy (destination, data, size);
+  *length += size;
+
+  return true;
+}
+
+static bool
+aichat_request_append_text (struct aichat_session *session, unsigned long int *length, const char *text)
+{
+  return aichat_request_append (session, length, text, strlen (text));
+}
+
+// skips the characters that are written as they are, stops at a control character, a quote, a backslash or a slash
+static const unsigned char *
+aichat_json_skip_unescaped (const unsigned char *text, const unsigned char *end)
+{
+#ifdef __SSE2__
+  const __m128i control = _mm_set1_epi8 (0x1F);
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i slash = _mm_set1_epi8 ('/');
+
+  while (end - text >= 16)
+  {
+    __m128i bytes = _mm_loadu_si128 ((const __m128i *) text);
+
+    // a byte is a control character when the unsigned maximum of it and 0x1F is 0x1F
+    __m128i special = _mm_or_si128 (_mm_cmpeq_epi8 (_mm_max_epu8 (bytes, control), control),
+                                    _mm_or_si128 (_mm_cmpeq_epi8 (bytes, quote), _mm_or_si128 (_mm_cmpeq_epi8 (bytes, backslash), _mm_cmpeq_epi8 (bytes, slash))));
+    unsigned int mask = _mm_movemask_epi8 (special);
+
+    if (mask != 0)
+      return text + __builtin_ctz (mask);
+
+    text += 16;
+  }
+#endif
+
+  while (text < end && *text >= 0x20 && *text != '"' && *text != '\\' && *text != '/')
+    text++;
+
+  return text;
+}
+
+// appends the text as a JSON string with its quotes
+static bool
+aichat_request_append_string (struct aichat_session *session, unsigned long int *length, const char *text, unsigned long int text_length)
+{
+  static const char hex [] = "0123456789abcdef";
+
+  const unsigned char *cursor = (const unsigned char *) text;
+  const unsigned char *end = cursor + text_length;
+
+  // the common case of a string without escapes needs a single reservation
+  char *destination = aichat_request_reserve (session, *length, text_length + 2);
+
+  if (destination == NULL)
+    return false;
+
+  session->request_body[(*length)++] = '"';
+
+  while (true)
+  {
+    const unsigned char *special = aichat_json_skip_unescaped (cursor, end);
+
+    if (aichat_request_append (session, length, (const char *) cursor, special - cursor) == false)
+      return false;
+
+    if (special == end)
+      break;
+
+    char escape [6] = { '\\', 0 };
+    unsigned long int escape_length = 2;
+
+    switch (*special)
+    {
+      case '"':  escape[1] = '"'; break;
+      case '\\': escape[1] = '\\'; break;
+      case '/':  escape[1] = '/'; break;
+      case '\b': escape[1] = 'b'; break;
+      case '\f': escape[1] = 'f'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default:
+        memcpy (escape + 1, "u00", 3);
+        escape[4] = hex[*special >> 4];
+        escape[5] = hex[*special & 0xF];
+        escape_length = 6;
+        break;
+    }
+
+    if (aichat_request_append (session, length, escape, escape_length) == false)
+      return false;
+
+    cursor = special + 1;
+  }
+
+  return aichat_request_append_text (session, length, "\"");
+}
+
+// the number the way json-c writes a double that has no string of its own
+static bool
+aichat_request_append_double (struct aichat_session *session, unsigned long int *length, double value)
+{
+  char number [64];
+  int size = snprintf (number, sizeof (number), "%.17g", value);
+
+  if (size < 0 || size >= (int) sizeof (number) - 2)
+    return false;
+
+  if (strpbrk (number, ".e") == NULL && ((number[0] >= '0' && number[0] <= '9') || (number[0] == '-' && number[1] >= '0' && number[1] <= '9')))
+  {
+    memcpy (number + size, ".0", 3);
+    size += 2;
+  }
+
+  return aichat_request_append (session, length, number, size);
+}
+
+static const char *
+aichat_role_to_string (enum aichat_role role)
+{
+  return role == AICHAT_ROLE_SYSTEM ? "system" : role == AICHAT_ROLE_USER ? "user" : "assistant";
+}
+
+// the request body for the session, when cache_key is given it receives the key of the request in the
+// response cache, which does not depend on whether the response is streamed. The body belongs to the
+// session and stays valid until the next request body is built for it.
+char *
+aichat_session_to_json (struct aichat_session *session, unsigned long int *length, int *omitted_messages, char *cache_key)
+{
+  long int sent = aichat_session_select_context (session);
+
+  if (sent < 0)
+    return NULL;
+
+  session->context_count = sent;
+
+  // the summary is sent in place of messages, it is not one of them
+  long int summaries = 0;
+
+  for (long int i = 0; i < sent; i++)
+    summaries += session->context[i] == AICHAT_CONTEXT_SUMMARY;
+
+  *omitted_messages = session->message_count - (sent - summaries);
+
+  unsigned long int used = 0;
+  bool written = aichat_request_append_text (session, &used, "{\"model\":") &&
+                 aichat_request_append_string (session, &used, aichat_model_to_string (session->model), strlen (aichat_model_to_string (session->model))) &&
+                 aichat_request_append_text (session, &used, ",\"temperature\":") &&
+                 aichat_request_append_double (session, &used, session->temperature) &&
+                 aichat_request_append_text (session, &used, ",\"messages\":[");
+
+  for (long int i = 0; i < sent && written; i++)
+  {
+    struct aichat_message *message = aichat_session_context_message (session, session->context[i]);
+    const char *role = aichat_role_to_string (message->role);
+    const char *separator = i > 0 ? ",{\"role\":\"" : "{\"role\":\"";
+
+    written = aichat_request_append_text (session, &used, separator) &&
+              aichat_request_append_text (session, &used, role) &&
+              aichat_request_append_text (session, &used, "\",\"content\":") &&
+              aichat_request_append_string (session, &used, message->text, message->length) &&
+              aichat_request_append_text (session, &used, "}");
+  }
+
+  // the body as it is hashed ends here, everything after it only belongs in the request
+  written = written && aichat_request_append_text (session, &used, "]}");
+
+  if (written == false)
+    return NULL;
+
+  if (cache_key)
+    aichat_cache_key (session->client ? session->client->url : NULL, session->request_body, used, cache_key);
+
+  if (session->choices > 1 || session->stream_callback)
+  {
+    char extra [128];
+    int extra_length = 0;
+
+    if (session->choices > 1)
+      extra_length += snprintf (extra + extra_length, sizeof (extra) - extra_length, ",\"n\":%u", session->choices);
+
+    if (session->stream_callback && session->choices <= 1)
+      extra_length += snprintf (extra + extra_length, sizeof (extra) - extra_length, ",\"stream\":true,\"stream_options\":{\"include_usage\":true}");
+
+    // the closing brace is moved behind the extra members
+    used--;
+
+    if (aichat_request_append (session, &used, extra, extra_length) == false || aichat_request_append_text (session, &used, "}") == false)
+      return NULL;
+  }
+
+  if (aichat_request_append (session, &used, "", 1) == false)
+    return NULL;
+
+  *length = used - 1;
+  return session->request_body;
+}
+
+const char *
+aichat_session_request_body (struct aichat_session *session, unsigned long int *length)
+{
+  int omitted_messages;
+  return aichat_session_to_json (session, length, &omitted_messages, NULL);
+}
+
+
+static bool
+aichat_buffer_append (char **buffer, unsigned long int *length, unsigned long int *capacity, const char *data, unsigned long int size)
+{
+  // keep room for a null terminator so the buffer can always be used as a string
+  if (*length + size + 1 > *capacity)
+  {
+    unsigned long int new_capacity = *capacity ? *capacity : 256;
+
+    while (*length + size + 1 > new_capacity)
+      new_capacity *= 2;
+
+    char *new_buffer = realloc (*buffer, new_capacity);
+
+    if (new_buffer == NULL)
+      return false;
+
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+  }
+
+  memcpy (*buffer + *length, data, size);
+  *length += size;
+  (*buffer)[*length] = '\0';
+
+  return true;
+}
+
+static void
+aichat_api_call_stream_dispatch (struct aichat_api_call_state *state)
+{
+  if (state->event_length == 0)
+    return;
+
+  state->event_length = 0;
+
+  if (strcmp (state->event, "[DONE]") == 0)
+  {
+    state->stream_done = true;
+    return;
+  }
+
+  json_object *jchunk = json_tokener_parse (state->event);
+
+  if (jchunk == NULL)
+  {
+    state->stream_error = AICHAT_ERROR_JSON_PARSE;
+    return;
+  }
+
+  json_object *jerror = NULL;
+  if (json_object_object_get_ex (jchunk, "error", &jerror))
+  {
+    state->stream_error = AICHAT_ERROR_API_ERROR;
+    json_object_put (jchunk);
+    return;
+  }
+
+  // the usage is sent in a final chunk with no choices when requested through stream_options
+  json_object *jusage = NULL;
+  if (json_object_object_get_ex (jchunk, "usage", &jusage) && json_object_get_type (jusage) == json_type_object)
+  {
+    json_object *jprompt_tokens = NULL;
+    json_object *jcompletion_tokens = NULL;
+
+    if (json_object_object_get_ex (jusage, "prompt_tokens", &jprompt_tokens))
+      state->prompt_tokens = json_object_get_int (jprompt_tokens);
+
+    if (json_object_object_get_ex (jusage, "completion_tokens", &jcompletion_tokens))
+      state->completion_tokens = json_object_get_int (jcompletion_tokens);
+  }
+
+  // extract the increment from .choices[0].delta.content and hand it to the sink
+  json_object *jchoices = NULL;
+  if (json_object_object_get_ex (jchunk, "choices", &jchoices) && json_object_array_length (jchoices) > 0)
+  {
+    json_object *jchoice = json_object_array_get_idx (jchoices, 0);
+    json_object *jdelta = NULL;
+    json_object *jcontent = NULL;
+
+    if (json_object_object_get_ex (jchoice, "delta", &jdelta) && json_object_object_get_ex (jdelta, "content", &jcontent))
+    {
+      const char *content = json_object_get_string (jcontent);
+      unsigned long int content_length = json_object_get_string_len (jcontent);
+
+      if (content != NULL && content_length > 0)
+      {
+        fwrite (content, 1, content_length, state->content_file);
+        state->stream_callback (content, content_length, state->stream_userdata);
+        state->delivered = true;
+      }
+    }
+  }
+
+  json_object_put (jchunk);
+}
+
+static bool
+aichat_api_call_stream_line (struct aichat_api_call_state *state, char *line, unsigned long int length)
+{
+  if (length > 0 && line[length - 1] == '\r')
+    length--;
+
+  // an empty line terminates the event
+  if (length == 0)
+  {
+    aichat_api_call_stream_dispatch (state);
+    return true;
+  }
+
+  // only the data field is used by the API, comments and other fields are ignored
+  if (length < 5 || strncmp (line, "data:", 5) != 0)
+    return true;
+
+  char *value = line + 5;
+  length -= 5;
+
+  if (length > 0 && *value == ' ')
+  {
+    value++; length--;
+  }
+
+  if (state->event_length > 0 && aichat_buffer_append (&state->event, &state->event_length, &state->event_capacity, "\n", 1) == false)
+    return false;
+
+  return aichat_buffer_append (&state->event, &state->event_length, &state->event_capacity, value, length);
+}
+
+static bool
+aichat_api_call_stream_write (struct aichat_api_call_state *state, char *buffer, unsigned long int size)
+{
+  while (size > 0)
+  {
+    char *newline = memchr (buffer, '\n', size);
+    unsigned long int segment = newline ? (unsigned long int) (newline - buffer) : size;
+
+    if (aichat_buffer_append (&state->line, &state->line_length, &state->line_capacity, buffer, segment) == false)
+      return false;
+
+    if (newline == NULL)
+      break;
+
+    if (aichat_api_call_stream_line (state, state->line, state->line_length) == false)
+      return false;
+
+    state->line_length = 0;
+    buffer += segment + 1;
+    size -= segment + 1;
+  }
+
+  return true;
+}
+
+unsigned long int
+aichat_api_call_write_callback (char *buffer, unsigned long int size, unsigned long int n, void *userdata)
+{
+  /* calculate the real size of the incoming buffer */
+  unsigned long int realsize = size * n;
+  
+  struct aichat_api_call_state *state = (struct aichat_api_call_state *) userdata;
+
+  if (realsize == 0)
+    return 0;
+
+  // of two hedged requests only the first successful response is read, the other one is aborted
+  if (state->race && state->status >= 200 && state->status < 300)
+  {
+    if (*state->race == NULL)
+      *state->race = state;
+    else if (*state->race != state)
+      return 0;
+  }
+
+  if (state->recording && aichat_buffer_append (&state->recorded, &state->recorded_length, &state->recorded_capacity, buffer, realsize) == false)
+    return 0;
+
+  /* errors are reported as a plain JSON document even when streaming was requested */
+  if (state->started == false)
+  {
+    state->started = true;
+    state->streaming = state->stream_callback != NULL && buffer[0] != '{';
+  }
+
+  if (state->streaming)
+  {
+    return aichat_api_call_stream_write (state, buffer, realsize) ? realsize : 0;
+  }
+
+  /* parse the received data */
+  state->object = json_tokener_parse_ex (state->tokener, buffer, realsize);
+
+  /* check for errors */
+  enum json_tokener_error jerr = json_tokener_get_error (state->tokener);
+  if (jerr != json_tokener_success && jerr != json_tokener_continue) {
+      return 0; /* tell libcurl to stop the download */
+  }
+
+  return realsize;
+}
+
+// parses the durations of the x-ratelimit-reset headers such as "1s", "6m0s" or "20ms", -1 when it is not one
+static double
+aichat_parse_duration (const char *text)
+{
+  double seconds = 0;
+
+  while (*text != '\0')
+  {
+    char *end;
+    double value = strtod (text, &end);
+
+    if (end == text || value < 0)
+      return -1;
+
+    if (strncmp (end, "ms", 2) == 0)   { seconds += value / 1000; end += 2; }
+    else if (*end == 'h')              { seconds += value * 3600; end++; }
+    else if (*end == 'm')              { seconds += value * 60; end++; }
+    else if (*end == 's')              { seconds += value; end++; }
+    else if (*end == '\0')             { seconds += value; }
+    else                               return -1;
+
+    text = end;
+  }
+
+  return seconds;
+}
+
+static size_t
+aichat_api_call_header_callback (char *buffer, size_t size, size_t n, void *userdata)
+{
+  unsigned long int length = size * n;
+  struct aichat_api_call_state *state = (struct aichat_api_call_state *) userdata;
+  struct aichat_rate_limits *limits = &state->limits;
+  char line [256];
+
+  // every response starts with a status line, only the headers of the last one count
+  if (length >= 5 && strncmp (buffer, "HTTP/", 5) == 0)
+  {
+    const char *space = memchr (buffer, ' ', length);
+
+    state->status = space ? strtol (space + 1, NULL, 10) : 0;
+    aichat_rate_limits_clear (limits);
+    return length;
+  }
+
+  if (length >= sizeof (line))
+    return length;
+
+  memcpy (line, buffer, length);
+  line [length] = '\0';
+  line [strcspn (line, "\r\n")] = '\0';
+
+  char *value = strchr (line, ':');
+
+  if (value == NULL)
+    return length;
+
+  *value++ = '\0';
+  value += strspn (value, " \t");
+
+  char *end;
+
+  if (strcasecmp (line, "retry-after-ms") == 0)
+  {
+    double milliseconds = strtod (value, &end);
+    if (end != value && milliseconds >= 0) limits->retry_after = milliseconds / 1000;
+  }
+  else if (strcasecmp (line, "retry-after") == 0 && limits->retry_after < 0)
+  {
+    // either a number of seconds or an HTTP date, the more precise retry-after-ms wins when both are sent
+    double seconds = strtod (value, &end);
+
+    if (end != value && *end == '\0')
+    {
+      limits->retry_after = seconds >= 0 ? seconds : 0;
+    }
+    else
+    {
+      time_t date = curl_getdate (value, NULL);
+      if (date >= 0) limits->retry_after = date > time (NULL) ? difftime (date, time (NULL)) : 0;
+    }
+  }
+  else if (strcasecmp (line, "x-ratelimit-limit-requests") == 0)     limits->limit_requests = strtol (value, NULL, 10);
+  else if (strcasecmp (line, "x-ratelimit-limit-tokens") == 0)       limits->limit_tokens = strtol (value, NULL, 10);
+  else if (strcasecmp (line, "x-ratelimit-remaining-requests") == 0) limits->remaining_requests = strtol (value, NULL, 10);
+  else if (strcasecmp (line, "x-ratelimit-remaining-tokens") == 0)   limits->remaining_tokens = strtol (value, NULL, 10);
+  else if (strcasecmp (line, "x-ratelimit-reset-requests") == 0)     limits->reset_requests = aichat_parse_duration (value);
+  else if (strcasecmp (line, "x-ratelimit-reset-tokens") == 0)       limits->reset_tokens = aichat_parse_duration (value);
+
+  return length;
+}
+
+struct aichat_api_call_state *
+aichat_api_call_state_initialize (aichat_stream_callback stream_callback, void *stream_userdata)
+{
+  struct aichat_api_call_state *state = calloc (1, sizeof (struct aichat_api_call_state));
+
+  if (state == NULL)
+    return NULL;
+
+  state->tokener = json_tokener_new ();
+  state->object = NULL;
+  aichat_rate_limits_clear (&state->limits);
+
+  state->stream_callback = stream_callback;
+  state->stream_userdata = stream_userdata;
+
+  if (stream_callback)
+  {
+    state->content_file = open_memstream (&state->content, &state->content_length);
+  }
+
+  if (state->tokener == NULL || (stream_callback && state->content_file == NULL))
+  {
+    json_tokener_free (state->tokener);
+    free (state);
+    return NULL;
+  }
+
+  return state;
+}
+
+void
+aichat_api_call_state_free (struct aichat_api_call_state *state)
+{
+  json_tokener_free (state->tokener);
+  json_object_put (state->object);
+
+  if (state->content_file)
+    fclose (state->content_file);
+
+  free (state->content);
+  free (state->line);
+  free (state->event);
+  free (state->recorded);
+  free (state);
+}
+
+static char *
+aichat_api_call_state_resolve_stream (struct aichat_api_call_state *state, struct aichat_api_call_results *results)
+{
+  // a trailing event may not be followed by an empty line when the connection closes
+  if (state->line_length > 0)
+    aichat_api_call_stream_line (state, state->line, state->line_length);
+
+  aichat_api_call_stream_dispatch (state);
+
+  results->prompt_tokens = state->prompt_tokens;
+  results->completion_tokens = state->completion_tokens;
+
+  if (state->stream_error)
+  {
+    results->error = state->stream_error;
+    return NULL;
+  }
+
+  if (state->stream_done == false)
+  {
+    results->error = AICHAT_ERROR_API_RESPONSE;
+    return NULL;
+  }
+
+  fflush (state->content_file);
+
+  results->error = 0;
+  return strdup (state->content ? state->content : "");
+}
+
+// the code of the error the API answered with, NULL when the response is not an error or has no code
+static const char *
+aichat_api_call_error_code (struct aichat_api_call_state *state)
+{
+  json_object *jerror = NULL;
+  json_object *jcode = NULL;
+
+  if (state->streaming || state->object == NULL)
+    return NULL;
+
+  if (json_object_object_get_ex (state->object, "error", &jerror) && json_object_object_get_ex (jerror, "code", &jcode) &&
+      json_object_is_type (jcode, json_type_string))
+    return json_object_get_string (jcode);
+
+  return NULL;
+}
+
+char *
+aichat_api_call_state_resolve (struct aichat_api_call_state *state, struct aichat_api_call_results *results)
+{
+  if (state->streaming)
+    return aichat_api_call_state_resolve_stream (state, results);
+
+  enum json_tokener_error jerr = json_tokener_get_error (state->tokener);
+
+  if (jerr != json_tokener_success)
+  {
+    results->error = AICHAT_ERROR_JSON_PARSE;
+    return NULL;
+  }
+
+  // check if the response is an error
+  if (json_object_object_get_ex (state->object, "error", NULL))
+  {
+    const char *code = aichat_api_call_error_code (state);
+
+    if (code && strcmp (code, "context_length_exceeded") == 0)
+      results->error = AICHAT_ERROR_CONTEXT_LENGTH;
+    else
+      results->error = AICHAT_ERROR_API_ERROR;
+
+    return NULL;
+  }
+
+  // otherwise extract .usage.prompt_tokens, .usage.completion_tokens and store in results
+  json_object *jusage = NULL;
+  if (json_object_object_get_ex (state->object, "usage", &jusage))
+  {
+    json_object *jprompt_tokens = NULL;
+    json_object *jcompletion_tokens = NULL;
+
+    if (json_object_object_get_ex (jusage, "prompt_tokens", &jprompt_tokens))
+    {
+      results->prompt_tokens = json_object_get_int (jprompt_tokens);
+    }
+
+    if (json_object_object_get_ex (jusage, "completion_tokens", &jcompletion_tokens))
+    {
+      results->completion_tokens = json_object_get_int (jcompletion_tokens);
+    }
+  }
+
+  // extract the response from .choices[0].message.content and return a strdup of it
+  json_object *jchoices = NULL;
+  if (json_object_object_get_ex (state->object, "choices", &jchoices))
+  {
+    json_object *jchoice = json_object_array_get_idx (jchoices, 0);
+    json_object *jmessage = NULL;
+    if (json_object_object_get_ex (jchoice, "message", &jmessage))
+    {
+      json_object *jcontent = NULL;
+      if (json_object_object_get_ex (jmessage, "content", &jcontent))
+      {
+        const char *content = json_object_get_string (jcontent);
+        results->error = 0;
+        return strdup (content);
+      }
+    }
+  }
+
+  // if we get here, something went wrong so return NULL and set error
+  results->error = AICHAT_ERROR_API_RESPONSE;
+  return NULL;
+}
+
+// the choices of a response that has more than one, which the caller must put, NULL for any other response
+static json_object *
+aichat_api_call_state_choices (struct aichat_api_call_state *state)
+{
+  json_object *jchoices = NULL;
+
+  if (state->streaming || state->object == NULL || json_object_object_get_ex (state->object, "choices", &jchoices) == false ||
+      json_object_get_type (jchoices) != json_type_array || json_object_array_length (jchoices) < 2)
+    return NULL;
+
+  return json_object_get (jchoices);
+}
+
+static int
+aichat_api_call_setup (struct aichat_client *client, CURL *curl, const char *data, unsigned long int data_strlen, const char *key, struct aichat_api_call_state *state, struct curl_slist **headers)
+{
+  aichat_client_prepare_handle (client, curl);
+
+  // set the appropriate headers
+  *headers = NULL;
+  *headers = curl_slist_append (*headers, "Content-Type: application/json");
+  *headers = curl_slist_append (*headers, state->stream_callback ? "Accept: text/event-stream" : "Accept: application/json");
+
+  if (key)
+  {
     char *authorization;
     int length = asprintf (&authorization, "Authorization: Bearer %s", key);
 
-    if (length < 0)
+    if (length < 0)
+    {
+      curl_slist_free_all (*headers);
+      *headers = NULL;
+      return -AICHAT_ERROR_MEMORY;
+    }
+
+    // add the header
+    *headers = curl_slist_append (*headers, authorization);
+
+    free (authorization);
+  }
+
+  curl_easy_setopt (curl, CURLOPT_URL, client->url);
+  curl_easy_setopt (curl, CURLOPT_POSTFIELDS, data);
+  curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, data_strlen);
+  curl_easy_setopt (curl, CURLOPT_WRITEDATA, state);
+  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, aichat_api_call_write_callback);
+  curl_easy_setopt (curl, CURLOPT_HEADERDATA, state);
+  curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, aichat_api_call_header_callback);
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, *headers);
+
+  return 0;
+}
+
+double
+aichat_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// curl reports every phase as the time since the start of the transfer, the results hold how long each phase took
+static void
+aichat_api_call_measure (CURL *curl, unsigned long int request_bytes, struct aichat_api_call_results *results)
+{
+  curl_off_t name_lookup = 0, connect = 0, app_connect = 0, start_transfer = 0, total = 0, downloaded = 0;
+  long int status = 0;
+
+  curl_easy_getinfo (curl, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup);
+  curl_easy_getinfo (curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo (curl, CURLINFO_APPCONNECT_TIME_T, &app_connect);
+  curl_easy_getinfo (curl, CURLINFO_STARTTRANSFER_TIME_T, &start_transfer);
+  curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo (curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+  curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status);
+
+  results->name_lookup_time = name_lookup * 1e-6;
+  results->connect_time = connect > name_lookup ? (connect - name_lookup) * 1e-6 : 0;
+  results->tls_time = app_connect > connect ? (app_connect - connect) * 1e-6 : 0;
+  results->first_byte_time = start_transfer * 1e-6;
+  results->total_time = total * 1e-6;
+  results->request_bytes = request_bytes;
+  results->response_bytes = downloaded;
+  results->http_status = status;
+}
+
+// the error of a finished attempt that may go away when the request is sent again, 0 for any other outcome
+static int
+aichat_api_call_transient_error (CURLcode code, long int status, struct aichat_api_call_state *state)
+{
+  // running out of quota is reported as a 429 as well but waiting does not help
+  if (status == 429)
+  {
+    const char *error_code = aichat_api_call_error_code (state);
+    return error_code && strcmp (error_code, "insufficient_quota") == 0 ? 0 : AICHAT_ERROR_RATE_LIMITED;
+  }
+
+  if (status == 408 || status >= 500)
+    return AICHAT_ERROR_SERVER;
+
+  switch (code)
+  {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return AICHAT_ERROR_NETWORK;
+
+    default:
+      return 0;
+  }
+}
+
+// a write error is a response that was aborted because it did not parse, the state knows the details
+static char *
+aichat_api_call_finish (CURLcode code, struct aichat_api_call_state *state, struct aichat_api_call_results *results)
+{
+  int error = aichat_api_call_transient_error (code, results->http_status, state);
+
+  if (error == 0 && code != CURLE_OK && code != CURLE_WRITE_ERROR)
+    error = AICHAT_ERROR_NETWORK;
+
+  if (error)
+  {
+    results->error = error;
+    return NULL;
+  }
+
+  return aichat_api_call_state_resolve (state, results);
+}
+
+static void
+aichat_client_update_rate_limits (struct aichat_client *client, struct aichat_api_call_state *state, long int status)
+{
+  if (status == 0)
+    return;
+
+  client->rate_limits = state->limits;
+  client->rate_limits.received = aichat_now ();
+}
+
+// xorshift64*, uniform in [0, 1)
+static double
+aichat_client_random (struct aichat_client *client)
+{
+  uint64_t x = client->random_state;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  client->random_state = x;
+
+  return ((x * 2685821657736338717ULL) >> 11) * 0x1.0p-53;
+}
+
+// how long to wait before the given retry, negative when the API asked for a longer wait than the policy allows
+static double
+aichat_client_retry_delay (struct aichat_client *client, unsigned int retry, struct aichat_rate_limits *limits)
+{
+  double backoff = client->retry_base_delay;
+
+  for (unsigned int i = 0; i < retry && backoff < client->retry_max_delay; i++)
+    backoff *= 2;
+
+  if (backoff > client->retry_max_delay)
+    backoff = client->retry_max_delay;
+
+  double delay = backoff / 2 + aichat_client_random (client) * backoff / 2;
+  double requested = limits->retry_after;
+
+  if (limits->remaining_requests == 0 && limits->reset_requests > requested)
+    requested = limits->reset_requests;
+
+  if (limits->remaining_tokens == 0 && limits->reset_tokens > requested)
+    requested = limits->reset_tokens;
+
+  if (requested > client->retry_max_delay)
+    return -1;
+
+  return requested > delay ? requested : delay;
+}
+
+static void
+aichat_sleep (double seconds)
+{
+  struct timespec delay;
+
+  delay.tv_sec = (time_t) seconds;
+  delay.tv_nsec = (long int) ((seconds - delay.tv_sec) * 1e9);
+
+  while (nanosleep (&delay, &delay) < 0 && errno == EINTR)
+    ;
+}
+
+static void
+aichat_client_add_hedge_sample (struct aichat_client *client, double first_byte_time)
+{
+  client->hedge_samples [client->hedge_sample_next] = first_byte_time;
+  client->hedge_sample_next = (client->hedge_sample_next + 1) % AICHAT_HEDGE_SAMPLES;
+
+  if (client->hedge_sample_count < AICHAT_HEDGE_SAMPLES)
+    client->hedge_sample_count++;
+}
+
+static int
+aichat_compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+// how long to wait for a response to start before sending a duplicate, 0 when there is no delay yet
+static double
+aichat_client_hedge_delay (struct aichat_client *client)
+{
+  unsigned int count = client->hedge_sample_count;
+
+  if (client->hedge_percentile == 0 || count < AICHAT_HEDGE_MIN_SAMPLES)
+    return client->hedge_delay;
+
+  double sorted [AICHAT_HEDGE_SAMPLES];
+  memcpy (sorted, client->hedge_samples, count * sizeof (double));
+  qsort (sorted, count, sizeof (double), aichat_compare_doubles);
+
+  unsigned int index = client->hedge_percentile / 100 * count;
+  return sorted [index < count ? index : count - 1];
+}
+
+// sends the request on the handle of the client and, when its response has not started after the hedge delay,
+// a duplicate on a second handle. The handles share their connections, so the duplicate is made to open a
+// fresh one instead of being multiplexed onto the connection of the request that is slow. The state and the
+// handle of the response that is used are returned in state and used, the state of the other one is freed.
+static CURLcode
+aichat_api_call_perform_hedged (struct aichat_client *client, const char *data, unsigned long int data_strlen, long int estimated_tokens, const char *key, struct aichat_api_call_state **state, CURL **used, struct aichat_api_call_results *results)
+{
+  double delay = aichat_client_hedge_delay (client);
+  curl_off_t first_byte = 0;
+
+  *used = client->curl;
+
+  if (client->multi == NULL)
+    client->multi = curl_multi_init ();
+
+  if (client->hedge_curl == NULL)
+    client->hedge_curl = curl_easy_init ();
+
+  // while there is nothing to hedge after yet the request is sent on its own and only measured
+  if (delay <= 0 || client->multi == NULL || client->hedge_curl == NULL)
+  {
+    CURLcode code = curl_easy_perform (client->curl);
+
+    if (code == CURLE_OK && (*state)->status >= 200 && (*state)->status < 300 &&
+        curl_easy_getinfo (client->curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte) == CURLE_OK)
+      aichat_client_add_hedge_sample (client, first_byte * 1e-6);
+
+    return code;
+  }
+
+  struct aichat_api_call_state *winner = NULL;
+  struct aichat_api_call_state *hedge = NULL;
+  struct curl_slist *hedge_headers = NULL;
+  CURLcode primary_code = CURLE_OK, hedge_code = CURLE_OK;
+  bool primary_done = false, hedge_running = false, hedge_skipped = false;
+  double start = aichat_now (), hedge_start = 0;
+
+  (*state)->race = &winner;
+
+  if (curl_multi_add_handle (client->multi, client->curl) != CURLM_OK)
+  {
+    (*state)->race = NULL;
+    return curl_easy_perform (client->curl);
+  }
+
+  while (primary_done == false || hedge_running)
+  {
+    int running = 0, queued = 0;
+    CURLMsg *message;
+
+    curl_multi_perform (client->multi, &running);
+
+    while ((message = curl_multi_info_read (client->multi, &queued)) != NULL)
+    {
+      if (message->msg != CURLMSG_DONE)
+        continue;
+
+      if (message->easy_handle == client->curl)
+      {
+        primary_done = true;
+        primary_code = message->data.result;
+      }
+      else
+      {
+        hedge_running = false;
+        hedge_code = message->data.result;
+      }
+
+      curl_multi_remove_handle (client->multi, message->easy_handle);
+    }
+
+    // a successful response without a body never reached the write callback but is just as good
+    if (winner == NULL && primary_done && primary_code == CURLE_OK && (*state)->status >= 200 && (*state)->status < 300)
+      winner = *state;
+
+    // the loser is cancelled as soon as the response of the winner starts
+    if (winner == *state && hedge_running)
+    {
+      curl_multi_remove_handle (client->multi, client->hedge_curl);
+      hedge_running = false;
+    }
+
+    if (winner && winner == hedge && primary_done == false)
+    {
+      curl_multi_remove_handle (client->multi, client->curl);
+      primary_done = true;
+    }
+
+    double now = aichat_now ();
+
+    // a duplicate is only sent while no response has started, and not when the scheduler holds it back
+    if (hedge == NULL && hedge_skipped == false && primary_done == false && (*state)->status == 0 && now - start >= delay)
+    {
+      double wait;
+
+      // a scheduler that cannot be locked sends no duplicate, the primary request reports the error if it matters
+      hedge = aichat_scheduler_try_acquire (client, estimated_tokens, &wait) == 0 && wait == 0 ? aichat_api_call_state_initialize ((*state)->stream_callback, (*state)->stream_userdata) : NULL;
+
+      if (hedge)
+      {
+        hedge->recording = (*state)->recording;
+        hedge->race = &winner;
+      }
+
+      int setup = hedge ? aichat_api_call_setup (client, client->hedge_curl, data, data_strlen, key, hedge, &hedge_headers) : -AICHAT_ERROR_MEMORY;
+
+      if (setup == 0)
+        curl_easy_setopt (client->hedge_curl, CURLOPT_FRESH_CONNECT, 1L);
+
+      if (setup < 0 || curl_multi_add_handle (client->multi, client->hedge_curl) != CURLM_OK)
+      {
+        if (hedge) aichat_api_call_state_free (hedge);
+        hedge = NULL;
+        hedge_skipped = true;
+      }
+      else
+      {
+        hedge_running = true;
+        hedge_start = now;
+        results->hedges++;
+      }
+    }
+
+    if (primary_done && hedge_running == false)
+      break;
+
+    int timeout = 1000;
+
+    if (hedge == NULL && hedge_skipped == false && (start + delay - now) * 1000 < timeout)
+      timeout = start + delay > now ? (int) ((start + delay - now) * 1000) + 1 : 0;
+
+    if (curl_multi_poll (client->multi, NULL, 0, timeout, NULL) != CURLM_OK)
+      break;
+  }
+
+  CURLcode code = primary_code;
+
+  if (hedge && winner == hedge)
+  {
+    aichat_api_call_state_free (*state);
+    *state = hedge;
+    *used = client->hedge_curl;
+    code = hedge_code;
+    results->hedge_won = 1;
+  }
+  else if (hedge)
+  {
+    aichat_api_call_state_free (hedge);
+  }
+
+  (*state)->race = NULL;
+
+  // the learned delay is measured from when the first request was sent, whichever handle answered
+  if (winner && code == CURLE_OK && curl_easy_getinfo (*used, CURLINFO_STARTTRANSFER_TIME_T, &first_byte) == CURLE_OK)
+    aichat_client_add_hedge_sample (client, first_byte * 1e-6 + (*used == client->hedge_curl ? hedge_start - start : 0));
+
+  curl_easy_setopt (client->hedge_curl, CURLOPT_HTTPHEADER, NULL);
+  curl_slist_free_all (hedge_headers);
+
+  return code;
+}
+
+static uint32_t
+aichat_ledger_microseconds (double seconds)
+{
+  double microseconds = seconds * 1e6 + 0.5;
+  return microseconds >= UINT32_MAX ? UINT32_MAX : (uint32_t) microseconds;
+}
+
+// failing to record a request is not an error, the request itself is done
+static bool
+aichat_ledger_append (struct aichat_client *client, struct aichat_session *session, struct aichat_api_call_results *results)
+{
+  if (client == NULL || client->ledger < 0)
+    return false;
+
+  struct aichat_ledger_record record;
+  struct timespec now;
+
+  memset (&record, 0, sizeof (record));
+  clock_gettime (CLOCK_REALTIME, &now);
+
+  record.time = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  record.name_lookup_time = aichat_ledger_microseconds (results->name_lookup_time);
+  record.connect_time = aichat_ledger_microseconds (results->connect_time);
+  record.tls_time = aichat_ledger_microseconds (results->tls_time);
+  record.first_byte_time = aichat_ledger_microseconds (results->first_byte_time);
+  record.total_time = aichat_ledger_microseconds (results->total_time);
+  record.serialize_time = aichat_ledger_microseconds (results->serialize_time);
+  record.prompt_tokens = results->prompt_tokens;
+  record.completion_tokens = results->completion_tokens;
+  record.request_bytes = results->request_bytes;
+  record.response_bytes = results->response_bytes;
+  record.http_status = results->http_status;
+  record.error = results->error;
+  record.model = session->model;
+  record.omitted_messages = results->omitted_messages;
+
+  if (results->cached)
+    record.flags |= AICHAT_LEDGER_CACHED;
+
+  if (client->cassette_mode == AICHAT_CASSETTE_REPLAY)
+    record.flags |= AICHAT_LEDGER_REPLAYED;
+
+  if (results->hedges > 0)
+    record.flags |= AICHAT_LEDGER_HEDGED;
+
+  if (results->hedge_won)
+    record.flags |= AICHAT_LEDGER_HEDGE_WON;
+
+  if (session->name)
+    memcpy (record.session, session->name, strnlen (session->name, sizeof (record.session)));
+
+  // a single append never interleaves with the records of other processes
+  return write (client->ledger, &record, sizeof (record)) == sizeof (record);
+}
+
+// answers a request from the cassette of the client, the recorded response goes through the same parsing as one from the network
+static char *
+aichat_cassette_replay (struct aichat_client *client, const char *data, unsigned long int data_strlen, struct aichat_api_call_results *results, aichat_stream_callback stream_callback, void *stream_userdata, json_object **choices)
+{
+  struct aichat_cassette_entry *entry = NULL;
+
+  for (unsigned long int i = 0; i < client->cassette_count && entry == NULL; i++)
+  {
+    if (client->cassette[i].request_length == data_strlen && memcmp (client->cassette[i].request, data, data_strlen) == 0)
+      entry = &client->cassette[i];
+  }
+
+  if (entry == NULL)
+  {
+    results->error = AICHAT_ERROR_CASSETTE_MISS;
+    return NULL;
+  }
+
+  struct aichat_api_call_state *state = aichat_api_call_state_initialize (stream_callback, stream_userdata);
+
+  if (state == NULL)
+  {
+    results->error = AICHAT_ERROR_MEMORY;
+    return NULL;
+  }
+
+  char *new_message = NULL;
+
+  results->request_bytes = data_strlen;
+  results->response_bytes = entry->response_length;
+
+  if (entry->response_length == 0 || aichat_api_call_write_callback (entry->response, 1, entry->response_length, state) == entry->response_length)
+    new_message = aichat_api_call_state_resolve (state, results);
+  else
+    results->error = AICHAT_ERROR_JSON_PARSE;
+
+  if (new_message && choices)
+    *choices = aichat_api_call_state_choices (state);
+
+  aichat_api_call_state_free (state);
+  return new_message;
+}
+
+// failing to record an exchange is not an error, the call itself succeeded
+static void
+aichat_cassette_record (struct aichat_client *client, const char *data, unsigned long int data_strlen, struct aichat_api_call_state *state)
+{
+  FILE *file = fopen (client->cassette_path, "a");
+
+  if (file == NULL)
+    return;
+
+  json_object *jentry = json_object_new_object ();
+  json_object_object_add (jentry, "request", json_object_new_string_len (data, data_strlen));
+  json_object_object_add (jentry, "response", json_object_new_string_len (state->recorded ? state->recorded : "", state->recorded_length));
+
+  fprintf (file, "%s\n", json_object_to_json_string_ext (jentry, JSON_C_TO_STRING_PLAIN));
+  json_object_put (jentry);
+  fclose (file);
+}
+
+// when choices is given it receives the choices of a response that has more than one, see aichat_api_call_state_choices
+char *
+aichat_api_call_do (struct aichat_client *client, const char *data, unsigned long int data_strlen, long int estimated_tokens, const char *key, struct aichat_api_call_results *results, aichat_stream_callback stream_callback, void *stream_userdata, json_object **choices)
+{
+  // without a long-lived client every call pays for its own connection
+  struct aichat_client *temporary_client = NULL;
+
+  if (client == NULL)
+  {
+    client = temporary_client = aichat_client_initialize ();
+
+    if (client == NULL)
+    {
+      results->error = AICHAT_ERROR_CURL_INITIALIZATION;
+      return NULL;
+    }
+  }
+
+  if (client->cassette_mode == AICHAT_CASSETTE_REPLAY)
+    return aichat_cassette_replay (client, data, data_strlen, results, stream_callback, stream_userdata, choices);
+
+  struct aichat_api_call_state *state = NULL;
+  CURLcode code;
+
+  // every attempt starts from a fresh state, the results describe the last one
+  for (unsigned int attempt = 0; ; attempt++)
+  {
+    state = aichat_api_call_state_initialize (stream_callback, stream_userdata);
+
+    if (state == NULL)
+    {
+      aichat_client_free (temporary_client);
+      results->error = AICHAT_ERROR_MEMORY;
+      return NULL;
+    }
+
+    state->recording = client->cassette_mode == AICHAT_CASSETTE_RECORD;
+
+    struct curl_slist *headers = NULL;
+    int error = aichat_api_call_setup (client, client->curl, data, data_strlen, key, state, &headers);
+
+    if (error < 0)
+    {
+      aichat_api_call_state_free (state);
+      aichat_client_free (temporary_client);
+      results->error = -error;
+      return NULL;
+    }
+
+    CURL *used = client->curl;
+
+    if ((error = aichat_scheduler_acquire (client, estimated_tokens, &results->queue_time)) < 0)
+    {
+      curl_easy_setopt (client->curl, CURLOPT_HTTPHEADER, NULL);
+      curl_slist_free_all (headers);
+      aichat_api_call_state_free (state);
+      aichat_client_free (temporary_client);
+      results->error = -error;
+      return NULL;
+    }
+
+    results->hedge_won = 0;
+
+    if (aichat_client_hedging (client))
+      code = aichat_api_call_perform_hedged (client, data, data_strlen, estimated_tokens, key, &state, &used, results);
+    else
+      code = curl_easy_perform (client->curl);
+
+    aichat_api_call_measure (used, data_strlen, results);
+    aichat_client_update_rate_limits (client, state, results->http_status);
+
+    // the headers must outlive the transfer but not the next reset of the handle
+    curl_easy_setopt (client->curl, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all (headers);
+
+    double delay = -1;
+
+    if (attempt < client->max_retries && state->delivered == false && aichat_api_call_transient_error (code, results->http_status, state))
+      delay = aichat_client_retry_delay (client, attempt, &state->limits);
+
+    if (delay < 0)
+      break;
+
+    aichat_api_call_state_free (state);
+    aichat_scheduler_settle (client, estimated_tokens, 0);
+    results->retries++;
+    aichat_sleep (delay);
+  }
+
+  if (code == CURLE_OK && state->recording)
+    aichat_cassette_record (client, data, data_strlen, state);
+
+  char *new_message = aichat_api_call_finish (code, state, results);
+
+  if (new_message && choices)
+    *choices = aichat_api_call_state_choices (state);
+
+  aichat_api_call_state_free (state);
+
+  aichat_scheduler_settle_results (client, estimated_tokens, results);
+
+  // a cancelled duplicate is billed for its prompt like the request that was answered
+  if (results->hedges > 0)
+  {
+    results->hedge_tokens = results->hedges * (results->prompt_tokens > 0 ? results->prompt_tokens : estimated_tokens);
+    aichat_scheduler_settle (client, results->hedges * estimated_tokens, results->hedge_tokens);
+  }
+
+  aichat_client_free (temporary_client);
+
+  return new_message;
+}
+
+// turns the choices of the response into the alternatives of the last message, which is the first of them
+static int
+aichat_session_add_choices (struct aichat_session *session, json_object *jchoices)
+{
+  unsigned int message = session->message_count - 1;
+  struct aichat_alternative *alternative;
+
+  aichat_session_drop_alternatives (session, message);
+
+  for (unsigned long int i = 0; i < json_object_array_length (jchoices); i++)
+  {
+    json_object *jmessage = NULL;
+    json_object *jcontent = NULL;
+
+    if (json_object_object_get_ex (json_object_array_get_idx (jchoices, i), "message", &jmessage) == false ||
+        json_object_object_get_ex (jmessage, "content", &jcontent) == false || json_object_get_type (jcontent) != json_type_string)
+      continue;
+
+    if ((alternative = aichat_session_reserve_alternative (session)) == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    // the message itself was read from the choice at index 0 and shares its text
+    if (i == 0)
+    {
+      *alternative = (struct aichat_alternative) { .message = message, .text = session->messages[message].text, .length = session->messages[message].length };
+      session->alternative_count++;
+      continue;
+    }
+
+    unsigned long int length = json_object_get_string_len (jcontent);
+    char *text = aichat_session_reserve (session, length + 1);
+
+    if (text == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    memcpy (text, json_object_get_string (jcontent), length);
+    aichat_session_commit_alternative (session, message, text, length);
+  }
+
+  return 0;
+}
+
+static int
+aichat_session_check_extendable (struct aichat_session *session)
+{
+  if (session->message_count == 0)
+    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+
+  if (session->messages[session->message_count - 1].role == AICHAT_ROLE_ASSISTANT)
+    return -AICHAT_ERROR_SESSION_LAST_MESSAGE_ASSISTANT;
+
+  return 0;
+}
+
+static void
+aichat_api_call_results_initialize (struct aichat_api_call_results *results)
+{
+  results->error = 0;
+  results->prompt_tokens = 0;
+  results->completion_tokens = 0;
+  results->omitted_messages = 0;
+  results->cached = 0;
+  results->name_lookup_time = 0;
+  results->connect_time = 0;
+  results->tls_time = 0;
+  results->first_byte_time = 0;
+  results->total_time = 0;
+  results->serialize_time = 0;
+  results->request_bytes = 0;
+  results->response_bytes = 0;
+  results->http_status = 0;
+  results->retries = 0;
+  results->queue_time = 0;
+  results->hedges = 0;
+  results->hedge_won = 0;
+  results->hedge_tokens = 0;
+  results->compact_tokens = 0;
+  results->compact_error = 0;
+}
+
+// compaction
+
+// the request for a summary has these instructions as its system prompt and the turns as its user message
+static const char *aichat_compact_instructions =
+  "Summarize the conversation you are given for whoever continues it, who will only see your summary and the "
+  "turns that follow it. Keep facts, decisions, names, numbers, code and open questions and leave out "
+  "pleasantries. When it begins with an earlier summary, fold that into yours. Reply with the summary only.";
+
+static const char *aichat_compact_summary_label = "Earlier summary: ";
+
+static const char *
+aichat_compact_role_label (enum aichat_role role)
+{
+  return role == AICHAT_ROLE_SYSTEM ? "System: " : role == AICHAT_ROLE_USER ? "User: " : "Assistant: ";
+}
+
+// the length of the text of message cut to share of it, without splitting a character
+static unsigned long int
+aichat_compact_cut_length (const struct aichat_message *message, double share)
+{
+  if (share >= 1)
+    return message->length;
+
+  unsigned long int length = message->length * share;
+
+  while (length > 0 && ((unsigned char) message->text[length] & 0xC0) == 0x80)
+    length--;
+
+  return length;
+}
+
+// the prompt tokens of the session with its summary in place of the messages it summarizes, before the
+// prompt budget is applied
+static long int
+aichat_session_summarized_tokens (struct aichat_session *session)
+{
+  unsigned int count = session->message_count;
+  unsigned int prefix = 0;
+
+  while (prefix < count && session->messages[prefix].role == AICHAT_ROLE_SYSTEM)
+    prefix++;
+
+  bool summarized = session->summary_messages > prefix && session->summary_messages < count;
+  long int tokens = AICHAT_TOKENS_PER_REPLY;
+
+  if (summarized)
+    tokens += aichat_session_message_tokens (session, &session->summary);
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (summarized == false || i < prefix || i >= session->summary_messages)
+      tokens += aichat_session_message_tokens (session, &session->messages[i]);
+  }
+
+  return tokens;
+}
+
+int
+aichat_session_compact (struct aichat_session *session, unsigned int keep_turns, struct aichat_api_call_results *results)
+{
+  aichat_api_call_results_initialize (results);
+
+  unsigned int count = session->message_count;
+  unsigned int prefix = 0;
+
+  while (prefix < count && session->messages[prefix].role == AICHAT_ROLE_SYSTEM)
+    prefix++;
+
+  bool summarized = session->summary_messages > prefix && session->summary_messages < count;
+  unsigned int start = summarized ? session->summary_messages : prefix;
+
+  // the last turn is always kept, the summary ends where the first of the kept turns starts
+  unsigned int end = count;
+  unsigned int turns = 0;
+
+  if (keep_turns == 0)
+    keep_turns = 1;
+
+  while (end > start && turns < keep_turns)
+    turns += session->messages[--end].role == AICHAT_ROLE_USER;
+
+  if (turns < keep_turns || end <= start)
+    return -AICHAT_ERROR_NOTHING_TO_COMPACT;
+
+  // the oldest whole turns that fit into one request. A first turn that does not fit on its own is cut short,
+  // each of its messages to the same share of its length, rather than sending a request that cannot succeed.
+  struct aichat_message instructions = { .role = AICHAT_ROLE_SYSTEM, .text = (char *) aichat_compact_instructions, .length = strlen (aichat_compact_instructions) };
+  long int budget = session->max_prompt_tokens > 0 ? session->max_prompt_tokens : aichat_model_context_window (session->model) - session->reserved_completion_tokens;
+  long int used = AICHAT_TOKENS_PER_REPLY + aichat_session_message_tokens (session, &instructions) + AICHAT_TOKENS_PER_MESSAGE + 1;
+  unsigned long int length = 0;
+
+  if (summarized)
+  {
+    used += aichat_session_message_tokens (session, &session->summary);
+    length += strlen (aichat_compact_summary_label) + session->summary.length + 2;
+  }
+
+  unsigned int first_end = start + 1;
+  long int first_tokens = 0;
+
+  while (first_end < end && session->messages[first_end].role != AICHAT_ROLE_USER)
+    first_end++;
+
+  for (unsigned int i = start; i < first_end; i++)
+    first_tokens += aichat_session_message_tokens (session, &session->messages[i]);
+
+  double share = used + first_tokens <= budget ? 1 : used < budget ? (double) (budget - used) / first_tokens : 0;
+  unsigned int last = first_end;
+
+  for (unsigned int i = start; i < first_end; i++)
+    length += strlen (aichat_compact_role_label (session->messages[i].role)) + aichat_compact_cut_length (&session->messages[i], share) + 2;
+
+  used += first_tokens;
+
+  unsigned long int turn_length = 0;
+
+  for (unsigned int i = first_end; i < end && share == 1; i++)
+  {
+    used += aichat_session_message_tokens (session, &session->messages[i]);
+
+    if (used > budget)
+      break;
+
+    turn_length += strlen (aichat_compact_role_label (session->messages[i].role)) + session->messages[i].length + 2;
+
+    if (i + 1 == end || session->messages[i + 1].role == AICHAT_ROLE_USER)
     {
-      results->error = AICHAT_ERROR_MEMORY;
-      return NULL;
+      last = i + 1;
+      length += turn_length;
+      turn_length = 0;
     }
+  }
 
-    // add the header
-    headers = curl_slist_append (headers, authorization);
+  struct aichat_session request;
+  aichat_session_initialize (&request);
 
-    free (authorization);
+  request.model = session->model;
+  request.temperature = 0;
+  request.client = session->client;
+  request.tokenizer = session->tokenizer;
+  request.name = session->name;
+  request.max_prompt_tokens = -1;
+
+  int error = aichat_session_add_message (&request, AICHAT_ROLE_SYSTEM, aichat_compact_instructions);
+
+  // the turns are written straight into the session of the request as one transcript
+  char *transcript = NULL;
+
+  if (error >= 0 && (aichat_session_reserve_message (&request) == NULL || (transcript = aichat_session_reserve (&request, length + 1)) == NULL))
+    error = -AICHAT_ERROR_MEMORY;
+
+  if (error >= 0)
+  {
+    char *end_of_transcript = transcript;
+
+    if (summarized)
+      end_of_transcript = mempcpy (mempcpy (mempcpy (end_of_transcript, aichat_compact_summary_label, strlen (aichat_compact_summary_label)),
+                                            session->summary.text, session->summary.length), "\n\n", 2);
+
+    for (unsigned int i = start; i < last; i++)
+    {
+      const char *label = aichat_compact_role_label (session->messages[i].role);
+      unsigned long int text_length = i < first_end ? aichat_compact_cut_length (&session->messages[i], share) : session->messages[i].length;
+
+      end_of_transcript = mempcpy (mempcpy (mempcpy (end_of_transcript, label, strlen (label)), session->messages[i].text, text_length), "\n\n", 2);
+    }
+
+    aichat_session_commit_message (&request, AICHAT_ROLE_USER, transcript, end_of_transcript - transcript);
+    error = aichat_session_extend (&request, results);
   }
 
-  curl_easy_setopt (curl, CURLOPT_URL, "https://api.openai.com/v1/chat/completions");
-  curl_easy_setopt (curl, CURLOPT_POSTFIELDS, data);
-  curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, data_strlen);
-  curl_easy_setopt (curl, CURLOPT_WRITEDATA, state);
-  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, aichat_api_call_write_callback);
-  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_perform (curl);
-  curl_easy_cleanup (curl);
+  if (error >= 0)
+  {
+    struct aichat_message *reply = &request.messages[request.message_count - 1];
+    char *text = aichat_session_reserve (session, reply->length + 1);
 
-  curl_slist_free_all (headers);
+    if (text == NULL)
+      error = -AICHAT_ERROR_MEMORY;
+    else
+    {
+      memcpy (text, reply->text, reply->length);
+      text[reply->length] = '\0';
+      session->current_chunk->used += reply->length + 1;
 
-  char *new_message = aichat_api_call_state_resolve (state, results);
-  aichat_api_call_state_free (state);
+      session->summary.text = text;
+      session->summary.length = reply->length;
+      session->summary_messages = last;
+      session->summary_unsaved = true;
+    }
+  }
 
-  return new_message;
+  aichat_session_free (&request);
+  return error;
 }
 
 int
 aichat_session_extend (struct aichat_session *session, struct aichat_api_call_results *results)
 {
-  if (session->message_count == 0)
-    return -AICHAT_ERROR_SESSION_NO_MESSAGES;
+  int error = aichat_session_check_extendable (session);
 
-  if (session->messages[session->message_count - 1].role == AICHAT_ROLE_ASSISTANT)
-    return -AICHAT_ERROR_SESSION_LAST_MESSAGE_ASSISTANT;
+  if (error < 0)
+  {
+    aichat_api_call_results_initialize (results);
+    return error;
+  }
+
+  // the older turns are summarized first once the messages since the last summary take up too many tokens,
+  // without a summary the request is left to the prompt budget. After a compaction failed it is not tried on
+  // every turn again, but once the messages since the summary grew by another compact_threshold tokens.
+  int compact_error = 0, compact_tokens = 0;
+
+  if (session->compact_threshold > 0)
+  {
+    long int tokens = aichat_session_summarized_tokens (session);
+
+    if (tokens > session->compact_threshold && tokens > session->compact_retry_tokens)
+    {
+      compact_error = aichat_session_compact (session, session->compact_keep_turns, results);
+      compact_tokens = results->prompt_tokens + results->completion_tokens + results->hedge_tokens;
+      session->compact_retry_tokens = compact_error < 0 ? tokens + session->compact_threshold : 0;
+    }
+  }
+
+  aichat_api_call_results_initialize (results);
+  results->compact_error = compact_error;
+  results->compact_tokens = compact_tokens;
+
+  struct aichat_client *client = session->client;
+  bool use_cache = client && client->cache_directory && session->choices <= 1;
+  char cache_key [AICHAT_CACHE_KEY_LENGTH + 1];
+
+  // several candidates are not streamed, they would arrive interleaved
+  aichat_stream_callback stream_callback = session->choices <= 1 ? session->stream_callback : NULL;
+  json_object *jchoices = NULL;
 
   unsigned long int data_strlen;
-  char *data = aichat_session_to_json (session, &data_strlen);
+  double serialize_start = aichat_now ();
+  char *data = aichat_session_to_json (session, &data_strlen, &results->omitted_messages, use_cache ? cache_key : NULL);
+  results->serialize_time = aichat_now () - serialize_start;
+
   const char *key = getenv ("OPENAI_API_KEY");
+  char *next_message = NULL;
+
+  if (data == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  if (use_cache && session->cache_bypass == false)
+    next_message = aichat_cache_lookup (client, cache_key, results);
 
-  char *next_message = aichat_api_call_do (data, data_strlen, key, results);
-  free (data);
+  if (next_message)
+  {
+    // a cached response arrives all at once
+    if (stream_callback)
+      stream_callback (next_message, strlen (next_message), session->stream_userdata);
+  }
+  else
+  {
+    long int estimated_tokens = client && (client->scheduler || aichat_client_hedging (client)) ? aichat_session_prompt_tokens (session) : 0;
+    next_message = aichat_api_call_do (client, data, data_strlen, estimated_tokens, key, results, stream_callback, session->stream_userdata,
+                                       session->choices > 1 ? &jchoices : NULL);
+
+    if (next_message && use_cache)
+      aichat_cache_store (client, cache_key, next_message, results);
+  }
+
+  aichat_ledger_append (client, session, results);
 
   if (next_message == NULL)
     return -results->error;
@@ -448,9 +5161,481 @@ aichat_session_extend (struct aichat_session *session, struct aichat_api_call_re
   int retval = aichat_session_add_message (session, AICHAT_ROLE_ASSISTANT, next_message);
   free (next_message);
 
+  if (retval == 0 && jchoices)
+    retval = aichat_session_add_choices (session, jchoices);
+
+  json_object_put (jchoices);
+
   return retval;
 }
 
+struct
+aichat_batch_item
+{
+  CURL *curl;
+  struct curl_slist *headers;
+
+  // the body belongs to the session, which is not changed while the request is in the batch
+  char *data;
+  int omitted_messages;
+  struct aichat_api_call_state *state;
+
+  // set for a request that is answered from the cache and never goes over the network
+  char *cached_message;
+  struct aichat_api_call_results cached_results;
+  struct aichat_batch_item *next_cached;
+  double serialize_time;
+  char cache_key [AICHAT_CACHE_KEY_LENGTH + 1];
+
+  struct aichat_session *session;
+  void *userdata;
+
+  unsigned int slot;
+
+  // a request that failed for a reason that may go away or has to wait for the scheduler of the client
+  // waits in the delayed list until retry_at
+  unsigned int retries;
+  double retry_at;
+  struct aichat_batch_item *next_delayed;
+
+  long int estimated_tokens;
+  double queued_at;
+  double queue_time;
+};
+
+struct
+aichat_batch
+{
+  CURLM *multi;
+
+  struct aichat_client *client;
+  struct aichat_client *owned_client;
+
+  unsigned int max_in_flight;
+  unsigned int in_flight;
+
+  // one slot per request that may be in flight, empty slots are NULL
+  struct aichat_batch_item **items;
+
+  // requests answered from the cache, they are returned by aichat_batch_wait before any other
+  struct aichat_batch_item *cached;
+
+  // requests waiting to be sent again, their handles are not in the multi handle meanwhile
+  struct aichat_batch_item *delayed;
+
+  // finished easy handles are kept around so their connections can be reused
+  CURL **idle;
+  unsigned int idle_count;
+};
+
+struct aichat_batch *
+aichat_batch_initialize (struct aichat_client *client, unsigned int max_in_flight)
+{
+  if (max_in_flight == 0)
+    return NULL;
+
+  struct aichat_batch *batch = calloc (1, sizeof (struct aichat_batch));
+
+  if (batch == NULL)
+    return NULL;
+
+  if (client == NULL)
+    client = batch->owned_client = aichat_client_initialize ();
+
+  batch->client = client;
+  batch->max_in_flight = max_in_flight;
+  batch->multi = curl_multi_init ();
+  batch->items = calloc (max_in_flight, sizeof (struct aichat_batch_item *));
+  batch->idle = calloc (max_in_flight, sizeof (CURL *));
+
+  if (client == NULL || batch->multi == NULL || batch->items == NULL || batch->idle == NULL)
+  {
+    aichat_batch_free (batch);
+    return NULL;
+  }
+
+  // never open more connections than there are requests in flight
+  curl_multi_setopt (batch->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) max_in_flight);
+
+  return batch;
+}
+
+static void
+aichat_batch_item_free (struct aichat_batch *batch, struct aichat_batch_item *item)
+{
+  // requests answered from the cache never had a transfer
+  if (item->curl)
+  {
+    curl_multi_remove_handle (batch->multi, item->curl);
+    curl_easy_setopt (item->curl, CURLOPT_HTTPHEADER, NULL);
+
+    if (batch->idle_count < batch->max_in_flight)
+      batch->idle [batch->idle_count++] = item->curl;
+    else
+      curl_easy_cleanup (item->curl);
+  }
+
+  if (item->state)
+    aichat_api_call_state_free (item->state);
+
+  curl_slist_free_all (item->headers);
+  free (item->cached_message);
+
+  batch->items [item->slot] = NULL;
+  batch->in_flight--;
+
+  free (item);
+}
+
+void
+aichat_batch_free (struct aichat_batch *batch)
+{
+  if (batch == NULL)
+    return;
+
+  // abandon whatever is still in flight
+  for (unsigned int i = 0; batch->items && i < batch->max_in_flight; i++)
+  {
+    if (batch->items [i])
+      aichat_batch_item_free (batch, batch->items [i]);
+  }
+
+  if (batch->multi)
+    curl_multi_cleanup (batch->multi);
+
+  for (unsigned int i = 0; i < batch->idle_count; i++)
+    curl_easy_cleanup (batch->idle [i]);
+
+  free (batch->items);
+  free (batch->idle);
+  aichat_client_free (batch->owned_client);
+  free (batch);
+}
+
+unsigned int
+aichat_batch_in_flight (struct aichat_batch *batch)
+{
+  return batch->in_flight;
+}
+
+struct aichat_client *
+aichat_batch_client (struct aichat_batch *batch)
+{
+  return batch->client;
+}
+
+// sends the request when the scheduler of the client lets it through and otherwise puts it in the delayed list,
+// the batch never blocks on the scheduler while other requests are in flight
+static int
+aichat_batch_schedule (struct aichat_batch *batch, struct aichat_batch_item *item, double now)
+{
+  double wait;
+  int error = aichat_scheduler_try_acquire (batch->client, item->estimated_tokens, &wait);
+
+  if (error < 0)
+    return error;
+
+  if (wait > 0)
+  {
+    item->retry_at = now + wait;
+    item->next_delayed = batch->delayed;
+    batch->delayed = item;
+    return 0;
+  }
+
+  item->queue_time += now - item->queued_at;
+
+  if (curl_multi_add_handle (batch->multi, item->curl) != CURLM_OK)
+    return -AICHAT_ERROR_CURL_INITIALIZATION;
+
+  return 0;
+}
+
+int
+aichat_batch_add (struct aichat_batch *batch, struct aichat_session *session, void *userdata)
+{
+  if (batch->in_flight >= batch->max_in_flight)
+    return -AICHAT_ERROR_BATCH_FULL;
+
+  // the candidates of a response are only collected by aichat_session_extend
+  if (session->choices > 1)
+    return -AICHAT_ERROR_NOT_IMPLEMENTED;
+
+  int error = aichat_session_check_extendable (session);
+
+  if (error < 0)
+    return error;
+
+  struct aichat_batch_item *item = calloc (1, sizeof (struct aichat_batch_item));
+
+  if (item == NULL)
+    return -AICHAT_ERROR_MEMORY;
+
+  unsigned long int data_strlen;
+  bool use_cache = batch->client->cache_directory != NULL;
+
+  item->session = session;
+  item->userdata = userdata;
+  double serialize_start = aichat_now ();
+  item->data = aichat_session_to_json (session, &data_strlen, &item->omitted_messages, use_cache ? item->cache_key : NULL);
+  item->serialize_time = aichat_now () - serialize_start;
+
+  if (item->data == NULL)
+  {
+    error = -AICHAT_ERROR_MEMORY;
+    goto aichat_batch_add_error;
+  }
+
+  aichat_api_call_results_initialize (&item->cached_results);
+
+  if (use_cache && session->cache_bypass == false)
+    item->cached_message = aichat_cache_lookup (batch->client, item->cache_key, &item->cached_results);
+
+  // a replayed request is answered right away like a cached one, including when it is missing from the cassette
+  if (item->cached_message == NULL && batch->client->cassette_mode == AICHAT_CASSETTE_REPLAY)
+  {
+    item->cached_message = aichat_cassette_replay (batch->client, item->data, data_strlen, &item->cached_results, NULL, NULL, NULL);
+
+    if (item->cached_message && use_cache)
+      aichat_cache_store (batch->client, item->cache_key, item->cached_message, &item->cached_results);
+  }
+
+  if (item->cached_message || item->cached_results.error != 0)
+  {
+    if (session->stream_callback && item->cached_message)
+      session->stream_callback (item->cached_message, strlen (item->cached_message), session->stream_userdata);
+
+    while (batch->items [item->slot] != NULL)
+      item->slot++;
+
+    batch->items [item->slot] = item;
+    batch->in_flight++;
+
+    item->next_cached = batch->cached;
+    batch->cached = item;
+    return 0;
+  }
+
+  item->state = aichat_api_call_state_initialize (session->stream_callback, session->stream_userdata);
+  item->curl = batch->idle_count > 0 ? batch->idle [--batch->idle_count] : curl_easy_init ();
+
+  if (item->data == NULL || item->state == NULL || item->curl == NULL)
+  {
+    error = -AICHAT_ERROR_MEMORY;
+    goto aichat_batch_add_error;
+  }
+
+  item->state->recording = batch->client->cassette_mode == AICHAT_CASSETTE_RECORD;
+
+  error = aichat_api_call_setup (batch->client, item->curl, item->data, data_strlen, getenv ("OPENAI_API_KEY"), item->state, &item->headers);
+
+  if (error < 0)
+    goto aichat_batch_add_error;
+
+  curl_easy_setopt (item->curl, CURLOPT_PRIVATE, item);
+
+  if (batch->client->scheduler)
+    item->estimated_tokens = aichat_session_prompt_tokens (session);
+
+  item->queued_at = aichat_now ();
+
+  if ((error = aichat_batch_schedule (batch, item, item->queued_at)) < 0)
+    goto aichat_batch_add_error;
+
+  // there is always an empty slot while the batch is not full
+  while (batch->items [item->slot] != NULL)
+    item->slot++;
+
+  batch->items [item->slot] = item;
+  batch->in_flight++;
+  return 0;
+
+aichat_batch_add_error:
+  if (item->curl) curl_easy_cleanup (item->curl);
+  if (item->state) aichat_api_call_state_free (item->state);
+  curl_slist_free_all (item->headers);
+  free (item);
+  return error;
+}
+
+// moves a failed request to the delayed list with a fresh state, false when it is not to be sent again
+static bool
+aichat_batch_retry (struct aichat_batch *batch, struct aichat_batch_item *item, CURLcode code, long int status)
+{
+  struct aichat_client *client = batch->client;
+
+  if (item->retries >= client->max_retries || item->state->delivered || aichat_api_call_transient_error (code, status, item->state) == 0)
+    return false;
+
+  double delay = aichat_client_retry_delay (client, item->retries, &item->state->limits);
+
+  if (delay < 0)
+    return false;
+
+  struct aichat_api_call_state *state = aichat_api_call_state_initialize (item->state->stream_callback, item->state->stream_userdata);
+
+  if (state == NULL)
+    return false;
+
+  state->recording = item->state->recording;
+
+  curl_multi_remove_handle (batch->multi, item->curl);
+  curl_easy_setopt (item->curl, CURLOPT_HTTPHEADER, NULL);
+  curl_slist_free_all (item->headers);
+  item->headers = NULL;
+
+  // a failed setup leaves the old state in place to report the failure of the last attempt
+  if (aichat_api_call_setup (client, item->curl, item->data, strlen (item->data), getenv ("OPENAI_API_KEY"), state, &item->headers) < 0)
+  {
+    aichat_api_call_state_free (state);
+    return false;
+  }
+
+  aichat_api_call_state_free (item->state);
+  item->state = state;
+  curl_easy_setopt (item->curl, CURLOPT_PRIVATE, item);
+
+  aichat_scheduler_settle (client, item->estimated_tokens, 0);
+
+  item->retries++;
+  item->retry_at = aichat_now () + delay;
+  item->queued_at = item->retry_at;
+  item->next_delayed = batch->delayed;
+  batch->delayed = item;
+
+  return true;
+}
+
+int
+aichat_batch_wait (struct aichat_batch *batch, struct aichat_session **session, struct aichat_api_call_results *results, void **userdata)
+{
+  if (batch->cached)
+  {
+    struct aichat_batch_item *item = batch->cached;
+    batch->cached = item->next_cached;
+
+    *results = item->cached_results;
+    results->omitted_messages = item->omitted_messages;
+    results->serialize_time = item->serialize_time;
+    aichat_ledger_append (batch->client, item->session, results);
+
+    if (item->cached_message)
+    {
+      int error = aichat_session_add_message (item->session, AICHAT_ROLE_ASSISTANT, item->cached_message);
+      if (error < 0) results->error = -error;
+    }
+
+    *session = item->session;
+    *userdata = item->userdata;
+
+    aichat_batch_item_free (batch, item);
+    return 1;
+  }
+
+  while (true)
+  {
+    double now = aichat_now ();
+    struct aichat_batch_item *due = NULL;
+
+    // the requests whose time has come are taken off the list first, scheduling may put them back
+    for (struct aichat_batch_item **link = &batch->delayed; *link != NULL; )
+    {
+      struct aichat_batch_item *item = *link;
+
+      if (item->retry_at > now)
+      {
+        link = &item->next_delayed;
+        continue;
+      }
+
+      *link = item->next_delayed;
+      item->next_delayed = due;
+      due = item;
+    }
+
+    while (due)
+    {
+      struct aichat_batch_item *item = due;
+      due = item->next_delayed;
+
+      int error = aichat_batch_schedule (batch, item, now);
+
+      if (error < 0)
+        return error;
+    }
+
+    int running = 0;
+    curl_multi_perform (batch->multi, &running);
+
+    int queued = 0;
+    CURLMsg *message;
+
+    while ((message = curl_multi_info_read (batch->multi, &queued)) != NULL)
+    {
+      if (message->msg != CURLMSG_DONE)
+        continue;
+
+      struct aichat_batch_item *item = NULL;
+      curl_easy_getinfo (message->easy_handle, CURLINFO_PRIVATE, (char **) &item);
+
+      aichat_api_call_results_initialize (results);
+      results->omitted_messages = item->omitted_messages;
+      results->serialize_time = item->serialize_time;
+      aichat_api_call_measure (item->curl, strlen (item->data), results);
+      aichat_client_update_rate_limits (batch->client, item->state, results->http_status);
+
+      if (aichat_batch_retry (batch, item, message->data.result, results->http_status))
+        continue;
+
+      results->retries = item->retries;
+      results->queue_time = item->queue_time;
+      char *next_message = aichat_api_call_finish (message->data.result, item->state, results);
+      aichat_scheduler_settle_results (batch->client, item->estimated_tokens, results);
+
+      if (message->data.result == CURLE_OK && item->state->recording)
+        aichat_cassette_record (batch->client, item->data, strlen (item->data), item->state);
+
+      aichat_ledger_append (batch->client, item->session, results);
+
+      if (next_message)
+      {
+        if (batch->client->cache_directory)
+          aichat_cache_store (batch->client, item->cache_key, next_message, results);
+
+        int error = aichat_session_add_message (item->session, AICHAT_ROLE_ASSISTANT, next_message);
+        if (error < 0) results->error = -error;
+        free (next_message);
+      }
+
+      *session = item->session;
+      *userdata = item->userdata;
+
+      aichat_batch_item_free (batch, item);
+      return 1;
+    }
+
+    if (batch->in_flight == 0)
+    {
+      *session = NULL;
+      *userdata = NULL;
+      return 0;
+    }
+
+    // wake up in time for the next retry
+    int timeout = 1000;
+    now = aichat_now ();
+
+    for (struct aichat_batch_item *item = batch->delayed; item != NULL; item = item->next_delayed)
+    {
+      if ((item->retry_at - now) * 1000 < timeout)
+        timeout = item->retry_at > now ? (int) ((item->retry_at - now) * 1000) + 1 : 0;
+    }
+
+    if (curl_multi_poll (batch->multi, NULL, 0, timeout, NULL) != CURLM_OK)
+      return -AICHAT_ERROR_CURL_INITIALIZATION;
+  }
+}
+
 const char *
 aichat_strerror (int error_code)
 {
@@ -481,8 +5666,34 @@ aichat_strerror (int error_code)
       return "API returned an unexpected response";
     case AICHAT_ERROR_IO:
       return "I/O error";
+    case AICHAT_ERROR_NETWORK:
+      return "Could not reach the API";
     case AICHAT_ERROR_MEMORY:
       return "Memory allocation error";
+    case AICHAT_ERROR_BATCH_FULL:
+      return "Too many requests in flight in batch";
+    case AICHAT_ERROR_NO_TOKENIZER:
+      return "Session has no tokenizer";
+    case AICHAT_ERROR_CONTEXT_LENGTH:
+      return "Request does not fit into the context window of the model";
+    case AICHAT_ERROR_CASSETTE_MISS:
+      return "No recorded response for the request in the cassette";
+    case AICHAT_ERROR_LEDGER_FORMAT:
+      return "The ledger file is not in a known format";
+    case AICHAT_ERROR_RATE_LIMITED:
+      return "The API rate limit was exceeded";
+    case AICHAT_ERROR_SERVER:
+      return "The API server failed to answer";
+    case AICHAT_ERROR_SCHEDULER_FORMAT:
+      return "The scheduler file is not in a known format";
+    case AICHAT_ERROR_NO_ALTERNATIVE:
+      return "The last message has no such alternative";
+    case AICHAT_ERROR_NOTHING_TO_COMPACT:
+      return "The session has no turns to summarize";
+    case AICHAT_ERROR_STORE:
+      return "The messages the session is based on are missing from the message store";
+    case AICHAT_ERROR_STORE_COLLISION:
+      return "Other messages are in the message store under the same key";
     default:
       return "Unknown error";
   }
@@ -3,27 +3,76 @@
 /***
  * About the token limit for the OpenAI API
  *
- * The OpenAI API has a limit of 4096 tokens per request but it is generally
- * difficult to know how many tokens a request will use. It seems that a token
- * is roughly 2.5 characters when code is sent to the API while it is 4 characters
- * when text is sent to the API. There are tokens with up to 128 characters and
- * with as little as 1 character.
+ * The OpenAI API has a limit of 4096 tokens per request. A token is roughly 2.5
+ * characters when code is sent to the API while it is 4 characters when text is
+ * sent to the API, but there are tokens with up to 128 characters and with as
+ * little as 1 character. The exact number of tokens of a session can be counted
+ * before it is sent with a tokenizer loaded from the cl100k_base vocabulary, see
+ * aichat_session_count_prompt_tokens.
  *
- * We will support a reasonable maximum message length of 4096 * 8 = 32768 characters
- * but the majority of conversations will hit the token limit long before that
- * so we must have robust handling of the token limit. We may consider limiting
- * the message length to say 4096 * 2 = 8192 characters so that the majority of
- * reasonable conversations will hit our limit before the token limit.
+ * Since the size of a session is not known up front, libaichat does not
+ * limit its size. The text of the messages is stored in a chain of chunks that
+ * starts small and grows geometrically so that short sessions stay cheap and
+ * long sessions need only a handful of allocations. The chunks never move, so
+ * the text of a message stays where it is for as long as the message is part
+ * of the session.
  *
- * On the other hand, there can be messages that contain only 1 token and therefore
- * we can have as many as 4096 messages in a single session.
+ * About the journal format
+ *
+ * A session can be stored either as a single JSON object or as a journal. A
+ * journal starts with a header line holding the configuration of the session,
+ * every following line is a record that adds a message or removes messages from
+ * the end of the session. Saving a turn appends its records instead of rewriting
+ * the whole session, and once most of the records describe messages that were
+ * removed the journal is compacted by writing it out again. Both formats are
+ * read by aichat_session_initialize_from_json_file.
+ *
+ * About the ledger format
+ *
+ * A client with a ledger appends one fixed size binary record to it for every
+ * request it answers, see aichat_client_set_ledger. The file starts with a
+ * header of the same size as a record so that the records that follow can be
+ * read straight out of a mapping of the file. Records are written with a single
+ * append, so any number of processes can share a ledger, and a record that was
+ * cut short at the end of the file is ignored by readers. Numbers are stored in
+ * the byte order of the machine that wrote them.
+ *
+ * About the scheduler
+ *
+ * Clients that share an API key can share a token bucket for its requests per
+ * minute and tokens per minute, see aichat_client_set_scheduler. The bucket is a
+ * small file mapped into every process and updated under flock. A request takes
+ * one request and the estimated prompt tokens out of the bucket before it is
+ * sent, waiting for the bucket to refill when that is not possible, and the
+ * estimate is replaced by the tokens the response reports as used once it is
+ * done. The bucket holds a minute worth of each and refills continuously.
  ***/
 
-#define AICHAT_MAX_TOKENS 16384
-#define AICHAT_MAX_CHARACTERS_PER_TOKEN 8
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AICHAT_DEFAULT_BASE_URL "https://api.openai.com/v1"
 
-#define AICHAT_SESSION_BUFFER_SIZE (AICHAT_MAX_TOKENS * AICHAT_MAX_CHARACTERS_PER_TOKEN)
-#define AICHAT_SESSION_MAX_MESSAGES 1024
+#define AICHAT_SESSION_CHUNK_SIZE 4096
+#define AICHAT_SESSION_MAX_CHUNK_SIZE (1024 * 1024)
+
+#define AICHAT_JOURNAL_VERSION 1
+#define AICHAT_JOURNAL_MIN_GARBAGE 16
+
+#define AICHAT_LEDGER_MAGIC "AICHATLG"
+#define AICHAT_LEDGER_VERSION 1
+#define AICHAT_LEDGER_RECORD_SIZE 128
+
+// the flags of a ledger record
+#define AICHAT_LEDGER_CACHED 1
+#define AICHAT_LEDGER_REPLAYED 2
+#define AICHAT_LEDGER_HEDGED 4
+#define AICHAT_LEDGER_HEDGE_WON 8
+
+#define AICHAT_SCHEDULER_MAGIC "AICHATSC"
+#define AICHAT_SCHEDULER_VERSION 1
 
 // define the error codes
 #define AICHAT_ERROR_SESSION_FULL 1
@@ -37,29 +86,193 @@
 #define AICHAT_ERROR_API_ERROR 9
 #define AICHAT_ERROR_API_RESPONSE 10
 #define AICHAT_ERROR_IO 11
+#define AICHAT_ERROR_NETWORK 12
 #define AICHAT_ERROR_MEMORY 14
+#define AICHAT_ERROR_BATCH_FULL 15
+#define AICHAT_ERROR_NO_TOKENIZER 16
+#define AICHAT_ERROR_CONTEXT_LENGTH 17
+#define AICHAT_ERROR_CASSETTE_MISS 18
+#define AICHAT_ERROR_LEDGER_FORMAT 19
+#define AICHAT_ERROR_RATE_LIMITED 21
+#define AICHAT_ERROR_SERVER 22
+#define AICHAT_ERROR_SCHEDULER_FORMAT 23
+#define AICHAT_ERROR_NO_ALTERNATIVE 24
+#define AICHAT_ERROR_NOTHING_TO_COMPACT 25
+#define AICHAT_ERROR_STORE 26
+#define AICHAT_ERROR_STORE_COLLISION 27
+
+// the tokens the chat format adds around every message and before the reply
+#define AICHAT_TOKENS_PER_MESSAGE 3
+#define AICHAT_TOKENS_PER_REPLY 3
+
+// the length of the name of an entry in the response cache, the hash of the request in hexadecimal
+#define AICHAT_CACHE_KEY_LENGTH 32
+
+// the length of the name of a run of messages in a message store, the hash of its content in hexadecimal
+#define AICHAT_STORE_KEY_LENGTH 32
+
+// the part of the context window of the model that is kept free for the response by default
+#define AICHAT_DEFAULT_RESERVED_COMPLETION_TOKENS 1024
+
+// the turns a summary leaves out by default, the newest ones are always sent as they are
+#define AICHAT_DEFAULT_COMPACT_KEEP_TURNS 4
+
+// the entry of session->context that stands for the summary of the session
+#define AICHAT_CONTEXT_SUMMARY UINT_MAX
+
+// requests that fail for a reason that may go away are sent again after an exponentially growing delay
+#define AICHAT_DEFAULT_MAX_RETRIES 4
+#define AICHAT_DEFAULT_RETRY_BASE_DELAY 0.5 // seconds
+#define AICHAT_DEFAULT_RETRY_MAX_DELAY 30.0 // seconds
+
+// a learned hedge delay is a percentile of the first byte times of this many recent requests, and
+// there is no hedging until there are at least the minimum of them
+#define AICHAT_HEDGE_SAMPLES 64
+#define AICHAT_HEDGE_MIN_SAMPLES 16
 
 enum aichat_role { AICHAT_ROLE_SYSTEM, AICHAT_ROLE_USER, AICHAT_ROLE_ASSISTANT };
 enum aichat_model { AICHAT_MODEL_GPT_3_5_TURBO, AICHAT_MODEL_GPT_3_5_TURBO_16K };
 
+// a client recording a cassette appends every request and the raw response to it, a client replaying a
+// cassette answers requests from it without touching the network
+enum aichat_cassette_mode { AICHAT_CASSETTE_OFF, AICHAT_CASSETTE_RECORD, AICHAT_CASSETTE_REPLAY };
+
+// a long-lived client keeps connections, resolved addresses and TLS sessions
+// warm between requests, a session without a client connects from scratch
+struct aichat_client;
+
+// runs the requests of many sessions concurrently over a bounded number of connections
+struct aichat_batch;
+
+// counts tokens with byte pair encoding using the ranks of a cl100k_base style vocabulary
+struct aichat_tokenizer;
+
+// receives each piece of the assistant message as it arrives when streaming
+typedef void (*aichat_stream_callback) (const char *delta, unsigned long int length, void *userdata);
+
 struct
 aichat_message
 {
   enum aichat_role role;
   char *text;
+  unsigned long int length;
+};
+
+// a candidate for the message at index message, see aichat_session_pick_alternative
+struct
+aichat_alternative
+{
+  unsigned int message;
+  char *text;
+  unsigned long int length;
+};
+
+struct aichat_session_chunk;
+struct aichat_message_terms;
+
+// a run of a message store and how many messages there are up to the last one of it that is used
+struct
+aichat_store_run
+{
+  char key [AICHAT_STORE_KEY_LENGTH + 1];
+  unsigned int messages;
 };
 
 struct
 aichat_session
 {
-  struct aichat_message messages [AICHAT_SESSION_MAX_MESSAGES];
+  struct aichat_message *messages;
   unsigned int message_count;
+  unsigned int message_capacity;
 
-  char buffer [AICHAT_SESSION_BUFFER_SIZE];
-  unsigned int buffer_remaining;
+  struct aichat_session_chunk *first_chunk;
+  struct aichat_session_chunk *current_chunk;
 
   enum aichat_model model;
   double temperature;
+
+  // when set the response is requested as a stream and handed to the callback as it arrives
+  aichat_stream_callback stream_callback;
+  void *stream_userdata;
+
+  // optional, requests are made through this client when set
+  struct aichat_client *client;
+
+  // optional, needed to count the tokens of the session before it is sent
+  struct aichat_tokenizer *tokenizer;
+
+  // optional, identifies the session in the ledger of the client
+  const char *name;
+
+  // when set the response is not looked up in the cache of the client, the new response still replaces the cached one
+  bool cache_bypass;
+
+  // when the session does not fit into the prompt budget the oldest messages after the system prompt are
+  // left out of the request, the budget is max_prompt_tokens or, when that is 0, the context window of the
+  // model less reserved_completion_tokens. A negative max_prompt_tokens sends every message. Without a
+  // tokenizer the number of tokens of a message is estimated from its length.
+  int max_prompt_tokens;
+  int reserved_completion_tokens;
+
+  // with context_recent_turns set only the last that many turns, a turn being a user message and the
+  // responses to it, are sent after the system prompt, along with the exchanges of up to
+  // context_relevant_messages of the older messages that share the most words with the last message. The
+  // older messages are ranked with BM25, the prompt budget still applies and everything is sent in the order
+  // of the session. 0 sends the newest messages that fit the budget.
+  unsigned int context_recent_turns;
+  unsigned int context_relevant_messages;
+
+  // a system message that summarizes the messages after the system prompt up to summary_messages and is sent
+  // in their place, the messages themselves stay in the session. It is saved with the session and dropped
+  // when one of the messages it summarizes is removed. summary_unsaved is set until a journal has a record of it.
+  struct aichat_message summary;
+  unsigned int summary_messages;
+  bool summary_unsaved;
+
+  // when the messages since the summary take up more than compact_threshold tokens, aichat_session_extend first
+  // summarizes all but the last compact_keep_turns turns with aichat_session_compact. 0 never does.
+  unsigned int compact_threshold;
+  unsigned int compact_keep_turns;
+
+  // after a compaction failed the next one waits until the messages since the summary take up more tokens than this
+  long int compact_retry_tokens;
+
+  // how many candidates the next response is asked for. With more than one the response is neither streamed
+  // nor cached, the first candidate becomes the new message and all of them become its alternatives.
+  unsigned int choices;
+
+  // the candidates of every message that was asked for several, ordered by their message and for each message
+  // in the order the API returned them. The text of such a message is one of its candidates, see
+  // aichat_session_pick_alternative. They are saved with their message and dropped when it is removed.
+  struct aichat_alternative *alternatives;
+  unsigned int alternative_count;
+  unsigned int alternative_capacity;
+
+  // the body of the last request, its memory is reused by the next one
+  char *request_body;
+  unsigned long int request_body_capacity;
+
+  // the context_count messages of the last request in the order they were sent, the memory is reused by the next one
+  unsigned int *context;
+  unsigned int context_count;
+  unsigned int context_capacity;
+
+  // the hashed words of the first message_terms_count messages for ranking them against the last message,
+  // kept from one request to the next and dropped for messages that are removed or replaced
+  struct aichat_message_terms *message_terms;
+  unsigned int message_terms_count;
+  unsigned int message_terms_capacity;
+
+  // the session starts with the first base_messages messages of the run named base in a message store and
+  // its ancestors, which it shares with the sessions forked from the same messages. Only the messages after
+  // them are saved with the session, see aichat_session_freeze.
+  char base [AICHAT_STORE_KEY_LENGTH + 1];
+  unsigned int base_messages;
+
+  // set when the session was read from or written to a journal, which can then be appended to
+  bool journal;
+  unsigned int journal_records;
+  unsigned long int journal_size;
 };
 
 struct
@@ -69,14 +282,205 @@ aichat_api_call_results
 
   int prompt_tokens;
   int completion_tokens;
+
+  // the number of messages that were left out of the request to fit into the prompt budget
+  int omitted_messages;
+
+  // set when the response was served from the cache of the client
+  int cached;
+
+  // where the time of the request went in seconds, as reported by curl. The connection phases are zero
+  // when a connection was reused and all of them are zero when no request was sent.
+  double name_lookup_time;
+  double connect_time;
+  double tls_time;
+  double first_byte_time; // since the start of the request
+  double total_time;
+
+  // the time it took to turn the session into the request body
+  double serialize_time;
+
+  unsigned long int request_bytes;
+  unsigned long int response_bytes;
+
+  // the HTTP status of the response, zero when no request was sent
+  int http_status;
+
+  // how often the request was sent again after a network error, a rate limit or a server error, the times
+  // above are those of the last attempt
+  int retries;
+
+  // how long the request waited for the scheduler of the client, over all attempts
+  double queue_time;
+
+  // how many duplicates were sent because a response was slow to start, whether one of them answered first
+  // and the prompt tokens they are billed for, even though their responses were cancelled
+  int hedges;
+  int hedge_won;
+  int hedge_tokens;
+
+  // when aichat_session_extend summarized the older turns first, the tokens the summary was billed for and the
+  // error of its request, which only leaves the turns to the prompt budget
+  int compact_tokens;
+  int compact_error;
 };
 
+// the rate limits reported with the last response the client received, a negative number was not reported
+struct
+aichat_rate_limits
+{
+  long int limit_requests;
+  long int limit_tokens;
+  long int remaining_requests;
+  long int remaining_tokens;
+
+  // seconds from when the response was received until the limits are replenished and, from Retry-After,
+  // until the API accepts the next request
+  double reset_requests;
+  double reset_tokens;
+  double retry_after;
+
+  // when the response was received, in seconds on the CLOCK_MONOTONIC clock
+  double received;
+};
+
+struct
+aichat_ledger_header
+{
+  char magic [8]; // AICHAT_LEDGER_MAGIC without the terminating null byte
+  uint32_t version;
+  uint32_t record_size;
+  char reserved [AICHAT_LEDGER_RECORD_SIZE - 16];
+};
+
+// the times are in microseconds, the name of the session is cut short to fit and padded with null bytes
+struct
+aichat_ledger_record
+{
+  int64_t time; // since the epoch, when the response was complete
+  uint32_t name_lookup_time;
+  uint32_t connect_time;
+  uint32_t tls_time;
+  uint32_t first_byte_time;
+  uint32_t total_time;
+  uint32_t serialize_time;
+  uint32_t prompt_tokens;
+  uint32_t completion_tokens;
+  uint32_t request_bytes;
+  uint32_t response_bytes;
+  uint16_t http_status;
+  uint16_t error;
+  uint8_t model;
+  uint8_t flags;
+  uint16_t omitted_messages;
+  char session [72];
+};
+
+struct aichat_client * aichat_client_initialize (void);
+void aichat_client_free (struct aichat_client *client);
+int aichat_client_set_base_url (struct aichat_client *client, const char *base_url);
+int aichat_client_set_ca_file (struct aichat_client *client, const char *ca_file);
+// responses are cached as files in directory, which is created if needed, keyed by a hash of the request.
+// The least recently used responses are removed when the cache grows beyond max_size bytes, a max_size of
+// 0 leaves it unbounded, and responses older than ttl seconds are not used when ttl is positive. A NULL
+// directory disables the cache.
+int aichat_client_set_cache (struct aichat_client *client, const char *directory, unsigned long int max_size, long int ttl);
+// a cassette is a file with one JSON object per line holding a request body and the response body exactly as
+// it was received. Requests are matched byte for byte, one that is not in a replayed cassette fails with
+// AICHAT_ERROR_CASSETTE_MISS. A NULL path or AICHAT_CASSETTE_OFF stops recording or replaying.
+int aichat_client_set_cassette (struct aichat_client *client, const char *path, enum aichat_cassette_mode mode);
+// every request made through the client, including the ones answered from its cache or cassette, is recorded in
+// the ledger at path, which is created if needed. A NULL path closes the ledger.
+int aichat_client_set_ledger (struct aichat_client *client, const char *path);
+// network errors, 408, 429 and 5xx responses are retried up to max_retries times. The n-th retry waits a
+// random time between half and all of base_delay * 2^n, capped at max_delay, or as long as the API asked
+// for through Retry-After or its rate limit headers when that is longer. A request the API asks to hold
+// off for longer than max_delay fails right away. A streamed response is not retried once a part of it
+// was handed to the stream callback.
+int aichat_client_set_retry_policy (struct aichat_client *client, unsigned int max_retries, double base_delay, double max_delay);
+void aichat_client_get_rate_limits (struct aichat_client *client, struct aichat_rate_limits *limits);
+// the seconds to wait before the next request so that it does not run into a rate limit the API reported
+double aichat_client_rate_limit_delay (struct aichat_client *client);
+// requests go through the token bucket at path, which is created if needed and shared with every other client
+// using it. A limit of 0 is not enforced, a NULL path turns the scheduler off.
+int aichat_client_set_scheduler (struct aichat_client *client, const char *path, long int requests_per_minute, long int tokens_per_minute);
+// a request that has not started to answer after delay seconds is sent again on a second connection, the
+// first of the two to answer is used and the other one is cancelled. With a percentile between 0 and 100 the
+// delay is learned from the first byte times of recent requests instead, and delay is used until there are
+// enough of them. A delay of 0 and percentile of 0 turn hedging off. Batches are never hedged.
+int aichat_client_set_hedging (struct aichat_client *client, double delay, double percentile);
+
 void aichat_session_initialize (struct aichat_session *session);
+void aichat_session_reset (struct aichat_session *session); // removes all messages but keeps the memory and the configuration
+void aichat_session_free (struct aichat_session *session);
+// the session is freed again when the file cannot be read
 int aichat_session_initialize_from_json_file (struct aichat_session *session, FILE *file);
+
+// like aichat_session_initialize_from_json_file, the messages a session is based on are read from the
+// message store in the directory store
+int aichat_session_initialize_from_json_file_in_store (struct aichat_session *session, FILE *file, const char *store);
+
+// moves the messages of the session after its base into a new run in the message store in the directory store,
+// which then becomes the base of the session. Runs are named after their content and never change, so any
+// number of sessions can be based on any number of the messages of a run.
+int aichat_session_freeze (struct aichat_session *session, const char *store);
+
+// the base of a saved session without reading its messages, 0 when it has none and 1 when it has one
+int aichat_session_read_base (FILE *file, char base [AICHAT_STORE_KEY_LENGTH + 1], unsigned int *base_messages);
+
+// the runs the first messages messages of the run key come from, the first run first. Runs that none of the
+// messages come from are left out. The number of runs is returned, when it is larger than capacity only the
+// last capacity runs are written.
+long int aichat_store_lineage (const char *store, const char *key, unsigned int messages, struct aichat_store_run *runs, unsigned int capacity);
+
+// removes the runs of the message store that are neither one of the count runs in bases nor one they are based
+// on and returns how many were removed. A run that is added while the store is collected is not based on yet and
+// would be removed too, keeping the store from being written meanwhile is up to the caller.
+long int aichat_store_collect (const char *store, const struct aichat_store_run *bases, unsigned long int count);
 int aichat_session_write_to_json_file (struct aichat_session *session, FILE *file);
+int aichat_session_write_to_journal_file (struct aichat_session *session, FILE *file);
+int aichat_session_append_to_journal_file (struct aichat_session *session, FILE *file, unsigned int removed, unsigned int first_message);
+bool aichat_session_journal_needs_compaction (struct aichat_session *session);
 int aichat_session_add_message (struct aichat_session *session, enum aichat_role role, const char *text);
 int aichat_session_add_message_from_file (struct aichat_session *session, enum aichat_role role, FILE *file);
 int aichat_session_extend (struct aichat_session *session, struct aichat_api_call_results *results);
+
+// asks for a summary of the oldest turns up to the last keep_turns that fit into one request, together with
+// the summary they follow, and makes it the summary of the session
+int aichat_session_compact (struct aichat_session *session, unsigned int keep_turns, struct aichat_api_call_results *results);
+int aichat_session_count_prompt_tokens (struct aichat_session *session);
+// the tokens of every message of the session, counted with the tokenizer of the session or estimated from their length
+long int aichat_session_estimate_tokens (struct aichat_session *session);
+// the body of the next request for the session, which belongs to the session and is valid until the next one is built
+const char * aichat_session_request_body (struct aichat_session *session, unsigned long int *length);
 int aichat_session_print_last_message (struct aichat_session *session, FILE *file);
 int aichat_session_remove_last_message (struct aichat_session *session);
+// the alternatives of the message at index message, their number is stored in count
+struct aichat_alternative * aichat_session_get_alternatives (struct aichat_session *session, unsigned int message, unsigned int *count);
+// adds a copy of text to the alternatives of the last message, after the ones it has
+int aichat_session_add_alternative (struct aichat_session *session, const char *text, unsigned long int length);
+// makes a copy of text the summary of the messages up to messages, which is saved like one made by aichat_session_compact
+int aichat_session_set_summary (struct aichat_session *session, const char *text, unsigned long int length, unsigned int messages);
+// makes the alternative at index the text of the last message, which must have alternatives
+int aichat_session_pick_alternative (struct aichat_session *session, unsigned int index);
 const char * aichat_strerror (int error_code);
+// the seconds on a monotonic clock, for measuring how long something took
+double aichat_now (void);
+const char * aichat_model_to_string (enum aichat_model model);
+
+struct aichat_tokenizer * aichat_tokenizer_initialize_from_file (FILE *file);
+// like aichat_tokenizer_initialize_from_file, but keeps a mappable image of the vocabulary in <path>.image
+struct aichat_tokenizer * aichat_tokenizer_initialize_from_path (const char *path);
+void aichat_tokenizer_free (struct aichat_tokenizer *tokenizer);
+long int aichat_tokenizer_count (struct aichat_tokenizer *tokenizer, const char *text, unsigned long int length);
+long int aichat_tokenizer_count_cached (struct aichat_tokenizer *tokenizer, const char *text, unsigned long int length);
+
+struct aichat_batch * aichat_batch_initialize (struct aichat_client *client, unsigned int max_in_flight);
+void aichat_batch_free (struct aichat_batch *batch);
+unsigned int aichat_batch_in_flight (struct aichat_batch *batch);
+// the client the requests are sent with, the one the batch was initialized with or its own
+struct aichat_client * aichat_batch_client (struct aichat_batch *batch);
+// sends the next request of the session like aichat_session_extend, except that the session is never compacted
+// first and cannot ask for more than one choice
+int aichat_batch_add (struct aichat_batch *batch, struct aichat_session *session, void *userdata);
+int aichat_batch_wait (struct aichat_batch *batch, struct aichat_session **session, struct aichat_api_call_results *results, void **userdata);
@@ -0,0 +1,807 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aichat.h"
+
+// A byte pair encoding tokenizer compatible with the cl100k_base encoding.
+//
+// Text is first split into pieces the way the cl100k_base pattern splits it:
+//
+//   '(?i:[sdmt]|ll|ve|re)|[^\r\n\p{L}\p{N}]?+\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]++[\r\n]*|\s*[\r\n]|\s+(?!\S)|\s+
+//
+// and every piece is then merged into tokens using the ranks of the vocabulary.
+// The pattern is matched by hand, letters and numbers outside of ASCII are
+// looked up in the ranges of aichat_tokenizer_unicode.h, which are generated
+// from the general categories of Unicode. Runs of ASCII letters and of
+// spaces, which make up most of both prose and code, are scanned 16 bytes at a
+// time when SSE2 is available.
+
+#define AICHAT_TOKENIZER_CACHE_SIZE 4096
+#define AICHAT_TOKENIZER_NO_RANK UINT32_MAX
+
+struct
+aichat_tokenizer_entry
+{
+  uint32_t offset;
+  uint32_t length; // zero for an empty slot
+  uint32_t rank;
+};
+
+// the number of tokens of texts that were counted before, messages are counted again on every turn
+struct
+aichat_tokenizer_cache_entry
+{
+  uint64_t hash;
+  unsigned long int length;
+  long int count;
+};
+
+struct
+aichat_tokenizer
+{
+  char *bytes;
+  unsigned long int bytes_size;
+  unsigned long int bytes_capacity;
+
+  struct aichat_tokenizer_entry *entries;
+  unsigned long int entry_count;
+  unsigned long int entry_mask;
+
+  // the entries and bytes point into this mapping of an image when the tokenizer was loaded from one
+  void *image;
+  unsigned long int image_size;
+
+  struct aichat_tokenizer_cache_entry cache [AICHAT_TOKENIZER_CACHE_SIZE];
+};
+
+// An image of the hash table of a vocabulary is written next to the .tiktoken
+// file the first time it is read, so that later processes map the table instead
+// of decoding and inserting every token again. The header is followed by the
+// entry_mask + 1 entries and the bytes of the tokens. An image belongs to the
+// version of the vocabulary with the size and modification time in its header.
+#define AICHAT_TOKENIZER_IMAGE_MAGIC "AITOKEN1"
+
+struct
+aichat_tokenizer_image_header
+{
+  char magic[8];
+  int64_t source_size;
+  int64_t source_time;
+  uint64_t entry_count;
+  uint64_t entry_mask;
+  uint64_t bytes_size;
+};
+
+enum aichat_character_class { AICHAT_CHARACTER_LETTER, AICHAT_CHARACTER_NUMBER, AICHAT_CHARACTER_SPACE, AICHAT_CHARACTER_NEWLINE, AICHAT_CHARACTER_OTHER };
+
+struct
+aichat_unicode_range
+{
+  uint32_t first;
+  uint32_t last;
+  uint8_t class;
+};
+
+#include "aichat_tokenizer_unicode.h"
+
+static uint64_t
+aichat_tokenizer_hash (const char *bytes, unsigned long int length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (unsigned long int i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char) bytes[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash ^ (hash >> 29);
+}
+
+static uint32_t
+aichat_tokenizer_rank (struct aichat_tokenizer *tokenizer, const char *bytes, unsigned long int length)
+{
+  unsigned long int index = aichat_tokenizer_hash (bytes, length) & tokenizer->entry_mask;
+
+  while (tokenizer->entries[index].length != 0)
+  {
+    struct aichat_tokenizer_entry *entry = &tokenizer->entries[index];
+
+    if (entry->length == length && memcmp (tokenizer->bytes + entry->offset, bytes, length) == 0)
+      return entry->rank;
+
+    index = (index + 1) & tokenizer->entry_mask;
+  }
+
+  return AICHAT_TOKENIZER_NO_RANK;
+}
+
+static void
+aichat_tokenizer_insert (struct aichat_tokenizer_entry *entries, unsigned long int mask, const char *bytes, struct aichat_tokenizer_entry entry)
+{
+  unsigned long int index = aichat_tokenizer_hash (bytes + entry.offset, entry.length) & mask;
+
+  while (entries[index].length != 0)
+    index = (index + 1) & mask;
+
+  entries[index] = entry;
+}
+
+static int
+aichat_tokenizer_add (struct aichat_tokenizer *tokenizer, const char *bytes, unsigned long int length, uint32_t rank)
+{
+  // keep the table at most half full
+  if (2 * (tokenizer->entry_count + 1) > tokenizer->entry_mask + 1)
+  {
+    unsigned long int capacity = tokenizer->entry_mask ? 2 * (tokenizer->entry_mask + 1) : 65536;
+    struct aichat_tokenizer_entry *entries = calloc (capacity, sizeof (struct aichat_tokenizer_entry));
+
+    if (entries == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    for (unsigned long int i = 0; tokenizer->entries && i <= tokenizer->entry_mask; i++)
+    {
+      if (tokenizer->entries[i].length != 0)
+        aichat_tokenizer_insert (entries, capacity - 1, tokenizer->bytes, tokenizer->entries[i]);
+    }
+
+    free (tokenizer->entries);
+    tokenizer->entries = entries;
+    tokenizer->entry_mask = capacity - 1;
+  }
+
+  if (tokenizer->bytes_size + length > tokenizer->bytes_capacity)
+  {
+    unsigned long int capacity = tokenizer->bytes_capacity ? tokenizer->bytes_capacity : 65536;
+
+    while (tokenizer->bytes_size + length > capacity)
+      capacity *= 2;
+
+    char *larger = realloc (tokenizer->bytes, capacity);
+
+    if (larger == NULL)
+      return -AICHAT_ERROR_MEMORY;
+
+    tokenizer->bytes = larger;
+    tokenizer->bytes_capacity = capacity;
+  }
+
+  struct aichat_tokenizer_entry entry = { .offset = tokenizer->bytes_size, .length = length, .rank = rank };
+
+  memcpy (tokenizer->bytes + tokenizer->bytes_size, bytes, length);
+  tokenizer->bytes_size += length;
+
+  aichat_tokenizer_insert (tokenizer->entries, tokenizer->entry_mask, tokenizer->bytes, entry);
+  tokenizer->entry_count++;
+
+  return 0;
+}
+
+static int
+aichat_base64_value (char c)
+{
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+
+  return -1;
+}
+
+// decodes base64 in place, returns the decoded length or -1
+static long int
+aichat_base64_decode (char *text, unsigned long int length)
+{
+  unsigned long int output = 0;
+  unsigned int bits = 0, buffer = 0;
+
+  for (unsigned long int i = 0; i < length; i++)
+  {
+    if (text[i] == '=')
+      break;
+
+    int value = aichat_base64_value (text[i]);
+
+    if (value < 0)
+      return -1;
+
+    buffer = (buffer << 6) | value;
+    bits += 6;
+
+    if (bits >= 8)
+    {
+      bits -= 8;
+      text[output++] = (buffer >> bits) & 0xFF;
+    }
+  }
+
+  return output;
+}
+
+// reads a vocabulary in the format of the .tiktoken files, a base64 encoded token and its rank on every line
+struct aichat_tokenizer *
+aichat_tokenizer_initialize_from_file (FILE *file)
+{
+  struct aichat_tokenizer *tokenizer = calloc (1, sizeof (struct aichat_tokenizer));
+
+  if (tokenizer == NULL)
+    return NULL;
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t length;
+
+  while ((length = getline (&line, &line_capacity, file)) >= 0)
+  {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+
+    if (length == 0)
+      continue;
+
+    char *separator = strchr (line, ' ');
+    char *end;
+
+    if (separator == NULL)
+      goto aichat_tokenizer_initialize_error;
+
+    unsigned long int rank = strtoul (separator + 1, &end, 10);
+    long int token_length = aichat_base64_decode (line, separator - line);
+
+    if (*end != '\0' || end == separator + 1 || rank >= AICHAT_TOKENIZER_NO_RANK || token_length <= 0)
+      goto aichat_tokenizer_initialize_error;
+
+    if (aichat_tokenizer_add (tokenizer, line, token_length, rank) < 0)
+      goto aichat_tokenizer_initialize_error;
+  }
+
+  if (ferror (file) || tokenizer->entry_count == 0)
+    goto aichat_tokenizer_initialize_error;
+
+  // every text can be encoded only if every single byte is a token
+  for (int byte = 0; byte < 256; byte++)
+  {
+    char c = byte;
+
+    if (aichat_tokenizer_rank (tokenizer, &c, 1) == AICHAT_TOKENIZER_NO_RANK)
+      goto aichat_tokenizer_initialize_error;
+  }
+
+  free (line);
+  return tokenizer;
+
+aichat_tokenizer_initialize_error:
+  free (line);
+  aichat_tokenizer_free (tokenizer);
+  return NULL;
+}
+
+void
+aichat_tokenizer_free (struct aichat_tokenizer *tokenizer)
+{
+  if (tokenizer == NULL)
+    return;
+
+  if (tokenizer->image)
+    munmap (tokenizer->image, tokenizer->image_size);
+  else
+  {
+    free (tokenizer->entries);
+    free (tokenizer->bytes);
+  }
+
+  free (tokenizer);
+}
+
+static int64_t
+aichat_tokenizer_source_time (const struct stat *status)
+{
+#ifdef __APPLE__
+  return (int64_t) status->st_mtimespec.tv_sec * 1000000000 + status->st_mtimespec.tv_nsec;
+#else
+  return (int64_t) status->st_mtim.tv_sec * 1000000000 + status->st_mtim.tv_nsec;
+#endif
+}
+
+// maps the image at path if it was written for the vocabulary with the status source
+static struct aichat_tokenizer *
+aichat_tokenizer_map_image (const char *path, const struct stat *source)
+{
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return NULL;
+
+  struct stat status;
+  struct aichat_tokenizer_image_header header;
+  void *image = MAP_FAILED;
+
+  if (fstat (fd, &status) == 0 && (unsigned long int) status.st_size >= sizeof (header))
+    image = mmap (NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close (fd);
+
+  if (image == MAP_FAILED)
+    return NULL;
+
+  memcpy (&header, image, sizeof (header));
+
+  unsigned long int size = status.st_size;
+  unsigned long int slots = header.entry_mask + 1;
+
+  // the image must be complete and its table must have a free slot for every lookup to end
+  if (memcmp (header.magic, AICHAT_TOKENIZER_IMAGE_MAGIC, sizeof (header.magic)) != 0
+      || header.source_size != source->st_size || header.source_time != aichat_tokenizer_source_time (source)
+      || header.bytes_size > size || slots == 0 || (slots & header.entry_mask) != 0 || header.entry_count == 0 || header.entry_count >= slots
+      || slots > (size - sizeof (header)) / sizeof (struct aichat_tokenizer_entry)
+      || sizeof (header) + slots * sizeof (struct aichat_tokenizer_entry) + header.bytes_size != size)
+  {
+    munmap (image, size);
+    return NULL;
+  }
+
+  struct aichat_tokenizer_entry *entries = (struct aichat_tokenizer_entry *) ((char *) image + sizeof (header));
+
+  for (unsigned long int i = 0; i < slots; i++)
+  {
+    if ((uint64_t) entries[i].offset + entries[i].length > header.bytes_size)
+    {
+      munmap (image, size);
+      return NULL;
+    }
+  }
+
+  struct aichat_tokenizer *tokenizer = calloc (1, sizeof (struct aichat_tokenizer));
+
+  if (tokenizer == NULL)
+  {
+    munmap (image, size);
+    return NULL;
+  }
+
+  tokenizer->image = image;
+  tokenizer->image_size = size;
+  tokenizer->entries = entries;
+  tokenizer->entry_count = header.entry_count;
+  tokenizer->entry_mask = header.entry_mask;
+  tokenizer->bytes = (char *) (entries + slots);
+  tokenizer->bytes_size = header.bytes_size;
+
+  return tokenizer;
+}
+
+// writes the image through a temporary file, so that another process never maps half of it
+static void
+aichat_tokenizer_write_image (struct aichat_tokenizer *tokenizer, const char *path, const struct stat *source)
+{
+  struct aichat_tokenizer_image_header header = {
+    .magic = AICHAT_TOKENIZER_IMAGE_MAGIC,
+    .source_size = source->st_size,
+    .source_time = aichat_tokenizer_source_time (source),
+    .entry_count = tokenizer->entry_count,
+    .entry_mask = tokenizer->entry_mask,
+    .bytes_size = tokenizer->bytes_size
+  };
+  char *temporary_path;
+
+  if (asprintf (&temporary_path, "%s.%ld", path, (long int) getpid ()) < 0)
+    return;
+
+  FILE *file = fopen (temporary_path, "w");
+
+  if (file == NULL)
+  {
+    free (temporary_path);
+    return;
+  }
+
+  bool written = fwrite (&header, sizeof (header), 1, file) == 1
+    && fwrite (tokenizer->entries, sizeof (struct aichat_tokenizer_entry), tokenizer->entry_mask + 1, file) == tokenizer->entry_mask + 1
+    && fwrite (tokenizer->bytes, 1, tokenizer->bytes_size, file) == tokenizer->bytes_size;
+
+  if (fclose (file) != 0 || written == false || rename (temporary_path, path) != 0)
+    unlink (temporary_path);
+
+  free (temporary_path);
+}
+
+// maps the image of the vocabulary at path, or reads the vocabulary and writes its image for the next time
+struct aichat_tokenizer *
+aichat_tokenizer_initialize_from_path (const char *path)
+{
+  struct stat source;
+  char *image_path;
+
+  if (stat (path, &source) != 0 || asprintf (&image_path, "%s.image", path) < 0)
+    return NULL;
+
+  struct aichat_tokenizer *tokenizer = aichat_tokenizer_map_image (image_path, &source);
+
+  if (tokenizer == NULL)
+  {
+    FILE *file = fopen (path, "r");
+
+    if (file)
+    {
+      tokenizer = aichat_tokenizer_initialize_from_file (file);
+      fclose (file);
+    }
+
+    // an image that cannot be written, for example in a read-only directory, only means reading the vocabulary again
+    if (tokenizer)
+      aichat_tokenizer_write_image (tokenizer, image_path, &source);
+  }
+
+  free (image_path);
+  return tokenizer;
+}
+
+// the class of the character at text, its length in bytes is stored in length
+static enum aichat_character_class
+aichat_character_class (const unsigned char *text, const unsigned char *end, unsigned int *length)
+{
+  unsigned char c = *text;
+
+  if (c < 0x80)
+  {
+    *length = 1;
+
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return AICHAT_CHARACTER_LETTER;
+    if (c >= '0' && c <= '9')                   return AICHAT_CHARACTER_NUMBER;
+    if (c == '\n' || c == '\r')                 return AICHAT_CHARACTER_NEWLINE;
+    if (c == ' ' || (c >= '\t' && c <= '\f'))   return AICHAT_CHARACTER_SPACE;
+
+    return AICHAT_CHARACTER_OTHER;
+  }
+
+  uint32_t codepoint;
+
+  if ((c & 0xE0) == 0xC0 && end - text >= 2 && (text[1] & 0xC0) == 0x80)
+  {
+    *length = 2;
+    codepoint = ((c & 0x1F) << 6) | (text[1] & 0x3F);
+  }
+  else if ((c & 0xF0) == 0xE0 && end - text >= 3 && (text[1] & 0xC0) == 0x80 && (text[2] & 0xC0) == 0x80)
+  {
+    *length = 3;
+    codepoint = ((c & 0x0F) << 12) | ((text[1] & 0x3F) << 6) | (text[2] & 0x3F);
+  }
+  else if ((c & 0xF8) == 0xF0 && end - text >= 4 && (text[1] & 0xC0) == 0x80 && (text[2] & 0xC0) == 0x80 && (text[3] & 0xC0) == 0x80)
+  {
+    *length = 4;
+    codepoint = ((c & 0x07) << 18) | ((text[1] & 0x3F) << 12) | ((text[2] & 0x3F) << 6) | (text[3] & 0x3F);
+  }
+  else
+  {
+    // not UTF-8, the byte stands on its own
+    *length = 1;
+    return AICHAT_CHARACTER_OTHER;
+  }
+
+  if (codepoint == 0x85 || codepoint == 0xA0 || codepoint == 0x1680 || (codepoint >= 0x2000 && codepoint <= 0x200A) ||
+      codepoint == 0x2028 || codepoint == 0x2029 || codepoint == 0x202F || codepoint == 0x205F || codepoint == 0x3000)
+    return AICHAT_CHARACTER_SPACE;
+
+  // the ranges are sorted and do not overlap
+  unsigned long int low = 0, high = sizeof (aichat_unicode_ranges) / sizeof (aichat_unicode_ranges [0]);
+
+  while (low < high)
+  {
+    unsigned long int middle = (low + high) / 2;
+
+    if (codepoint < aichat_unicode_ranges [middle].first)     high = middle;
+    else if (codepoint > aichat_unicode_ranges [middle].last) low = middle + 1;
+    else                                                      return aichat_unicode_ranges [middle].class;
+  }
+
+  return AICHAT_CHARACTER_OTHER;
+}
+
+static inline bool
+aichat_is_space (enum aichat_character_class class)
+{
+  return class == AICHAT_CHARACTER_SPACE || class == AICHAT_CHARACTER_NEWLINE;
+}
+
+// skips ASCII letters, stops at the first byte that is anything else
+static const unsigned char *
+aichat_skip_ascii_letters (const unsigned char *text, const unsigned char *end)
+{
+#ifdef __SSE2__
+  const __m128i case_bit = _mm_set1_epi8 (0x20);
+  const __m128i before_a = _mm_set1_epi8 ('a' - 1);
+  const __m128i after_z = _mm_set1_epi8 ('z' + 1);
+
+  while (end - text >= 16)
+  {
+    // bytes from 0x80 up are negative and so are never taken for letters
+    __m128i folded = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *) text), case_bit);
+    __m128i letters = _mm_and_si128 (_mm_cmpgt_epi8 (folded, before_a), _mm_cmplt_epi8 (folded, after_z));
+    unsigned int mask = _mm_movemask_epi8 (letters);
+
+    if (mask != 0xFFFF)
+      return text + __builtin_ctz (~mask);
+
+    text += 16;
+  }
+#endif
+
+  while (text < end && (*text | 0x20) >= 'a' && (*text | 0x20) <= 'z')
+    text++;
+
+  return text;
+}
+
+static const unsigned char *
+aichat_skip_ascii_spaces (const unsigned char *text, const unsigned char *end)
+{
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8 (' ');
+
+  while (end - text >= 16)
+  {
+    unsigned int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) text), space));
+
+    if (mask != 0xFFFF)
+      return text + __builtin_ctz (~mask);
+
+    text += 16;
+  }
+#endif
+
+  while (text < end && *text == ' ')
+    text++;
+
+  return text;
+}
+
+static const unsigned char *
+aichat_skip_letters (const unsigned char *text, const unsigned char *end)
+{
+  unsigned int length;
+
+  while (text < end)
+  {
+    text = aichat_skip_ascii_letters (text, end);
+
+    if (text == end || *text < 0x80 || aichat_character_class (text, end, &length) != AICHAT_CHARACTER_LETTER)
+      break;
+
+    text += length;
+  }
+
+  return text;
+}
+
+static bool
+aichat_is_ascii_letter (const unsigned char *text, const unsigned char *end, char lowercase)
+{
+  return text < end && (*text | 0x20) == lowercase && ((*text | 0x20) >= 'a' && (*text | 0x20) <= 'z');
+}
+
+// finds the end of the piece that starts at text
+static const unsigned char *
+aichat_pretokenize (const unsigned char *text, const unsigned char *end)
+{
+  unsigned int length, next_length;
+  enum aichat_character_class class = aichat_character_class (text, end, &length);
+
+  // '(?i:[sdmt]|ll|ve|re)
+  if (*text == '\'' && text + 1 < end)
+  {
+    const unsigned char *next = text + 1;
+
+    if (aichat_is_ascii_letter (next, end, 's') || aichat_is_ascii_letter (next, end, 'd') ||
+        aichat_is_ascii_letter (next, end, 'm') || aichat_is_ascii_letter (next, end, 't'))
+      return text + 2;
+
+    if ((aichat_is_ascii_letter (next, end, 'l') && aichat_is_ascii_letter (next + 1, end, 'l')) ||
+        (aichat_is_ascii_letter (next, end, 'v') && aichat_is_ascii_letter (next + 1, end, 'e')) ||
+        (aichat_is_ascii_letter (next, end, 'r') && aichat_is_ascii_letter (next + 1, end, 'e')))
+      return text + 3;
+  }
+
+  // [^\r\n\p{L}\p{N}]?+\p{L}+
+  if (class == AICHAT_CHARACTER_LETTER)
+    return aichat_skip_letters (text, end);
+
+  if (class != AICHAT_CHARACTER_NUMBER && class != AICHAT_CHARACTER_NEWLINE && text + length < end &&
+      aichat_character_class (text + length, end, &next_length) == AICHAT_CHARACTER_LETTER)
+    return aichat_skip_letters (text + length, end);
+
+  // \p{N}{1,3}
+  if (class == AICHAT_CHARACTER_NUMBER)
+  {
+    const unsigned char *cursor = text + length;
+
+    for (int i = 1; i < 3 && cursor < end && aichat_character_class (cursor, end, &next_length) == AICHAT_CHARACTER_NUMBER; i++)
+      cursor += next_length;
+
+    return cursor;
+  }
+
+  //  ?[^\s\p{L}\p{N}]++[\r\n]*
+  const unsigned char *cursor = text;
+
+  if (*text == ' ' && text + 1 < end && aichat_character_class (text + 1, end, &next_length) == AICHAT_CHARACTER_OTHER)
+    cursor = text + 1;
+
+  if (aichat_character_class (cursor, end, &next_length) == AICHAT_CHARACTER_OTHER)
+  {
+    while (cursor < end && aichat_character_class (cursor, end, &next_length) == AICHAT_CHARACTER_OTHER)
+      cursor += next_length;
+
+    while (cursor < end && (*cursor == '\r' || *cursor == '\n'))
+      cursor++;
+
+    return cursor;
+  }
+
+  // what is left starts with whitespace, find the end of the run and its last newline
+  const unsigned char *last_newline = NULL;
+  const unsigned char *last_character = text;
+
+  cursor = text;
+
+  while (cursor < end)
+  {
+    const unsigned char *spaces = aichat_skip_ascii_spaces (cursor, end);
+
+    if (spaces != cursor)
+    {
+      last_character = spaces - 1;
+      cursor = spaces;
+      continue;
+    }
+
+    enum aichat_character_class next_class = aichat_character_class (cursor, end, &next_length);
+
+    if (aichat_is_space (next_class) == false)
+      break;
+
+    if (next_class == AICHAT_CHARACTER_NEWLINE)
+      last_newline = cursor;
+
+    last_character = cursor;
+    cursor += next_length;
+  }
+
+  // \s*[\r\n]
+  if (last_newline)
+    return last_newline + 1;
+
+  // \s+(?!\S) leaves the last space to the piece that follows, \s+ takes the only one
+  if (cursor < end && last_character != text)
+    return last_character;
+
+  return cursor;
+}
+
+// the number of tokens byte pair encoding turns a piece into
+static long int
+aichat_tokenizer_count_piece (struct aichat_tokenizer *tokenizer, const char *piece, unsigned long int length)
+{
+  if (length == 1 || aichat_tokenizer_rank (tokenizer, piece, length) != AICHAT_TOKENIZER_NO_RANK)
+    return 1;
+
+  // starts[i] is where the i-th part begins, ranks[i] is the rank of the i-th and the following part together
+  uint32_t small_starts [65], small_ranks [64];
+  uint32_t *starts = small_starts, *ranks = small_ranks;
+
+  if (length > 64)
+  {
+    starts = malloc ((length + 1) * sizeof (uint32_t));
+    ranks = malloc (length * sizeof (uint32_t));
+
+    if (starts == NULL || ranks == NULL)
+    {
+      free (starts);
+      free (ranks);
+      return -AICHAT_ERROR_MEMORY;
+    }
+  }
+
+  unsigned long int parts = length;
+
+  for (unsigned long int i = 0; i <= length; i++)
+    starts[i] = i;
+
+  for (unsigned long int i = 0; i + 1 < parts; i++)
+    ranks[i] = aichat_tokenizer_rank (tokenizer, piece + i, 2);
+
+  ranks[parts - 1] = AICHAT_TOKENIZER_NO_RANK;
+
+  while (parts > 1)
+  {
+    unsigned long int best = 0;
+
+    for (unsigned long int i = 1; i + 1 < parts; i++)
+    {
+      if (ranks[i] < ranks[best])
+        best = i;
+    }
+
+    if (ranks[best] == AICHAT_TOKENIZER_NO_RANK)
+      break;
+
+    // merge the best part with the one after it
+    memmove (&starts[best + 1], &starts[best + 2], (parts - best - 1) * sizeof (uint32_t));
+    memmove (&ranks[best + 1], &ranks[best + 2], (parts - best - 2) * sizeof (uint32_t));
+    parts--;
+
+    if (best + 1 < parts)
+      ranks[best] = aichat_tokenizer_rank (tokenizer, piece + starts[best], starts[best + 2] - starts[best]);
+    else
+      ranks[best] = AICHAT_TOKENIZER_NO_RANK;
+
+    if (best > 0)
+      ranks[best - 1] = aichat_tokenizer_rank (tokenizer, piece + starts[best - 1], starts[best + 1] - starts[best - 1]);
+  }
+
+  if (starts != small_starts)
+  {
+    free (starts);
+    free (ranks);
+  }
+
+  return parts;
+}
+
+long int
+aichat_tokenizer_count (struct aichat_tokenizer *tokenizer, const char *text, unsigned long int length)
+{
+  const unsigned char *cursor = (const unsigned char *) text;
+  const unsigned char *end = cursor + length;
+  long int count = 0;
+
+  while (cursor < end)
+  {
+    const unsigned char *piece_end = aichat_pretokenize (cursor, end);
+    long int piece_count = aichat_tokenizer_count_piece (tokenizer, (const char *) cursor, piece_end - cursor);
+
+    if (piece_count < 0)
+      return piece_count;
+
+    count += piece_count;
+    cursor = piece_end;
+  }
+
+  return count;
+}
+
+// counts like aichat_tokenizer_count but remembers the counts of the texts it has seen
+long int
+aichat_tokenizer_count_cached (struct aichat_tokenizer *tokenizer, const char *text, unsigned long int length)
+{
+  uint64_t hash = aichat_tokenizer_hash (text, length);
+  struct aichat_tokenizer_cache_entry *entry = &tokenizer->cache[hash % AICHAT_TOKENIZER_CACHE_SIZE];
+
+  if (entry->hash == hash && entry->length == length && entry->count > 0)
+    return entry->count;
+
+  long int count = aichat_tokenizer_count (tokenizer, text, length);
+
+  if (count > 0)
+  {
+    entry->hash = hash;
+    entry->length = length;
+    entry->count = count;
+  }
+
+  return count;
+}
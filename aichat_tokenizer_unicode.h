@@ -0,0 +1,224 @@
+#pragma once
+
+// The letters (\p{L}) and numbers (\p{N}) outside of ASCII as sorted ranges of code points, anything else
+// outside of ASCII that is not a space is neither. Generated from the general categories of Unicode 17.0
+// (UnicodeData.txt), consecutive code points of the same kind are merged into one range.
+
+#define L AICHAT_CHARACTER_LETTER
+#define N AICHAT_CHARACTER_NUMBER
+
+static const struct aichat_unicode_range aichat_unicode_ranges [] = {
+  { 0x000AA, 0x000AA, L }, { 0x000B2, 0x000B3, N }, { 0x000B5, 0x000B5, L }, { 0x000B9, 0x000B9, N },
+  { 0x000BA, 0x000BA, L }, { 0x000BC, 0x000BE, N }, { 0x000C0, 0x000D6, L }, { 0x000D8, 0x000F6, L },
+  { 0x000F8, 0x002C1, L }, { 0x002C6, 0x002D1, L }, { 0x002E0, 0x002E4, L }, { 0x002EC, 0x002EC, L },
+  { 0x002EE, 0x002EE, L }, { 0x00370, 0x00374, L }, { 0x00376, 0x00377, L }, { 0x0037A, 0x0037D, L },
+  { 0x0037F, 0x0037F, L }, { 0x00386, 0x00386, L }, { 0x00388, 0x0038A, L }, { 0x0038C, 0x0038C, L },
+  { 0x0038E, 0x003A1, L }, { 0x003A3, 0x003F5, L }, { 0x003F7, 0x00481, L }, { 0x0048A, 0x0052F, L },
+  { 0x00531, 0x00556, L }, { 0x00558, 0x00559, L }, { 0x00560, 0x00588, L }, { 0x0058B, 0x0058C, L },
+  { 0x005D0, 0x005EA, L }, { 0x005EF, 0x005F2, L }, { 0x00620, 0x0064A, L }, { 0x00660, 0x00669, N },
+  { 0x0066E, 0x0066F, L }, { 0x00671, 0x006D3, L }, { 0x006D5, 0x006D5, L }, { 0x006E5, 0x006E6, L },
+  { 0x006EE, 0x006EF, L }, { 0x006F0, 0x006F9, N }, { 0x006FA, 0x006FC, L }, { 0x006FF, 0x006FF, L },
+  { 0x00710, 0x00710, L }, { 0x00712, 0x0072F, L }, { 0x0074D, 0x007A5, L }, { 0x007B1, 0x007B1, L },
+  { 0x007C0, 0x007C9, N }, { 0x007CA, 0x007EA, L }, { 0x007F4, 0x007F5, L }, { 0x007FA, 0x007FA, L },
+  { 0x00800, 0x00815, L }, { 0x0081A, 0x0081A, L }, { 0x00824, 0x00824, L }, { 0x00828, 0x00828, L },
+  { 0x00840, 0x00858, L }, { 0x00860, 0x0086A, L }, { 0x00870, 0x00887, L }, { 0x00889, 0x0088F, L },
+  { 0x008A0, 0x008C9, L }, { 0x00904, 0x00939, L }, { 0x0093D, 0x0093D, L }, { 0x00950, 0x00950, L },
+  { 0x00958, 0x00961, L }, { 0x00966, 0x0096F, N }, { 0x00971, 0x00980, L }, { 0x00985, 0x0098C, L },
+  { 0x0098F, 0x00990, L }, { 0x00993, 0x009A8, L }, { 0x009AA, 0x009B0, L }, { 0x009B2, 0x009B2, L },
+  { 0x009B6, 0x009B9, L }, { 0x009BD, 0x009BD, L }, { 0x009CE, 0x009CE, L }, { 0x009DC, 0x009DD, L },
+  { 0x009DF, 0x009E1, L }, { 0x009E6, 0x009EF, N }, { 0x009F0, 0x009F1, L }, { 0x009F4, 0x009F9, N },
+  { 0x009FC, 0x009FC, L }, { 0x00A05, 0x00A0A, L }, { 0x00A0F, 0x00A10, L }, { 0x00A13, 0x00A28, L },
+  { 0x00A2A, 0x00A30, L }, { 0x00A32, 0x00A33, L }, { 0x00A35, 0x00A36, L }, { 0x00A38, 0x00A39, L },
+  { 0x00A59, 0x00A5C, L }, { 0x00A5E, 0x00A5E, L }, { 0x00A66, 0x00A6F, N }, { 0x00A72, 0x00A74, L },
+  { 0x00A85, 0x00A8D, L }, { 0x00A8F, 0x00A91, L }, { 0x00A93, 0x00AA8, L }, { 0x00AAA, 0x00AB0, L },
+  { 0x00AB2, 0x00AB3, L }, { 0x00AB5, 0x00AB9, L }, { 0x00ABD, 0x00ABD, L }, { 0x00AD0, 0x00AD0, L },
+  { 0x00AE0, 0x00AE1, L }, { 0x00AE6, 0x00AEF, N }, { 0x00AF9, 0x00AF9, L }, { 0x00B05, 0x00B0C, L },
+  { 0x00B0F, 0x00B10, L }, { 0x00B13, 0x00B28, L }, { 0x00B2A, 0x00B30, L }, { 0x00B32, 0x00B33, L },
+  { 0x00B35, 0x00B39, L }, { 0x00B3D, 0x00B3D, L }, { 0x00B5C, 0x00B5D, L }, { 0x00B5F, 0x00B61, L },
+  { 0x00B66, 0x00B6F, N }, { 0x00B71, 0x00B71, L }, { 0x00B72, 0x00B77, N }, { 0x00B83, 0x00B83, L },
+  { 0x00B85, 0x00B8A, L }, { 0x00B8E, 0x00B90, L }, { 0x00B92, 0x00B95, L }, { 0x00B99, 0x00B9A, L },
+  { 0x00B9C, 0x00B9C, L }, { 0x00B9E, 0x00B9F, L }, { 0x00BA3, 0x00BA4, L }, { 0x00BA8, 0x00BAA, L },
+  { 0x00BAE, 0x00BB9, L }, { 0x00BD0, 0x00BD0, L }, { 0x00BE6, 0x00BF2, N }, { 0x00C05, 0x00C0C, L },
+  { 0x00C0E, 0x00C10, L }, { 0x00C12, 0x00C28, L }, { 0x00C2A, 0x00C39, L }, { 0x00C3D, 0x00C3D, L },
+  { 0x00C58, 0x00C5A, L }, { 0x00C5C, 0x00C5D, L }, { 0x00C60, 0x00C61, L }, { 0x00C66, 0x00C6F, N },
+  { 0x00C78, 0x00C7E, N }, { 0x00C80, 0x00C80, L }, { 0x00C85, 0x00C8C, L }, { 0x00C8E, 0x00C90, L },
+  { 0x00C92, 0x00CA8, L }, { 0x00CAA, 0x00CB3, L }, { 0x00CB5, 0x00CB9, L }, { 0x00CBD, 0x00CBD, L },
+  { 0x00CDC, 0x00CDE, L }, { 0x00CE0, 0x00CE1, L }, { 0x00CE6, 0x00CEF, N }, { 0x00CF1, 0x00CF2, L },
+  { 0x00D04, 0x00D0C, L }, { 0x00D0E, 0x00D10, L }, { 0x00D12, 0x00D3A, L }, { 0x00D3D, 0x00D3D, L },
+  { 0x00D4E, 0x00D4E, L }, { 0x00D54, 0x00D56, L }, { 0x00D58, 0x00D5E, N }, { 0x00D5F, 0x00D61, L },
+  { 0x00D66, 0x00D78, N }, { 0x00D7A, 0x00D7F, L }, { 0x00D85, 0x00D96, L }, { 0x00D9A, 0x00DB1, L },
+  { 0x00DB3, 0x00DBB, L }, { 0x00DBD, 0x00DBD, L }, { 0x00DC0, 0x00DC6, L }, { 0x00DE6, 0x00DEF, N },
+  { 0x00E01, 0x00E30, L }, { 0x00E32, 0x00E33, L }, { 0x00E40, 0x00E46, L }, { 0x00E50, 0x00E59, N },
+  { 0x00E81, 0x00E82, L }, { 0x00E84, 0x00E84, L }, { 0x00E86, 0x00E8A, L }, { 0x00E8C, 0x00EA3, L },
+  { 0x00EA5, 0x00EA5, L }, { 0x00EA7, 0x00EB0, L }, { 0x00EB2, 0x00EB3, L }, { 0x00EBD, 0x00EBD, L },
+  { 0x00EC0, 0x00EC4, L }, { 0x00EC6, 0x00EC6, L }, { 0x00ED0, 0x00ED9, N }, { 0x00EDC, 0x00EDF, L },
+  { 0x00F00, 0x00F00, L }, { 0x00F20, 0x00F33, N }, { 0x00F40, 0x00F47, L }, { 0x00F49, 0x00F6C, L },
+  { 0x00F88, 0x00F8C, L }, { 0x01000, 0x0102A, L }, { 0x0103F, 0x0103F, L }, { 0x01040, 0x01049, N },
+  { 0x01050, 0x01055, L }, { 0x0105A, 0x0105D, L }, { 0x01061, 0x01061, L }, { 0x01065, 0x01066, L },
+  { 0x0106E, 0x01070, L }, { 0x01075, 0x01081, L }, { 0x0108E, 0x0108E, L }, { 0x01090, 0x01099, N },
+  { 0x010A0, 0x010C5, L }, { 0x010C7, 0x010C7, L }, { 0x010CD, 0x010CD, L }, { 0x010D0, 0x010FA, L },
+  { 0x010FC, 0x01248, L }, { 0x0124A, 0x0124D, L }, { 0x01250, 0x01256, L }, { 0x01258, 0x01258, L },
+  { 0x0125A, 0x0125D, L }, { 0x01260, 0x01288, L }, { 0x0128A, 0x0128D, L }, { 0x01290, 0x012B0, L },
+  { 0x012B2, 0x012B5, L }, { 0x012B8, 0x012BE, L }, { 0x012C0, 0x012C0, L }, { 0x012C2, 0x012C5, L },
+  { 0x012C8, 0x012D6, L }, { 0x012D8, 0x01310, L }, { 0x01312, 0x01315, L }, { 0x01318, 0x0135A, L },
+  { 0x01369, 0x0137C, N }, { 0x01380, 0x0138F, L }, { 0x013A0, 0x013F5, L }, { 0x013F8, 0x013FD, L },
+  { 0x01401, 0x0166C, L }, { 0x0166F, 0x0167F, L }, { 0x01681, 0x0169A, L }, { 0x016A0, 0x016EA, L },
+  { 0x016EE, 0x016F0, N }, { 0x016F1, 0x016F8, L }, { 0x01700, 0x01711, L }, { 0x0171F, 0x01731, L },
+  { 0x01740, 0x01751, L }, { 0x01760, 0x0176C, L }, { 0x0176E, 0x01770, L }, { 0x01780, 0x017B3, L },
+  { 0x017D7, 0x017D7, L }, { 0x017DC, 0x017DC, L }, { 0x017E0, 0x017E9, N }, { 0x017F0, 0x017F9, N },
+  { 0x01810, 0x01819, N }, { 0x01820, 0x01878, L }, { 0x01880, 0x01884, L }, { 0x01887, 0x018A8, L },
+  { 0x018AA, 0x018AA, L }, { 0x018B0, 0x018F5, L }, { 0x01900, 0x0191E, L }, { 0x01946, 0x0194F, N },
+  { 0x01950, 0x0196D, L }, { 0x01970, 0x01974, L }, { 0x01980, 0x019AB, L }, { 0x019B0, 0x019C9, L },
+  { 0x019D0, 0x019DA, N }, { 0x01A00, 0x01A16, L }, { 0x01A20, 0x01A54, L }, { 0x01A80, 0x01A89, N },
+  { 0x01A90, 0x01A99, N }, { 0x01AA7, 0x01AA7, L }, { 0x01B05, 0x01B33, L }, { 0x01B45, 0x01B4C, L },
+  { 0x01B50, 0x01B59, N }, { 0x01B83, 0x01BA0, L }, { 0x01BAE, 0x01BAF, L }, { 0x01BB0, 0x01BB9, N },
+  { 0x01BBA, 0x01BE5, L }, { 0x01C00, 0x01C23, L }, { 0x01C40, 0x01C49, N }, { 0x01C4D, 0x01C4F, L },
+  { 0x01C50, 0x01C59, N }, { 0x01C5A, 0x01C7D, L }, { 0x01C80, 0x01C8A, L }, { 0x01C90, 0x01CBA, L },
+  { 0x01CBD, 0x01CBF, L }, { 0x01CE9, 0x01CEC, L }, { 0x01CEE, 0x01CF3, L }, { 0x01CF5, 0x01CF6, L },
+  { 0x01CFA, 0x01CFA, L }, { 0x01D00, 0x01DBF, L }, { 0x01E00, 0x01F15, L }, { 0x01F18, 0x01F1D, L },
+  { 0x01F20, 0x01F45, L }, { 0x01F48, 0x01F4D, L }, { 0x01F50, 0x01F57, L }, { 0x01F59, 0x01F59, L },
+  { 0x01F5B, 0x01F5B, L }, { 0x01F5D, 0x01F5D, L }, { 0x01F5F, 0x01F7D, L }, { 0x01F80, 0x01FB4, L },
+  { 0x01FB6, 0x01FBC, L }, { 0x01FBE, 0x01FBE, L }, { 0x01FC2, 0x01FC4, L }, { 0x01FC6, 0x01FCC, L },
+  { 0x01FD0, 0x01FD3, L }, { 0x01FD6, 0x01FDB, L }, { 0x01FE0, 0x01FEC, L }, { 0x01FF2, 0x01FF4, L },
+  { 0x01FF6, 0x01FFC, L }, { 0x02070, 0x02070, N }, { 0x02071, 0x02071, L }, { 0x02074, 0x02079, N },
+  { 0x0207F, 0x0207F, L }, { 0x02080, 0x02089, N }, { 0x0208F, 0x0209F, L }, { 0x02102, 0x02102, L },
+  { 0x02107, 0x02107, L }, { 0x0210A, 0x02113, L }, { 0x02115, 0x02115, L }, { 0x02119, 0x0211D, L },
+  { 0x02124, 0x02124, L }, { 0x02126, 0x02126, L }, { 0x02128, 0x02128, L }, { 0x0212A, 0x0212D, L },
+  { 0x0212F, 0x02139, L }, { 0x0213C, 0x0213F, L }, { 0x02145, 0x02149, L }, { 0x0214E, 0x0214E, L },
+  { 0x02150, 0x02182, N }, { 0x02183, 0x02184, L }, { 0x02185, 0x02189, N }, { 0x02460, 0x0249B, N },
+  { 0x024EA, 0x024FF, N }, { 0x02776, 0x02793, N }, { 0x02C00, 0x02CE4, L }, { 0x02CEB, 0x02CEE, L },
+  { 0x02CF2, 0x02CF3, L }, { 0x02CFD, 0x02CFD, N }, { 0x02D00, 0x02D25, L }, { 0x02D27, 0x02D27, L },
+  { 0x02D2D, 0x02D2D, L }, { 0x02D30, 0x02D67, L }, { 0x02D6F, 0x02D6F, L }, { 0x02D80, 0x02D96, L },
+  { 0x02DA0, 0x02DA6, L }, { 0x02DA8, 0x02DAE, L }, { 0x02DB0, 0x02DB6, L }, { 0x02DB8, 0x02DBE, L },
+  { 0x02DC0, 0x02DC6, L }, { 0x02DC8, 0x02DCE, L }, { 0x02DD0, 0x02DD6, L }, { 0x02DD8, 0x02DDE, L },
+  { 0x02E2F, 0x02E2F, L }, { 0x03005, 0x03006, L }, { 0x03007, 0x03007, N }, { 0x03021, 0x03029, N },
+  { 0x03031, 0x03035, L }, { 0x03038, 0x0303A, N }, { 0x0303B, 0x0303C, L }, { 0x03041, 0x03096, L },
+  { 0x0309D, 0x0309F, L }, { 0x030A1, 0x030FA, L }, { 0x030FC, 0x030FF, L }, { 0x03105, 0x0312F, L },
+  { 0x03131, 0x0318E, L }, { 0x03192, 0x03195, N }, { 0x031A0, 0x031BF, L }, { 0x031F0, 0x031FF, L },
+  { 0x03220, 0x03229, N }, { 0x03248, 0x0324F, N }, { 0x03251, 0x0325F, N }, { 0x03280, 0x03289, N },
+  { 0x032B1, 0x032BF, N }, { 0x03400, 0x04DBF, L }, { 0x04E00, 0x0A48C, L }, { 0x0A4D0, 0x0A4FD, L },
+  { 0x0A500, 0x0A60C, L }, { 0x0A610, 0x0A61F, L }, { 0x0A620, 0x0A629, N }, { 0x0A62A, 0x0A62B, L },
+  { 0x0A640, 0x0A66E, L }, { 0x0A67F, 0x0A69D, L }, { 0x0A6A0, 0x0A6E5, L }, { 0x0A6E6, 0x0A6EF, N },
+  { 0x0A717, 0x0A71F, L }, { 0x0A722, 0x0A788, L }, { 0x0A78B, 0x0A7DD, L }, { 0x0A7E2, 0x0A7E2, L },
+  { 0x0A7F1, 0x0A801, L }, { 0x0A803, 0x0A805, L }, { 0x0A807, 0x0A80A, L }, { 0x0A80C, 0x0A822, L },
+  { 0x0A830, 0x0A835, N }, { 0x0A840, 0x0A873, L }, { 0x0A882, 0x0A8B3, L }, { 0x0A8D0, 0x0A8D9, N },
+  { 0x0A8F2, 0x0A8F7, L }, { 0x0A8FB, 0x0A8FB, L }, { 0x0A8FD, 0x0A8FE, L }, { 0x0A900, 0x0A909, N },
+  { 0x0A90A, 0x0A925, L }, { 0x0A930, 0x0A946, L }, { 0x0A960, 0x0A97C, L }, { 0x0A984, 0x0A9B2, L },
+  { 0x0A9CF, 0x0A9CF, L }, { 0x0A9D0, 0x0A9D9, N }, { 0x0A9E0, 0x0A9E4, L }, { 0x0A9E6, 0x0A9EF, L },
+  { 0x0A9F0, 0x0A9F9, N }, { 0x0A9FA, 0x0A9FE, L }, { 0x0AA00, 0x0AA28, L }, { 0x0AA40, 0x0AA42, L },
+  { 0x0AA44, 0x0AA4B, L }, { 0x0AA50, 0x0AA59, N }, { 0x0AA60, 0x0AA76, L }, { 0x0AA7A, 0x0AA7A, L },
+  { 0x0AA7E, 0x0AAAF, L }, { 0x0AAB1, 0x0AAB1, L }, { 0x0AAB5, 0x0AAB6, L }, { 0x0AAB9, 0x0AABD, L },
+  { 0x0AAC0, 0x0AAC0, L }, { 0x0AAC2, 0x0AAC2, L }, { 0x0AADB, 0x0AADD, L }, { 0x0AAE0, 0x0AAEA, L },
+  { 0x0AAF2, 0x0AAF4, L }, { 0x0AB01, 0x0AB06, L }, { 0x0AB09, 0x0AB0E, L }, { 0x0AB11, 0x0AB16, L },
+  { 0x0AB20, 0x0AB26, L }, { 0x0AB28, 0x0AB2E, L }, { 0x0AB30, 0x0AB5A, L }, { 0x0AB5C, 0x0AB69, L },
+  { 0x0AB6C, 0x0AB6D, L }, { 0x0AB70, 0x0ABE2, L }, { 0x0ABF0, 0x0ABF9, N }, { 0x0AC00, 0x0D7A3, L },
+  { 0x0D7B0, 0x0D7C6, L }, { 0x0D7CB, 0x0D7FB, L }, { 0x0F900, 0x0FA6D, L }, { 0x0FA70, 0x0FAD9, L },
+  { 0x0FB00, 0x0FB06, L }, { 0x0FB13, 0x0FB17, L }, { 0x0FB1D, 0x0FB1D, L }, { 0x0FB1F, 0x0FB28, L },
+  { 0x0FB2A, 0x0FB36, L }, { 0x0FB38, 0x0FB3C, L }, { 0x0FB3E, 0x0FB3E, L }, { 0x0FB40, 0x0FB41, L },
+  { 0x0FB43, 0x0FB44, L }, { 0x0FB46, 0x0FBB1, L }, { 0x0FBD3, 0x0FD3D, L }, { 0x0FD50, 0x0FD8F, L },
+  { 0x0FD92, 0x0FDC7, L }, { 0x0FDF0, 0x0FDFB, L }, { 0x0FE70, 0x0FE74, L }, { 0x0FE76, 0x0FEFC, L },
+  { 0x0FF10, 0x0FF19, N }, { 0x0FF21, 0x0FF3A, L }, { 0x0FF41, 0x0FF5A, L }, { 0x0FF66, 0x0FFBE, L },
+  { 0x0FFC2, 0x0FFC7, L }, { 0x0FFCA, 0x0FFCF, L }, { 0x0FFD2, 0x0FFD7, L }, { 0x0FFDA, 0x0FFDC, L },
+  { 0x10000, 0x1000B, L }, { 0x1000D, 0x10026, L }, { 0x10028, 0x1003A, L }, { 0x1003C, 0x1003D, L },
+  { 0x1003F, 0x1004D, L }, { 0x10050, 0x1005D, L }, { 0x10080, 0x100FA, L }, { 0x10107, 0x10133, N },
+  { 0x10140, 0x10178, N }, { 0x1018A, 0x1018B, N }, { 0x10280, 0x1029C, L }, { 0x102A0, 0x102D0, L },
+  { 0x102E1, 0x102FB, N }, { 0x10300, 0x1031F, L }, { 0x10320, 0x10323, N }, { 0x1032D, 0x10340, L },
+  { 0x10341, 0x10341, N }, { 0x10342, 0x10349, L }, { 0x1034A, 0x1034A, N }, { 0x10350, 0x10375, L },
+  { 0x10380, 0x1039D, L }, { 0x103A0, 0x103C3, L }, { 0x103C8, 0x103CF, L }, { 0x103D1, 0x103D5, N },
+  { 0x10400, 0x1049D, L }, { 0x104A0, 0x104A9, N }, { 0x104B0, 0x104D3, L }, { 0x104D8, 0x104FB, L },
+  { 0x10500, 0x10527, L }, { 0x10530, 0x10563, L }, { 0x10570, 0x1057A, L }, { 0x1057C, 0x1058A, L },
+  { 0x1058C, 0x10592, L }, { 0x10594, 0x10595, L }, { 0x10597, 0x105A1, L }, { 0x105A3, 0x105B1, L },
+  { 0x105B3, 0x105B9, L }, { 0x105BB, 0x105BC, L }, { 0x105C0, 0x105F3, L }, { 0x10600, 0x10736, L },
+  { 0x10740, 0x10755, L }, { 0x10760, 0x10767, L }, { 0x10780, 0x10785, L }, { 0x10787, 0x107B0, L },
+  { 0x107B2, 0x107BF, L }, { 0x10800, 0x10805, L }, { 0x10808, 0x10808, L }, { 0x1080A, 0x10835, L },
+  { 0x10837, 0x10838, L }, { 0x1083C, 0x1083C, L }, { 0x1083F, 0x10855, L }, { 0x10858, 0x1085F, N },
+  { 0x10860, 0x10876, L }, { 0x10879, 0x1087F, N }, { 0x10880, 0x1089E, L }, { 0x108A7, 0x108AF, N },
+  { 0x108E0, 0x108F2, L }, { 0x108F4, 0x108F5, L }, { 0x108FB, 0x108FF, N }, { 0x10900, 0x10915, L },
+  { 0x10916, 0x1091B, N }, { 0x10920, 0x10939, L }, { 0x10940, 0x10959, L }, { 0x10980, 0x109B7, L },
+  { 0x109BC, 0x109BD, N }, { 0x109BE, 0x109BF, L }, { 0x109C0, 0x109CF, N }, { 0x109D2, 0x109FF, N },
+  { 0x10A00, 0x10A00, L }, { 0x10A10, 0x10A13, L }, { 0x10A15, 0x10A17, L }, { 0x10A19, 0x10A35, L },
+  { 0x10A40, 0x10A48, N }, { 0x10A60, 0x10A7C, L }, { 0x10A7D, 0x10A7E, N }, { 0x10A80, 0x10A9C, L },
+  { 0x10A9D, 0x10A9F, N }, { 0x10AC0, 0x10AC7, L }, { 0x10AC9, 0x10AE4, L }, { 0x10AEB, 0x10AEF, N },
+  { 0x10B00, 0x10B35, L }, { 0x10B40, 0x10B55, L }, { 0x10B58, 0x10B5F, N }, { 0x10B60, 0x10B72, L },
+  { 0x10B78, 0x10B7F, N }, { 0x10B80, 0x10B91, L }, { 0x10BA9, 0x10BAF, N }, { 0x10C00, 0x10C48, L },
+  { 0x10C80, 0x10CB2, L }, { 0x10CC0, 0x10CF2, L }, { 0x10CFA, 0x10CFF, N }, { 0x10D00, 0x10D23, L },
+  { 0x10D30, 0x10D39, N }, { 0x10D40, 0x10D49, N }, { 0x10D4A, 0x10D65, L }, { 0x10D6F, 0x10D85, L },
+  { 0x10E60, 0x10E7E, N }, { 0x10E80, 0x10EA9, L }, { 0x10EB0, 0x10EB1, L }, { 0x10EC2, 0x10EC7, L },
+  { 0x10ED9, 0x10EEE, L }, { 0x10F00, 0x10F1C, L }, { 0x10F1D, 0x10F26, N }, { 0x10F27, 0x10F27, L },
+  { 0x10F30, 0x10F45, L }, { 0x10F51, 0x10F54, N }, { 0x10F70, 0x10F81, L }, { 0x10FB0, 0x10FC4, L },
+  { 0x10FC5, 0x10FCB, N }, { 0x10FE0, 0x10FF6, L }, { 0x11003, 0x11037, L }, { 0x11052, 0x1106F, N },
+  { 0x11071, 0x11072, L }, { 0x11075, 0x11075, L }, { 0x11083, 0x110AF, L }, { 0x110D0, 0x110E8, L },
+  { 0x110F0, 0x110F9, N }, { 0x11103, 0x11126, L }, { 0x11136, 0x1113F, N }, { 0x11144, 0x11144, L },
+  { 0x11147, 0x11147, L }, { 0x11150, 0x11172, L }, { 0x11176, 0x11176, L }, { 0x11183, 0x111B2, L },
+  { 0x111C1, 0x111C4, L }, { 0x111D0, 0x111D9, N }, { 0x111DA, 0x111DA, L }, { 0x111DC, 0x111DC, L },
+  { 0x111E1, 0x111F4, N }, { 0x11200, 0x11211, L }, { 0x11213, 0x1122B, L }, { 0x1123F, 0x11240, L },
+  { 0x11280, 0x11286, L }, { 0x11288, 0x11288, L }, { 0x1128A, 0x1128D, L }, { 0x1128F, 0x1129D, L },
+  { 0x1129F, 0x112A8, L }, { 0x112B0, 0x112DE, L }, { 0x112F0, 0x112F9, N }, { 0x11305, 0x1130C, L },
+  { 0x1130F, 0x11310, L }, { 0x11313, 0x11328, L }, { 0x1132A, 0x11330, L }, { 0x11332, 0x11333, L },
+  { 0x11335, 0x11339, L }, { 0x1133D, 0x1133D, L }, { 0x11350, 0x11350, L }, { 0x1135D, 0x11361, L },
+  { 0x11380, 0x11389, L }, { 0x1138B, 0x1138B, L }, { 0x1138E, 0x1138E, L }, { 0x11390, 0x113B5, L },
+  { 0x113B7, 0x113B7, L }, { 0x113D1, 0x113D1, L }, { 0x113D3, 0x113D3, L }, { 0x11400, 0x11434, L },
+  { 0x11447, 0x1144A, L }, { 0x11450, 0x11459, N }, { 0x1145F, 0x11461, L }, { 0x11480, 0x114AF, L },
+  { 0x114C4, 0x114C5, L }, { 0x114C7, 0x114C7, L }, { 0x114D0, 0x114D9, N }, { 0x11580, 0x115AE, L },
+  { 0x115D8, 0x115DB, L }, { 0x11600, 0x1162F, L }, { 0x11644, 0x11644, L }, { 0x11650, 0x11659, N },
+  { 0x11680, 0x116AA, L }, { 0x116B8, 0x116B8, L }, { 0x116C0, 0x116C9, N }, { 0x116D0, 0x116E3, N },
+  { 0x11700, 0x1171A, L }, { 0x11730, 0x1173B, N }, { 0x11740, 0x11746, L }, { 0x11800, 0x1182B, L },
+  { 0x118A0, 0x118DF, L }, { 0x118E0, 0x118F2, N }, { 0x118FF, 0x11906, L }, { 0x11909, 0x11909, L },
+  { 0x1190C, 0x11913, L }, { 0x11915, 0x11916, L }, { 0x11918, 0x1192F, L }, { 0x1193F, 0x1193F, L },
+  { 0x11941, 0x11941, L }, { 0x11950, 0x11959, N }, { 0x119A0, 0x119A7, L }, { 0x119AA, 0x119D0, L },
+  { 0x119E1, 0x119E1, L }, { 0x119E3, 0x119E3, L }, { 0x11A00, 0x11A00, L }, { 0x11A0B, 0x11A32, L },
+  { 0x11A3A, 0x11A3A, L }, { 0x11A50, 0x11A50, L }, { 0x11A5C, 0x11A89, L }, { 0x11A9D, 0x11A9D, L },
+  { 0x11AB0, 0x11AF8, L }, { 0x11B0A, 0x11B0A, L }, { 0x11BC0, 0x11BE0, L }, { 0x11BF0, 0x11BF9, N },
+  { 0x11C00, 0x11C08, L }, { 0x11C0A, 0x11C2E, L }, { 0x11C40, 0x11C40, L }, { 0x11C50, 0x11C6C, N },
+  { 0x11C72, 0x11C8F, L }, { 0x11D00, 0x11D06, L }, { 0x11D08, 0x11D09, L }, { 0x11D0B, 0x11D30, L },
+  { 0x11D46, 0x11D46, L }, { 0x11D50, 0x11D59, N }, { 0x11D60, 0x11D65, L }, { 0x11D67, 0x11D68, L },
+  { 0x11D6A, 0x11D89, L }, { 0x11D98, 0x11D98, L }, { 0x11DA0, 0x11DA9, N }, { 0x11DB0, 0x11DDB, L },
+  { 0x11DE0, 0x11DE9, N }, { 0x11DF1, 0x11DF1, L }, { 0x11EE0, 0x11EF2, L }, { 0x11F02, 0x11F02, L },
+  { 0x11F04, 0x11F10, L }, { 0x11F12, 0x11F33, L }, { 0x11F50, 0x11F59, N }, { 0x11FB0, 0x11FB0, L },
+  { 0x11FC0, 0x11FD4, N }, { 0x12000, 0x12399, L }, { 0x12400, 0x1246F, N }, { 0x12475, 0x1247F, N },
+  { 0x12480, 0x12543, L }, { 0x12550, 0x12686, N }, { 0x12F90, 0x12FF0, L }, { 0x13000, 0x1342F, L },
+  { 0x13441, 0x13446, L }, { 0x13460, 0x143FA, L }, { 0x14400, 0x14646, L }, { 0x16100, 0x1611D, L },
+  { 0x16130, 0x16139, N }, { 0x16800, 0x16A38, L }, { 0x16A40, 0x16A5E, L }, { 0x16A60, 0x16A69, N },
+  { 0x16A70, 0x16ABE, L }, { 0x16AC0, 0x16AC9, N }, { 0x16AD0, 0x16AED, L }, { 0x16B00, 0x16B2F, L },
+  { 0x16B40, 0x16B43, L }, { 0x16B50, 0x16B59, N }, { 0x16B5B, 0x16B61, N }, { 0x16B63, 0x16B77, L },
+  { 0x16B7D, 0x16B8F, L }, { 0x16D40, 0x16D6C, L }, { 0x16D70, 0x16D79, N }, { 0x16E40, 0x16E7F, L },
+  { 0x16E80, 0x16E96, N }, { 0x16EA0, 0x16EB8, L }, { 0x16EBB, 0x16ED3, L }, { 0x16F00, 0x16F4A, L },
+  { 0x16F50, 0x16F50, L }, { 0x16F93, 0x16F9F, L }, { 0x16FE0, 0x16FE1, L }, { 0x16FE3, 0x16FE3, L },
+  { 0x16FF2, 0x16FF3, L }, { 0x16FF4, 0x16FF6, N }, { 0x17000, 0x18CDA, L }, { 0x18CFF, 0x18D20, L },
+  { 0x18D80, 0x18DF2, L }, { 0x18E00, 0x19191, L }, { 0x191A0, 0x191D2, L }, { 0x1AFF0, 0x1AFF3, L },
+  { 0x1AFF5, 0x1AFFB, L }, { 0x1AFFD, 0x1AFFE, L }, { 0x1B000, 0x1B128, L }, { 0x1B132, 0x1B132, L },
+  { 0x1B150, 0x1B152, L }, { 0x1B155, 0x1B155, L }, { 0x1B164, 0x1B168, L }, { 0x1B170, 0x1B2FB, L },
+  { 0x1BC00, 0x1BC6A, L }, { 0x1BC70, 0x1BC7C, L }, { 0x1BC80, 0x1BC88, L }, { 0x1BC90, 0x1BC99, L },
+  { 0x1CCF0, 0x1CCF9, N }, { 0x1D2C0, 0x1D2D3, N }, { 0x1D2E0, 0x1D2F3, N }, { 0x1D360, 0x1D378, N },
+  { 0x1D400, 0x1D454, L }, { 0x1D456, 0x1D49C, L }, { 0x1D49E, 0x1D49F, L }, { 0x1D4A2, 0x1D4A2, L },
+  { 0x1D4A5, 0x1D4A6, L }, { 0x1D4A9, 0x1D4AC, L }, { 0x1D4AE, 0x1D4B9, L }, { 0x1D4BB, 0x1D4BB, L },
+  { 0x1D4BD, 0x1D4C3, L }, { 0x1D4C5, 0x1D505, L }, { 0x1D507, 0x1D50A, L }, { 0x1D50D, 0x1D514, L },
+  { 0x1D516, 0x1D51C, L }, { 0x1D51E, 0x1D539, L }, { 0x1D53B, 0x1D53E, L }, { 0x1D540, 0x1D544, L },
+  { 0x1D546, 0x1D546, L }, { 0x1D54A, 0x1D550, L }, { 0x1D552, 0x1D6A6, L }, { 0x1D6A8, 0x1D6C0, L },
+  { 0x1D6C2, 0x1D6DA, L }, { 0x1D6DC, 0x1D6FA, L }, { 0x1D6FC, 0x1D714, L }, { 0x1D716, 0x1D734, L },
+  { 0x1D736, 0x1D74E, L }, { 0x1D750, 0x1D76E, L }, { 0x1D770, 0x1D788, L }, { 0x1D78A, 0x1D7A8, L },
+  { 0x1D7AA, 0x1D7C2, L }, { 0x1D7C4, 0x1D7CB, L }, { 0x1D7CE, 0x1D7FF, N }, { 0x1DF00, 0x1DF81, L },
+  { 0x1DF90, 0x1DF96, L }, { 0x1DFCD, 0x1DFFF, L }, { 0x1E030, 0x1E06D, L }, { 0x1E100, 0x1E12C, L },
+  { 0x1E137, 0x1E13D, L }, { 0x1E140, 0x1E149, N }, { 0x1E14E, 0x1E14E, L }, { 0x1E290, 0x1E2AD, L },
+  { 0x1E2C0, 0x1E2EB, L }, { 0x1E2F0, 0x1E2F9, N }, { 0x1E4D0, 0x1E4EB, L }, { 0x1E4F0, 0x1E4F9, N },
+  { 0x1E5D0, 0x1E5ED, L }, { 0x1E5F0, 0x1E5F0, L }, { 0x1E5F1, 0x1E5FA, N }, { 0x1E6C0, 0x1E6DE, L },
+  { 0x1E6E0, 0x1E6E2, L }, { 0x1E6E4, 0x1E6E5, L }, { 0x1E6E7, 0x1E6ED, L }, { 0x1E6F0, 0x1E6F4, L },
+  { 0x1E6FE, 0x1E6FF, L }, { 0x1E7E0, 0x1E7E6, L }, { 0x1E7E8, 0x1E7EB, L }, { 0x1E7ED, 0x1E7EE, L },
+  { 0x1E7F0, 0x1E7FE, L }, { 0x1E800, 0x1E8C4, L }, { 0x1E8C7, 0x1E8CF, N }, { 0x1E900, 0x1E943, L },
+  { 0x1E94B, 0x1E94B, L }, { 0x1E950, 0x1E959, N }, { 0x1EC71, 0x1ECAB, N }, { 0x1ECAD, 0x1ECAF, N },
+  { 0x1ECB1, 0x1ECB4, N }, { 0x1ED01, 0x1ED2D, N }, { 0x1ED2F, 0x1ED3D, N }, { 0x1EE00, 0x1EE03, L },
+  { 0x1EE05, 0x1EE1F, L }, { 0x1EE21, 0x1EE22, L }, { 0x1EE24, 0x1EE24, L }, { 0x1EE27, 0x1EE27, L },
+  { 0x1EE29, 0x1EE32, L }, { 0x1EE34, 0x1EE37, L }, { 0x1EE39, 0x1EE39, L }, { 0x1EE3B, 0x1EE3B, L },
+  { 0x1EE42, 0x1EE42, L }, { 0x1EE47, 0x1EE47, L }, { 0x1EE49, 0x1EE49, L }, { 0x1EE4B, 0x1EE4B, L },
+  { 0x1EE4D, 0x1EE4F, L }, { 0x1EE51, 0x1EE52, L }, { 0x1EE54, 0x1EE54, L }, { 0x1EE57, 0x1EE57, L },
+  { 0x1EE59, 0x1EE59, L }, { 0x1EE5B, 0x1EE5B, L }, { 0x1EE5D, 0x1EE5D, L }, { 0x1EE5F, 0x1EE5F, L },
+  { 0x1EE61, 0x1EE62, L }, { 0x1EE64, 0x1EE64, L }, { 0x1EE67, 0x1EE6A, L }, { 0x1EE6C, 0x1EE72, L },
+  { 0x1EE74, 0x1EE77, L }, { 0x1EE79, 0x1EE7C, L }, { 0x1EE7E, 0x1EE7E, L }, { 0x1EE80, 0x1EE89, L },
+  { 0x1EE8B, 0x1EE9B, L }, { 0x1EEA1, 0x1EEA3, L }, { 0x1EEA5, 0x1EEA9, L }, { 0x1EEAB, 0x1EEBB, L },
+  { 0x1F100, 0x1F10C, N }, { 0x1FBF0, 0x1FBF9, N }, { 0x20000, 0x2A6DF, L }, { 0x2A700, 0x2B81E, L },
+  { 0x2B820, 0x2CEAD, L }, { 0x2CEB0, 0x2EBE0, L }, { 0x2EBF0, 0x2EE5D, L }, { 0x2F800, 0x2FA1D, L },
+  { 0x30000, 0x3134A, L }, { 0x31350, 0x33479, L }, { 0x3D000, 0x3FC3F, L },
+};
+
+#undef L
+#undef N
@@ -0,0 +1,112 @@
+// usage:
+//  client_bench <base url> [requests] [ca file]
+//
+// Measures the per-request cost of aichat_session_extend when every request
+// uses a fresh client (full DNS, TCP and TLS handshake) against a single
+// long-lived client that keeps its connection warm. Run it against the mock
+// server, for example:
+//
+//  openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -keyout key.pem -out cert.pem
+//  bench/mock_server --port=8443 --cert=cert.pem --key=key.pem &
+//  bench/client_bench https://localhost:8443/v1 200 cert.pem
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aichat.h"
+
+static double
+client_bench_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static struct aichat_client *
+client_bench_client_or_die (const char *base_url, const char *ca_file)
+{
+  struct aichat_client *client = aichat_client_initialize ();
+
+  if (client == NULL || aichat_client_set_base_url (client, base_url) < 0 || aichat_client_set_ca_file (client, ca_file) < 0)
+  {
+    fprintf (stderr, "client_bench: cannot create client\n");
+    exit (1);
+  }
+
+  return client;
+}
+
+static void
+client_bench_extend_or_die (struct aichat_session *session, struct aichat_client *client)
+{
+  struct aichat_api_call_results results;
+
+  session->client = client;
+
+  int error = aichat_session_extend (session, &results);
+
+  if (error < 0)
+  {
+    fprintf (stderr, "client_bench: %s\n", aichat_strerror (error));
+    exit (1);
+  }
+
+  // drop the response so the request body stays the same size every time
+  aichat_session_remove_last_message (session);
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf (stderr, "usage: %s <base url> [requests] [ca file]\n", argv [0]);
+    return 1;
+  }
+
+  const char *base_url = argv [1];
+  int requests = argc > 2 ? atoi (argv [2]) : 100;
+  const char *ca_file = argc > 3 ? argv [3] : NULL;
+
+  struct aichat_session session;
+  aichat_session_initialize (&session);
+  aichat_session_add_message (&session, AICHAT_ROLE_SYSTEM, "You are a benchmark.");
+  aichat_session_add_message (&session, AICHAT_ROLE_USER, "Say something short.");
+
+  double start = client_bench_now ();
+
+  for (int i = 0; i < requests; i++)
+  {
+    struct aichat_client *client = client_bench_client_or_die (base_url, ca_file);
+    client_bench_extend_or_die (&session, client);
+    aichat_client_free (client);
+  }
+
+  double cold = (client_bench_now () - start) / requests;
+
+  struct aichat_client *client = client_bench_client_or_die (base_url, ca_file);
+
+  // the first request opens the connection and is not part of the measurement
+  client_bench_extend_or_die (&session, client);
+
+  start = client_bench_now ();
+
+  for (int i = 0; i < requests; i++)
+    client_bench_extend_or_die (&session, client);
+
+  double warm = (client_bench_now () - start) / requests;
+
+  aichat_client_free (client);
+  aichat_session_free (&session);
+
+  printf ("requests:            %d\n", requests);
+  printf ("fresh client:        %8.3f ms/request\n", cold * 1e3);
+  printf ("long-lived client:   %8.3f ms/request\n", warm * 1e3);
+  printf ("saved per request:   %8.3f ms (%.1fx)\n", (cold - warm) * 1e3, cold / warm);
+
+  return 0;
+}
@@ -0,0 +1,164 @@
+// usage:
+//  load_bench [directory]
+//
+// Compares the time it takes to load session files of 10 KB, 1 MB and 50 MB
+// with aichat_session_initialize_from_json_file against the previous loader,
+// which copied the file one fgetc at a time into a memory stream, parsed it
+// with json-c and then copied every message into the session. The session
+// files are written to <directory> (default /tmp) and removed afterwards.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <json-c/json.h>
+
+#include "aichat.h"
+
+static const char *load_bench_texts [] = {
+  "Sure! Here is how you can reverse a linked list in C:\n\n```c\nstruct node *reverse (struct node *head)\n{\n\tstruct node *previous = NULL;\n\twhile (head)\n\t{\n\t\tstruct node *next = head->next;\n\t\thead->next = previous;\n\t\tprevious = head;\n\t\thead = next;\n\t}\n\treturn previous;\n}\n```\n\nThe function walks the list once and flips every \"next\" pointer.",
+  "The café on the corner serves the best crème brûlée in town \xe2\x80\x94 although the queue at lunchtime can be long. Most people agree that it is worth the wait, and the staff are friendly.",
+  "Can you explain what the path /usr/local/bin is used for and why it comes before /usr/bin in my $PATH?",
+};
+
+static double
+load_bench_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int
+load_bench_previous_loader (struct aichat_session *session, FILE *file)
+{
+  aichat_session_initialize (session);
+
+  char *buffer = NULL;
+  size_t current_size = 0;
+  FILE *buffer_file = open_memstream (&buffer, &current_size);
+
+  int c;
+  while ((c = fgetc (file)) != EOF)
+    fputc (c, buffer_file);
+
+  fflush (buffer_file);
+
+  json_object *object = json_tokener_parse (buffer);
+  fclose (buffer_file); free (buffer);
+
+  if (object == NULL)
+    return -AICHAT_ERROR_JSON_PARSE;
+
+  json_object *messages = json_object_object_get (object, "messages");
+  int message_count = json_object_array_length (messages);
+
+  for (int i = 0; i < message_count; i++)
+  {
+    json_object *message = json_object_array_get_idx (messages, i);
+    const char *role = json_object_get_string (json_object_object_get (message, "role"));
+    const char *content = json_object_get_string (json_object_object_get (message, "content"));
+
+    enum aichat_role role_enum = strcmp (role, "user") == 0 ? AICHAT_ROLE_USER : strcmp (role, "system") == 0 ? AICHAT_ROLE_SYSTEM : AICHAT_ROLE_ASSISTANT;
+    aichat_session_add_message (session, role_enum, content);
+  }
+
+  json_object_put (object);
+  return 0;
+}
+
+static double
+load_bench_time (const char *path, int (*loader) (struct aichat_session *, FILE *), int repetitions, unsigned int *message_count)
+{
+  double best = 1e9;
+
+  for (int i = 0; i < repetitions; i++)
+  {
+    struct aichat_session session;
+    FILE *file = fopen (path, "r");
+
+    double start = load_bench_now ();
+    int result = loader (&session, file);
+    double elapsed = load_bench_now () - start;
+
+    fclose (file);
+
+    if (result < 0)
+    {
+      fprintf (stderr, "load_bench: cannot load '%s': %s\n", path, aichat_strerror (result));
+      exit (1);
+    }
+
+    *message_count = session.message_count;
+    aichat_session_free (&session);
+
+    if (elapsed < best)
+      best = elapsed;
+  }
+
+  return best;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *directory = argc > 1 ? argv [1] : "/tmp";
+  const unsigned long int sizes [] = { 10 * 1000, 1000 * 1000, 50 * 1000 * 1000 };
+  const char *labels [] = { "10 KB", "1 MB", "50 MB" };
+
+  printf ("%-8s %10s %14s %14s %8s\n", "size", "messages", "previous (ms)", "mmap (ms)", "speedup");
+
+  for (unsigned int i = 0; i < sizeof (sizes) / sizeof (sizes [0]); i++)
+  {
+    struct aichat_session session;
+    aichat_session_initialize (&session);
+
+    unsigned long int total = 0;
+
+    for (unsigned int j = 0; total < sizes [i]; j++)
+    {
+      const char *text = load_bench_texts [j % 3];
+      aichat_session_add_message (&session, j == 0 ? AICHAT_ROLE_SYSTEM : j % 2 ? AICHAT_ROLE_USER : AICHAT_ROLE_ASSISTANT, text);
+      total += strlen (text) + 40;
+    }
+
+    char *path = NULL;
+
+    if (asprintf (&path, "%s/load_bench_%u.json", directory, i) < 0)
+      return 1;
+
+    FILE *file = fopen (path, "w");
+
+    if (file == NULL)
+    {
+      fprintf (stderr, "load_bench: cannot create '%s'\n", path);
+      return 1;
+    }
+
+    aichat_session_write_to_json_file (&session, file);
+    fclose (file);
+    aichat_session_free (&session);
+
+    int repetitions = sizes [i] > 10000000 ? 3 : 20;
+    unsigned int previous_count = 0, mmap_count = 0;
+
+    double previous = load_bench_time (path, load_bench_previous_loader, repetitions, &previous_count);
+    double mapped = load_bench_time (path, aichat_session_initialize_from_json_file, repetitions, &mmap_count);
+
+    if (previous_count != mmap_count)
+    {
+      fprintf (stderr, "load_bench: loaders disagree on '%s'\n", path);
+      return 1;
+    }
+
+    printf ("%-8s %10u %14.3f %14.3f %7.1fx\n", labels [i], mmap_count, previous * 1e3, mapped * 1e3, previous / mapped);
+
+    remove (path);
+    free (path);
+  }
+
+  return 0;
+}
@@ -0,0 +1,419 @@
+// usage:
+//  mock_server [--port=<port>] [--cert=<certificate file> --key=<key file>]
+//              [--latency=<milliseconds>] [--tokens=<count>] [--token-rate=<tokens per second>]
+//              [--fail=<fraction>] [--fail-status=<code>] [--retry-after=<milliseconds>]
+//
+// A minimal stand-in for the chat completion endpoint used to benchmark libaichat
+// without the network. It answers every POST with a completion of the given
+// number of tokens (default 6) and keeps connections alive so that clients which
+// reuse connections can be told apart from clients which do not. Each connection
+// is served by its own process.
+//
+// The first byte of a response is sent after the latency (default 0), the tokens
+// then follow at the token rate (default unlimited). Requests with "stream":true
+// are answered with server-sent events, one chunk per token and a final chunk
+// with the usage, so that the time to the first token and the time to the last
+// token can be measured separately. Point chatty at the server with
+// CHATTY_BASE_URL=http://127.0.0.1:<port>/v1.
+//
+// A random fraction of the requests (default none) fails with the given status
+// (default 429) and an error body, telling the client to come back after the
+// retry-after time (default 100 milliseconds) through retry-after-ms and the
+// x-ratelimit headers, so that retries and pacing can be exercised.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define MOCK_SERVER_REQUEST_SIZE (1 << 20)
+
+// every successful response claims plenty of room under the rate limit
+#define MOCK_SERVER_RATE_LIMIT_HEADERS "x-ratelimit-limit-requests: 10000\r\nx-ratelimit-remaining-requests: 9999\r\nx-ratelimit-reset-requests: 6ms\r\n"
+
+// the completion cycles through these pieces, six tokens read "This is a mock response."
+static const char *mock_server_pieces [] = { "This", " is", " a", " mock", " response", "." };
+
+static long int mock_server_latency = 0;
+static long int mock_server_tokens = 6;
+static double mock_server_token_rate = 0;
+static double mock_server_fail = 0;
+static long int mock_server_fail_status = 429;
+static long int mock_server_retry_after = 100;
+
+struct
+mock_server_connection
+{
+  int fd;
+  SSL *ssl;
+};
+
+static long int
+mock_server_read (struct mock_server_connection *connection, char *buffer, unsigned long int size)
+{
+  if (connection->ssl)
+    return SSL_read (connection->ssl, buffer, size);
+
+  return read (connection->fd, buffer, size);
+}
+
+static bool
+mock_server_write (struct mock_server_connection *connection, const char *buffer, unsigned long int size)
+{
+  while (size > 0)
+  {
+    long int written = connection->ssl ? SSL_write (connection->ssl, buffer, size) : write (connection->fd, buffer, size);
+
+    if (written <= 0)
+      return false;
+
+    buffer += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+static void
+mock_server_sleep (double seconds)
+{
+  if (seconds <= 0)
+    return;
+
+  struct timespec duration = { .tv_sec = (time_t) seconds, .tv_nsec = (long int) ((seconds - (time_t) seconds) * 1e9) };
+
+  while (nanosleep (&duration, &duration) < 0 && errno == EINTR);
+}
+
+static char *
+mock_server_content (void)
+{
+  char *content = malloc (16 * mock_server_tokens + 1);
+
+  if (content == NULL)
+    return NULL;
+
+  content[0] = '\0';
+
+  for (long int i = 0; i < mock_server_tokens; i++)
+    strcat (content, mock_server_pieces [i % 6]);
+
+  return content;
+}
+
+static char *
+mock_server_completion (void)
+{
+  char *content = mock_server_content ();
+  char *completion = NULL;
+
+  if (content == NULL)
+    return NULL;
+
+  if (asprintf (&completion,
+                "{\"id\":\"chatcmpl-mock\",\"object\":\"chat.completion\",\"model\":\"gpt-3.5-turbo\","
+                "\"choices\":[{\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":\"%s\"},\"finish_reason\":\"stop\"}],"
+                "\"usage\":{\"prompt_tokens\":10,\"completion_tokens\":%ld,\"total_tokens\":%ld}}",
+                content, mock_server_tokens, 10 + mock_server_tokens) < 0)
+    completion = NULL;
+
+  free (content);
+  return completion;
+}
+
+// writes one server-sent event as a chunk of a chunked response
+static bool
+mock_server_write_event (struct mock_server_connection *connection, const char *data)
+{
+  char header [32];
+  unsigned long int size = strlen ("data: ") + strlen (data) + strlen ("\n\n");
+  int header_size = snprintf (header, sizeof (header), "%lx\r\n", size);
+
+  return mock_server_write (connection, header, header_size) &&
+         mock_server_write (connection, "data: ", strlen ("data: ")) &&
+         mock_server_write (connection, data, strlen (data)) &&
+         mock_server_write (connection, "\n\n\r\n", strlen ("\n\n\r\n"));
+}
+
+static bool
+mock_server_stream (struct mock_server_connection *connection)
+{
+  const char header [] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\n" MOCK_SERVER_RATE_LIMIT_HEADERS "\r\n";
+
+  if (mock_server_write (connection, header, strlen (header)) == false)
+    return false;
+
+  char event [256];
+
+  for (long int i = 0; i < mock_server_tokens; i++)
+  {
+    if (i > 0 && mock_server_token_rate > 0)
+      mock_server_sleep (1 / mock_server_token_rate);
+
+    snprintf (event, sizeof (event),
+              "{\"id\":\"chatcmpl-mock\",\"object\":\"chat.completion.chunk\",\"choices\":[{\"index\":0,\"delta\":{%s\"content\":\"%s\"},\"finish_reason\":null}]}",
+              i == 0 ? "\"role\":\"assistant\"," : "", mock_server_pieces [i % 6]);
+
+    if (mock_server_write_event (connection, event) == false)
+      return false;
+  }
+
+  snprintf (event, sizeof (event),
+            "{\"id\":\"chatcmpl-mock\",\"object\":\"chat.completion.chunk\",\"choices\":[],"
+            "\"usage\":{\"prompt_tokens\":10,\"completion_tokens\":%ld,\"total_tokens\":%ld}}",
+            mock_server_tokens, 10 + mock_server_tokens);
+
+  return mock_server_write_event (connection, event) &&
+         mock_server_write_event (connection, "[DONE]") &&
+         mock_server_write (connection, "0\r\n\r\n", strlen ("0\r\n\r\n"));
+}
+
+static bool
+mock_server_fail_request (struct mock_server_connection *connection)
+{
+  const char *body = mock_server_fail_status == 429
+    ? "{\"error\":{\"message\":\"Rate limit reached for requests\",\"type\":\"requests\",\"code\":\"rate_limit_exceeded\"}}"
+    : "{\"error\":{\"message\":\"The server had an error while processing your request\",\"type\":\"server_error\",\"code\":null}}";
+
+  char header [512];
+  int header_size = snprintf (header, sizeof (header),
+                              "HTTP/1.1 %ld Mock Failure\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+                              "retry-after-ms: %ld\r\nretry-after: %ld\r\n"
+                              "x-ratelimit-limit-requests: 10000\r\nx-ratelimit-remaining-requests: 0\r\nx-ratelimit-reset-requests: %ldms\r\n\r\n",
+                              mock_server_fail_status, strlen (body), mock_server_retry_after, (mock_server_retry_after + 999) / 1000, mock_server_retry_after);
+
+  return mock_server_write (connection, header, header_size) && mock_server_write (connection, body, strlen (body));
+}
+
+// reads one request and answers it, returns false once the connection should be closed
+static bool
+mock_server_handle_request (struct mock_server_connection *connection, char *buffer)
+{
+  unsigned long int length = 0;
+  char *header_end = NULL;
+
+  while ((header_end = strstr (buffer, "\r\n\r\n")) == NULL)
+  {
+    if (length >= MOCK_SERVER_REQUEST_SIZE - 1)
+      return false;
+
+    long int received = mock_server_read (connection, buffer + length, MOCK_SERVER_REQUEST_SIZE - 1 - length);
+
+    if (received <= 0)
+      return false;
+
+    length += received;
+    buffer[length] = '\0';
+  }
+
+  unsigned long int content_length = 0;
+  char *content_length_header = strcasestr (buffer, "\r\nContent-Length:");
+
+  if (content_length_header)
+    content_length = strtoul (content_length_header + strlen ("\r\nContent-Length:"), NULL, 10);
+
+  unsigned long int header_length = header_end + 4 - buffer;
+
+  if (header_length + content_length >= MOCK_SERVER_REQUEST_SIZE)
+    return false;
+
+  while (length < header_length + content_length)
+  {
+    long int received = mock_server_read (connection, buffer + length, header_length + content_length - length);
+
+    if (received <= 0)
+      return false;
+
+    length += received;
+  }
+
+  buffer[length] = '\0';
+  bool stream = strstr (buffer + header_length, "\"stream\":true") != NULL;
+
+  mock_server_sleep (mock_server_latency / 1000.0);
+
+  if (mock_server_fail > 0 && drand48 () < mock_server_fail)
+  {
+    if (mock_server_fail_request (connection) == false)
+      return false;
+  }
+  else if (stream)
+  {
+    if (mock_server_stream (connection) == false)
+      return false;
+  }
+  else
+  {
+    char *completion = mock_server_completion ();
+
+    if (completion == NULL)
+      return false;
+
+    // a buffered response is only complete once every token has been generated
+    if (mock_server_token_rate > 0)
+      mock_server_sleep (mock_server_tokens / mock_server_token_rate);
+
+    char header [256];
+    int header_size = snprintf (header, sizeof (header), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n" MOCK_SERVER_RATE_LIMIT_HEADERS "\r\n", strlen (completion));
+
+    bool written = mock_server_write (connection, header, header_size) && mock_server_write (connection, completion, strlen (completion));
+    free (completion);
+
+    if (written == false)
+      return false;
+  }
+
+  // pipelined requests are not supported, anything past this request is dropped
+  buffer[0] = '\0';
+  return true;
+}
+
+static void
+mock_server_serve (int fd, SSL_CTX *context)
+{
+  struct mock_server_connection connection = { .fd = fd, .ssl = NULL };
+
+  int one = 1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  if (context)
+  {
+    connection.ssl = SSL_new (context);
+    SSL_set_fd (connection.ssl, fd);
+
+    if (SSL_accept (connection.ssl) <= 0)
+    {
+      SSL_free (connection.ssl);
+      return;
+    }
+  }
+
+  char *buffer = malloc (MOCK_SERVER_REQUEST_SIZE);
+
+  if (buffer)
+  {
+    buffer[0] = '\0';
+    while (mock_server_handle_request (&connection, buffer));
+  }
+
+  free (buffer);
+
+  if (connection.ssl)
+  {
+    SSL_shutdown (connection.ssl);
+    SSL_free (connection.ssl);
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  int port = 8443;
+  const char *certificate = NULL;
+  const char *key = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp (argv [i], "--port=", 7) == 0)      port = atoi (argv [i] + 7);
+    else if (strncmp (argv [i], "--cert=", 7) == 0) certificate = argv [i] + 7;
+    else if (strncmp (argv [i], "--key=", 6) == 0)  key = argv [i] + 6;
+    else if (strncmp (argv [i], "--latency=", 10) == 0)    mock_server_latency = atol (argv [i] + 10);
+    else if (strncmp (argv [i], "--tokens=", 9) == 0)      mock_server_tokens = atol (argv [i] + 9);
+    else if (strncmp (argv [i], "--token-rate=", 13) == 0) mock_server_token_rate = atof (argv [i] + 13);
+    else if (strncmp (argv [i], "--fail=", 7) == 0)         mock_server_fail = atof (argv [i] + 7);
+    else if (strncmp (argv [i], "--fail-status=", 14) == 0) mock_server_fail_status = atol (argv [i] + 14);
+    else if (strncmp (argv [i], "--retry-after=", 14) == 0) mock_server_retry_after = atol (argv [i] + 14);
+    else
+    {
+      fprintf (stderr, "%s: error: unknown argument: %s\n", argv [0], argv [i]);
+      return 1;
+    }
+  }
+
+  if (mock_server_latency < 0 || mock_server_tokens < 1 || mock_server_token_rate < 0)
+  {
+    fprintf (stderr, "%s: error: --latency, --tokens and --token-rate must not be negative and there must be a token\n", argv [0]);
+    return 1;
+  }
+
+  if (mock_server_fail < 0 || mock_server_fail > 1 || mock_server_fail_status < 400 || mock_server_fail_status > 599 || mock_server_retry_after < 0)
+  {
+    fprintf (stderr, "%s: error: --fail must be between 0 and 1, --fail-status an error status and --retry-after not negative\n", argv [0]);
+    return 1;
+  }
+
+  if ((certificate == NULL) != (key == NULL))
+  {
+    fprintf (stderr, "%s: error: --cert and --key must be given together\n", argv [0]);
+    return 1;
+  }
+
+  SSL_CTX *context = NULL;
+
+  if (certificate)
+  {
+    context = SSL_CTX_new (TLS_server_method ());
+
+    if (context == NULL || SSL_CTX_use_certificate_chain_file (context, certificate) <= 0 || SSL_CTX_use_PrivateKey_file (context, key, SSL_FILETYPE_PEM) <= 0)
+    {
+      ERR_print_errors_fp (stderr);
+      return 1;
+    }
+  }
+
+  int listener = socket (AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons (port), .sin_addr.s_addr = htonl (INADDR_LOOPBACK) };
+
+  if (bind (listener, (struct sockaddr *) &address, sizeof (address)) < 0 || listen (listener, 128) < 0)
+  {
+    fprintf (stderr, "%s: cannot listen on port %d: %s\n", argv [0], port, strerror (errno));
+    return 1;
+  }
+
+  // connection handlers are never waited for
+  signal (SIGCHLD, SIG_IGN);
+
+  fprintf (stderr, "%s: listening on %s://127.0.0.1:%d/v1\n", argv [0], context ? "https" : "http", port);
+
+  while (true)
+  {
+    int fd = accept (listener, NULL, NULL);
+
+    if (fd < 0)
+    {
+      if (errno == EINTR) continue;
+      fprintf (stderr, "%s: accept: %s\n", argv [0], strerror (errno));
+      return 1;
+    }
+
+    pid_t pid = fork ();
+
+    if (pid == 0)
+    {
+      close (listener);
+      srand48 (getpid () ^ time (NULL));
+      mock_server_serve (fd, context);
+      close (fd);
+      _exit (0);
+    }
+
+    close (fd);
+  }
+}
@@ -0,0 +1,152 @@
+// usage:
+//  search_bench [sessions] [messages per session]
+//
+// Measures --search on a generated set of sessions, 2000 sessions of 50 messages by default. The sessions
+// are written to a temporary $XDG_DATA_HOME, the first search builds the index and is timed on its own,
+// then a few queries with rare and common words are timed warm. Results are printed to /dev/null.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aichat.h"
+#include "chatty_index.h"
+#include "chatty_methods.h"
+
+#define SEARCH_BENCH_VOCABULARY 20000
+#define SEARCH_BENCH_ROUNDS 20
+
+static double
+search_bench_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// words with a skewed distribution, so that some are in most messages and most are rare
+static void
+search_bench_word (unsigned int *seed, char *word)
+{
+  unsigned int rank = rand_r (seed) % SEARCH_BENCH_VOCABULARY;
+
+  rank = rank * (rand_r (seed) % SEARCH_BENCH_VOCABULARY) / SEARCH_BENCH_VOCABULARY;
+  sprintf (word, "w%u", rank);
+}
+
+static void
+search_bench_write_sessions (const char *directory, unsigned int session_count, unsigned int message_count)
+{
+  unsigned int seed = 1;
+  char *text = malloc (4096);
+
+  for (unsigned int s = 0; s < session_count; s++)
+  {
+    struct aichat_session session;
+    aichat_session_initialize (&session);
+    aichat_session_add_message (&session, AICHAT_ROLE_SYSTEM, "You are a helpful assistant.");
+
+    for (unsigned int m = 1; m < message_count; m++)
+    {
+      unsigned int words = 20 + rand_r (&seed) % 100;
+      char *end = text;
+
+      for (unsigned int w = 0; w < words; w++)
+      {
+        search_bench_word (&seed, end);
+        end += strlen (end);
+        *end++ = ' ';
+      }
+
+      end [-1] = '\0';
+      aichat_session_add_message (&session, m % 2 ? AICHAT_ROLE_USER : AICHAT_ROLE_ASSISTANT, text);
+    }
+
+    char *path = NULL;
+
+    if (asprintf (&path, "%s/chatty/sessions/s%05u", directory, s) < 0)
+      exit (1);
+
+    FILE *file = fopen (path, "w");
+
+    if (file == NULL || aichat_session_write_to_json_file (&session, file) < 0 || fclose (file) != 0)
+    {
+      fprintf (stderr, "search_bench: cannot write '%s'\n", path);
+      exit (1);
+    }
+
+    free (path);
+    aichat_session_free (&session);
+  }
+
+  free (text);
+}
+
+// runs the search with its results going to /dev/null
+static double
+search_bench_search (const char *query)
+{
+  int saved = dup (STDOUT_FILENO);
+  int null = open ("/dev/null", O_WRONLY);
+
+  fflush (stdout);
+  dup2 (null, STDOUT_FILENO);
+  close (null);
+
+  double start = search_bench_now ();
+  chatty_search (query);
+  fflush (stdout);
+  double time = search_bench_now () - start;
+
+  dup2 (saved, STDOUT_FILENO);
+  close (saved);
+  return time;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned int session_count = argc > 1 ? strtoul (argv [1], NULL, 10) : 2000;
+  unsigned int message_count = argc > 2 ? strtoul (argv [2], NULL, 10) : 50;
+
+  if (session_count == 0 || message_count < 2)
+  {
+    fprintf (stderr, "usage: %s [sessions] [messages per session]\n", argv [0]);
+    return 1;
+  }
+
+  char directory [] = "/tmp/search_bench.XXXXXX";
+
+  if (mkdtemp (directory) == NULL)
+  {
+    perror ("search_bench");
+    return 1;
+  }
+
+  setenv ("XDG_DATA_HOME", directory, 1);
+  chatty_initialize_directories ();
+  search_bench_write_sessions (directory, session_count, message_count);
+
+  printf ("%u sessions, %u messages\n", session_count, session_count * message_count);
+  printf ("  %-24s %9.1f ms\n", "building the index", search_bench_search ("w1") * 1e3);
+
+  const char *queries [] = { "w19999", "w5000 w7000", "w1", "w1 w2 w3 w4 w5 w6 w7 w8" };
+
+  for (unsigned int i = 0; i < sizeof (queries) / sizeof (queries [0]); i++)
+  {
+    double total = 0;
+
+    for (unsigned int j = 0; j < SEARCH_BENCH_ROUNDS; j++)
+      total += search_bench_search (queries [i]);
+
+    printf ("  %-24s %9.3f ms\n", queries [i], total / SEARCH_BENCH_ROUNDS * 1e3);
+  }
+
+  printf ("the sessions and the index are left in %s\n", directory);
+  return 0;
+}
@@ -0,0 +1,144 @@
+// usage:
+//  serialize_bench [iterations]
+//
+// Measures how long it takes to build the request body of a session with 10,
+// 100 and 1000 messages, with aichat_session_request_body, which writes the body
+// straight into a buffer that belongs to the session, against building a json-c
+// object tree of the session, rendering it and copying the result the way the
+// body used to be built. Both produce the same bytes, which is checked first.
+// Messages alternate between prose and code so that both long runs without
+// escapes and frequent quotes, backslashes and newlines are covered.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <json-c/json.h>
+
+#include "aichat.h"
+
+static const char *serialize_bench_prose =
+  "The history of the printing press is often told as the story of a single invention, but it was really the "
+  "meeting of several older crafts. Paper had reached Europe centuries earlier, oil-based inks were known to "
+  "painters, and screw presses had been used to make wine and olive oil since Roman times. What changed in the "
+  "1440s was that someone combined them with movable metal type that could be cast quickly and precisely. "
+  "Some say the caf\xc3\xa9, the newspaper and the scientific journal all followed from it.";
+
+static const char *serialize_bench_code =
+  "Here is the function:\n\n"
+  "```c\n"
+  "static int\n"
+  "parse (const char *path)\n"
+  "{\n"
+  "\tFILE *file = fopen (path, \"r\"); // see https://example.com/docs\n"
+  "\tif (file == NULL)\n"
+  "\t\treturn fprintf (stderr, \"%s: \\\"%s\\\"\\n\", path, strerror (errno)), -1;\n"
+  "}\n"
+  "```\n";
+
+static double
+serialize_bench_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// the request body the way it was built before, through a json-c object per message
+static char *
+serialize_bench_json_c (struct aichat_session *session, unsigned long int *length)
+{
+  json_object *jobj = json_object_new_object ();
+
+  json_object_object_add (jobj, "model", json_object_new_string (session->model == AICHAT_MODEL_GPT_3_5_TURBO ? "gpt-3.5-turbo" : "gpt-3.5-turbo-16k"));
+  json_object_object_add (jobj, "temperature", json_object_new_double (session->temperature));
+
+  json_object *jmsgs = json_object_new_array ();
+
+  for (unsigned int i = 0; i < session->message_count; i++)
+  {
+    struct aichat_message *message = &session->messages[i];
+    json_object *jmsg = json_object_new_object ();
+
+    json_object_object_add (jmsg, "role", json_object_new_string (message->role == AICHAT_ROLE_SYSTEM ? "system" : message->role == AICHAT_ROLE_USER ? "user" : "assistant"));
+    json_object_object_add (jmsg, "content", json_object_new_string (message->text));
+    json_object_array_add (jmsgs, jmsg);
+  }
+
+  json_object_object_add (jobj, "messages", jmsgs);
+
+  size_t rendered_length;
+  char *json = strdup (json_object_to_json_string_length (jobj, JSON_C_TO_STRING_PLAIN, &rendered_length));
+
+  json_object_put (jobj);
+  *length = rendered_length;
+  return json;
+}
+
+static void
+serialize_bench_run (unsigned int message_count, unsigned int iterations)
+{
+  struct aichat_session session;
+  aichat_session_initialize (&session);
+
+  // every message is sent, the body does not depend on a context budget
+  session.max_prompt_tokens = -1;
+
+  aichat_session_add_message (&session, AICHAT_ROLE_SYSTEM, "You are a helpful assistant.");
+
+  for (unsigned int i = 1; i < message_count; i++)
+    aichat_session_add_message (&session, i % 2 ? AICHAT_ROLE_USER : AICHAT_ROLE_ASSISTANT, i % 4 == 2 ? serialize_bench_code : serialize_bench_prose);
+
+  unsigned long int direct_length, json_c_length;
+  const char *direct = aichat_session_request_body (&session, &direct_length);
+  char *json_c = serialize_bench_json_c (&session, &json_c_length);
+
+  if (direct == NULL || json_c == NULL || direct_length != json_c_length || memcmp (direct, json_c, direct_length) != 0)
+  {
+    fprintf (stderr, "serialize_bench: the bodies of a session with %u messages differ\n", message_count);
+    exit (1);
+  }
+
+  free (json_c);
+
+  double start = serialize_bench_now ();
+
+  for (unsigned int i = 0; i < iterations; i++)
+    aichat_session_request_body (&session, &direct_length);
+
+  double direct_time = (serialize_bench_now () - start) / iterations;
+
+  start = serialize_bench_now ();
+
+  for (unsigned int i = 0; i < iterations; i++)
+    free (serialize_bench_json_c (&session, &json_c_length));
+
+  double json_c_time = (serialize_bench_now () - start) / iterations;
+
+  printf ("%5u messages %9lu bytes  direct %9.1f us %8.1f MB/s  json-c %9.1f us %8.1f MB/s  %5.1fx\n", message_count, direct_length,
+          direct_time * 1e6, direct_length / direct_time / 1e6, json_c_time * 1e6, json_c_length / json_c_time / 1e6, json_c_time / direct_time);
+
+  aichat_session_free (&session);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned int iterations = argc > 1 ? strtoul (argv[1], NULL, 10) : 0;
+
+  if (argc > 1 && iterations == 0)
+  {
+    fprintf (stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  // fewer rounds for the larger sessions keep every run at a similar length
+  serialize_bench_run (10, iterations ? iterations : 20000);
+  serialize_bench_run (100, iterations ? iterations : 2000);
+  serialize_bench_run (1000, iterations ? iterations : 200);
+
+  return 0;
+}
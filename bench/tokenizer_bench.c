@@ -0,0 +1,181 @@
+// usage:
+//  tokenizer_bench <vocabulary file> [megabytes]
+//
+// Measures the throughput of aichat_tokenizer_count in MB/s on code-heavy and
+// on prose-heavy text of the given size (default 16 MB), and the time it takes
+// aichat_session_count_prompt_tokens to count a long session for the first
+// time and again after a message was added, when the cache already holds the
+// counts of the older messages. The vocabulary is a .tiktoken file such as
+// cl100k_base.tiktoken. The time it takes to read the vocabulary is printed
+// next to the time it takes to map the image that chatty keeps of it.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aichat.h"
+
+static const char *tokenizer_bench_code =
+  "static int\n"
+  "aichat_buffer_append (char **buffer, unsigned long int *length, unsigned long int *capacity, const char *data, unsigned long int size)\n"
+  "{\n"
+  "  if (*length + size + 1 > *capacity)\n"
+  "  {\n"
+  "    unsigned long int new_capacity = *capacity ? *capacity * 2 : 256;\n"
+  "\n"
+  "    while (*length + size + 1 > new_capacity)\n"
+  "      new_capacity *= 2;\n"
+  "\n"
+  "    char *larger = realloc (*buffer, new_capacity);\n"
+  "    if (larger == NULL) return -AICHAT_ERROR_MEMORY; // 0x1F, i += 42;\n"
+  "  }\n"
+  "}\n\n"
+  "def fibonacci(n: int) -> list[int]:\n"
+  "    values = [0, 1]\n"
+  "    for i in range(2, n):\n"
+  "        values.append(values[i - 1] + values[i - 2])\n"
+  "    return values[:n]\n\n";
+
+static const char *tokenizer_bench_prose =
+  "The history of the printing press is often told as the story of a single invention, but it was really the "
+  "meeting of several older crafts. Paper had reached Europe centuries earlier, oil-based inks were known to "
+  "painters, and screw presses had been used to make wine and olive oil since Roman times. What changed in the "
+  "1440s was that someone combined them with movable metal type that could be cast quickly and precisely. "
+  "Within fifty years there were presses in more than two hundred cities, and the price of books fell so far "
+  "that ordinary people could afford them. Didn't that change everything? Historians still argue about it \xe2\x80\x94 "
+  "some say the café, the newspaper and the scientific journal all followed from it.\n\n";
+
+static double
+tokenizer_bench_now (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static char *
+tokenizer_bench_repeat (const char *sample, unsigned long int size)
+{
+  unsigned long int sample_length = strlen (sample);
+  char *text = malloc (size + 1);
+
+  if (text == NULL)
+    return NULL;
+
+  for (unsigned long int i = 0; i < size; i += sample_length)
+    memcpy (text + i, sample, size - i < sample_length ? size - i : sample_length);
+
+  text[size] = '\0';
+  return text;
+}
+
+static void
+tokenizer_bench_throughput (struct aichat_tokenizer *tokenizer, const char *name, const char *sample, unsigned long int size)
+{
+  char *text = tokenizer_bench_repeat (sample, size);
+
+  if (text == NULL)
+  {
+    fprintf (stderr, "tokenizer_bench: out of memory\n");
+    exit (1);
+  }
+
+  double best = 1e9;
+  long int tokens = 0;
+
+  for (int i = 0; i < 3; i++)
+  {
+    double start = tokenizer_bench_now ();
+    tokens = aichat_tokenizer_count (tokenizer, text, size);
+    double elapsed = tokenizer_bench_now () - start;
+
+    if (elapsed < best)
+      best = elapsed;
+  }
+
+  printf ("%-8s %8.1f MB/s  %10ld tokens  %.2f bytes per token\n", name, size / best / 1e6, tokens, (double) size / tokens);
+  free (text);
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf (stderr, "usage: %s <vocabulary file> [megabytes]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen (argv[1], "r");
+
+  if (file == NULL)
+  {
+    perror (argv[1]);
+    return 1;
+  }
+
+  double start = tokenizer_bench_now ();
+  struct aichat_tokenizer *tokenizer = aichat_tokenizer_initialize_from_file (file);
+  double load_time = tokenizer_bench_now () - start;
+  fclose (file);
+
+  if (tokenizer == NULL)
+  {
+    fprintf (stderr, "%s: cannot read vocabulary\n", argv[1]);
+    return 1;
+  }
+
+  unsigned long int size = (argc > 2 ? strtoul (argv[2], NULL, 10) : 16) * 1000 * 1000;
+
+  // the first call may have to write the image, the second one maps it
+  aichat_tokenizer_free (aichat_tokenizer_initialize_from_path (argv[1]));
+
+  start = tokenizer_bench_now ();
+  struct aichat_tokenizer *mapped = aichat_tokenizer_initialize_from_path (argv[1]);
+  double map_time = tokenizer_bench_now () - start;
+
+  aichat_tokenizer_free (mapped);
+
+  printf ("vocabulary loaded in %.1f ms, its image mapped in %.3f ms\n", load_time * 1e3, map_time * 1e3);
+  tokenizer_bench_throughput (tokenizer, "code", tokenizer_bench_code, size);
+  tokenizer_bench_throughput (tokenizer, "prose", tokenizer_bench_prose, size);
+
+  // a long session is counted once and then again after every turn
+  struct aichat_session session;
+  aichat_session_initialize (&session);
+  session.tokenizer = tokenizer;
+
+  aichat_session_add_message (&session, AICHAT_ROLE_SYSTEM, "You are a helpful assistant.");
+
+  for (int i = 0; i < 500; i++)
+  {
+    char *text;
+
+    if (asprintf (&text, "%d: %s", i, i % 2 ? tokenizer_bench_code : tokenizer_bench_prose) < 0)
+      return 1;
+
+    aichat_session_add_message (&session, i % 2 ? AICHAT_ROLE_ASSISTANT : AICHAT_ROLE_USER, text);
+    free (text);
+  }
+
+  start = tokenizer_bench_now ();
+  int cold = aichat_session_count_prompt_tokens (&session);
+  double cold_time = tokenizer_bench_now () - start;
+
+  aichat_session_add_message (&session, AICHAT_ROLE_USER, "And one more question.");
+
+  start = tokenizer_bench_now ();
+  int warm = aichat_session_count_prompt_tokens (&session);
+  double warm_time = tokenizer_bench_now () - start;
+
+  printf ("session  %d messages, %d prompt tokens counted in %.3f ms, %d after one more message in %.3f ms\n",
+          session.message_count - 1, cold, cold_time * 1e3, warm, warm_time * 1e3);
+
+  aichat_session_free (&session);
+  aichat_tokenizer_free (tokenizer);
+
+  return 0;
+}
@@ -14,13 +14,33 @@
 //  (13) chatty --rollback                                            ; remove the user text and response from the most recent conversation
 //  (14) chatty --session=<session name> --rollback                   ; remove the user text and response from the session <session name>
 //  (15) chatty --help                                                ; print this help message
+//  (16) chatty --batch[=<max in flight>] [--ordered]                 ; run the JSONL requests from stdin concurrently and print JSONL results to stdout
+//  (17) chatty --daemon                                              ; serve (1) and (2) for other chatty invocations from memory over a Unix socket
+//  (18) chatty --stats[=json] ...                                    ; print where the time of the request of (1)-(6) or (16) went to stderr
+//  (19) chatty --report                                              ; print latency percentiles and token totals per session and per day from the ledger
+//  (20) chatty [--session=<session name>] --retry=<n>                ; like (5) and (6) but ask for <n> responses at once and keep all of them as alternatives
+//  (21) chatty [--session=<session name>] --pick=<k>                 ; make the <k>-th alternative the last response without another request
+//  (22) chatty --list=<order>[,days=<n>][,min-size=<b>][,limit=<n>]  ; list sessions from the catalog as a table, sorted by name, recent, size or tokens
+//  (23) chatty --complete=<prefix>                                   ; print the names of the sessions that start with <prefix>, for shell completion
+//  (24) chatty --search=<query>                                      ; print the messages of all sessions that match <query> best, with a snippet each
+//  (25) chatty [--session=<session name>] --compact                  ; summarize the older turns of a session, which are then sent as the summary
+//  (26) chatty [--session=<session name>] --fork=<new>[,<n>]         ; start the session <new> with the first <n> messages of a session, all of them by default
+//  (27) chatty [--session=<session name>] --branches                 ; list the sessions that were forked from a session or that it was forked from
+//  (28) chatty --switch=<session name>                               ; make <session name> the most recent conversation
+//  (29) chatty --gc                                                  ; remove the messages of the message store that no session refers to any more
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "aichat.h"
+#include "chatty_batch.h"
+#include "chatty_catalog.h"
+#include "chatty_daemon.h"
+#include "chatty_index.h"
 #include "chatty_methods.h"
+#include "chatty_report.h"
 
 #define CHATTY_RETRY_MASK 1
 #define CHATTY_NEW_SESSION_MASK 2
@@ -35,6 +55,22 @@
 #define CHATTY_SESSION_MASK 1024
 #define CHATTY_PROMPT_MASK 2048
 #define CHATTY_ONCE_MASK 4096
+#define CHATTY_BATCH_MASK 8192
+#define CHATTY_ORDERED_MASK 16384
+#define CHATTY_DAEMON_MASK 32768
+#define CHATTY_STATS_MASK 65536
+#define CHATTY_REPORT_MASK 131072
+#define CHATTY_PICK_MASK 262144
+#define CHATTY_COMPLETE_MASK 524288
+#define CHATTY_SEARCH_MASK 1048576
+#define CHATTY_COMPACT_MASK 2097152
+#define CHATTY_FORK_MASK 4194304
+#define CHATTY_BRANCHES_MASK 8388608
+#define CHATTY_SWITCH_MASK 16777216
+#define CHATTY_GC_MASK 33554432
+
+// the most responses --retry asks for at once
+#define CHATTY_RETRY_MAX_CHOICES 16
 
 struct
 chatty_options
@@ -42,7 +78,17 @@ chatty_options
   char *progname;
   char *session;
   char *prompt;
-
+  char *batch;
+  char *stats;
+  char *retry;
+  char *pick;
+  char *list;
+  char *complete;
+  char *search;
+  char *fork;
+
+  struct chatty_catalog_query list_query;
+  unsigned int fork_messages; // the messages the fork starts with, all of them when 0
   unsigned int mask;
 };
 
@@ -63,6 +109,19 @@ chatty_options_argument_parse_or_die (struct chatty_options *options, const char
     "--session",
     "--prompt",
     "--once",
+    "--batch",
+    "--ordered",
+    "--daemon",
+    "--stats",
+    "--report",
+    "--pick",
+    "--complete",
+    "--search",
+    "--compact",
+    "--fork",
+    "--branches",
+    "--switch",
+    "--gc",
   };
   const unsigned int arguments_count = sizeof (arguments) / sizeof (arguments [0]);
 
@@ -80,13 +139,27 @@ chatty_options_argument_parse_or_die (struct chatty_options *options, const char
     CHATTY_SESSION_MASK,
     CHATTY_PROMPT_MASK,
     CHATTY_ONCE_MASK,
+    CHATTY_BATCH_MASK,
+    CHATTY_ORDERED_MASK,
+    CHATTY_DAEMON_MASK,
+    CHATTY_STATS_MASK,
+    CHATTY_REPORT_MASK,
+    CHATTY_PICK_MASK,
+    CHATTY_COMPLETE_MASK,
+    CHATTY_SEARCH_MASK,
+    CHATTY_COMPACT_MASK,
+    CHATTY_FORK_MASK,
+    CHATTY_BRANCHES_MASK,
+    CHATTY_SWITCH_MASK,
+    CHATTY_GC_MASK,
   };
 
   static_assert (sizeof (argument_masks) / sizeof (argument_masks [0]) == sizeof (arguments) / sizeof (arguments [0]), "argument_masks and arguments must have the same number of elements");
 
   char **argument_subargument_pointer [] =
   {
-    NULL, &options->session, &options->session, &options->session, NULL, NULL, &options->session, &options->session, NULL, NULL, &options->session, &options->prompt, NULL,
+    &options->retry, &options->session, &options->session, &options->session, NULL, &options->list, &options->session, &options->session, NULL, NULL, &options->session, &options->prompt, NULL, &options->batch, NULL, NULL, &options->stats, NULL,
+    &options->pick, &options->complete, &options->search, NULL, &options->fork, NULL, &options->session, NULL,
   };
 
   for (unsigned int i = 0; i < arguments_count; i++)
@@ -114,6 +187,29 @@ chatty_options_argument_parse_or_die (struct chatty_options *options, const char
   exit (1);
 }
 
+// session names end up in paths inside the session directory
+static void
+chatty_options_check_session_name_or_die (struct chatty_options *options, const char *name)
+{
+  if (name == NULL)
+  {
+    fprintf (stderr, "%s: error: session name must be provided.\n", options->progname);
+    exit (1);
+  }
+
+  if (strlen (name) == 0)
+  {
+    fprintf (stderr, "%s: error: session name must not be empty.\n", options->progname);
+    exit (1);
+  }
+
+  if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0 || strchr (name, '/') != NULL || strchr (name, '\\') != NULL)
+  {
+    fprintf (stderr, "%s: error: session name must not be \".\" or \"..\" and must not contain a slash or a backslash\n", options->progname);
+    exit (1);
+  }
+}
+
 void
 chatty_options_initialize_from_arguments_or_die (struct chatty_options *options, int argc, char **argv)
 {
@@ -126,6 +222,15 @@ chatty_options_initialize_from_arguments_or_die (struct chatty_options *options,
   
   options->session = NULL;
   options->prompt = NULL;
+  options->batch = NULL;
+  options->stats = NULL;
+  options->retry = NULL;
+  options->pick = NULL;
+  options->list = NULL;
+  options->complete = NULL;
+  options->search = NULL;
+  options->fork = NULL;
+  options->fork_messages = 0;
   options->mask = 0;
 
   for (int i = 1; i < argc; i++)
@@ -160,10 +265,46 @@ chatty_options_initialize_from_arguments_or_die (struct chatty_options *options,
     printf("    Get a new response from the most recent conversation using the last input.\n\n");
     printf("  --session=<session name> --retry\n");
     printf("    Same as --retry, but for a specific session.\n\n");
+    printf("  [--session=<session name>] --retry=<n>\n");
+    printf("    Ask for <n> (at most %d) responses in a single request instead of one and print\n", CHATTY_RETRY_MAX_CHOICES);
+    printf("    them numbered. The first one becomes the response and all of them are kept\n");
+    printf("    in the session as its alternatives.\n\n");
+    printf("  [--session=<session name>] --pick=<k>\n");
+    printf("    Make the <k>-th alternative of the last response the response, without\n");
+    printf("    sending another request.\n\n");
+    printf("  [--session=<session name>] --compact\n");
+    printf("    Summarize the turns of the session before the last $CHATTY_COMPACT_KEEP_TURNS\n");
+    printf("    (default %d) in one request and print the summary. The summary is sent in\n", AICHAT_DEFAULT_COMPACT_KEEP_TURNS);
+    printf("    place of those turns from then on, which stay in the session. With\n");
+    printf("    $CHATTY_COMPACT_THRESHOLD set this happens whenever the prompt grows beyond\n");
+    printf("    that many tokens.\n\n");
+    printf("  [--session=<session name>] --fork=<new>[,<n>]\n");
+    printf("    Start the session <new> with the messages #1 to #<n> of the session, as\n");
+    printf("    numbered by --search, or all of them, and make it the most recent\n");
+    printf("    conversation. Both sessions share these messages through the message store\n");
+    printf("    in $XDG_DATA_HOME/chatty/store instead of keeping a copy each.\n\n");
+    printf("  [--session=<session name>] --branches\n");
+    printf("    List the sessions that share messages with the session through forks and\n");
+    printf("    after which message each of them went its own way.\n\n");
+    printf("  --switch=<session name>\n");
+    printf("    Make <session name> the most recent conversation without sending anything.\n\n");
+    printf("  --gc\n");
+    printf("    Remove the messages of the message store that no session refers to any more\n");
+    printf("    since the sessions that were forked from them were deleted or rolled back.\n\n");
     printf("  --prompt-from=<session name>\n");
     printf("    Retrieve the prompt text from the specified session <session name>.\n\n");
     printf("  --list\n");
     printf("    List all available sessions.\n\n");
+    printf("  --list=<order>[,days=<n>][,min-size=<bytes>][,limit=<n>]\n");
+    printf("    List the sessions saved within the last <n> days that are at least <bytes>\n");
+    printf("    large as a table with their size, messages, tokens and model, sorted by\n");
+    printf("    name, recent, size or tokens and cut off after <limit> sessions.\n\n");
+    printf("  --complete=<prefix>\n");
+    printf("    Print the names of the sessions that start with <prefix>, one per line.\n\n");
+    printf("  --search=<query>\n");
+    printf("    Print the %d messages of all sessions that match the words of <query> best,\n", CHATTY_INDEX_DEFAULT_RESULTS);
+    printf("    or $CHATTY_SEARCH_RESULTS of them, each with its session, number and a\n");
+    printf("    snippet. The first search indexes all sessions, which takes a while.\n\n");
     printf("  --delete=<session name>\n");
     printf("    Delete the session <session name>.\n\n");
     printf("  --delete-all\n");
@@ -177,6 +318,28 @@ chatty_options_initialize_from_arguments_or_die (struct chatty_options *options,
     printf("    Remove the input and response from the most recent conversation.\n\n");
     printf("  --session=<session name> --rollback\n");
     printf("    Remove the input and response from the specified session <session name>.\n\n");
+    printf("  --batch[=<max in flight>] [--ordered]\n");
+    printf("    Read one JSON request per line from stdin and send them concurrently with at\n");
+    printf("    most <max in flight> (default %d) outstanding. Each request has an \"id\", a\n", CHATTY_BATCH_DEFAULT_MAX_IN_FLIGHT);
+    printf("    \"user\" text and either a \"prompt\" file or a \"system\" text. One JSON result\n");
+    printf("    tagged with the request id is printed per line as requests complete, or in\n");
+    printf("    input order with --ordered.\n\n");
+    printf("  --daemon\n");
+    printf("    Listen on $XDG_RUNTIME_DIR/chatty.sock and continue conversations for other\n");
+    printf("    chatty invocations, keeping sessions and connections warm in between. While\n");
+    printf("    the daemon runs, chatty forwards --session and the default to it unless\n");
+    printf("    $CHATTY_DAEMON is 0.\n\n");
+    printf("  --stats[=json]\n");
+    printf("    Together with an option that sends a request, print to stderr how long\n");
+    printf("    loading, serializing, resolving, connecting, the TLS handshake, the first\n");
+    printf("    byte, the whole request and saving took, the bytes sent and received and\n");
+    printf("    the completion tokens per second. With =json the numbers are printed as\n");
+    printf("    one JSON object, with --batch they are part of every result.\n\n");
+    printf("  --report\n");
+    printf("    Print the p50, p95 and p99 latency of every phase of a request, the\n");
+    printf("    completion tokens per second and the tokens used per session and per day\n");
+    printf("    from the ledger of all requests, which is only recorded with $CHATTY_LEDGER\n");
+    printf("    set to 1 for $XDG_DATA_HOME/chatty/ledger or to another file.\n\n");
     printf("If no options are provided, the program will automatically continue the most recent conversation.\n");
     exit (0);
   }
@@ -199,30 +362,104 @@ chatty_options_initialize_from_arguments_or_die (struct chatty_options *options,
     }
   }
 
-  unsigned int uses_session_mask = CHATTY_NEW_SESSION_MASK | CHATTY_PROMPT_FROM_MASK | CHATTY_DELETE_MASK | CHATTY_EXPORT_MASK | CHATTY_SESSION_MASK | CHATTY_IMPORT_MASK;
+  if (options->mask & CHATTY_BATCH_MASK)
+  {
+    if (options->batch && (*options->batch == '\0' || strspn (options->batch, "0123456789") != strlen (options->batch) || atoi (options->batch) <= 0))
+    {
+      fprintf (stderr, "%s: error: --batch requires a positive number of requests in flight\n", options->progname);
+      exit (1);
+    }
+  }
 
-  if (options->mask & uses_session_mask)
+  if (options->mask & CHATTY_RETRY_MASK)
   {
-    if (options->session == NULL)
+    if (options->retry && (*options->retry == '\0' || strspn (options->retry, "0123456789") != strlen (options->retry) ||
+                           atoi (options->retry) <= 0 || atoi (options->retry) > CHATTY_RETRY_MAX_CHOICES))
     {
-      fprintf (stderr, "%s: error: session name must be provided.\n", options->progname);
+      fprintf (stderr, "%s: error: --retry requires a number of responses between 1 and %d\n", options->progname, CHATTY_RETRY_MAX_CHOICES);
       exit (1);
     }
+  }
 
-    if (strlen (options->session) == 0)
+  if (options->mask & CHATTY_PICK_MASK)
+  {
+    if (options->pick == NULL || *options->pick == '\0' || strspn (options->pick, "0123456789") != strlen (options->pick) || atoi (options->pick) <= 0)
     {
-      fprintf (stderr, "%s: error: session name must not be empty.\n", options->progname);
+      fprintf (stderr, "%s: error: --pick requires the positive number of an alternative\n", options->progname);
       exit (1);
     }
+  }
 
-    if (strcmp (options->session, ".") == 0 || strcmp (options->session, "..") == 0 || strchr (options->session, '/') != NULL || strchr (options->session, '\\') != NULL)
+  if ((options->mask & CHATTY_SEARCH_MASK) && (options->search == NULL || *options->search == '\0'))
+  {
+    fprintf (stderr, "%s: error: --search requires a query\n", options->progname);
+    exit (1);
+  }
+
+  if (options->mask & CHATTY_FORK_MASK)
+  {
+    char *comma = options->fork ? strrchr (options->fork, ',') : NULL;
+
+    // the number of messages follows the last comma, the name may have commas of its own
+    if (comma && comma [1] != '\0' && strspn (comma + 1, "0123456789") == strlen (comma + 1))
     {
-      fprintf (stderr, "%s: error: session name must not be \".\" or \"..\" and must not contain a slash or a backslash\n", options->progname);
+      if (atoi (comma + 1) <= 0)
+      {
+        fprintf (stderr, "%s: error: --fork requires a positive number of messages\n", options->progname);
+        exit (1);
+      }
+
+      options->fork_messages = atoi (comma + 1);
+      *comma = '\0';
+    }
+
+    chatty_options_check_session_name_or_die (options, options->fork);
+  }
+
+  if ((options->mask & CHATTY_LIST_MASK) && chatty_catalog_parse_query (options->list, &options->list_query) < 0)
+  {
+    fprintf (stderr, "%s: error: --list accepts name, recent, size or tokens, days=<n>, min-size=<bytes> and limit=<n>\n", options->progname);
+    exit (1);
+  }
+
+  if ((options->mask & CHATTY_ORDERED_MASK) && (options->mask & CHATTY_BATCH_MASK) == 0)
+  {
+    fprintf (stderr, "%s: error: --ordered requires --batch\n", options->progname);
+    exit (1);
+  }
+
+  // --stats goes with whatever else sends a request, it is left out of the checks below
+  unsigned int mask = options->mask & ~CHATTY_STATS_MASK;
+
+  if (options->mask & CHATTY_STATS_MASK)
+  {
+    if (options->stats && strcmp (options->stats, "json") != 0)
+    {
+      fprintf (stderr, "%s: error: --stats accepts only json as its format\n", options->progname);
+      exit (1);
+    }
+
+    unsigned int no_request_mask = CHATTY_PROMPT_FROM_MASK | CHATTY_DELETE_MASK | CHATTY_DELETE_ALL_MASK | CHATTY_LIST_MASK | CHATTY_EXPORT_MASK |
+                                   CHATTY_IMPORT_MASK | CHATTY_ROLLBACK_MASK | CHATTY_DAEMON_MASK | CHATTY_REPORT_MASK | CHATTY_PICK_MASK |
+                                   CHATTY_COMPLETE_MASK | CHATTY_SEARCH_MASK | CHATTY_FORK_MASK | CHATTY_BRANCHES_MASK | CHATTY_SWITCH_MASK |
+                                   CHATTY_GC_MASK;
+
+    if (mask & no_request_mask)
+    {
+      fprintf (stderr, "%s: error: --stats requires an option that sends a request\n", options->progname);
       exit (1);
     }
   }
 
-  if (__builtin_popcount (options->mask) <= 1)
+  unsigned int uses_session_mask = CHATTY_NEW_SESSION_MASK | CHATTY_PROMPT_FROM_MASK | CHATTY_DELETE_MASK | CHATTY_EXPORT_MASK | CHATTY_SESSION_MASK | CHATTY_IMPORT_MASK |
+                                   CHATTY_SWITCH_MASK;
+
+  if (options->mask & uses_session_mask)
+  {
+    chatty_options_check_session_name_or_die (options, options->session);
+  }
+
+  if (__builtin_popcount (mask) <= 1)
   {
     return;
   }
@@ -231,14 +468,19 @@ chatty_options_initialize_from_arguments_or_die (struct chatty_options *options,
     CHATTY_NEW_SESSION_MASK | CHATTY_PROMPT_MASK, 
     CHATTY_ONCE_MASK | CHATTY_PROMPT_MASK,
     CHATTY_SESSION_MASK | CHATTY_RETRY_MASK,
-    CHATTY_SESSION_MASK | CHATTY_ROLLBACK_MASK
+    CHATTY_SESSION_MASK | CHATTY_ROLLBACK_MASK,
+    CHATTY_SESSION_MASK | CHATTY_PICK_MASK,
+    CHATTY_SESSION_MASK | CHATTY_COMPACT_MASK,
+    CHATTY_SESSION_MASK | CHATTY_FORK_MASK,
+    CHATTY_SESSION_MASK | CHATTY_BRANCHES_MASK,
+    CHATTY_BATCH_MASK | CHATTY_ORDERED_MASK
   };
   
   unsigned int allowed_multiple_masks_count = sizeof (allowed_multiple_masks) / sizeof (allowed_multiple_masks [0]);
 
   for (unsigned int i = 0; i < allowed_multiple_masks_count; i++)
   {
-    if (options->mask == allowed_multiple_masks [i])
+    if (mask == allowed_multiple_masks [i])
     {
       return;
     }
@@ -255,27 +497,93 @@ main (int argc, char **argv)
   chatty_options_initialize_from_arguments_or_die (&options, argc, argv);
   chatty_initialize_directories ();
 
-  unsigned int mask = options.mask;
+  unsigned int mask = options.mask & ~CHATTY_STATS_MASK;
 
-  if (mask == 0)
+  if (options.mask & CHATTY_STATS_MASK)
   {
-    chatty_extend_session (NULL);
+    chatty_set_stats_mode (options.stats ? CHATTY_STATS_JSON : CHATTY_STATS_TEXT);
   }
-  else if (mask & CHATTY_SESSION_MASK)
+
+  if (mask == 0)
   {
-    chatty_extend_session (options.session);
+    chatty_daemon_extend_session (NULL);
   }
   else if (mask & CHATTY_RETRY_MASK)
+  {
+    unsigned int choices = options.retry ? atoi (options.retry) : 1;
+
+    if (mask & CHATTY_SESSION_MASK)
+    {
+      chatty_retry_session (options.session, choices);
+    }
+    else
+    {
+      chatty_retry_session (NULL, choices);
+    }
+  }
+  else if (mask & CHATTY_PICK_MASK)
+  {
+    if (mask & CHATTY_SESSION_MASK)
+    {
+      chatty_pick_alternative (options.session, atoi (options.pick));
+    }
+    else
+    {
+      chatty_pick_alternative (NULL, atoi (options.pick));
+    }
+  }
+  else if (mask & CHATTY_COMPACT_MASK)
+  {
+    if (mask & CHATTY_SESSION_MASK)
+    {
+      chatty_compact_session (options.session);
+    }
+    else
+    {
+      chatty_compact_session (NULL);
+    }
+  }
+  else if (mask & CHATTY_FORK_MASK)
+  {
+    if (mask & CHATTY_SESSION_MASK)
+    {
+      chatty_fork_session (options.session, options.fork, options.fork_messages);
+    }
+    else
+    {
+      chatty_fork_session (NULL, options.fork, options.fork_messages);
+    }
+  }
+  else if (mask & CHATTY_BRANCHES_MASK)
   {
     if (mask & CHATTY_SESSION_MASK)
     {
-      chatty_retry_session (options.session);
+      chatty_catalog_branches (options.session);
     }
     else
     {
-      chatty_retry_session (NULL);
+      chatty_catalog_branches (NULL);
     }
   }
+  else if (mask & CHATTY_ROLLBACK_MASK)
+  {
+    if (mask & CHATTY_SESSION_MASK)
+    {
+      chatty_rollback_session (options.session);
+    }
+    else
+    {
+      chatty_rollback_session (NULL);
+    }
+  }
+  else if (mask & CHATTY_SWITCH_MASK)
+  {
+    chatty_switch_session (options.session);
+  }
+  else if (mask & CHATTY_SESSION_MASK)
+  {
+    chatty_daemon_extend_session (options.session);
+  }
   else if (mask & CHATTY_NEW_SESSION_MASK)
   {
     chatty_create_session (options.session, options.prompt);
@@ -290,7 +598,15 @@ main (int argc, char **argv)
   }
   else if (mask & CHATTY_LIST_MASK)
   {
-    chatty_list_sessions ();
+    chatty_catalog_list (&options.list_query);
+  }
+  else if (mask & CHATTY_COMPLETE_MASK)
+  {
+    chatty_catalog_complete (options.complete);
+  }
+  else if (mask & CHATTY_SEARCH_MASK)
+  {
+    chatty_search (options.search);
   }
   else if (mask & CHATTY_ONCE_MASK)
   {
@@ -304,6 +620,23 @@ main (int argc, char **argv)
   {
     chatty_import_session (options.session);
   }
+  else if (mask & CHATTY_BATCH_MASK)
+  {
+    unsigned int max_in_flight = options.batch ? atoi (options.batch) : CHATTY_BATCH_DEFAULT_MAX_IN_FLIGHT;
+    chatty_batch (max_in_flight, (mask & CHATTY_ORDERED_MASK) != 0);
+  }
+  else if (mask & CHATTY_DAEMON_MASK)
+  {
+    chatty_daemon ();
+  }
+  else if (mask & CHATTY_REPORT_MASK)
+  {
+    chatty_report ();
+  }
+  else if (mask & CHATTY_GC_MASK)
+  {
+    chatty_collect_store ();
+  }
   else
   {
     fprintf (stderr, "%s: chatty mask %u not implemented\n", options.progname, mask);
@@ -0,0 +1,362 @@
+// batch mode: every line of stdin is one request and every line of stdout is one result
+//
+//  request: {"id": <any>, "prompt": "<prompt file>", "user": "<user text>"}
+//           {"id": <any>, "system": "<system text>", "user": "<user text>", "model": "gpt-3.5-turbo-16k", "temperature": 0.2}
+//  result:  {"id": <id>, "content": "<assistant text>", "prompt_tokens": <n>, "completion_tokens": <n>}
+//           {"id": <id>, "content": ..., "stats": {"serialize_ms": <ms>, "total_ms": <ms>, ...}} with --stats
+//           {"id": <id>, "error": "<error message>"}
+//
+// Requests are sent concurrently over a single curl_multi event loop with at most
+// max_in_flight of them outstanding at any time. Results are written as soon as
+// they complete or, in ordered mode, in the order the requests were read. In ordered mode
+// no more input is read while CHATTY_BATCH_REORDER_WINDOW * max_in_flight requests wait
+// for a slow one before them. No new request is sent while the rate limit headers of the
+// last response say the limit is used up.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <json-c/json.h>
+
+#include "aichat.h"
+#include "chatty_batch.h"
+#include "chatty_methods.h"
+
+struct
+chatty_batch_entry
+{
+  struct chatty_batch_entry *next_spare;
+  unsigned long int sequence;
+
+  json_object *id;
+  json_object *result;
+
+  struct aichat_session session;
+};
+
+struct
+chatty_batch_output
+{
+  bool ordered;
+
+  // written entries are kept for the next request so their sessions need not allocate again
+  struct chatty_batch_entry *spare;
+
+  // completed entries waiting for their predecessors, a ring indexed by sequence number modulo its capacity
+  struct chatty_batch_entry **pending;
+  unsigned long int pending_capacity;
+  unsigned long int next_sequence;
+};
+
+static struct chatty_batch_entry *
+chatty_batch_entry_new_or_die (struct chatty_batch_output *output)
+{
+  struct chatty_batch_entry *entry = output->spare;
+
+  if (entry)
+  {
+    output->spare = entry->next_spare;
+    aichat_session_reset (&entry->session);
+    return entry;
+  }
+
+  entry = calloc (1, sizeof (struct chatty_batch_entry));
+
+  if (entry == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
+    exit (1);
+  }
+
+  aichat_session_initialize (&entry->session);
+  return entry;
+}
+
+static void
+chatty_batch_entry_recycle (struct chatty_batch_output *output, struct chatty_batch_entry *entry)
+{
+  json_object_put (entry->id);
+  json_object_put (entry->result);
+
+  entry->id = NULL;
+  entry->result = NULL;
+  entry->next_spare = output->spare;
+  output->spare = entry;
+}
+
+static void
+chatty_batch_entry_set_error (struct chatty_batch_entry *entry, const char *error)
+{
+  entry->result = json_object_new_object ();
+  json_object_object_add (entry->result, "id", json_object_get (entry->id));
+  json_object_object_add (entry->result, "error", json_object_new_string (error));
+}
+
+static void
+chatty_batch_entry_set_results (struct chatty_batch_entry *entry, struct aichat_api_call_results *results)
+{
+  if (results->error != 0)
+  {
+    chatty_batch_entry_set_error (entry, aichat_strerror (-results->error));
+    return;
+  }
+
+  struct aichat_message *message = &entry->session.messages [entry->session.message_count - 1];
+
+  entry->result = json_object_new_object ();
+  json_object_object_add (entry->result, "id", json_object_get (entry->id));
+  json_object_object_add (entry->result, "content", json_object_new_string (message->text));
+  json_object_object_add (entry->result, "prompt_tokens", json_object_new_int (results->prompt_tokens));
+  json_object_object_add (entry->result, "completion_tokens", json_object_new_int (results->completion_tokens));
+
+  if (chatty_get_stats_mode () != CHATTY_STATS_OFF)
+    json_object_object_add (entry->result, "stats", chatty_stats_to_json (results, -1, -1));
+}
+
+static void
+chatty_batch_write_or_die (struct chatty_batch_output *output, struct chatty_batch_entry *entry)
+{
+  const char *line = json_object_to_json_string_ext (entry->result, JSON_C_TO_STRING_PLAIN);
+
+  if (printf ("%s\n", line) < 0 || fflush (stdout) != 0)
+  {
+    fprintf (stderr, "%s: cannot write result: %s\n", program_invocation_short_name, strerror (errno));
+    exit (1);
+  }
+
+  chatty_batch_entry_recycle (output, entry);
+}
+
+static void
+chatty_batch_complete (struct chatty_batch_output *output, struct chatty_batch_entry *entry)
+{
+  if (output->ordered == false)
+  {
+    chatty_batch_write_or_die (output, entry);
+    return;
+  }
+
+  // no more entries are read than the ring holds, see chatty_batch_can_read
+  output->pending [entry->sequence % output->pending_capacity] = entry;
+
+  struct chatty_batch_entry **next;
+
+  while (*(next = &output->pending [output->next_sequence % output->pending_capacity]))
+  {
+    chatty_batch_write_or_die (output, *next);
+    *next = NULL;
+    output->next_sequence++;
+  }
+}
+
+// in ordered mode the entries read but not yet written are bounded, a slow request otherwise lets every
+// later result pile up behind it together with its session
+static bool
+chatty_batch_can_read (const struct chatty_batch_output *output, unsigned long int sequence)
+{
+  return output->ordered == false || sequence - output->next_sequence < output->pending_capacity;
+}
+
+static const char *
+chatty_batch_entry_initialize (struct chatty_batch_entry *entry, const struct aichat_session *defaults, const char *line)
+{
+  // a recycled session keeps the configuration of the request it was last used for
+  entry->session.model = defaults->model;
+  entry->session.temperature = defaults->temperature;
+
+  json_object *request = json_tokener_parse (line);
+
+  if (request == NULL || json_object_get_type (request) != json_type_object)
+  {
+    json_object_put (request);
+    return "request is not a JSON object";
+  }
+
+  json_object *jid = NULL, *jprompt = NULL, *jsystem = NULL, *juser = NULL, *jmodel = NULL, *jtemperature = NULL;
+
+  if (json_object_object_get_ex (request, "id", &jid))
+    entry->id = json_object_get (jid);
+
+  json_object_object_get_ex (request, "prompt", &jprompt);
+  json_object_object_get_ex (request, "system", &jsystem);
+  json_object_object_get_ex (request, "user", &juser);
+
+  const char *error = NULL;
+
+  if (juser == NULL || (jprompt == NULL) == (jsystem == NULL))
+  {
+    error = "request needs \"user\" and exactly one of \"prompt\" and \"system\"";
+    goto chatty_batch_entry_initialize_done;
+  }
+
+  if (json_object_object_get_ex (request, "model", &jmodel))
+  {
+    const char *model = json_object_get_string (jmodel);
+
+    if (strcmp (model, "gpt-3.5-turbo") == 0)          entry->session.model = AICHAT_MODEL_GPT_3_5_TURBO;
+    else if (strcmp (model, "gpt-3.5-turbo-16k") == 0) entry->session.model = AICHAT_MODEL_GPT_3_5_TURBO_16K;
+    else
+    {
+      error = "unknown model";
+      goto chatty_batch_entry_initialize_done;
+    }
+  }
+
+  if (json_object_object_get_ex (request, "temperature", &jtemperature))
+    entry->session.temperature = json_object_get_double (jtemperature);
+
+  int result;
+
+  if (jprompt)
+  {
+    FILE *prompt = fopen (json_object_get_string (jprompt), "r");
+
+    if (prompt == NULL)
+    {
+      error = "cannot open prompt file";
+      goto chatty_batch_entry_initialize_done;
+    }
+
+    result = aichat_session_add_message_from_file (&entry->session, AICHAT_ROLE_SYSTEM, prompt);
+    fclose (prompt);
+  }
+  else
+  {
+    result = aichat_session_add_message (&entry->session, AICHAT_ROLE_SYSTEM, json_object_get_string (jsystem));
+  }
+
+  if (result >= 0)
+    result = aichat_session_add_message (&entry->session, AICHAT_ROLE_USER, json_object_get_string (juser));
+
+  if (result < 0)
+    error = aichat_strerror (result);
+
+chatty_batch_entry_initialize_done:
+  json_object_put (request);
+  return error;
+}
+
+void
+chatty_batch (unsigned int max_in_flight, bool ordered)
+{
+  struct aichat_client *client = chatty_client_initialize_or_die ();
+  struct aichat_batch *batch = aichat_batch_initialize (client, max_in_flight);
+
+  if (batch == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror (-AICHAT_ERROR_CURL_INITIALIZATION));
+    exit (1);
+  }
+
+  // without settings the batch has a client of its own, the rate limits are read from whichever it uses
+  struct aichat_client *limits = aichat_batch_client (batch);
+
+  struct chatty_batch_output output = { .ordered = ordered, .spare = NULL, .pending = NULL, .pending_capacity = 0, .next_sequence = 0 };
+
+  if (ordered)
+  {
+    output.pending_capacity = (unsigned long int) CHATTY_BATCH_REORDER_WINDOW * max_in_flight;
+    output.pending = calloc (output.pending_capacity, sizeof (struct chatty_batch_entry *));
+
+    if (output.pending == NULL)
+    {
+      fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
+      exit (1);
+    }
+  }
+
+  struct aichat_session defaults;
+  aichat_session_initialize (&defaults);
+
+  char *line = NULL;
+  unsigned long int line_capacity = 0;
+  unsigned long int sequence = 0;
+  bool end_of_input = false;
+
+  while (true)
+  {
+    // keep the window full while there is input left
+    while (end_of_input == false && aichat_batch_in_flight (batch) < max_in_flight && chatty_batch_can_read (&output, sequence))
+    {
+      double delay = aichat_client_rate_limit_delay (limits);
+
+      // the requests in flight are collected while the limit recovers, without any there is nothing to do but wait
+      if (delay > 0 && aichat_batch_in_flight (batch) > 0)
+        break;
+
+      if (delay > 0)
+      {
+        struct timespec pause = { .tv_sec = (time_t) delay, .tv_nsec = (long int) ((delay - (time_t) delay) * 1e9) };
+        nanosleep (&pause, NULL);
+      }
+
+      long int length = getline (&line, &line_capacity, stdin);
+
+      if (length < 0)
+      {
+        end_of_input = true;
+        break;
+      }
+
+      if (strspn (line, " \t\r\n") == (unsigned long int) length)
+        continue;
+
+      struct chatty_batch_entry *entry = chatty_batch_entry_new_or_die (&output);
+      entry->sequence = sequence++;
+
+      const char *error = chatty_batch_entry_initialize (entry, &defaults, line);
+      int result = error ? 0 : aichat_batch_add (batch, &entry->session, entry);
+
+      if (result < 0)
+        error = aichat_strerror (result);
+
+      if (error)
+      {
+        chatty_batch_entry_set_error (entry, error);
+        chatty_batch_complete (&output, entry);
+      }
+    }
+
+    struct aichat_session *session;
+    struct aichat_api_call_results results;
+    void *userdata;
+
+    int done = aichat_batch_wait (batch, &session, &results, &userdata);
+
+    if (done < 0)
+    {
+      fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror (done));
+      exit (1);
+    }
+
+    if (done == 0)
+    {
+      if (end_of_input) break;
+      continue;
+    }
+
+    struct chatty_batch_entry *entry = userdata;
+    chatty_batch_entry_set_results (entry, &results);
+    chatty_batch_complete (&output, entry);
+  }
+
+  while (output.spare)
+  {
+    struct chatty_batch_entry *entry = output.spare;
+    output.spare = entry->next_spare;
+
+    aichat_session_free (&entry->session);
+    free (entry);
+  }
+
+  free (line);
+  free (output.pending);
+  aichat_batch_free (batch);
+  aichat_client_free (client);
+}
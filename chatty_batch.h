@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define CHATTY_BATCH_DEFAULT_MAX_IN_FLIGHT 8
+
+// in ordered mode at most this many times max_in_flight requests are read ahead of the oldest unwritten result
+#define CHATTY_BATCH_REORDER_WINDOW 4
+
+void chatty_batch (unsigned int max_in_flight, bool ordered);
@@ -0,0 +1,776 @@
+// the session catalog: one record per session with its size, message count, tokens and model
+//
+// The catalog lives next to the session directory and is updated whenever chatty saves or deletes a
+// session, so --list and completion read a single file instead of every session. The header remembers
+// the modification time of the session directory the catalog was last brought up to date with. When the
+// directory changed since, sessions were added or removed behind chatty's back and the catalog is rebuilt
+// before it is read: sessions whose size and modification time still match their record keep it, the
+// others are loaded once to count their messages. A catalog that cannot be written is never a reason to
+// fail, --list and completion then scan the session directory instead.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aichat.h"
+#include "chatty_catalog.h"
+#include "chatty_methods.h"
+
+static_assert (sizeof (struct chatty_catalog_header) == CHATTY_CATALOG_RECORD_SIZE, "the catalog header must take up one record");
+static_assert (sizeof (struct chatty_catalog_record) == CHATTY_CATALOG_RECORD_SIZE, "catalog records must be CHATTY_CATALOG_RECORD_SIZE bytes");
+
+static char *
+chatty_catalog_path (const char *name)
+{
+  char *path = NULL;
+
+  if (asprintf (&path, "%s/%s", chatty_get_home_directory (), name) < 0)
+    return NULL;
+
+  return path;
+}
+
+static int
+chatty_catalog_directory_time (int64_t *time)
+{
+  char *path = chatty_catalog_path ("sessions");
+  struct stat status;
+  int result = path && stat (path, &status) == 0 ? 0 : -1;
+
+  if (result == 0)
+    *time = chatty_modification_time (&status);
+
+  free (path);
+  return result;
+}
+
+// the catalog with the lock taken, or -1
+static int
+chatty_catalog_open (int operation)
+{
+  char *path = chatty_catalog_path ("catalog");
+
+  if (path == NULL)
+    return -1;
+
+  int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  free (path);
+
+  if (fd < 0)
+    return -1;
+
+  while (flock (fd, operation) != 0)
+  {
+    if (errno != EINTR)
+    {
+      close (fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+// false for an empty catalog as well as for a file that is not a catalog, either is rebuilt
+static bool
+chatty_catalog_read_header (int fd, struct chatty_catalog_header *header, unsigned long int *count)
+{
+  struct stat status;
+
+  if (fstat (fd, &status) != 0 || status.st_size < CHATTY_CATALOG_RECORD_SIZE)
+    return false;
+
+  if (pread (fd, header, sizeof (*header), 0) != sizeof (*header) || memcmp (header->magic, CHATTY_CATALOG_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != CHATTY_CATALOG_VERSION || header->record_size != CHATTY_CATALOG_RECORD_SIZE)
+    return false;
+
+  *count = status.st_size / CHATTY_CATALOG_RECORD_SIZE - 1;
+  return true;
+}
+
+static int
+chatty_catalog_write_header (int fd, int64_t directory_time)
+{
+  struct chatty_catalog_header header;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CHATTY_CATALOG_MAGIC, sizeof (header.magic));
+  header.version = CHATTY_CATALOG_VERSION;
+  header.record_size = CHATTY_CATALOG_RECORD_SIZE;
+  header.directory_time = directory_time;
+
+  return pwrite (fd, &header, sizeof (header), 0) == sizeof (header) ? 0 : -1;
+}
+
+static void
+chatty_catalog_fill (struct chatty_catalog_record *record, const char *name, struct aichat_session *session, const struct stat *status)
+{
+  memset (record, 0, sizeof (*record));
+  record->time = chatty_modification_time (status);
+  record->size = status->st_size;
+  record->used = 1;
+  strcpy (record->name, name);
+
+  // a session that could not be read is listed without its messages
+  if (session)
+  {
+    long int tokens = aichat_session_estimate_tokens (session);
+
+    record->message_count = session->message_count;
+    record->tokens = tokens > UINT32_MAX ? UINT32_MAX : (uint32_t) tokens;
+    record->model = session->model;
+  }
+}
+
+static int
+chatty_catalog_compare_names (const void *a, const void *b)
+{
+  return strcmp (((const struct chatty_catalog_record *) a)->name, ((const struct chatty_catalog_record *) b)->name);
+}
+
+// the records of every session in the session directory, taken from known, sorted by name, when the session did not change since
+static long int
+chatty_catalog_scan (const struct chatty_catalog_record *known, unsigned long int known_count, struct chatty_catalog_record **records)
+{
+  char *directory_path = chatty_catalog_path ("sessions");
+  DIR *directory = directory_path ? opendir (directory_path) : NULL;
+
+  free (directory_path);
+
+  if (directory == NULL)
+    return -1;
+
+  struct chatty_catalog_record *scanned = NULL;
+  unsigned long int count = 0, capacity = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir (directory)))
+  {
+    if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) continue;
+    if (entry->d_name[0] == '.') continue; // sessions that are being written
+    if (strlen (entry->d_name) >= sizeof (scanned->name)) continue;
+
+    struct stat status;
+
+    // some file systems leave the type to a stat
+    if (fstatat (dirfd (directory), entry->d_name, &status, AT_SYMLINK_NOFOLLOW) != 0 || S_ISREG (status.st_mode) == false)
+      continue;
+
+    if (count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 256;
+      struct chatty_catalog_record *larger = realloc (scanned, capacity * sizeof (struct chatty_catalog_record));
+
+      if (larger == NULL)
+      {
+        free (scanned);
+        closedir (directory);
+        return -1;
+      }
+
+      scanned = larger;
+    }
+
+    struct chatty_catalog_record *record = &scanned [count++];
+    const struct chatty_catalog_record *match = NULL;
+
+    strcpy (record->name, entry->d_name);
+
+    if (known_count > 0)
+      match = bsearch (record, known, known_count, sizeof (struct chatty_catalog_record), chatty_catalog_compare_names);
+
+    if (match && match->time == chatty_modification_time (&status) && match->size == (uint64_t) status.st_size)
+    {
+      *record = *match;
+      continue;
+    }
+
+    int fd = openat (dirfd (directory), entry->d_name, O_RDONLY | O_CLOEXEC);
+    FILE *file = fd >= 0 ? fdopen (fd, "r") : NULL;
+    struct aichat_session session;
+
+    if (file && aichat_session_initialize_from_json_file_in_store (&session, file, chatty_get_store_directory ()) >= 0)
+    {
+      chatty_catalog_fill (record, entry->d_name, &session, &status);
+      aichat_session_free (&session);
+    }
+    else
+    {
+      chatty_catalog_fill (record, entry->d_name, NULL, &status);
+    }
+
+    if (file)
+      fclose (file);
+    else if (fd >= 0)
+      close (fd);
+  }
+
+  closedir (directory);
+
+  *records = scanned;
+  return count;
+}
+
+// replaces the records of the catalog with the sessions in the session directory, the exclusive lock must be held
+static int
+chatty_catalog_rebuild (int fd)
+{
+  struct chatty_catalog_header header;
+  struct chatty_catalog_record *known = NULL, *records = NULL;
+  unsigned long int known_count = 0;
+  int64_t directory_time;
+
+  // taken before the scan, so that a session saved during the scan makes the catalog stale again
+  if (chatty_catalog_directory_time (&directory_time) != 0)
+    return -1;
+
+  if (chatty_catalog_read_header (fd, &header, &known_count) && known_count > 0)
+  {
+    known = malloc (known_count * sizeof (struct chatty_catalog_record));
+
+    if (known && pread (fd, known, known_count * sizeof (struct chatty_catalog_record), CHATTY_CATALOG_RECORD_SIZE) == (ssize_t) (known_count * sizeof (struct chatty_catalog_record)))
+    {
+      unsigned long int used = 0;
+
+      for (unsigned long int i = 0; i < known_count; i++)
+      {
+        if (known [i].used)
+          known [used++] = known [i];
+      }
+
+      known_count = used;
+      qsort (known, known_count, sizeof (struct chatty_catalog_record), chatty_catalog_compare_names);
+    }
+    else
+    {
+      known_count = 0;
+    }
+  }
+
+  long int count = chatty_catalog_scan (known, known_count, &records);
+  int result = -1;
+
+  free (known);
+
+  if (count < 0)
+    return -1;
+
+  // the header goes last, a rebuild that is cut short leaves a catalog that is still stale
+  unsigned long int size = count * sizeof (struct chatty_catalog_record);
+
+  if ((size == 0 || pwrite (fd, records, size, CHATTY_CATALOG_RECORD_SIZE) == (ssize_t) size) &&
+      ftruncate (fd, CHATTY_CATALOG_RECORD_SIZE + size) == 0 && chatty_catalog_write_header (fd, directory_time) == 0)
+    result = 0;
+
+  free (records);
+  return result;
+}
+
+// the record of the session, or the first unused one when want_unused is set, or -1
+static long int
+chatty_catalog_find (int fd, unsigned long int count, const char *sessionname, bool want_unused)
+{
+  if (count == 0)
+    return -1;
+
+  unsigned long int size = (count + 1) * CHATTY_CATALOG_RECORD_SIZE;
+  char *data = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+    return -1;
+
+  const struct chatty_catalog_record *records = (const struct chatty_catalog_record *) (data + CHATTY_CATALOG_RECORD_SIZE);
+  long int found = -1, unused = -1;
+
+  for (unsigned long int i = 0; i < count && found < 0; i++)
+  {
+    if (records [i].used == 0)
+    {
+      if (unused < 0) unused = i;
+    }
+    else if (strcmp (records [i].name, sessionname) == 0)
+    {
+      found = i;
+    }
+  }
+
+  munmap (data, size);
+  return found >= 0 || want_unused == false ? found : unused;
+}
+
+static void
+chatty_catalog_write_record (const char *sessionname, const struct chatty_catalog_record *record)
+{
+  if (strlen (sessionname) >= sizeof (record->name))
+    return;
+
+  int fd = chatty_catalog_open (LOCK_EX);
+
+  if (fd < 0)
+    return;
+
+  struct chatty_catalog_header header;
+  unsigned long int count;
+  int64_t directory_time;
+
+  // a catalog that is not there yet is left to the next rebuild, which finds the session anyway
+  if (chatty_catalog_read_header (fd, &header, &count) && chatty_catalog_directory_time (&directory_time) == 0)
+  {
+    long int index = chatty_catalog_find (fd, count, sessionname, record->used);
+
+    if (index < 0 && record->used)
+      index = count;
+
+    if (index < 0 || pwrite (fd, record, sizeof (*record), (index + 1) * CHATTY_CATALOG_RECORD_SIZE) == sizeof (*record))
+      chatty_catalog_write_header (fd, directory_time);
+  }
+
+  close (fd);
+}
+
+void
+chatty_catalog_update (const char *sessionname, struct aichat_session *session, const struct stat *status)
+{
+  struct chatty_catalog_record record;
+
+  if (strlen (sessionname) >= sizeof (record.name))
+    return;
+
+  chatty_catalog_fill (&record, sessionname, session, status);
+  chatty_catalog_write_record (sessionname, &record);
+}
+
+void
+chatty_catalog_remove (const char *sessionname)
+{
+  struct chatty_catalog_record record;
+
+  memset (&record, 0, sizeof (record));
+  chatty_catalog_write_record (sessionname, &record);
+}
+
+// the shared lock is held until chatty_catalog_unmap
+void
+chatty_catalog_map (struct chatty_catalog_mapping *mapping)
+{
+  struct chatty_catalog_header header;
+  unsigned long int count = 0;
+  int64_t directory_time;
+  int fd = chatty_catalog_open (LOCK_SH);
+
+  mapping->fd = -1;
+  mapping->data = NULL;
+
+  if (fd >= 0 && chatty_catalog_directory_time (&directory_time) == 0)
+  {
+    bool ready = chatty_catalog_read_header (fd, &header, &count) && header.directory_time == directory_time;
+
+    // another chatty may rebuild the catalog while the lock is traded, so it is checked again
+    if (ready == false && flock (fd, LOCK_EX) == 0)
+    {
+      ready = (chatty_catalog_read_header (fd, &header, &count) && header.directory_time == directory_time) || chatty_catalog_rebuild (fd) == 0;
+      ready = ready && flock (fd, LOCK_SH) == 0 && chatty_catalog_read_header (fd, &header, &count);
+    }
+
+    unsigned long int size = (count + 1) * CHATTY_CATALOG_RECORD_SIZE;
+    void *data = ready ? mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    if (data != MAP_FAILED)
+    {
+      mapping->fd = fd;
+      mapping->data = data;
+      mapping->size = size;
+      mapping->records = (struct chatty_catalog_record *) ((char *) data + CHATTY_CATALOG_RECORD_SIZE);
+      mapping->count = count;
+      return;
+    }
+  }
+
+  if (fd >= 0)
+    close (fd);
+
+  long int scanned = chatty_catalog_scan (NULL, 0, &mapping->records);
+
+  if (scanned < 0)
+  {
+    if (errno == ENOENT)
+    {
+      mapping->records = NULL;
+      mapping->count = 0;
+      return;
+    }
+
+    chatty_die ("cannot list sessions");
+  }
+
+  mapping->count = scanned;
+}
+
+void
+chatty_catalog_unmap (struct chatty_catalog_mapping *mapping)
+{
+  if (mapping->data)
+  {
+    munmap (mapping->data, mapping->size);
+    close (mapping->fd);
+  }
+  else
+  {
+    free (mapping->records);
+  }
+}
+
+static bool
+chatty_catalog_parse_number (const char *text, unsigned long int *number)
+{
+  if (*text == '\0' || strspn (text, "0123456789") != strlen (text))
+    return false;
+
+  errno = 0;
+  *number = strtoul (text, NULL, 10);
+  return errno == 0;
+}
+
+int
+chatty_catalog_parse_query (const char *spec, struct chatty_catalog_query *query)
+{
+  query->order = CHATTY_CATALOG_ORDER_NAME;
+  query->days = 0;
+  query->min_size = 0;
+  query->limit = 0;
+  query->table = spec != NULL;
+
+  if (spec == NULL)
+    return 0;
+
+  char *copy = strdup (spec);
+  char *saveptr = NULL;
+  int result = 0;
+
+  if (copy == NULL)
+    return -1;
+
+  for (char *part = strtok_r (copy, ",", &saveptr); part && result == 0; part = strtok_r (NULL, ",", &saveptr))
+  {
+    unsigned long int number;
+
+    if (strcmp (part, "name") == 0)
+      query->order = CHATTY_CATALOG_ORDER_NAME;
+    else if (strcmp (part, "recent") == 0)
+      query->order = CHATTY_CATALOG_ORDER_RECENT;
+    else if (strcmp (part, "size") == 0)
+      query->order = CHATTY_CATALOG_ORDER_SIZE;
+    else if (strcmp (part, "tokens") == 0)
+      query->order = CHATTY_CATALOG_ORDER_TOKENS;
+    else if (strncmp (part, "days=", 5) == 0 && chatty_catalog_parse_number (part + 5, &number) && number > 0 && number <= 100000)
+      query->days = number;
+    else if (strncmp (part, "min-size=", 9) == 0 && chatty_catalog_parse_number (part + 9, &number))
+      query->min_size = number;
+    else if (strncmp (part, "limit=", 6) == 0 && chatty_catalog_parse_number (part + 6, &number) && number > 0)
+      query->limit = number;
+    else
+      result = -1;
+  }
+
+  free (copy);
+  return result;
+}
+
+static int
+chatty_catalog_compare_name (const void *a, const void *b)
+{
+  return strcmp ((*(const struct chatty_catalog_record **) a)->name, (*(const struct chatty_catalog_record **) b)->name);
+}
+
+// newer, larger and longer sessions come first, sessions that tie are ordered by name
+static int
+chatty_catalog_compare_recent (const void *a, const void *b)
+{
+  const struct chatty_catalog_record *x = *(const struct chatty_catalog_record **) a, *y = *(const struct chatty_catalog_record **) b;
+
+  if (x->time != y->time)
+    return x->time > y->time ? -1 : 1;
+
+  return strcmp (x->name, y->name);
+}
+
+static int
+chatty_catalog_compare_size (const void *a, const void *b)
+{
+  const struct chatty_catalog_record *x = *(const struct chatty_catalog_record **) a, *y = *(const struct chatty_catalog_record **) b;
+
+  if (x->size != y->size)
+    return x->size > y->size ? -1 : 1;
+
+  return strcmp (x->name, y->name);
+}
+
+static int
+chatty_catalog_compare_tokens (const void *a, const void *b)
+{
+  const struct chatty_catalog_record *x = *(const struct chatty_catalog_record **) a, *y = *(const struct chatty_catalog_record **) b;
+
+  if (x->tokens != y->tokens)
+    return x->tokens > y->tokens ? -1 : 1;
+
+  return strcmp (x->name, y->name);
+}
+
+// the name of the session the last session links to, or NULL
+static char *
+chatty_catalog_last_session (void)
+{
+  char *path = chatty_catalog_path (".last_session");
+  char *target_path = path ? realpath (path, NULL) : NULL;
+  char *name = target_path ? strdup (strrchr (target_path, '/') + 1) : NULL;
+
+  free (path);
+  free (target_path);
+  return name;
+}
+
+void
+chatty_catalog_list (const struct chatty_catalog_query *query)
+{
+  int (*compare []) (const void *, const void *) = {
+    [CHATTY_CATALOG_ORDER_NAME] = chatty_catalog_compare_name,
+    [CHATTY_CATALOG_ORDER_RECENT] = chatty_catalog_compare_recent,
+    [CHATTY_CATALOG_ORDER_SIZE] = chatty_catalog_compare_size,
+    [CHATTY_CATALOG_ORDER_TOKENS] = chatty_catalog_compare_tokens,
+  };
+
+  struct chatty_catalog_mapping mapping;
+  chatty_catalog_map (&mapping);
+
+  const struct chatty_catalog_record **selected = malloc ((mapping.count ? mapping.count : 1) * sizeof (struct chatty_catalog_record *));
+  int64_t oldest = query->days > 0 ? ((int64_t) time (NULL) - query->days * 86400) * 1000000000 : INT64_MIN;
+  unsigned long int count = 0;
+
+  if (selected == NULL)
+    chatty_die ("cannot list sessions");
+
+  for (unsigned long int i = 0; i < mapping.count; i++)
+  {
+    const struct chatty_catalog_record *record = &mapping.records [i];
+
+    if (record->used && record->time >= oldest && record->size >= query->min_size)
+      selected [count++] = record;
+  }
+
+  qsort (selected, count, sizeof (struct chatty_catalog_record *), compare [query->order]);
+
+  if (query->limit > 0 && count > query->limit)
+    count = query->limit;
+
+  char *last_session = chatty_catalog_last_session ();
+
+  if (query->table && count > 0)
+    printf ("%-32s %-16s %8s %8s %10s  %s\n", "session", "saved", "messages", "tokens", "bytes", "model");
+
+  for (unsigned long int i = 0; i < count; i++)
+  {
+    const struct chatty_catalog_record *record = selected [i];
+    const char *marker = last_session && strcmp (last_session, record->name) == 0 ? " (last session)" : "";
+
+    if (query->table == false)
+    {
+      printf ("%s%s\n", record->name, marker);
+      continue;
+    }
+
+    time_t seconds = record->time / 1000000000;
+    struct tm tm;
+    char saved [32];
+
+    localtime_r (&seconds, &tm);
+    strftime (saved, sizeof (saved), "%Y-%m-%d %H:%M", &tm);
+
+    // sessions that could not be read have no tokens, not even those of the reply
+    printf ("%-32s %-16s %8u %8u %10lu  %s%s\n", record->name, saved, record->message_count, record->tokens, (unsigned long int) record->size,
+            record->tokens ? aichat_model_to_string (record->model) : "-", marker);
+  }
+
+  free (last_session);
+  free (selected);
+  chatty_catalog_unmap (&mapping);
+}
+
+void
+chatty_catalog_complete (const char *prefix)
+{
+  struct chatty_catalog_mapping mapping;
+  unsigned long int length = prefix ? strlen (prefix) : 0;
+
+  chatty_catalog_map (&mapping);
+
+  for (unsigned long int i = 0; i < mapping.count; i++)
+  {
+    const struct chatty_catalog_record *record = &mapping.records [i];
+
+    if (record->used && strncmp (record->name, prefix ? prefix : "", length) == 0)
+      printf ("%s\n", record->name);
+  }
+
+  chatty_catalog_unmap (&mapping);
+}
+
+// the runs of the message store the session is based on, 0 when it is not based on any
+static long int
+chatty_catalog_lineage (int directory_fd, const char *sessionname, struct aichat_store_run **runs)
+{
+  int fd = openat (directory_fd, sessionname, O_RDONLY | O_CLOEXEC);
+  FILE *file = fd >= 0 ? fdopen (fd, "r") : NULL;
+  char base [AICHAT_STORE_KEY_LENGTH + 1];
+  unsigned int base_messages;
+  int found = file ? aichat_session_read_base (file, base, &base_messages) : -1;
+
+  if (file)
+    fclose (file);
+  else if (fd >= 0)
+    close (fd);
+
+  if (found <= 0)
+    return 0;
+
+  long int count = 0;
+
+  // most sessions are a few forks away from the first one, the runs are only looked up again for longer chains
+  for (unsigned long int capacity = 16; ; capacity = count)
+  {
+    struct aichat_store_run *larger = realloc (*runs, capacity * sizeof (struct aichat_store_run));
+
+    if (larger == NULL)
+      chatty_die ("cannot list branches");
+
+    *runs = larger;
+    count = aichat_store_lineage (chatty_get_store_directory (), base, base_messages, *runs, capacity);
+
+    if (count <= (long int) capacity)
+      return count < 0 ? 0 : count;
+  }
+}
+
+struct
+chatty_catalog_branch
+{
+  const struct chatty_catalog_record *record;
+  unsigned int shared;
+};
+
+static int
+chatty_catalog_compare_branches (const void *a, const void *b)
+{
+  const struct chatty_catalog_branch *x = a, *y = b;
+  return strcmp (x->record->name, y->record->name);
+}
+
+// how many messages two sessions have in common, the runs they are based on are compared from the first one
+static unsigned int
+chatty_catalog_shared_messages (const struct aichat_store_run *a, long int a_count, const struct aichat_store_run *b, long int b_count)
+{
+  unsigned int shared = 0;
+
+  for (long int i = 0; i < a_count && i < b_count && strcmp (a [i].key, b [i].key) == 0; i++)
+  {
+    shared = a [i].messages < b [i].messages ? a [i].messages : b [i].messages;
+
+    if (a [i].messages != b [i].messages)
+      break;
+  }
+
+  return shared;
+}
+
+void
+chatty_catalog_branches (const char *sessionname)
+{
+  char *last_session = chatty_catalog_last_session ();
+  const char *name = sessionname ? sessionname : last_session;
+
+  if (name == NULL)
+  {
+    fprintf (stderr, "%s: there is no last session: select a session using --session\n", program_invocation_short_name);
+    exit (1);
+  }
+
+  struct chatty_catalog_mapping mapping;
+  chatty_catalog_map (&mapping);
+
+  char *directory_path = chatty_catalog_path ("sessions");
+  int directory_fd = directory_path ? open (directory_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+
+  free (directory_path);
+
+  if (directory_fd < 0)
+    chatty_die ("cannot list branches");
+
+  struct chatty_catalog_branch *branches = malloc ((mapping.count ? mapping.count : 1) * sizeof (struct chatty_catalog_branch));
+  const struct chatty_catalog_record *session = NULL;
+  unsigned long int count = 0;
+
+  if (branches == NULL)
+    chatty_die ("cannot list branches");
+
+  for (unsigned long int i = 0; i < mapping.count; i++)
+  {
+    if (mapping.records [i].used && strcmp (mapping.records [i].name, name) == 0)
+      session = &mapping.records [i];
+  }
+
+  if (session == NULL)
+  {
+    fprintf (stderr, "%s: session '%s' does not exist\n", program_invocation_short_name, name);
+    exit (1);
+  }
+
+  struct aichat_store_run *runs = NULL, *other_runs = NULL;
+  long int run_count = chatty_catalog_lineage (directory_fd, name, &runs);
+
+  // a session that is not based on the store was never forked, it has no branches to compare
+  for (unsigned long int i = 0; i < mapping.count && run_count > 0; i++)
+  {
+    const struct chatty_catalog_record *record = &mapping.records [i];
+
+    if (record->used == 0 || record == session)
+      continue;
+
+    long int other_count = chatty_catalog_lineage (directory_fd, record->name, &other_runs);
+    unsigned int common = chatty_catalog_shared_messages (runs, run_count, other_runs, other_count);
+
+    if (common > 0)
+      branches [count++] = (struct chatty_catalog_branch) { record, common };
+  }
+
+  qsort (branches, count, sizeof (struct chatty_catalog_branch), chatty_catalog_compare_branches);
+
+  printf ("%s%s: %u messages\n", session->name, last_session && strcmp (last_session, session->name) == 0 ? " (last session)" : "", session->message_count);
+
+  for (unsigned long int i = 0; i < count; i++)
+  {
+    const struct chatty_catalog_record *record = branches [i].record;
+    const char *marker = last_session && strcmp (last_session, record->name) == 0 ? " (last session)" : "";
+
+    printf ("  %s%s: %u messages, forked after #%u\n", record->name, marker, record->message_count, branches [i].shared);
+  }
+
+  free (runs);
+  free (other_runs);
+  free (branches);
+  free (last_session);
+  close (directory_fd);
+  chatty_catalog_unmap (&mapping);
+}
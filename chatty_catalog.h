@@ -0,0 +1,78 @@
+#pragma once
+
+#define CHATTY_CATALOG_MAGIC "CHATTYCT"
+#define CHATTY_CATALOG_VERSION 1
+#define CHATTY_CATALOG_RECORD_SIZE 288
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+enum chatty_catalog_order { CHATTY_CATALOG_ORDER_NAME, CHATTY_CATALOG_ORDER_RECENT, CHATTY_CATALOG_ORDER_SIZE, CHATTY_CATALOG_ORDER_TOKENS };
+
+struct aichat_session;
+
+// the header takes up the space of one record, the records follow it
+struct
+chatty_catalog_header
+{
+  char magic [8]; // CHATTY_CATALOG_MAGIC without the terminating null byte
+  uint32_t version;
+  uint32_t record_size;
+  int64_t directory_time; // the modification time of the session directory the catalog is up to date with, in nanoseconds
+  char reserved [CHATTY_CATALOG_RECORD_SIZE - 24];
+};
+
+// a session as it was when it was last saved, records of deleted sessions are unused until another session takes them
+struct
+chatty_catalog_record
+{
+  int64_t time; // the modification time of the session file in nanoseconds
+  uint64_t size;
+  uint32_t message_count;
+  uint32_t tokens;
+  uint8_t model;
+  uint8_t used;
+  char reserved [6];
+  char name [256]; // null terminated
+};
+
+// the records of the catalog, either mapped from the catalog file or scanned from the session directory
+struct
+chatty_catalog_mapping
+{
+  int fd;
+  void *data;
+  unsigned long int size;
+  struct chatty_catalog_record *records;
+  unsigned long int count;
+};
+
+struct
+chatty_catalog_query
+{
+  enum chatty_catalog_order order;
+  long int days; // only sessions saved within the last days, all of them when 0
+  unsigned long int min_size;
+  unsigned long int limit; // all sessions when 0
+  bool table;
+};
+
+// the query of --list[=<order>[,days=<n>][,min-size=<bytes>][,limit=<n>]], -1 when spec is not one
+int chatty_catalog_parse_query (const char *spec, struct chatty_catalog_query *query);
+
+// both keep the catalog in step with the session directory and do nothing when the catalog cannot be updated,
+// it is rebuilt from the session directory the next time it is read
+void chatty_catalog_update (const char *sessionname, struct aichat_session *session, const struct stat *status);
+void chatty_catalog_remove (const char *sessionname);
+
+// brings the catalog up to date and maps it, unused records are left in. Another chatty cannot change the
+// catalog until it is unmapped.
+void chatty_catalog_map (struct chatty_catalog_mapping *mapping);
+void chatty_catalog_unmap (struct chatty_catalog_mapping *mapping);
+
+void chatty_catalog_list (const struct chatty_catalog_query *query);
+void chatty_catalog_complete (const char *prefix);
+
+// the sessions that share messages with the session through the message store, the last session when it is NULL
+void chatty_catalog_branches (const char *sessionname);
@@ -7,14 +7,10 @@ _chatty_complete()
     local previous_previous=${COMP_WORDS[COMP_CWORD-2]}
     local previous=${COMP_WORDS[COMP_CWORD-1]}
     local current=${COMP_WORDS[COMP_CWORD]}
-    local options="--retry --new-session= --prompt-from= --delete= --delete-all --list --export= --import= --rollback --help --session= --prompt= --once"
-    local equals_options="--prompt-from --delete --export --import --session --prompt"
+    local options="--retry --pick= --compact --fork= --branches --switch= --new-session= --prompt-from= --delete= --delete-all --list --list= --complete= --search= --export= --import= --rollback --help --session= --prompt= --once --batch --batch= --ordered --daemon --stats --stats= --report --gc"
+    local equals_options="--prompt-from --delete --export --import --session --switch --prompt"
 
-    if [[ "y$XDG_DATA_HOME" != "y" ]]; then
-        local sessions=$(ls $XDG_DATA_HOME/chatty/sessions)
-    else
-        local sessions=$(ls ~/.local/share/chatty/sessions)
-    fi
+    local sessions=$(chatty --complete="${current#=}" 2>/dev/null)
 
     # If current word is "=" and previous word is one of the equals options then
     # prepend an equals sign each of sessions and use those as completions
@@ -0,0 +1,656 @@
+// daemon mode: chatty --daemon keeps sessions and connections warm behind a Unix socket
+//
+// The socket is $XDG_RUNTIME_DIR/chatty.sock. While the daemon runs, chatty forwards the
+// requests that continue a conversation to it instead of loading the session, connecting
+// to the API and saving the session itself. Every message is one JSON object per line:
+//
+//  chatty: {"home": "<chatty home directory>", "session": "<session name>" or null, "user": "<user text>"}
+//  daemon: {"ready": true} or {"ready": false}
+//  daemon: {"delta": "<piece of the response>"} for every piece as it arrives
+//  daemon: {"done": true, "stats": {<see chatty_stats_to_json>}} or {"error": "<error message>"}
+//
+// The user text is read before connecting so that a slow writer never holds up the daemon.
+// A daemon that serves another home directory answers that it is not ready and chatty then
+// does the work itself. Requests are served one at a time with the settings the daemon was
+// started with. Sessions that were used recently are kept in memory and are read again only
+// when another chatty changed them. A session is saved after the reply was sent, while its
+// lock is held, so that whatever runs next sees the new turn.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <json-c/json.h>
+
+#include "aichat.h"
+#include "chatty_daemon.h"
+#include "chatty_methods.h"
+
+struct
+chatty_daemon_session
+{
+  char *name;
+  struct aichat_session session;
+  struct stat loaded;
+  unsigned long int last_used;
+};
+
+struct
+chatty_daemon_state
+{
+  struct aichat_client *client;
+  struct aichat_tokenizer *tokenizer;
+  int max_prompt_tokens;
+  int reserved_completion_tokens;
+  unsigned int context_recent_turns;
+  unsigned int context_relevant_messages;
+  unsigned int compact_threshold;
+  unsigned int compact_keep_turns;
+
+  struct chatty_daemon_session sessions [CHATTY_DAEMON_MAX_SESSIONS];
+  unsigned int session_count;
+  unsigned long int clock;
+};
+
+static volatile sig_atomic_t chatty_daemon_stopping = 0;
+
+static char *
+chatty_daemon_socket_path (void)
+{
+  const char *runtime_directory = getenv ("XDG_RUNTIME_DIR");
+  char *path = NULL;
+
+  if (runtime_directory == NULL || *runtime_directory == '\0')
+    return NULL;
+
+  if (asprintf (&path, "%s/chatty.sock", runtime_directory) < 0)
+    return NULL;
+
+  if (strlen (path) >= sizeof (((struct sockaddr_un *) NULL)->sun_path))
+  {
+    free (path);
+    return NULL;
+  }
+
+  return path;
+}
+
+static int
+chatty_daemon_connect (const char *path)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  strcpy (address.sun_path, path);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *) &address, sizeof (address)) != 0)
+  {
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static bool
+chatty_daemon_send_bytes (int fd, const char *data, unsigned long int size)
+{
+  while (size > 0)
+  {
+    // a peer that went away must not take this process down with SIGPIPE
+    ssize_t sent = send (fd, data, size, MSG_NOSIGNAL);
+
+    if (sent < 0)
+    {
+      if (errno == EINTR) continue;
+
+      // a client that stopped reading is dropped, so the rest of the reply fails at once instead of timing out again
+      shutdown (fd, SHUT_RDWR);
+      return false;
+    }
+
+    data += sent;
+    size -= sent;
+  }
+
+  return true;
+}
+
+// sends one message and releases it
+static bool
+chatty_daemon_send (int fd, json_object *jmessage)
+{
+  size_t length;
+  const char *text = json_object_to_json_string_length (jmessage, JSON_C_TO_STRING_PLAIN, &length);
+  bool sent = chatty_daemon_send_bytes (fd, text, length) && chatty_daemon_send_bytes (fd, "\n", 1);
+
+  json_object_put (jmessage);
+  return sent;
+}
+
+static bool
+chatty_daemon_send_flag (int fd, const char *key, bool value)
+{
+  json_object *jmessage = json_object_new_object ();
+  json_object_object_add (jmessage, key, json_object_new_boolean (value));
+
+  return chatty_daemon_send (fd, jmessage);
+}
+
+static bool
+chatty_daemon_send_text (int fd, const char *key, const char *text, unsigned long int length)
+{
+  json_object *jmessage = json_object_new_object ();
+  json_object_object_add (jmessage, key, json_object_new_string_len (text, length));
+
+  return chatty_daemon_send (fd, jmessage);
+}
+
+// reads one message, NULL at the end of the connection or when the line is not a JSON object
+static json_object *
+chatty_daemon_receive (FILE *connection)
+{
+  char *line = NULL;
+  size_t capacity = 0;
+  json_object *jmessage = NULL;
+
+  if (getline (&line, &capacity, connection) > 0)
+    jmessage = json_tokener_parse (line);
+
+  free (line);
+
+  if (jmessage && json_object_get_type (jmessage) != json_type_object)
+  {
+    json_object_put (jmessage);
+    jmessage = NULL;
+  }
+
+  return jmessage;
+}
+
+// reads all of the input into memory, NULL when it cannot be read
+static char *
+chatty_daemon_read_input (FILE *input, unsigned long int *length)
+{
+  char *text = NULL;
+  size_t size = 0;
+  FILE *buffer = open_memstream (&text, &size);
+
+  if (buffer == NULL)
+    return NULL;
+
+  char chunk [BUFSIZ];
+  size_t read;
+
+  while ((read = fread (chunk, 1, sizeof (chunk), input)) > 0)
+    fwrite (chunk, 1, read, buffer);
+
+  if (ferror (input) || fclose (buffer) != 0)
+  {
+    free (text);
+    return NULL;
+  }
+
+  *length = size;
+  return text;
+}
+
+// continues the session through the daemon when one is running, otherwise like chatty_extend_session
+void
+chatty_daemon_extend_session (const char *session)
+{
+  const char *setting = getenv ("CHATTY_DAEMON");
+  char *path = chatty_daemon_socket_path ();
+
+  if ((setting && strcmp (setting, "0") == 0) || path == NULL || access (path, F_OK) != 0)
+  {
+    free (path);
+    chatty_extend_session (session);
+    return;
+  }
+
+  unsigned long int length = 0;
+  char *text = chatty_daemon_read_input (stdin, &length);
+
+  if (text == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror (-AICHAT_ERROR_IO));
+    exit (1);
+  }
+
+  int fd = chatty_daemon_connect (path);
+  FILE *connection = fd >= 0 ? fdopen (fd, "r") : NULL;
+  free (path);
+
+  json_object *jready = NULL, *jreply = NULL;
+  bool ready = false;
+
+  if (connection)
+  {
+    json_object *jrequest = json_object_new_object ();
+    json_object_object_add (jrequest, "home", json_object_new_string (chatty_get_home_directory ()));
+    json_object_object_add (jrequest, "session", session ? json_object_new_string (session) : NULL);
+    json_object_object_add (jrequest, "user", json_object_new_string_len (text, length));
+
+    ready = chatty_daemon_send (fd, jrequest) && (jready = chatty_daemon_receive (connection)) != NULL &&
+            json_object_object_get_ex (jready, "ready", &jreply) && json_object_get_boolean (jreply);
+
+    json_object_put (jready);
+  }
+  else if (fd >= 0)
+  {
+    close (fd);
+  }
+
+  if (ready == false)
+  {
+    // the input was read already, it is handed over from memory
+    FILE *input = length > 0 ? fmemopen (text, length, "r") : stdin;
+
+    if (connection) fclose (connection);
+    if (input == NULL)
+    {
+      fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
+      exit (1);
+    }
+
+    chatty_extend_session_from_file (session, input);
+
+    if (input != stdin) fclose (input);
+    free (text);
+    return;
+  }
+
+  free (text);
+
+  // from here on the daemon owns the request, a failure is reported instead of falling back
+  json_object *jmessage;
+
+  while ((jmessage = chatty_daemon_receive (connection)) != NULL)
+  {
+    json_object *jvalue;
+
+    if (json_object_object_get_ex (jmessage, "delta", &jvalue))
+    {
+      fwrite (json_object_get_string (jvalue), 1, json_object_get_string_len (jvalue), stdout);
+      fflush (stdout);
+    }
+    else if (json_object_object_get_ex (jmessage, "error", &jvalue))
+    {
+      fputs (json_object_get_string (jvalue), stderr);
+      exit (1);
+    }
+    else if (json_object_object_get_ex (jmessage, "done", &jvalue))
+    {
+      putchar ('\n');
+      fflush (stdout);
+
+      if (chatty_get_stats_mode () != CHATTY_STATS_OFF && json_object_object_get_ex (jmessage, "stats", &jvalue))
+        chatty_print_stats (json_object_get (jvalue));
+
+      json_object_put (jmessage);
+      fclose (connection);
+      return;
+    }
+
+    json_object_put (jmessage);
+  }
+
+  fprintf (stderr, "%s: the daemon closed the connection before the response was complete\n", program_invocation_short_name);
+  exit (1);
+}
+
+static void
+chatty_daemon_stream (const char *delta, unsigned long int length, void *userdata)
+{
+  int fd = *(int *) userdata;
+
+  // the client may have gone away, the response is saved anyway
+  chatty_daemon_send_text (fd, "delta", delta, length);
+}
+
+static void
+chatty_daemon_drop_session (struct chatty_daemon_state *daemon, struct chatty_daemon_session *entry)
+{
+  free (entry->name);
+  aichat_session_free (&entry->session);
+
+  *entry = daemon->sessions [--daemon->session_count];
+}
+
+// the session as it is stored, from memory when nobody changed it since it was last read or written
+static struct chatty_daemon_session *
+chatty_daemon_get_session (struct chatty_daemon_state *daemon, const char *name, const char *enoent, FILE *errors)
+{
+  struct chatty_daemon_session *entry = NULL;
+  struct stat current;
+
+  for (unsigned int i = 0; i < daemon->session_count && entry == NULL; i++)
+  {
+    if (strcmp (daemon->sessions [i].name, name) == 0)
+      entry = &daemon->sessions [i];
+  }
+
+  if (entry)
+  {
+    if (chatty_stat_session (name, &current) == 0 && chatty_session_changed (&current, &entry->loaded) == false)
+    {
+      entry->last_used = ++daemon->clock;
+      return entry;
+    }
+
+    chatty_daemon_drop_session (daemon, entry);
+  }
+
+  if (daemon->session_count == CHATTY_DAEMON_MAX_SESSIONS)
+  {
+    struct chatty_daemon_session *oldest = &daemon->sessions [0];
+
+    for (unsigned int i = 1; i < daemon->session_count; i++)
+    {
+      if (daemon->sessions [i].last_used < oldest->last_used)
+        oldest = &daemon->sessions [i];
+    }
+
+    chatty_daemon_drop_session (daemon, oldest);
+  }
+
+  entry = &daemon->sessions [daemon->session_count];
+
+  if ((entry->name = strdup (name)) == NULL)
+  {
+    fprintf (errors, "%s: %s\n", program_invocation_short_name, strerror (errno));
+    return NULL;
+  }
+
+  if (chatty_load_session (&entry->session, name, enoent, &entry->loaded, errors) < 0)
+  {
+    free (entry->name);
+    return NULL;
+  }
+
+  entry->last_used = ++daemon->clock;
+  daemon->session_count++;
+
+  return entry;
+}
+
+// continues a session like chatty_extend_session does, returns 0 once the reply was sent
+static int
+chatty_daemon_extend (struct chatty_daemon_state *daemon, int fd, const char *sessionname, const char *text, FILE *errors)
+{
+  const char *enoent = sessionname ? "use the --new-session option to create a new session" : "select a session using --session or create a new session using --new-session";
+  char *name = chatty_resolve_session_name (sessionname, enoent, errors);
+
+  if (name == NULL)
+    return -1;
+
+  int lock = chatty_lock_session (name, errors);
+  struct chatty_daemon_session *entry = NULL;
+  double load_time = 0;
+
+  if (lock >= 0)
+  {
+    double start = aichat_now ();
+    entry = chatty_daemon_get_session (daemon, name, enoent, errors);
+    load_time = aichat_now () - start;
+    chatty_unlock_session (lock);
+  }
+
+  if (entry == NULL)
+  {
+    free (name);
+    return -1;
+  }
+
+  struct aichat_session *session = &entry->session;
+  unsigned int first_message = session->message_count;
+  struct aichat_api_call_results results;
+
+  int error = aichat_session_add_message (session, AICHAT_ROLE_USER, text);
+
+  if (error >= 0)
+  {
+    session->client = daemon->client;
+    session->tokenizer = daemon->tokenizer;
+    session->name = name;
+    session->max_prompt_tokens = daemon->max_prompt_tokens;
+    session->reserved_completion_tokens = daemon->reserved_completion_tokens;
+    session->context_recent_turns = daemon->context_recent_turns;
+    session->context_relevant_messages = daemon->context_relevant_messages;
+    session->compact_threshold = daemon->compact_threshold;
+    session->compact_keep_turns = daemon->compact_keep_turns;
+    session->cache_bypass = false;
+    session->stream_callback = chatty_daemon_stream;
+    session->stream_userdata = &fd;
+
+    error = aichat_session_extend (session, &results);
+
+    session->client = NULL;
+    session->tokenizer = NULL;
+    session->name = NULL;
+    session->stream_callback = NULL;
+    session->stream_userdata = NULL;
+  }
+
+  if (error >= 0)
+    chatty_report_compaction (&results, errors);
+
+  if (error < 0)
+  {
+    fprintf (errors, "%s: %s\n", program_invocation_short_name, aichat_strerror (error));
+
+    // the session in memory goes back to what is stored
+    while (session->message_count > first_message)
+      aichat_session_remove_last_message (session);
+
+    free (name);
+    return -1;
+  }
+
+  // the lock is taken before the reply so that whatever runs next waits for the session to be saved
+  if ((lock = chatty_lock_session (name, errors)) < 0)
+  {
+    chatty_daemon_drop_session (daemon, entry);
+    free (name);
+    return -1;
+  }
+
+  // the session is saved after the reply, so the time it takes is not part of the statistics
+  json_object *jdone = json_object_new_object ();
+  json_object_object_add (jdone, "done", json_object_new_boolean (true));
+  json_object_object_add (jdone, "stats", chatty_stats_to_json (&results, load_time, -1));
+  chatty_daemon_send (fd, jdone);
+
+  // a session that another chatty changed in the meantime is merged and read again when it is next used
+  struct stat current;
+  bool changed = chatty_stat_session (name, &current) != 0 || chatty_session_changed (&current, &entry->loaded);
+
+  int result = chatty_save_session (session, name, &entry->loaded, 0, first_message, true, errors);
+
+  if (result < 0 || changed || chatty_stat_session (name, &entry->loaded) != 0)
+    chatty_daemon_drop_session (daemon, entry);
+
+  chatty_unlock_session (lock);
+
+  if (result == 0 && sessionname)
+    chatty_link_last_session (sessionname, errors);
+
+  free (name);
+  return 0;
+}
+
+static void
+chatty_daemon_serve (struct chatty_daemon_state *daemon, int fd)
+{
+  // a client that stops sending or reading must not hold up everybody else
+  struct timeval timeout = { .tv_sec = CHATTY_DAEMON_REQUEST_TIMEOUT };
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  int input = dup (fd);
+  FILE *connection = input >= 0 ? fdopen (input, "r") : NULL;
+
+  if (connection == NULL)
+  {
+    if (input >= 0) close (input);
+    return;
+  }
+
+  json_object *jrequest = chatty_daemon_receive (connection);
+  json_object *jhome, *jsession, *juser;
+
+  bool ready = jrequest && json_object_object_get_ex (jrequest, "home", &jhome) && json_object_object_get_ex (jrequest, "session", &jsession) &&
+               json_object_object_get_ex (jrequest, "user", &juser) && json_object_get_type (juser) == json_type_string &&
+               strcmp (json_object_get_string (jhome), chatty_get_home_directory ()) == 0 &&
+               (jsession == NULL || json_object_get_type (jsession) == json_type_string);
+
+  const char *session = ready && jsession ? json_object_get_string (jsession) : NULL;
+
+  // the client checked the name already, it is checked again because it becomes part of a path
+  if (session && (*session == '\0' || strcmp (session, ".") == 0 || strcmp (session, "..") == 0 || strchr (session, '/') != NULL))
+    ready = false;
+
+  if (chatty_daemon_send_flag (fd, "ready", ready) && ready)
+  {
+    char *error_text = NULL;
+    size_t error_length = 0;
+    FILE *errors = open_memstream (&error_text, &error_length);
+
+    if (errors)
+    {
+      int result = chatty_daemon_extend (daemon, fd, session, json_object_get_string (juser), errors);
+      fclose (errors);
+
+      // what goes wrong after the reply was sent can only be logged
+      if (result < 0)
+        chatty_daemon_send_text (fd, "error", error_text, error_length);
+      else if (error_length > 0)
+        fputs (error_text, stderr);
+
+      free (error_text);
+    }
+  }
+
+  json_object_put (jrequest);
+  fclose (connection);
+}
+
+static void
+chatty_daemon_stop (int signal)
+{
+  (void) signal;
+  chatty_daemon_stopping = 1;
+}
+
+void
+chatty_daemon (void)
+{
+  char *path = chatty_daemon_socket_path ();
+
+  if (path == NULL)
+  {
+    fprintf (stderr, "%s: the daemon needs $XDG_RUNTIME_DIR to be set to a short enough path\n", program_invocation_short_name);
+    exit (1);
+  }
+
+  // settings are read once, the daemon serves every chatty with the settings it was started with
+  struct chatty_daemon_state daemon = { .session_count = 0, .clock = 0 };
+
+  chatty_get_durability ();
+  daemon.tokenizer = chatty_load_tokenizer ();
+  daemon.max_prompt_tokens = chatty_get_number_setting_or_die ("CHATTY_MAX_PROMPT_TOKENS", 0);
+  daemon.reserved_completion_tokens = chatty_get_number_setting_or_die ("CHATTY_RESERVED_COMPLETION_TOKENS", AICHAT_DEFAULT_RESERVED_COMPLETION_TOKENS);
+  daemon.context_recent_turns = chatty_get_number_setting_or_die ("CHATTY_CONTEXT_RECENT_TURNS", 0);
+  daemon.context_relevant_messages = chatty_get_number_setting_or_die ("CHATTY_CONTEXT_RELEVANT_MESSAGES", 0);
+  daemon.compact_threshold = chatty_get_number_setting_or_die ("CHATTY_COMPACT_THRESHOLD", 0);
+  daemon.compact_keep_turns = chatty_get_number_setting_or_die ("CHATTY_COMPACT_KEEP_TURNS", AICHAT_DEFAULT_COMPACT_KEEP_TURNS);
+
+  // the whole point of the daemon is a client that stays warm
+  if ((daemon.client = chatty_client_initialize_or_die ()) == NULL && (daemon.client = aichat_client_initialize ()) == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror (-AICHAT_ERROR_CURL_INITIALIZATION));
+    exit (1);
+  }
+
+  int existing = chatty_daemon_connect (path);
+
+  if (existing >= 0)
+  {
+    fprintf (stderr, "%s: a daemon is already listening on '%s'\n", program_invocation_short_name, path);
+    exit (1);
+  }
+
+  // nobody listens on a socket that is left over from a daemon that did not stop cleanly
+  if (unlink (path) != 0 && errno != ENOENT)
+    goto chatty_daemon_error;
+
+  int listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (listener < 0)
+    goto chatty_daemon_error;
+
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  strcpy (address.sun_path, path);
+
+  // only the user may connect, the daemon acts on their sessions and with their API key
+  mode_t mask = umask (0077);
+  int bound = bind (listener, (struct sockaddr *) &address, sizeof (address));
+  umask (mask);
+
+  if (bound != 0 || listen (listener, 16) != 0)
+    goto chatty_daemon_error;
+
+  struct sigaction action = { .sa_handler = chatty_daemon_stop };
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  fprintf (stderr, "%s: listening on '%s'\n", program_invocation_short_name, path);
+
+  while (chatty_daemon_stopping == 0)
+  {
+    int fd = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+
+      fprintf (stderr, "%s: cannot accept connections on '%s': %s\n", program_invocation_short_name, path, strerror (errno));
+      break;
+    }
+
+    chatty_daemon_serve (&daemon, fd);
+    close (fd);
+  }
+
+  unlink (path);
+  close (listener);
+  free (path);
+
+  while (daemon.session_count > 0)
+    chatty_daemon_drop_session (&daemon, &daemon.sessions [0]);
+
+  aichat_tokenizer_free (daemon.tokenizer);
+  aichat_client_free (daemon.client);
+  return;
+
+chatty_daemon_error:
+  fprintf (stderr, "%s: cannot listen on '%s': %s\n", program_invocation_short_name, path, strerror (errno));
+  exit (1);
+}
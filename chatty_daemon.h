@@ -0,0 +1,7 @@
+#pragma once
+
+#define CHATTY_DAEMON_MAX_SESSIONS 16
+#define CHATTY_DAEMON_REQUEST_TIMEOUT 10 // seconds
+
+void chatty_daemon (void);
+void chatty_daemon_extend_session (const char *session);
@@ -0,0 +1,1890 @@
+// search mode: chatty --search=<query> finds the messages of all sessions that best match the query
+//
+// Every message is a document of an inverted index in $XDG_DATA_HOME/chatty/index. The index is a list of
+// immutable segments, each with a sorted term dictionary whose postings are the document numbers, delta
+// encoded as varints, each followed by how often the term occurs in the document. A manifest names the
+// segments and, for every session, the runs of messages that are in which segment. Saving a session only
+// indexes its new messages into a new segment and cuts the runs of the messages that were replaced or
+// removed, so a message that is in a segment but in no run is dead and skipped. A new segment is merged
+// into the one before it as soon as it holds a quarter of its live messages, which keeps the number of
+// segments logarithmic in the number of messages and drops dead messages along the way.
+//
+// Sessions are only indexed once there is an index, which the first search builds. Before every search the
+// index is compared with the session catalog and sessions that changed without chatty are indexed again.
+// Matches are ranked with BM25 and shown with a snippet of the message around the first term that matched.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aichat.h"
+#include "chatty_catalog.h"
+#include "chatty_index.h"
+#include "chatty_methods.h"
+
+#define CHATTY_INDEX_MAGIC "CHATTYIX"
+#define CHATTY_INDEX_SEGMENT_MAGIC "CHATTYSG"
+#define CHATTY_INDEX_VERSION 1
+
+// longer terms are cut short, they are rarely searched for
+#define CHATTY_INDEX_MAX_TERM_LENGTH 64
+#define CHATTY_INDEX_MAX_QUERY_TERMS 32
+
+// a segment is merged into the one before it once it holds 1/CHATTY_INDEX_MERGE_RATIO of its live messages
+#define CHATTY_INDEX_MERGE_RATIO 4
+
+#define CHATTY_INDEX_BM25_K1 1.2
+#define CHATTY_INDEX_BM25_B 0.75
+
+#define CHATTY_INDEX_SNIPPET_BEFORE 60
+#define CHATTY_INDEX_SNIPPET_AFTER 100
+
+struct
+chatty_index_manifest_header
+{
+  char magic [8]; // CHATTY_INDEX_MAGIC without the terminating null byte
+  uint32_t version;
+  uint32_t segment_count;
+  uint32_t session_count;
+  uint32_t next_segment;
+};
+
+// follows the header once per session, then the name without a null byte and the runs
+struct
+chatty_index_manifest_session
+{
+  int64_t time;
+  uint64_t size;
+  uint32_t run_count;
+  uint32_t name_length;
+};
+
+// the messages from first_message on that are documents of the segment
+struct
+chatty_index_run
+{
+  uint32_t segment;
+  uint32_t first_message;
+  uint32_t count;
+};
+
+struct
+chatty_index_session
+{
+  char *name;
+  int64_t time; // the modification time and size of the session file when it was indexed
+  uint64_t size;
+  struct chatty_index_run *runs;
+  uint32_t run_count;
+  uint32_t run_capacity;
+  bool seen;
+};
+
+struct
+chatty_index_manifest
+{
+  uint32_t next_segment;
+  uint32_t *segments; // oldest first
+  unsigned long int segment_count;
+  unsigned long int segment_capacity;
+  struct chatty_index_session *sessions; // sorted by name
+  unsigned long int session_count;
+  unsigned long int session_capacity;
+  uint32_t *obsolete; // segments to delete once the manifest that no longer names them is written
+  unsigned long int obsolete_count;
+  unsigned long int obsolete_capacity;
+};
+
+// a segment file is the header followed by its sessions, documents, terms, strings and postings, each
+// aligned to 8 bytes. Strings are null terminated, their lengths leave the null byte out.
+struct
+chatty_index_segment_header
+{
+  char magic [8]; // CHATTY_INDEX_SEGMENT_MAGIC without the terminating null byte
+  uint32_t version;
+  uint32_t document_count;
+  uint32_t session_count;
+  uint32_t term_count;
+  uint64_t total_length;
+  uint64_t sessions_offset;
+  uint64_t documents_offset;
+  uint64_t terms_offset;
+  uint64_t strings_offset;
+  uint64_t postings_offset;
+  uint64_t size;
+};
+
+struct
+chatty_index_segment_string
+{
+  uint32_t offset;
+  uint32_t length;
+};
+
+// a message of a session, its length is the number of terms in it
+struct
+chatty_index_document
+{
+  uint32_t session;
+  uint32_t message;
+  uint32_t length;
+};
+
+struct
+chatty_index_segment_term
+{
+  uint32_t offset;
+  uint32_t length;
+  uint32_t document_count;
+  uint32_t postings_length;
+  uint64_t postings_offset;
+};
+
+struct
+chatty_index_segment
+{
+  uint32_t id;
+  void *data;
+  unsigned long int size;
+  const struct chatty_index_segment_header *header;
+  const struct chatty_index_segment_string *sessions;
+  const struct chatty_index_document *documents;
+  const struct chatty_index_segment_term *terms;
+  const char *strings;
+  const unsigned char *postings;
+  unsigned char *live;
+  uint32_t base; // the number of the first document of the segment among the documents of all segments
+};
+
+// the postings of a term while a segment is built, pairs of document and count
+struct
+chatty_index_builder_term
+{
+  char *text;
+  uint32_t length;
+  uint32_t *postings;
+  uint32_t posting_count;
+  uint32_t posting_capacity;
+};
+
+struct
+chatty_index_builder
+{
+  struct chatty_index_builder_term *terms;
+  unsigned long int term_count;
+  unsigned long int mask;
+  struct chatty_index_document *documents;
+  unsigned long int document_count;
+  unsigned long int document_capacity;
+  char **sessions;
+  unsigned long int session_count;
+  unsigned long int session_capacity;
+  uint64_t total_length;
+  bool failed;
+};
+
+struct
+chatty_index_hit
+{
+  double score;
+  uint32_t document;
+};
+
+typedef void (*chatty_index_term_callback) (const char *term, uint32_t length, void *userdata);
+
+static char *
+chatty_index_path (const char *name)
+{
+  char *path = NULL;
+
+  if (asprintf (&path, "%s/index%s%s", chatty_get_home_directory (), name ? "/" : "", name ? name : "") < 0)
+    return NULL;
+
+  return path;
+}
+
+static char *
+chatty_index_segment_path (uint32_t id)
+{
+  char name [16];
+
+  snprintf (name, sizeof (name), "%08x", id);
+  return chatty_index_path (name);
+}
+
+// the lock that guards the manifest and the segments, or -1. Without create the index is not made
+// when there is none yet.
+static int
+chatty_index_lock (int operation, bool create)
+{
+  char *directory = chatty_index_path (NULL);
+  char *path = chatty_index_path ("lock");
+  int fd = -1;
+
+  if (directory && path && (create == false || mkdir (directory, 0775) == 0 || errno == EEXIST))
+    fd = open (path, create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0600);
+
+  free (directory);
+  free (path);
+
+  while (fd >= 0 && flock (fd, operation) != 0)
+  {
+    if (errno != EINTR)
+    {
+      close (fd);
+      fd = -1;
+    }
+  }
+
+  return fd;
+}
+
+// terms
+
+// terms are runs of letters, digits and bytes of multibyte characters, with ASCII letters lowercased
+static void
+chatty_index_tokenize (const char *text, unsigned long int length, chatty_index_term_callback callback, void *userdata)
+{
+  char term [CHATTY_INDEX_MAX_TERM_LENGTH];
+  uint32_t term_length = 0;
+  bool in_term = false;
+
+  for (unsigned long int i = 0; i <= length; i++)
+  {
+    unsigned char c = i < length ? (unsigned char) text [i] : ' ';
+    bool word = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+
+    if (word)
+    {
+      if (term_length < CHATTY_INDEX_MAX_TERM_LENGTH)
+        term [term_length++] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+
+      in_term = true;
+      continue;
+    }
+
+    if (in_term)
+      callback (term, term_length, userdata);
+
+    term_length = 0;
+    in_term = false;
+  }
+}
+
+static int
+chatty_index_compare_terms (const char *a, uint32_t a_length, const char *b, uint32_t b_length)
+{
+  int order = memcmp (a, b, a_length < b_length ? a_length : b_length);
+
+  if (order != 0)
+    return order;
+
+  return a_length < b_length ? -1 : a_length > b_length;
+}
+
+static uint64_t
+chatty_index_hash (const char *key, uint32_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (uint32_t i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char) key [i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static unsigned char *
+chatty_index_put_varint (unsigned char *output, uint32_t value)
+{
+  while (value >= 0x80)
+  {
+    *output++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+
+  *output++ = value;
+  return output;
+}
+
+// NULL when the varint runs past the end
+static const unsigned char *
+chatty_index_get_varint (const unsigned char *input, const unsigned char *end, uint32_t *value)
+{
+  uint32_t result = 0;
+
+  for (unsigned int shift = 0; input < end && shift < 35; shift += 7)
+  {
+    unsigned char byte = *input++;
+    result |= (uint32_t) (byte & 0x7f) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      *value = result;
+      return input;
+    }
+  }
+
+  return NULL;
+}
+
+// building segments
+
+static void
+chatty_index_builder_free (struct chatty_index_builder *builder)
+{
+  for (unsigned long int i = 0; builder->terms && i <= builder->mask; i++)
+  {
+    free (builder->terms [i].text);
+    free (builder->terms [i].postings);
+  }
+
+  for (unsigned long int i = 0; i < builder->session_count; i++)
+    free (builder->sessions [i]);
+
+  free (builder->terms);
+  free (builder->documents);
+  free (builder->sessions);
+  memset (builder, 0, sizeof (*builder));
+}
+
+static struct chatty_index_builder_term *
+chatty_index_builder_insert (struct chatty_index_builder_term *terms, unsigned long int mask, const char *text, uint32_t length)
+{
+  unsigned long int index = chatty_index_hash (text, length) & mask;
+
+  while (terms [index].text != NULL && chatty_index_compare_terms (terms [index].text, terms [index].length, text, length) != 0)
+    index = (index + 1) & mask;
+
+  return &terms [index];
+}
+
+// the term, which is added when it is not there yet, or NULL when memory ran out
+static struct chatty_index_builder_term *
+chatty_index_builder_term (struct chatty_index_builder *builder, const char *text, uint32_t length)
+{
+  // keep the table at most half full
+  if (2 * (builder->term_count + 1) > builder->mask + 1)
+  {
+    unsigned long int capacity = builder->terms ? 2 * (builder->mask + 1) : 1024;
+    struct chatty_index_builder_term *terms = calloc (capacity, sizeof (struct chatty_index_builder_term));
+
+    if (terms == NULL)
+      return NULL;
+
+    for (unsigned long int i = 0; builder->terms && i <= builder->mask; i++)
+    {
+      if (builder->terms [i].text != NULL)
+        *chatty_index_builder_insert (terms, capacity - 1, builder->terms [i].text, builder->terms [i].length) = builder->terms [i];
+    }
+
+    free (builder->terms);
+    builder->terms = terms;
+    builder->mask = capacity - 1;
+  }
+
+  struct chatty_index_builder_term *term = chatty_index_builder_insert (builder->terms, builder->mask, text, length);
+
+  if (term->text == NULL)
+  {
+    term->text = malloc (length + 1);
+
+    if (term->text == NULL)
+      return NULL;
+
+    memcpy (term->text, text, length);
+    term->text [length] = '\0';
+    term->length = length;
+    builder->term_count++;
+  }
+
+  return term;
+}
+
+// documents are added in order, so the postings of a term stay sorted by document
+static void
+chatty_index_builder_add (struct chatty_index_builder *builder, const char *text, uint32_t length, uint32_t document, uint32_t count)
+{
+  struct chatty_index_builder_term *term = chatty_index_builder_term (builder, text, length);
+
+  if (term == NULL)
+  {
+    builder->failed = true;
+    return;
+  }
+
+  if (term->posting_count > 0 && term->postings [2 * term->posting_count - 2] == document)
+  {
+    term->postings [2 * term->posting_count - 1] += count;
+    return;
+  }
+
+  if (term->posting_count == term->posting_capacity)
+  {
+    uint32_t capacity = term->posting_capacity ? 2 * term->posting_capacity : 4;
+    uint32_t *postings = realloc (term->postings, 2 * capacity * sizeof (uint32_t));
+
+    if (postings == NULL)
+    {
+      builder->failed = true;
+      return;
+    }
+
+    term->postings = postings;
+    term->posting_capacity = capacity;
+  }
+
+  term->postings [2 * term->posting_count] = document;
+  term->postings [2 * term->posting_count + 1] = count;
+  term->posting_count++;
+}
+
+// a new document for the message, the documents of a session are added one after the other
+static long int
+chatty_index_builder_document (struct chatty_index_builder *builder, const char *session, uint32_t message, uint32_t length)
+{
+  if (builder->session_count == 0 || strcmp (builder->sessions [builder->session_count - 1], session) != 0)
+  {
+    if (builder->session_count == builder->session_capacity)
+    {
+      unsigned long int capacity = builder->session_capacity ? 2 * builder->session_capacity : 16;
+      char **sessions = realloc (builder->sessions, capacity * sizeof (char *));
+
+      if (sessions == NULL)
+        return -1;
+
+      builder->sessions = sessions;
+      builder->session_capacity = capacity;
+    }
+
+    if ((builder->sessions [builder->session_count] = strdup (session)) == NULL)
+      return -1;
+
+    builder->session_count++;
+  }
+
+  if (builder->document_count == builder->document_capacity)
+  {
+    unsigned long int capacity = builder->document_capacity ? 2 * builder->document_capacity : 256;
+    struct chatty_index_document *documents = realloc (builder->documents, capacity * sizeof (struct chatty_index_document));
+
+    if (documents == NULL)
+      return -1;
+
+    builder->documents = documents;
+    builder->document_capacity = capacity;
+  }
+
+  struct chatty_index_document *document = &builder->documents [builder->document_count];
+
+  document->session = builder->session_count - 1;
+  document->message = message;
+  document->length = length;
+  builder->total_length += length;
+
+  return builder->document_count++;
+}
+
+struct
+chatty_index_builder_message
+{
+  struct chatty_index_builder *builder;
+  uint32_t document;
+  uint32_t length;
+};
+
+static void
+chatty_index_builder_message_term (const char *term, uint32_t length, void *userdata)
+{
+  struct chatty_index_builder_message *message = userdata;
+
+  chatty_index_builder_add (message->builder, term, length, message->document, 1);
+  message->length++;
+}
+
+static void
+chatty_index_builder_add_message (struct chatty_index_builder *builder, const char *session, uint32_t index, struct aichat_message *message)
+{
+  long int document = chatty_index_builder_document (builder, session, index, 0);
+
+  if (document < 0)
+  {
+    builder->failed = true;
+    return;
+  }
+
+  struct chatty_index_builder_message context = { builder, document, 0 };
+
+  chatty_index_tokenize (message->text, message->length, chatty_index_builder_message_term, &context);
+  builder->documents [document].length = context.length;
+  builder->total_length += context.length;
+}
+
+static int
+chatty_index_compare_builder_terms (const void *a, const void *b)
+{
+  const struct chatty_index_builder_term *x = *(const struct chatty_index_builder_term **) a, *y = *(const struct chatty_index_builder_term **) b;
+  return chatty_index_compare_terms (x->text, x->length, y->text, y->length);
+}
+
+static unsigned long int
+chatty_index_align (unsigned long int offset)
+{
+  return (offset + 7) & ~7UL;
+}
+
+static int
+chatty_index_builder_write (struct chatty_index_builder *builder, uint32_t id)
+{
+  if (builder->failed)
+    return -1;
+
+  // the dictionary is sorted for the binary search, the postings of every term are written in that order
+  struct chatty_index_builder_term **sorted = malloc ((builder->term_count ? builder->term_count : 1) * sizeof (struct chatty_index_builder_term *));
+  unsigned long int count = 0, strings_size = 0, postings_size = 0;
+
+  if (sorted == NULL)
+    return -1;
+
+  for (unsigned long int i = 0; builder->terms && i <= builder->mask; i++)
+  {
+    struct chatty_index_builder_term *term = &builder->terms [i];
+
+    if (term->text == NULL)
+      continue;
+
+    sorted [count++] = term;
+    strings_size += term->length + 1;
+    postings_size += 10 * term->posting_count;
+  }
+
+  qsort (sorted, count, sizeof (struct chatty_index_builder_term *), chatty_index_compare_builder_terms);
+
+  for (unsigned long int i = 0; i < builder->session_count; i++)
+    strings_size += strlen (builder->sessions [i]) + 1;
+
+  struct chatty_index_segment_header header;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CHATTY_INDEX_SEGMENT_MAGIC, sizeof (header.magic));
+  header.version = CHATTY_INDEX_VERSION;
+  header.document_count = builder->document_count;
+  header.session_count = builder->session_count;
+  header.term_count = count;
+  header.total_length = builder->total_length;
+  header.sessions_offset = chatty_index_align (sizeof (header));
+  header.documents_offset = chatty_index_align (header.sessions_offset + builder->session_count * sizeof (struct chatty_index_segment_string));
+  header.terms_offset = chatty_index_align (header.documents_offset + builder->document_count * sizeof (struct chatty_index_document));
+  header.strings_offset = chatty_index_align (header.terms_offset + count * sizeof (struct chatty_index_segment_term));
+  header.postings_offset = chatty_index_align (header.strings_offset + strings_size);
+
+  // the postings are sized for the longest varints and the file is cut to what they took
+  unsigned char *data = calloc (1, header.postings_offset + postings_size);
+
+  if (data == NULL)
+  {
+    free (sorted);
+    return -1;
+  }
+
+  struct chatty_index_segment_string *sessions = (struct chatty_index_segment_string *) (data + header.sessions_offset);
+  struct chatty_index_segment_term *terms = (struct chatty_index_segment_term *) (data + header.terms_offset);
+  char *strings = (char *) (data + header.strings_offset);
+  unsigned char *postings = data + header.postings_offset;
+  unsigned long int string_offset = 0;
+  unsigned char *output = postings;
+
+  memcpy (data + header.documents_offset, builder->documents, builder->document_count * sizeof (struct chatty_index_document));
+
+  for (unsigned long int i = 0; i < builder->session_count; i++)
+  {
+    unsigned long int length = strlen (builder->sessions [i]);
+
+    sessions [i].offset = string_offset;
+    sessions [i].length = length;
+    memcpy (strings + string_offset, builder->sessions [i], length + 1);
+    string_offset += length + 1;
+  }
+
+  for (unsigned long int i = 0; i < count; i++)
+  {
+    struct chatty_index_builder_term *term = sorted [i];
+    unsigned char *start = output;
+    uint32_t previous = 0;
+
+    terms [i].offset = string_offset;
+    terms [i].length = term->length;
+    terms [i].document_count = term->posting_count;
+    memcpy (strings + string_offset, term->text, term->length + 1);
+    string_offset += term->length + 1;
+
+    for (uint32_t j = 0; j < term->posting_count; j++)
+    {
+      output = chatty_index_put_varint (output, term->postings [2 * j] - previous);
+      output = chatty_index_put_varint (output, term->postings [2 * j + 1]);
+      previous = term->postings [2 * j];
+    }
+
+    terms [i].postings_offset = start - postings;
+    terms [i].postings_length = output - start;
+  }
+
+  header.size = output - data;
+  memcpy (data, &header, sizeof (header));
+  free (sorted);
+
+  char *path = chatty_index_segment_path (id);
+  int fd = path ? open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+  int result = -1;
+
+  if (fd >= 0)
+  {
+    unsigned long int written = 0;
+
+    while (written < header.size)
+    {
+      ssize_t size = write (fd, data + written, header.size - written);
+
+      if (size < 0 && errno == EINTR)
+        continue;
+
+      if (size <= 0)
+        break;
+
+      written += size;
+    }
+
+    result = written == header.size && close (fd) == 0 ? 0 : -1;
+
+    if (written != header.size)
+      close (fd);
+
+    if (result < 0)
+      unlink (path);
+  }
+
+  free (path);
+  free (data);
+  return result;
+}
+
+// the manifest
+
+static void
+chatty_index_manifest_free (struct chatty_index_manifest *manifest)
+{
+  for (unsigned long int i = 0; i < manifest->session_count; i++)
+  {
+    free (manifest->sessions [i].name);
+    free (manifest->sessions [i].runs);
+  }
+
+  free (manifest->segments);
+  free (manifest->sessions);
+  free (manifest->obsolete);
+  memset (manifest, 0, sizeof (*manifest));
+}
+
+static int
+chatty_index_add_segment_id (uint32_t **ids, unsigned long int *count, unsigned long int *capacity, uint32_t id)
+{
+  if (*count == *capacity)
+  {
+    unsigned long int larger = *capacity ? 2 * *capacity : 16;
+    uint32_t *grown = realloc (*ids, larger * sizeof (uint32_t));
+
+    if (grown == NULL)
+      return -1;
+
+    *ids = grown;
+    *capacity = larger;
+  }
+
+  (*ids) [(*count)++] = id;
+  return 0;
+}
+
+static int
+chatty_index_compare_session_name (const void *key, const void *session)
+{
+  return strcmp (key, ((const struct chatty_index_session *) session)->name);
+}
+
+static struct chatty_index_session *
+chatty_index_manifest_find (struct chatty_index_manifest *manifest, const char *name)
+{
+  if (manifest->session_count == 0)
+    return NULL;
+
+  return bsearch (name, manifest->sessions, manifest->session_count, sizeof (struct chatty_index_session), chatty_index_compare_session_name);
+}
+
+// the session, which is added without runs when it is not there yet. Sessions that were found
+// before may move.
+static struct chatty_index_session *
+chatty_index_manifest_session (struct chatty_index_manifest *manifest, const char *name)
+{
+  unsigned long int low = 0, high = manifest->session_count;
+
+  while (low < high)
+  {
+    unsigned long int middle = (low + high) / 2;
+    int order = strcmp (manifest->sessions [middle].name, name);
+
+    if (order == 0)
+      return &manifest->sessions [middle];
+
+    if (order < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (manifest->session_count == manifest->session_capacity)
+  {
+    unsigned long int capacity = manifest->session_capacity ? 2 * manifest->session_capacity : 64;
+    struct chatty_index_session *sessions = realloc (manifest->sessions, capacity * sizeof (struct chatty_index_session));
+
+    if (sessions == NULL)
+      return NULL;
+
+    manifest->sessions = sessions;
+    manifest->session_capacity = capacity;
+  }
+
+  struct chatty_index_session session = { .name = strdup (name) };
+
+  if (session.name == NULL)
+    return NULL;
+
+  memmove (&manifest->sessions [low + 1], &manifest->sessions [low], (manifest->session_count - low) * sizeof (struct chatty_index_session));
+  manifest->sessions [low] = session;
+  manifest->session_count++;
+
+  return &manifest->sessions [low];
+}
+
+static void
+chatty_index_manifest_remove (struct chatty_index_manifest *manifest, struct chatty_index_session *session)
+{
+  unsigned long int index = session - manifest->sessions;
+
+  free (session->name);
+  free (session->runs);
+  memmove (session, session + 1, (manifest->session_count - index - 1) * sizeof (struct chatty_index_session));
+  manifest->session_count--;
+}
+
+// keeps only the messages before first_message
+static void
+chatty_index_session_truncate (struct chatty_index_session *session, uint32_t first_message)
+{
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < session->run_count; i++)
+  {
+    struct chatty_index_run run = session->runs [i];
+
+    if (run.first_message >= first_message)
+      continue;
+
+    if (run.first_message + run.count > first_message)
+      run.count = first_message - run.first_message;
+
+    session->runs [count++] = run;
+  }
+
+  session->run_count = count;
+}
+
+// the number of messages from the start of the session that are in the index
+static uint32_t
+chatty_index_session_indexed (struct chatty_index_session *session)
+{
+  uint32_t end = 0;
+
+  for (uint32_t i = 0; i < session->run_count; i++)
+  {
+    if (session->runs [i].first_message + session->runs [i].count > end)
+      end = session->runs [i].first_message + session->runs [i].count;
+  }
+
+  return end;
+}
+
+static int
+chatty_index_session_add (struct chatty_index_session *session, uint32_t segment, uint32_t message)
+{
+  if (session->run_count > 0)
+  {
+    struct chatty_index_run *last = &session->runs [session->run_count - 1];
+
+    if (last->segment == segment && last->first_message + last->count == message)
+    {
+      last->count++;
+      return 0;
+    }
+  }
+
+  if (session->run_count == session->run_capacity)
+  {
+    uint32_t capacity = session->run_capacity ? 2 * session->run_capacity : 4;
+    struct chatty_index_run *runs = realloc (session->runs, capacity * sizeof (struct chatty_index_run));
+
+    if (runs == NULL)
+      return -1;
+
+    session->runs = runs;
+    session->run_capacity = capacity;
+  }
+
+  session->runs [session->run_count++] = (struct chatty_index_run) { segment, message, 1 };
+  return 0;
+}
+
+static bool
+chatty_index_session_covers (const struct chatty_index_session *session, uint32_t segment, uint32_t message)
+{
+  for (uint32_t i = 0; i < session->run_count; i++)
+  {
+    const struct chatty_index_run *run = &session->runs [i];
+
+    if (run->segment == segment && message >= run->first_message && message - run->first_message < run->count)
+      return true;
+  }
+
+  return false;
+}
+
+// reads the manifest, -1 when there is none or it is damaged
+static int
+chatty_index_manifest_read (struct chatty_index_manifest *manifest)
+{
+  memset (manifest, 0, sizeof (*manifest));
+
+  char *path = chatty_index_path ("manifest");
+  int fd = path ? open (path, O_RDONLY | O_CLOEXEC) : -1;
+  struct stat status;
+
+  free (path);
+
+  if (fd < 0 || fstat (fd, &status) != 0 || (unsigned long int) status.st_size < sizeof (struct chatty_index_manifest_header))
+  {
+    if (fd >= 0) close (fd);
+    return -1;
+  }
+
+  const char *data = mmap (NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return -1;
+
+  const char *cursor = data, *end = data + status.st_size;
+  struct chatty_index_manifest_header header;
+
+  memcpy (&header, cursor, sizeof (header));
+  cursor += sizeof (header);
+
+  if (memcmp (header.magic, CHATTY_INDEX_MAGIC, sizeof (header.magic)) != 0 || header.version != CHATTY_INDEX_VERSION ||
+      (unsigned long int) (end - cursor) / sizeof (uint32_t) < header.segment_count)
+    goto chatty_index_manifest_read_error;
+
+  manifest->next_segment = header.next_segment;
+
+  for (uint32_t i = 0; i < header.segment_count; i++)
+  {
+    uint32_t id;
+
+    memcpy (&id, cursor, sizeof (id));
+    cursor += sizeof (id);
+
+    if (chatty_index_add_segment_id (&manifest->segments, &manifest->segment_count, &manifest->segment_capacity, id) < 0)
+      goto chatty_index_manifest_read_error;
+  }
+
+  // the sessions were written in order, so every one of them goes to the end
+  for (uint32_t i = 0; i < header.session_count; i++)
+  {
+    struct chatty_index_manifest_session record;
+
+    if ((unsigned long int) (end - cursor) < sizeof (record))
+      goto chatty_index_manifest_read_error;
+
+    memcpy (&record, cursor, sizeof (record));
+    cursor += sizeof (record);
+
+    if ((unsigned long int) (end - cursor) < record.name_length ||
+        (unsigned long int) (end - cursor - record.name_length) / sizeof (struct chatty_index_run) < record.run_count)
+      goto chatty_index_manifest_read_error;
+
+    char *name = strndup (cursor, record.name_length);
+    cursor += record.name_length;
+
+    if (name == NULL)
+      goto chatty_index_manifest_read_error;
+
+    struct chatty_index_session *session = chatty_index_manifest_session (manifest, name);
+    free (name);
+
+    if (session == NULL || session->run_count > 0)
+      goto chatty_index_manifest_read_error;
+
+    session->time = record.time;
+    session->size = record.size;
+
+    if (record.run_count > 0)
+    {
+      session->runs = malloc (record.run_count * sizeof (struct chatty_index_run));
+
+      if (session->runs == NULL)
+        goto chatty_index_manifest_read_error;
+
+      memcpy (session->runs, cursor, record.run_count * sizeof (struct chatty_index_run));
+      session->run_count = session->run_capacity = record.run_count;
+      cursor += record.run_count * sizeof (struct chatty_index_run);
+    }
+  }
+
+  munmap ((void *) data, status.st_size);
+  return 0;
+
+chatty_index_manifest_read_error:
+  munmap ((void *) data, status.st_size);
+  chatty_index_manifest_free (manifest);
+  return -1;
+}
+
+// the manifest is replaced at once, readers see either the old or the new one
+static int
+chatty_index_manifest_write (struct chatty_index_manifest *manifest)
+{
+  char *path = chatty_index_path ("manifest");
+  char *temporary_path = chatty_index_path ("manifest.new");
+  FILE *file = temporary_path ? fopen (temporary_path, "we") : NULL;
+  int result = -1;
+
+  if (file)
+  {
+    struct chatty_index_manifest_header header;
+    bool written = true;
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, CHATTY_INDEX_MAGIC, sizeof (header.magic));
+    header.version = CHATTY_INDEX_VERSION;
+    header.segment_count = manifest->segment_count;
+    header.session_count = manifest->session_count;
+    header.next_segment = manifest->next_segment;
+
+    written = fwrite (&header, sizeof (header), 1, file) == 1;
+    written = written && fwrite (manifest->segments, sizeof (uint32_t), manifest->segment_count, file) == manifest->segment_count;
+
+    for (unsigned long int i = 0; i < manifest->session_count && written; i++)
+    {
+      struct chatty_index_session *session = &manifest->sessions [i];
+      struct chatty_index_manifest_session record = { session->time, session->size, session->run_count, strlen (session->name) };
+
+      written = fwrite (&record, sizeof (record), 1, file) == 1 && fwrite (session->name, 1, record.name_length, file) == record.name_length &&
+                fwrite (session->runs, sizeof (struct chatty_index_run), session->run_count, file) == session->run_count;
+    }
+
+    if (fclose (file) == 0 && written && rename (temporary_path, path) == 0)
+      result = 0;
+    else
+      unlink (temporary_path);
+  }
+
+  // the segments that are no longer named are only deleted once nothing can read them anymore
+  for (unsigned long int i = 0; result == 0 && i < manifest->obsolete_count; i++)
+  {
+    char *segment_path = chatty_index_segment_path (manifest->obsolete [i]);
+
+    if (segment_path)
+      unlink (segment_path);
+
+    free (segment_path);
+  }
+
+  manifest->obsolete_count = 0;
+  free (path);
+  free (temporary_path);
+  return result;
+}
+
+// reading segments
+
+static void
+chatty_index_segment_unmap (struct chatty_index_segment *segment)
+{
+  if (segment->data)
+    munmap (segment->data, segment->size);
+
+  free (segment->live);
+  segment->data = NULL;
+  segment->live = NULL;
+}
+
+static bool
+chatty_index_segment_section (const struct chatty_index_segment_header *header, uint64_t offset, uint64_t count, uint64_t size)
+{
+  return offset % 8 == 0 && offset <= header->size && (header->size - offset) / size >= count;
+}
+
+static int
+chatty_index_segment_map (struct chatty_index_segment *segment, uint32_t id)
+{
+  memset (segment, 0, sizeof (*segment));
+  segment->id = id;
+
+  char *path = chatty_index_segment_path (id);
+  int fd = path ? open (path, O_RDONLY | O_CLOEXEC) : -1;
+  struct stat status;
+
+  free (path);
+
+  if (fd < 0 || fstat (fd, &status) != 0 || (unsigned long int) status.st_size < sizeof (struct chatty_index_segment_header))
+  {
+    if (fd >= 0) close (fd);
+    return -1;
+  }
+
+  void *data = mmap (NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return -1;
+
+  segment->data = data;
+  segment->size = status.st_size;
+
+  const struct chatty_index_segment_header *header = data;
+
+  if (memcmp (header->magic, CHATTY_INDEX_SEGMENT_MAGIC, sizeof (header->magic)) != 0 || header->version != CHATTY_INDEX_VERSION ||
+      header->size != (uint64_t) status.st_size ||
+      chatty_index_segment_section (header, header->sessions_offset, header->session_count, sizeof (struct chatty_index_segment_string)) == false ||
+      chatty_index_segment_section (header, header->documents_offset, header->document_count, sizeof (struct chatty_index_document)) == false ||
+      chatty_index_segment_section (header, header->terms_offset, header->term_count, sizeof (struct chatty_index_segment_term)) == false ||
+      header->strings_offset > header->postings_offset || header->postings_offset > header->size)
+  {
+    chatty_index_segment_unmap (segment);
+    return -1;
+  }
+
+  segment->header = header;
+  segment->sessions = (const struct chatty_index_segment_string *) ((const char *) data + header->sessions_offset);
+  segment->documents = (const struct chatty_index_document *) ((const char *) data + header->documents_offset);
+  segment->terms = (const struct chatty_index_segment_term *) ((const char *) data + header->terms_offset);
+  segment->strings = (const char *) data + header->strings_offset;
+  segment->postings = (const unsigned char *) data + header->postings_offset;
+
+  // every string and every postings list has to be inside the file for the lookups to trust them
+  uint64_t strings_size = header->postings_offset - header->strings_offset;
+  uint64_t postings_size = header->size - header->postings_offset;
+
+  for (uint32_t i = 0; i < header->session_count; i++)
+  {
+    if (segment->sessions [i].offset >= strings_size || strings_size - segment->sessions [i].offset <= segment->sessions [i].length ||
+        segment->strings [segment->sessions [i].offset + segment->sessions [i].length] != '\0')
+    {
+      chatty_index_segment_unmap (segment);
+      return -1;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->document_count; i++)
+  {
+    if (segment->documents [i].session >= header->session_count)
+    {
+      chatty_index_segment_unmap (segment);
+      return -1;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->term_count; i++)
+  {
+    const struct chatty_index_segment_term *term = &segment->terms [i];
+
+    if (term->offset >= strings_size || strings_size - term->offset <= term->length || term->postings_offset > postings_size ||
+        postings_size - term->postings_offset < term->postings_length)
+    {
+      chatty_index_segment_unmap (segment);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static const struct chatty_index_segment_term *
+chatty_index_segment_find (const struct chatty_index_segment *segment, const char *text, uint32_t length)
+{
+  uint32_t low = 0, high = segment->header->term_count;
+
+  while (low < high)
+  {
+    uint32_t middle = low + (high - low) / 2;
+    const struct chatty_index_segment_term *term = &segment->terms [middle];
+    int order = chatty_index_compare_terms (segment->strings + term->offset, term->length, text, length);
+
+    if (order == 0)
+      return term;
+
+    if (order < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return NULL;
+}
+
+// marks the documents that are in a run of their session, returns how many there are
+static long int
+chatty_index_segment_live (struct chatty_index_segment *segment, struct chatty_index_manifest *manifest, uint64_t *total_length)
+{
+  const struct chatty_index_segment_header *header = segment->header;
+  struct chatty_index_session **sessions = calloc (header->session_count ? header->session_count : 1, sizeof (struct chatty_index_session *));
+  long int count = 0;
+
+  segment->live = calloc (header->document_count ? header->document_count : 1, 1);
+
+  if (sessions == NULL || segment->live == NULL)
+  {
+    free (sessions);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < header->session_count; i++)
+    sessions [i] = chatty_index_manifest_find (manifest, segment->strings + segment->sessions [i].offset);
+
+  for (uint32_t i = 0; i < header->document_count; i++)
+  {
+    const struct chatty_index_document *document = &segment->documents [i];
+    struct chatty_index_session *session = sessions [document->session];
+
+    if (session && chatty_index_session_covers (session, segment->id, document->message))
+    {
+      segment->live [i] = 1;
+      *total_length += document->length;
+      count++;
+    }
+  }
+
+  free (sessions);
+  return count;
+}
+
+// maintaining the index
+
+// gives the documents of the builder, written as the segment id, their runs
+static int
+chatty_index_add_runs (struct chatty_index_manifest *manifest, struct chatty_index_builder *builder, uint32_t id)
+{
+  struct chatty_index_session *session = NULL;
+  uint32_t session_index = UINT32_MAX;
+
+  for (unsigned long int i = 0; i < builder->document_count; i++)
+  {
+    struct chatty_index_document *document = &builder->documents [i];
+
+    if (document->session != session_index)
+    {
+      session_index = document->session;
+      session = chatty_index_manifest_session (manifest, builder->sessions [session_index]);
+
+      if (session == NULL)
+        return -1;
+    }
+
+    if (chatty_index_session_add (session, id, document->message) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+// writes the builder as a new segment after the others
+static int
+chatty_index_add_builder (struct chatty_index_manifest *manifest, struct chatty_index_builder *builder)
+{
+  if (builder->document_count == 0)
+    return 0;
+
+  uint32_t id = manifest->next_segment++;
+
+  if (chatty_index_builder_write (builder, id) < 0)
+    return -1;
+
+  if (chatty_index_add_segment_id (&manifest->segments, &manifest->segment_count, &manifest->segment_capacity, id) < 0)
+  {
+    chatty_index_add_segment_id (&manifest->obsolete, &manifest->obsolete_count, &manifest->obsolete_capacity, id);
+    return -1;
+  }
+
+  return chatty_index_add_runs (manifest, builder, id);
+}
+
+static void
+chatty_index_drop_segment_runs (struct chatty_index_manifest *manifest, uint32_t id)
+{
+  for (unsigned long int i = 0; i < manifest->session_count; i++)
+  {
+    struct chatty_index_session *session = &manifest->sessions [i];
+    uint32_t count = 0;
+
+    for (uint32_t j = 0; j < session->run_count; j++)
+    {
+      if (session->runs [j].segment != id)
+        session->runs [count++] = session->runs [j];
+    }
+
+    session->run_count = count;
+  }
+}
+
+// merges the last two segments into one that holds only their live documents
+static int
+chatty_index_merge (struct chatty_index_manifest *manifest)
+{
+  struct chatty_index_segment segments [2];
+  struct chatty_index_builder builder;
+  unsigned long int first = manifest->segment_count - 2;
+  uint32_t *renumbered [2] = { NULL, NULL };
+  int result = -1;
+
+  memset (&builder, 0, sizeof (builder));
+
+  if (chatty_index_segment_map (&segments [0], manifest->segments [first]) < 0)
+    return -1;
+
+  if (chatty_index_segment_map (&segments [1], manifest->segments [first + 1]) < 0)
+  {
+    chatty_index_segment_unmap (&segments [0]);
+    return -1;
+  }
+
+  // the documents keep their order, so every postings list of the merged segment stays sorted
+  for (unsigned int s = 0; s < 2; s++)
+  {
+    struct chatty_index_segment *segment = &segments [s];
+    uint64_t total_length = 0;
+
+    renumbered [s] = malloc ((segment->header->document_count ? segment->header->document_count : 1) * sizeof (uint32_t));
+
+    if (renumbered [s] == NULL || chatty_index_segment_live (segment, manifest, &total_length) < 0)
+      goto chatty_index_merge_cleanup;
+
+    for (uint32_t i = 0; i < segment->header->document_count; i++)
+    {
+      const struct chatty_index_document *document = &segment->documents [i];
+
+      if (segment->live [i] == 0)
+        continue;
+
+      long int number = chatty_index_builder_document (&builder, segment->strings + segment->sessions [document->session].offset, document->message, document->length);
+
+      if (number < 0)
+        goto chatty_index_merge_cleanup;
+
+      renumbered [s][i] = number;
+    }
+  }
+
+  for (unsigned int s = 0; s < 2; s++)
+  {
+    struct chatty_index_segment *segment = &segments [s];
+
+    for (uint32_t i = 0; i < segment->header->term_count; i++)
+    {
+      const struct chatty_index_segment_term *term = &segment->terms [i];
+      const unsigned char *input = segment->postings + term->postings_offset, *end = input + term->postings_length;
+      uint32_t document = 0;
+
+      for (uint32_t j = 0; j < term->document_count && input; j++)
+      {
+        uint32_t delta, count;
+
+        input = chatty_index_get_varint (input, end, &delta);
+        input = input ? chatty_index_get_varint (input, end, &count) : NULL;
+        document += delta;
+
+        if (input && document < segment->header->document_count && segment->live [document])
+          chatty_index_builder_add (&builder, segment->strings + term->offset, term->length, renumbered [s][document], count);
+      }
+    }
+  }
+
+  uint32_t id = manifest->next_segment++;
+
+  // the merged segment is written before the manifest changes, so a failure leaves both segments in place
+  if (chatty_index_builder_write (&builder, id) < 0)
+    goto chatty_index_merge_cleanup;
+
+  for (unsigned int s = 0; s < 2; s++)
+  {
+    chatty_index_drop_segment_runs (manifest, segments [s].id);
+    chatty_index_add_segment_id (&manifest->obsolete, &manifest->obsolete_count, &manifest->obsolete_capacity, segments [s].id);
+  }
+
+  manifest->segments [first] = id;
+  manifest->segment_count = first + 1;
+  result = chatty_index_add_runs (manifest, &builder, id);
+
+chatty_index_merge_cleanup:
+  free (renumbered [0]);
+  free (renumbered [1]);
+  chatty_index_segment_unmap (&segments [0]);
+  chatty_index_segment_unmap (&segments [1]);
+  chatty_index_builder_free (&builder);
+  return result;
+}
+
+// the live documents of every segment, according to the runs of the sessions
+static uint32_t *
+chatty_index_live_counts (struct chatty_index_manifest *manifest)
+{
+  uint32_t *counts = calloc (manifest->segment_count ? manifest->segment_count : 1, sizeof (uint32_t));
+
+  if (counts == NULL)
+    return NULL;
+
+  for (unsigned long int i = 0; i < manifest->session_count; i++)
+  {
+    struct chatty_index_session *session = &manifest->sessions [i];
+
+    for (uint32_t j = 0; j < session->run_count; j++)
+    {
+      for (unsigned long int k = 0; k < manifest->segment_count; k++)
+      {
+        if (manifest->segments [k] == session->runs [j].segment)
+        {
+          counts [k] += session->runs [j].count;
+          break;
+        }
+      }
+    }
+  }
+
+  return counts;
+}
+
+// drops segments without live documents and merges small segments into larger ones
+static void
+chatty_index_settle (struct chatty_index_manifest *manifest)
+{
+  while (true)
+  {
+    uint32_t *counts = chatty_index_live_counts (manifest);
+    unsigned long int count = 0;
+    bool merge;
+
+    if (counts == NULL)
+      return;
+
+    for (unsigned long int i = 0; i < manifest->segment_count; i++)
+    {
+      if (counts [i] > 0)
+      {
+        counts [count] = counts [i];
+        manifest->segments [count++] = manifest->segments [i];
+      }
+      else
+      {
+        chatty_index_add_segment_id (&manifest->obsolete, &manifest->obsolete_count, &manifest->obsolete_capacity, manifest->segments [i]);
+      }
+    }
+
+    manifest->segment_count = count;
+    merge = count >= 2 && (uint64_t) counts [count - 1] * CHATTY_INDEX_MERGE_RATIO >= counts [count - 2];
+    free (counts);
+
+    if (merge == false || chatty_index_merge (manifest) < 0)
+      return;
+  }
+}
+
+void
+chatty_index_update (const char *sessionname, struct aichat_session *session, unsigned int first_message, const struct stat *status)
+{
+  int lock = chatty_index_lock (LOCK_EX, false);
+
+  if (lock < 0)
+    return;
+
+  struct chatty_index_manifest manifest;
+
+  if (chatty_index_manifest_read (&manifest) < 0)
+  {
+    close (lock);
+    return;
+  }
+
+  struct chatty_index_session *indexed = chatty_index_manifest_session (&manifest, sessionname);
+  struct chatty_index_builder builder;
+
+  memset (&builder, 0, sizeof (builder));
+
+  if (indexed)
+  {
+    // messages that were never indexed are indexed along with the new ones
+    if (first_message > chatty_index_session_indexed (indexed))
+      first_message = 0;
+
+    chatty_index_session_truncate (indexed, first_message);
+
+    for (unsigned int i = first_message; i < session->message_count; i++)
+      chatty_index_builder_add_message (&builder, sessionname, i, &session->messages [i]);
+
+    // a session that could not be indexed is indexed again before the next search
+    indexed->time = builder.failed ? 0 : chatty_modification_time (status);
+    indexed->size = status->st_size;
+
+    if (chatty_index_add_builder (&manifest, &builder) < 0 && (indexed = chatty_index_manifest_find (&manifest, sessionname)))
+      indexed->time = 0;
+
+    chatty_index_settle (&manifest);
+    chatty_index_manifest_write (&manifest);
+  }
+
+  chatty_index_builder_free (&builder);
+  chatty_index_manifest_free (&manifest);
+  close (lock);
+}
+
+void
+chatty_index_remove (const char *sessionname)
+{
+  int lock = chatty_index_lock (LOCK_EX, false);
+
+  if (lock < 0)
+    return;
+
+  struct chatty_index_manifest manifest;
+
+  if (chatty_index_manifest_read (&manifest) == 0)
+  {
+    struct chatty_index_session *indexed = chatty_index_manifest_find (&manifest, sessionname);
+
+    if (indexed)
+    {
+      chatty_index_manifest_remove (&manifest, indexed);
+      chatty_index_settle (&manifest);
+      chatty_index_manifest_write (&manifest);
+    }
+
+    chatty_index_manifest_free (&manifest);
+  }
+
+  close (lock);
+}
+
+// indexes the sessions that were saved without updating the index and forgets the ones that are gone
+static void
+chatty_index_refresh (struct chatty_index_manifest *manifest)
+{
+  struct chatty_catalog_mapping catalog;
+  struct chatty_index_builder builder;
+  bool changed = false;
+
+  memset (&builder, 0, sizeof (builder));
+  chatty_catalog_map (&catalog);
+
+  for (unsigned long int i = 0; i < manifest->session_count; i++)
+    manifest->sessions [i].seen = false;
+
+  for (unsigned long int i = 0; i < catalog.count; i++)
+  {
+    const struct chatty_catalog_record *record = &catalog.records [i];
+
+    if (record->used == 0)
+      continue;
+
+    struct chatty_index_session *indexed = chatty_index_manifest_find (manifest, record->name);
+
+    if (indexed && indexed->time == record->time && indexed->size == record->size)
+    {
+      indexed->seen = true;
+      continue;
+    }
+
+    if ((indexed = chatty_index_manifest_session (manifest, record->name)) == NULL)
+      break;
+
+    chatty_index_session_truncate (indexed, 0);
+    indexed->time = record->time;
+    indexed->size = record->size;
+    indexed->seen = true;
+    changed = true;
+
+    // a session that cannot be read is left out until it changes
+    char *path = NULL;
+    FILE *file = asprintf (&path, "%s/sessions/%s", chatty_get_home_directory (), record->name) < 0 ? NULL : fopen (path, "re");
+    struct aichat_session session;
+
+    if (file && aichat_session_initialize_from_json_file_in_store (&session, file, chatty_get_store_directory ()) >= 0)
+    {
+      for (unsigned int j = 0; j < session.message_count; j++)
+        chatty_index_builder_add_message (&builder, record->name, j, &session.messages [j]);
+
+      aichat_session_free (&session);
+    }
+
+    if (file)
+      fclose (file);
+
+    free (path);
+  }
+
+  chatty_catalog_unmap (&catalog);
+
+  for (unsigned long int i = manifest->session_count; i > 0; i--)
+  {
+    if (manifest->sessions [i - 1].seen == false)
+    {
+      chatty_index_manifest_remove (manifest, &manifest->sessions [i - 1]);
+      changed = true;
+    }
+  }
+
+  if (changed)
+  {
+    if (chatty_index_add_builder (manifest, &builder) < 0)
+      chatty_die ("cannot update the search index");
+
+    chatty_index_settle (manifest);
+
+    if (chatty_index_manifest_write (manifest) < 0)
+      chatty_die ("cannot update the search index");
+  }
+
+  chatty_index_builder_free (&builder);
+}
+
+// searching
+
+struct
+chatty_index_query
+{
+  char terms [CHATTY_INDEX_MAX_QUERY_TERMS][CHATTY_INDEX_MAX_TERM_LENGTH];
+  uint32_t lengths [CHATTY_INDEX_MAX_QUERY_TERMS];
+  unsigned int count;
+};
+
+static void
+chatty_index_query_term (const char *term, uint32_t length, void *userdata)
+{
+  struct chatty_index_query *query = userdata;
+
+  for (unsigned int i = 0; i < query->count; i++)
+  {
+    if (chatty_index_compare_terms (query->terms [i], query->lengths [i], term, length) == 0)
+      return;
+  }
+
+  if (query->count < CHATTY_INDEX_MAX_QUERY_TERMS)
+  {
+    memcpy (query->terms [query->count], term, length);
+    query->lengths [query->count++] = length;
+  }
+}
+
+// the first place in text where one of the terms starts a word, or text when none does
+static const char *
+chatty_index_find_term (const char *text, unsigned long int length, struct chatty_index_query *query)
+{
+  for (unsigned long int i = 0; i < length; i++)
+  {
+    unsigned char previous = i > 0 ? text [i - 1] : ' ';
+    bool boundary = !((previous >= 'a' && previous <= 'z') || (previous >= 'A' && previous <= 'Z') || (previous >= '0' && previous <= '9') || previous >= 0x80);
+
+    if (boundary == false)
+      continue;
+
+    for (unsigned int j = 0; j < query->count; j++)
+    {
+      if (length - i >= query->lengths [j] && strncasecmp (text + i, query->terms [j], query->lengths [j]) == 0)
+        return text + i;
+    }
+  }
+
+  return text;
+}
+
+static void
+chatty_index_print_snippet (struct aichat_message *message, struct chatty_index_query *query)
+{
+  const char *text = message->text, *end = text + message->length;
+  const char *match = chatty_index_find_term (text, message->length, query);
+  const char *start = match - text > CHATTY_INDEX_SNIPPET_BEFORE ? match - CHATTY_INDEX_SNIPPET_BEFORE : text;
+  const char *stop = end - match > CHATTY_INDEX_SNIPPET_AFTER ? match + CHATTY_INDEX_SNIPPET_AFTER : end;
+
+  // the snippet does not cut characters apart
+  while (start > text && (*start & 0xc0) == 0x80) start--;
+  while (stop < end && (*stop & 0xc0) == 0x80) stop++;
+
+  printf ("    %s", start > text ? "..." : "");
+
+  for (const char *c = start; c < stop; c++)
+    putchar (*c == '\n' || *c == '\t' || *c == '\r' ? ' ' : *c);
+
+  printf ("%s\n", stop < end ? "..." : "");
+}
+
+static int
+chatty_index_compare_hits (const void *a, const void *b)
+{
+  const struct chatty_index_hit *x = a, *y = b;
+
+  if (x->score != y->score)
+    return x->score > y->score ? -1 : 1;
+
+  return x->document < y->document ? -1 : x->document > y->document;
+}
+
+void
+chatty_search (const char *text)
+{
+  struct chatty_index_query query = { .count = 0 };
+
+  chatty_index_tokenize (text, strlen (text), chatty_index_query_term, &query);
+
+  if (query.count == 0)
+  {
+    fprintf (stderr, "%s: the search has no words in it\n", program_invocation_short_name);
+    exit (1);
+  }
+
+  int lock = chatty_index_lock (LOCK_EX, true);
+  struct chatty_index_manifest manifest;
+  struct chatty_index_segment *segments = NULL;
+  unsigned long int segment_count = 0;
+
+  if (lock < 0)
+    chatty_die ("cannot open the search index");
+
+  // a damaged index is built again from scratch, once
+  for (int attempt = 0; ; attempt++)
+  {
+    if (chatty_index_manifest_read (&manifest) < 0)
+      memset (&manifest, 0, sizeof (manifest));
+
+    chatty_index_refresh (&manifest);
+
+    segments = calloc (manifest.segment_count ? manifest.segment_count : 1, sizeof (struct chatty_index_segment));
+
+    if (segments == NULL)
+      chatty_die ("cannot search");
+
+    for (segment_count = 0; segment_count < manifest.segment_count; segment_count++)
+    {
+      if (chatty_index_segment_map (&segments [segment_count], manifest.segments [segment_count]) < 0)
+        break;
+    }
+
+    if (segment_count == manifest.segment_count)
+      break;
+
+    if (attempt > 0)
+    {
+      fprintf (stderr, "%s: the search index in '%s/index' is damaged\n", program_invocation_short_name, chatty_get_home_directory ());
+      exit (1);
+    }
+
+    while (segment_count > 0)
+      chatty_index_segment_unmap (&segments [--segment_count]);
+
+    free (segments);
+
+    // an empty manifest that keeps counting segments makes the next refresh index every session
+    struct chatty_index_manifest empty;
+
+    memset (&empty, 0, sizeof (empty));
+    empty.next_segment = manifest.next_segment;
+
+    for (unsigned long int i = 0; i < manifest.segment_count; i++)
+      chatty_index_add_segment_id (&empty.obsolete, &empty.obsolete_count, &empty.obsolete_capacity, manifest.segments [i]);
+
+    if (chatty_index_manifest_write (&empty) < 0)
+      chatty_die ("cannot rebuild the search index");
+
+    chatty_index_manifest_free (&empty);
+    chatty_index_manifest_free (&manifest);
+  }
+
+  // the segments stay readable once they are mapped, so other chatty processes can go on
+  close (lock);
+
+  uint64_t total_length = 0;
+  unsigned long int document_count = 0, live_count = 0;
+
+  for (unsigned long int i = 0; i < segment_count; i++)
+  {
+    long int live = chatty_index_segment_live (&segments [i], &manifest, &total_length);
+
+    if (live < 0)
+      chatty_die ("cannot search");
+
+    segments [i].base = document_count;
+    document_count += segments [i].header->document_count;
+    live_count += live;
+  }
+
+  double *scores = calloc (document_count ? document_count : 1, sizeof (double));
+  double average_length = live_count ? (double) total_length / live_count : 1;
+
+  if (scores == NULL)
+    chatty_die ("cannot search");
+
+  for (unsigned int t = 0; t < query.count; t++)
+  {
+    // the live documents with the term are counted first, they give the term its weight
+    unsigned long int frequency = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+      double weight = log (1 + (live_count - frequency + 0.5) / (frequency + 0.5));
+
+      for (unsigned long int i = 0; i < segment_count; i++)
+      {
+        struct chatty_index_segment *segment = &segments [i];
+        const struct chatty_index_segment_term *term = chatty_index_segment_find (segment, query.terms [t], query.lengths [t]);
+
+        if (term == NULL)
+          continue;
+
+        const unsigned char *input = segment->postings + term->postings_offset, *end = input + term->postings_length;
+        uint32_t document = 0;
+
+        for (uint32_t j = 0; j < term->document_count && input; j++)
+        {
+          uint32_t delta, count;
+
+          input = chatty_index_get_varint (input, end, &delta);
+          input = input ? chatty_index_get_varint (input, end, &count) : NULL;
+          document += delta;
+
+          if (input == NULL || document >= segment->header->document_count || segment->live [document] == 0)
+            continue;
+
+          if (pass == 0)
+          {
+            frequency++;
+            continue;
+          }
+
+          double length = segment->documents [document].length;
+          double norm = CHATTY_INDEX_BM25_K1 * (1 - CHATTY_INDEX_BM25_B + CHATTY_INDEX_BM25_B * length / average_length);
+
+          scores [segment->base + document] += weight * count * (CHATTY_INDEX_BM25_K1 + 1) / (count + norm);
+        }
+      }
+
+      if (frequency == 0)
+        break;
+    }
+  }
+
+  // the best results are kept sorted at the front, everything else is compared with the worst of them
+  int setting = chatty_get_number_setting_or_die ("CHATTY_SEARCH_RESULTS", CHATTY_INDEX_DEFAULT_RESULTS);
+  unsigned int limit = setting > 0 ? setting : CHATTY_INDEX_DEFAULT_RESULTS;
+  struct chatty_index_hit *hits = calloc (limit, sizeof (struct chatty_index_hit));
+  unsigned int hit_count = 0;
+
+  if (hits == NULL)
+    chatty_die ("cannot search");
+
+  for (unsigned long int i = 0; i < document_count; i++)
+  {
+    if (scores [i] <= 0 || (hit_count == limit && scores [i] <= hits [hit_count - 1].score))
+      continue;
+
+    unsigned int position = hit_count < limit ? hit_count++ : hit_count - 1;
+
+    while (position > 0 && hits [position - 1].score < scores [i])
+    {
+      hits [position] = hits [position - 1];
+      position--;
+    }
+
+    hits [position] = (struct chatty_index_hit) { scores [i], i };
+  }
+
+  qsort (hits, hit_count, sizeof (struct chatty_index_hit), chatty_index_compare_hits);
+
+  // the sessions of the results are read for their snippets, consecutive results often share one
+  struct aichat_session session;
+  char *loaded = NULL;
+
+  for (unsigned int i = 0; i < hit_count; i++)
+  {
+    unsigned long int s = segment_count - 1;
+
+    while (segments [s].base > hits [i].document)
+      s--;
+
+    const struct chatty_index_document *document = &segments [s].documents [hits [i].document - segments [s].base];
+    const char *name = segments [s].strings + segments [s].sessions [document->session].offset;
+
+    if (loaded == NULL || strcmp (loaded, name) != 0)
+    {
+      if (loaded)
+        aichat_session_free (&session);
+
+      free (loaded);
+      loaded = NULL;
+
+      char *path = NULL;
+      FILE *file = asprintf (&path, "%s/sessions/%s", chatty_get_home_directory (), name) < 0 ? NULL : fopen (path, "re");
+
+      if (file && aichat_session_initialize_from_json_file_in_store (&session, file, chatty_get_store_directory ()) >= 0)
+        loaded = strdup (name);
+
+      if (file)
+        fclose (file);
+
+      free (path);
+    }
+
+    // the message may be gone if the session changed since the index was read
+    if (loaded && document->message < session.message_count)
+    {
+      struct aichat_message *message = &session.messages [document->message];
+      const char *role = message->role == AICHAT_ROLE_SYSTEM ? "system" : message->role == AICHAT_ROLE_USER ? "user" : "assistant";
+
+      printf ("%s #%u %s %.3f\n", name, document->message + 1, role, hits [i].score);
+      chatty_index_print_snippet (message, &query);
+    }
+    else
+    {
+      printf ("%s #%u %.3f\n", name, document->message + 1, hits [i].score);
+    }
+  }
+
+  if (loaded)
+    aichat_session_free (&session);
+
+  free (loaded);
+  free (hits);
+  free (scores);
+
+  for (unsigned long int i = 0; i < segment_count; i++)
+    chatty_index_segment_unmap (&segments [i]);
+
+  free (segments);
+  chatty_index_manifest_free (&manifest);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// how many results --search prints unless $CHATTY_SEARCH_RESULTS says otherwise
+#define CHATTY_INDEX_DEFAULT_RESULTS 10
+
+#include <sys/stat.h>
+
+struct aichat_session;
+
+// indexes the messages of a saved session from first_message on, the ones before it are indexed already.
+// Nothing is done while there is no index yet, the first search builds it.
+void chatty_index_update (const char *sessionname, struct aichat_session *session, unsigned int first_message, const struct stat *status);
+void chatty_index_remove (const char *sessionname);
+
+void chatty_search (const char *query);
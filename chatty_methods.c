@@ -20,10 +20,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(__unix__) || defined(__APPLE__) || defined(__MACH__)
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #else
@@ -38,13 +41,26 @@
 #error "Unsupported platform!"
 #endif
 
+#include <json-c/json.h>
+
 #include "aichat.h"
+#include "chatty_catalog.h"
+#include "chatty_index.h"
 #include "chatty_methods.h"
 
-#define CHATTY_MAYBE_DIE(x) if ((x) < 0) do { fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror(x)); exit (1); } while (0)
+// x is evaluated once, it is usually a call that must not be repeated
+#define CHATTY_MAYBE_DIE(x) do { int chatty_error = (x); if (chatty_error < 0) { fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror (chatty_error)); exit (1); } } while (0)
 
 static char chatty_home_directory [PATH_MAX];
 static char chatty_session_directory [PATH_MAX];
+static char chatty_store_directory [PATH_MAX];
+
+// what --stats reports about the request of this invocation, times are negative until they are known
+static enum chatty_stats_mode chatty_stats_mode = CHATTY_STATS_OFF;
+static struct aichat_api_call_results chatty_stats_results;
+static bool chatty_stats_requested = false;
+static double chatty_stats_load_time = -1;
+static double chatty_stats_save_time = -1;
 
 void
 chatty_initialize_directories (void)
@@ -60,6 +76,10 @@ chatty_initialize_directories (void)
     length = snprintf (chatty_session_directory, PATH_MAX, "%s/sessions", chatty_home_directory);
     if (length < 0) goto chatty_initialize_directories_system_error;
     if (length >= PATH_MAX) goto chatty_initialize_directories_length_error;
+
+    length = snprintf (chatty_store_directory, PATH_MAX, "%s/store", chatty_home_directory);
+    if (length < 0) goto chatty_initialize_directories_system_error;
+    if (length >= PATH_MAX) goto chatty_initialize_directories_length_error;
     
     if (mkdir (chatty_home_directory, 0775) < 0)
     {
@@ -96,6 +116,10 @@ chatty_initialize_directories (void)
     length = snprintf (chatty_session_directory, PATH_MAX, "%s/sessions", chatty_home_directory);
     if (length < 0) goto chatty_initialize_directories_system_error;
     if (length >= PATH_MAX) goto chatty_initialize_directories_length_error;
+
+    length = snprintf (chatty_store_directory, PATH_MAX, "%s/store", chatty_home_directory);
+    if (length < 0) goto chatty_initialize_directories_system_error;
+    if (length >= PATH_MAX) goto chatty_initialize_directories_length_error;
   
     char *directories_to_create [] = { chatty_local_directory, chatty_local_share_directory, chatty_home_directory, chatty_session_directory, NULL };
     char **iterator = directories_to_create;
@@ -123,66 +147,111 @@ chatty_initialize_directories_length_error:
   exit (1);
 }
 
+const char *
+chatty_get_home_directory (void)
+{
+  return chatty_home_directory;
+}
+
+// the messages forked sessions share, it is only created by the first fork
+const char *
+chatty_get_store_directory (void)
+{
+  return chatty_store_directory;
+}
+
 void
-chatty_list_sessions (void)
+chatty_set_stats_mode (enum chatty_stats_mode mode)
 {
-  DIR *directory = opendir (chatty_session_directory);
+  chatty_stats_mode = mode;
+}
 
-  if (directory == NULL)
-  {
-    if (errno == ENOENT) return;
-    fprintf (stderr, "%s: cannot access '%s': %s\n", program_invocation_short_name, chatty_session_directory, strerror (errno));
-    exit (1);
-  }
+enum chatty_stats_mode
+chatty_get_stats_mode (void)
+{
+  return chatty_stats_mode;
+}
 
-  bool found_last_session = false;
-  char *last_session_path = NULL;
-  int length = asprintf (&last_session_path, "%s/.last_session", chatty_home_directory);
+// numbers are printed to the microsecond, more digits are noise
+static json_object *
+chatty_stats_new_double (double value)
+{
+  char text [64];
+  snprintf (text, sizeof (text), "%.3f", value);
 
-  if (length < 0)
-  {
-    fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
-    exit (1);
-  }
+  return json_object_new_double_s (value, text);
+}
 
-  FILE *file = fopen (last_session_path, "r+");
-  free (last_session_path); last_session_path = NULL;
+static void
+chatty_stats_add_milliseconds (json_object *jstats, const char *key, double seconds)
+{
+  if (seconds >= 0)
+    json_object_object_add (jstats, key, chatty_stats_new_double (seconds * 1e3));
+}
 
-  if (file == NULL)
-  {
-    found_last_session = true; // don't bother trying to find the last session if we can't open the file
-  }
+// the latency of each phase in milliseconds and the size and speed of the exchange, a negative load or save
+// time leaves the phase out
+json_object *
+chatty_stats_to_json (struct aichat_api_call_results *results, double load_time, double save_time)
+{
+  json_object *jstats = json_object_new_object ();
+
+  chatty_stats_add_milliseconds (jstats, "load_ms", load_time);
+  chatty_stats_add_milliseconds (jstats, "serialize_ms", results->serialize_time);
+  chatty_stats_add_milliseconds (jstats, "queue_ms", results->queue_time);
+  chatty_stats_add_milliseconds (jstats, "dns_ms", results->name_lookup_time);
+  chatty_stats_add_milliseconds (jstats, "connect_ms", results->connect_time);
+  chatty_stats_add_milliseconds (jstats, "tls_ms", results->tls_time);
+  chatty_stats_add_milliseconds (jstats, "first_byte_ms", results->first_byte_time);
+  chatty_stats_add_milliseconds (jstats, "total_ms", results->total_time);
+  chatty_stats_add_milliseconds (jstats, "save_ms", save_time);
+
+  json_object_object_add (jstats, "request_bytes", json_object_new_int64 (results->request_bytes));
+  json_object_object_add (jstats, "response_bytes", json_object_new_int64 (results->response_bytes));
+  json_object_object_add (jstats, "prompt_tokens", json_object_new_int (results->prompt_tokens));
+  json_object_object_add (jstats, "completion_tokens", json_object_new_int (results->completion_tokens));
+
+  if (results->total_time > 0)
+    json_object_object_add (jstats, "completion_tokens_per_second", chatty_stats_new_double (results->completion_tokens / results->total_time));
+
+  json_object_object_add (jstats, "cached", json_object_new_boolean (results->cached));
+  json_object_object_add (jstats, "omitted_messages", json_object_new_int (results->omitted_messages));
+  json_object_object_add (jstats, "retries", json_object_new_int (results->retries));
+  json_object_object_add (jstats, "hedges", json_object_new_int (results->hedges));
+  json_object_object_add (jstats, "hedge_won", json_object_new_boolean (results->hedge_won));
+  json_object_object_add (jstats, "hedge_tokens", json_object_new_int (results->hedge_tokens));
+  json_object_object_add (jstats, "compact_tokens", json_object_new_int (results->compact_tokens));
+
+  return jstats;
+}
 
-  struct stat file_stat;
-  if (fstat (fileno (file), &file_stat) < 0)
+// prints the statistics to stderr in the selected format and releases them
+void
+chatty_print_stats (json_object *jstats)
+{
+  if (chatty_stats_mode == CHATTY_STATS_JSON)
   {
-    found_last_session = true; // don't bother trying to find the last session if we can't stat the file
+    fprintf (stderr, "%s\n", json_object_to_json_string_ext (jstats, JSON_C_TO_STRING_PLAIN));
   }
-
-  unsigned int inode = file_stat.st_ino;
-
-  struct dirent *entry;
-  while ((entry = readdir (directory)))
+  else if (chatty_stats_mode == CHATTY_STATS_TEXT)
   {
-    if (entry->d_type != DT_REG) continue;
-
-    printf ("%s", entry->d_name);
-
-    if (found_last_session == false)
+    json_object_object_foreach (jstats, key, jvalue)
     {
-      // we could have a false positive here if the $CHATTY_HOME/sessions folder
-      // is on a different filesystem than the $CHATTY_HOME/.last_session file but that's fine here
-      if (inode == entry->d_ino)
-      {
-        printf (" (last session)");
-        found_last_session = true;
-      }
+      if (json_object_is_type (jvalue, json_type_double))
+        fprintf (stderr, "%-30s %12.3f\n", key, json_object_get_double (jvalue));
+      else
+        fprintf (stderr, "%-30s %12s\n", key, json_object_get_string (jvalue));
     }
-
-    printf ("\n");
   }
 
-  closedir (directory);
+  json_object_put (jstats);
+}
+
+static void
+chatty_finish_stats (void)
+{
+  if (chatty_stats_mode != CHATTY_STATS_OFF && chatty_stats_requested)
+    chatty_print_stats (chatty_stats_to_json (&chatty_stats_results, chatty_stats_load_time, chatty_stats_save_time));
 }
 
 void
@@ -232,203 +301,1336 @@ chatty_delete_session (const char *session)
     exit (1);
   }
 
+  chatty_catalog_remove (session);
+  chatty_index_remove (session);
   free (session_path);
 }
 
 static void
-chatty_extend_session_helper (struct aichat_session *session)
+chatty_stream_to_stdout (const char *delta, unsigned long int length, void *userdata)
 {
-  struct aichat_api_call_results results;
-  aichat_session_extend (session, &results);
-
-  CHATTY_MAYBE_DIE (results.error);
-  CHATTY_MAYBE_DIE (aichat_session_print_last_message (session, stdout));
+  (void) userdata;
 
-  putchar ('\n');
+  fwrite (delta, 1, length, stdout);
+  fflush (stdout);
 }
 
-static FILE *
-chatty_open_session_file_or_die (const char *session, const char *mode, const char *err)
+// the candidates of the last message labeled with the number --pick selects them by, the current one is marked
+static void
+chatty_print_alternatives (struct aichat_session *session)
 {
-  char *session_path = chatty_get_session_path_or_die (session);
-  FILE *file = fopen (session_path, mode);
-  
-  free (session_path);
-  if (file == NULL)
-  {
-    if (errno == EEXIST || errno == ENOENT)
-    {
-      fprintf (stderr, "%s", program_invocation_short_name);
-      
-      if (session)
-      {
-        if (errno == EEXIST) fprintf (stderr, ": session '%s' already exists", session);
-        else                 fprintf (stderr, ": session '%s' does not exist", session);
-      }
-      else
-      {
-        if (errno == EEXIST) fprintf (stderr, ": there is no last session");
-        else                 fprintf (stderr, ": last session already exists");
-      }
+  struct aichat_message *last = &session->messages[session->message_count - 1];
+  unsigned int count;
+  struct aichat_alternative *alternatives = aichat_session_get_alternatives (session, session->message_count - 1, &count);
 
-      if (*err)
-      {
-        fprintf (stderr, ": %s", err);
-      }
-
-      fprintf (stderr, "\n");
-      exit (1);
-    }
+  for (unsigned int i = 0; i < count; i++)
+  {
+    struct aichat_alternative *alternative = &alternatives[i];
+    bool current = alternative->length == last->length && memcmp (alternative->text, last->text, last->length) == 0;
 
-    fprintf (stderr, "%s: cannot open session: %s\n", program_invocation_short_name, strerror (errno));
-    exit (1);
+    printf ("%s[%u]%s\n", i > 0 ? "\n" : "", i + 1, current ? " *" : "");
+    fwrite (alternative->text, 1, alternative->length, stdout);
+    putchar ('\n');
   }
-
-  return file;
 }
 
-
-static void
-chatty_set_last_session (const char *session)
+// the vocabulary for counting tokens is read from $CHATTY_TOKENIZER or from cl100k_base.tiktoken in the
+// chatty home directory, without one the number of tokens of a session is estimated from its length
+struct aichat_tokenizer *
+chatty_load_tokenizer (void)
 {
-  char *session_path = chatty_get_session_path_or_die (session);
-  char *last_session_path = chatty_get_session_path_or_die (NULL);
+  char *path = NULL;
+  const char *configured = getenv ("CHATTY_TOKENIZER");
 
-  if (remove (last_session_path) != 0)
-  {
-    if (errno != ENOENT) goto chatty_set_last_session_error;
-  }
+  if (configured)
+    path = strdup (configured);
+  else if (asprintf (&path, "%s/cl100k_base.tiktoken", chatty_home_directory) < 0)
+    path = NULL;
 
-  if (symlink (session_path, last_session_path) != 0) goto chatty_set_last_session_error;
+  if (path == NULL)
+    return NULL;
 
-  free (session_path);
-  free (last_session_path);
-  return;
+  // the vocabulary is parsed once, every later invocation maps the image written next to it
+  struct aichat_tokenizer *tokenizer = aichat_tokenizer_initialize_from_path (path);
 
-chatty_set_last_session_error:
-  fprintf (stderr, "%s: could not update last session: %s\n", program_invocation_short_name, strerror (errno));
-  free (session_path);
-  free (last_session_path);
-  exit (1);
+  if (tokenizer == NULL && configured)
+    fprintf (stderr, "%s: cannot read tokenizer vocabulary '%s', estimating tokens instead\n", program_invocation_short_name, path);
+
+  free (path);
+  return tokenizer;
 }
 
-void
-chatty_extend_session (const char *sessionname)
+int
+chatty_get_number_setting_or_die (const char *name, int fallback)
 {
-  const char *enoent = sessionname ? "use the --new-session option to create a new session" : "select a session using --session or create a new session using --new-session";
+  const char *value = getenv (name);
 
-  FILE *file = chatty_open_session_file_or_die (sessionname, "r+", enoent);
-  
-  struct aichat_session session;
-  CHATTY_MAYBE_DIE (aichat_session_initialize_from_json_file (&session, file));
-  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_USER, stdin));
+  if (value == NULL)
+    return fallback;
 
-  chatty_extend_session_helper (&session);
+  char *end;
+  long int number = strtol (value, &end, 10);
 
-  rewind (file);
-  CHATTY_MAYBE_DIE (aichat_session_write_to_json_file (&session, file));
-  fclose (file);
+  if (*value == '\0' || *end != '\0' || number < -1 || number > 1000000000)
+  {
+    fprintf (stderr, "%s: invalid value '%s' for %s\n", program_invocation_short_name, value, name);
+    exit (1);
+  }
 
-  if (sessionname) chatty_set_last_session (sessionname);
+  return number;
 }
 
-
-void
-chatty_retry_session (const char *sessionname)
+// requests are only recorded with $CHATTY_LEDGER set, to 1 for $XDG_DATA_HOME/chatty/ledger or to another file
+char *
+chatty_get_ledger_path (void)
 {
-  const char *enoent = sessionname ? "" : "select a session using --session";
+  const char *setting = getenv ("CHATTY_LEDGER");
+  char *path = NULL;
 
-  FILE *file = chatty_open_session_file_or_die (sessionname, "r+", enoent);
-  
-  struct aichat_session session;
-  CHATTY_MAYBE_DIE (aichat_session_initialize_from_json_file (&session, file));
-  CHATTY_MAYBE_DIE (aichat_session_remove_last_message (&session));
+  if (setting == NULL || *setting == '\0' || strcmp (setting, "0") == 0)
+    return NULL;
 
-  chatty_extend_session_helper (&session);
+  if (strcmp (setting, "1") != 0)
+    path = strdup (setting);
+  else if (asprintf (&path, "%s/ledger", chatty_home_directory) < 0)
+    path = NULL;
 
-  rewind (file);
-  CHATTY_MAYBE_DIE (aichat_session_write_to_json_file (&session, file));
-  fclose (file);
+  if (path == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
+    exit (1);
+  }
 
-  if (sessionname) chatty_set_last_session (sessionname);
+  return path;
 }
 
-void
-chatty_create_session (const char *sessionname, const char *promptfile)
+// responses are cached under $XDG_DATA_HOME/chatty/cache when $CHATTY_CACHE is set to anything but 0,
+// $CHATTY_CACHE_MAX_SIZE bounds the cache in megabytes and $CHATTY_CACHE_TTL is how many seconds a
+// response is used for. $CHATTY_BASE_URL points chatty at another server, such as bench/mock_server, and
+// $CHATTY_RECORD or $CHATTY_REPLAY name a cassette that every exchange is appended to or answered from.
+// $CHATTY_MAX_RETRIES and $CHATTY_RETRY_MAX_DELAY (in seconds) change how rate limited and failed requests are
+// retried. $CHATTY_REQUESTS_PER_MINUTE and $CHATTY_TOKENS_PER_MINUTE limit the requests of every chatty
+// process sharing $XDG_RUNTIME_DIR/chatty.scheduler. A request that has not started to answer after
+// $CHATTY_HEDGE_DELAY_MS milliseconds, or the $CHATTY_HEDGE_PERCENTILE of the first byte times of recent requests,
+// is sent a second time. Without any of these there is no need for a client that outlives the request.
+struct aichat_client *
+chatty_client_initialize_or_die (void)
 {
-  FILE *prompt = fopen (promptfile, "r");
+  const char *cache = getenv ("CHATTY_CACHE");
+  const char *base_url = getenv ("CHATTY_BASE_URL");
+  const char *record = getenv ("CHATTY_RECORD");
+  const char *replay = getenv ("CHATTY_REPLAY");
+  char *ledger = chatty_get_ledger_path ();
+  bool retry_settings = getenv ("CHATTY_MAX_RETRIES") != NULL || getenv ("CHATTY_RETRY_MAX_DELAY") != NULL;
+  long int requests_per_minute = chatty_get_number_setting_or_die ("CHATTY_REQUESTS_PER_MINUTE", 0);
+  long int tokens_per_minute = chatty_get_number_setting_or_die ("CHATTY_TOKENS_PER_MINUTE", 0);
+  bool use_scheduler = requests_per_minute > 0 || tokens_per_minute > 0;
+  int hedge_delay = chatty_get_number_setting_or_die ("CHATTY_HEDGE_DELAY_MS", 0);
+  int hedge_percentile = chatty_get_number_setting_or_die ("CHATTY_HEDGE_PERCENTILE", 0);
+  bool use_hedging = hedge_delay > 0 || hedge_percentile > 0;
+
+  bool use_cache = cache != NULL && *cache != '\0' && strcmp (cache, "0") != 0;
+
+  if (base_url && *base_url == '\0') base_url = NULL;
+  if (record && *record == '\0') record = NULL;
+  if (replay && *replay == '\0') replay = NULL;
+
+  if (use_cache == false && base_url == NULL && record == NULL && replay == NULL && ledger == NULL && retry_settings == false && use_scheduler == false &&
+      use_hedging == false)
+    return NULL;
+
+  if (record && replay)
+  {
+    fprintf (stderr, "%s: CHATTY_RECORD and CHATTY_REPLAY cannot be used together\n", program_invocation_short_name);
+    exit (1);
+  }
 
-  if (prompt == NULL)
+  struct aichat_client *client = aichat_client_initialize ();
+
+  if (client == NULL)
   {
-    fprintf (stderr, "%s: cannot open '%s': %s\n", program_invocation_short_name, promptfile, strerror (errno));
+    fprintf (stderr, "%s: %s\n", program_invocation_short_name, aichat_strerror (-AICHAT_ERROR_CURL_INITIALIZATION));
     exit (1);
   }
-  
-  struct aichat_session session;
-  aichat_session_initialize (&session);
-  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_SYSTEM, prompt));
-  fclose (prompt);
 
-  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_USER, stdin));
-  FILE *file = chatty_open_session_file_or_die (sessionname, "wx", "use the --session option to extend an existing session");
-  
-  chatty_extend_session_helper (&session);
-  rewind (file);
-  CHATTY_MAYBE_DIE (aichat_session_write_to_json_file (&session, file));
-  fclose (file);
+  if (base_url)
+    CHATTY_MAYBE_DIE (aichat_client_set_base_url (client, base_url));
 
-  if (sessionname) chatty_set_last_session (sessionname);
-}
+  if (record || replay)
+  {
+    const char *cassette = record ? record : replay;
+    int error = aichat_client_set_cassette (client, cassette, record ? AICHAT_CASSETTE_RECORD : AICHAT_CASSETTE_REPLAY);
 
-void
-chatty_once (const char *promptfile)
-{
-  FILE *prompt = fopen (promptfile, "r");
+    if (error == -AICHAT_ERROR_IO)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, cassette, strerror (errno));
+      exit (1);
+    }
 
-  if (prompt == NULL)
+    CHATTY_MAYBE_DIE (error);
+  }
+
+  if (use_cache)
   {
-    fprintf (stderr, "%s: cannot open '%s': %s\n", program_invocation_short_name, promptfile, strerror (errno));
-    exit (1);
+    char *cache_directory = NULL;
+
+    if (asprintf (&cache_directory, "%s/cache", chatty_home_directory) < 0)
+    {
+      fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
+      exit (1);
+    }
+
+    unsigned long int max_size = chatty_get_number_setting_or_die ("CHATTY_CACHE_MAX_SIZE", CHATTY_CACHE_DEFAULT_MAX_SIZE);
+    long int ttl = chatty_get_number_setting_or_die ("CHATTY_CACHE_TTL", CHATTY_CACHE_DEFAULT_TTL);
+
+    CHATTY_MAYBE_DIE (aichat_client_set_cache (client, cache_directory, max_size * 1000 * 1000, ttl));
+    free (cache_directory);
   }
 
-  struct aichat_session session;
-  aichat_session_initialize (&session);
-  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_SYSTEM, prompt));
-  fclose (prompt);
+  if (retry_settings)
+  {
+    int max_retries = chatty_get_number_setting_or_die ("CHATTY_MAX_RETRIES", AICHAT_DEFAULT_MAX_RETRIES);
+    int max_delay = chatty_get_number_setting_or_die ("CHATTY_RETRY_MAX_DELAY", AICHAT_DEFAULT_RETRY_MAX_DELAY);
 
-  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_USER, stdin));
-  chatty_extend_session_helper (&session);
+    CHATTY_MAYBE_DIE (aichat_client_set_retry_policy (client, max_retries > 0 ? max_retries : 0, AICHAT_DEFAULT_RETRY_BASE_DELAY, max_delay > 0 ? max_delay : 0));
+  }
+
+  if (use_scheduler)
+  {
+    const char *runtime_directory = getenv ("XDG_RUNTIME_DIR");
+    char *scheduler = NULL;
+    int length;
+
+    // without a runtime directory the bucket is only shared by the processes of this data directory
+    if (runtime_directory && *runtime_directory != '\0')
+      length = asprintf (&scheduler, "%s/chatty.scheduler", runtime_directory);
+    else
+      length = asprintf (&scheduler, "%s/scheduler", chatty_home_directory);
+
+    if (length < 0)
+    {
+      fprintf (stderr, "%s: %s\n", program_invocation_short_name, strerror (errno));
+      exit (1);
+    }
+
+    int error = aichat_client_set_scheduler (client, scheduler, requests_per_minute, tokens_per_minute);
+
+    if (error < 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, scheduler, error == -AICHAT_ERROR_IO ? strerror (errno) : aichat_strerror (error));
+      exit (1);
+    }
+
+    free (scheduler);
+  }
+
+  if (use_hedging)
+  {
+    if (hedge_percentile >= 100)
+    {
+      fprintf (stderr, "%s: invalid value '%d' for CHATTY_HEDGE_PERCENTILE\n", program_invocation_short_name, hedge_percentile);
+      exit (1);
+    }
+
+    CHATTY_MAYBE_DIE (aichat_client_set_hedging (client, hedge_delay > 0 ? hedge_delay * 1e-3 : 0, hedge_percentile > 0 ? hedge_percentile : 0));
+  }
+
+  if (ledger)
+  {
+    int error = aichat_client_set_ledger (client, ledger);
+
+    if (error < 0)
+    {
+      fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, ledger, error == -AICHAT_ERROR_IO ? strerror (errno) : aichat_strerror (error));
+      exit (1);
+    }
+
+    free (ledger);
+  }
+
+  return client;
 }
 
+// sets up the session for requests, name is what they are recorded under in the ledger, NULL for a
+// conversation that is not saved
+static void
+chatty_prepare_session (struct aichat_session *session, const char *name)
+{
+  session->client = chatty_client_initialize_or_die ();
+  session->name = name;
+
+  // long sessions are trimmed to the newest turns that fit, $CHATTY_MAX_PROMPT_TOKENS=-1 always sends everything
+  session->tokenizer = chatty_load_tokenizer ();
+  session->max_prompt_tokens = chatty_get_number_setting_or_die ("CHATTY_MAX_PROMPT_TOKENS", 0);
+  session->reserved_completion_tokens = chatty_get_number_setting_or_die ("CHATTY_RESERVED_COMPLETION_TOKENS", AICHAT_DEFAULT_RESERVED_COMPLETION_TOKENS);
+
+  // $CHATTY_CONTEXT_RECENT_TURNS limits the newest turns that are sent, older messages only come along when they
+  // are among the $CHATTY_CONTEXT_RELEVANT_MESSAGES that match the new message best
+  session->context_recent_turns = chatty_get_number_setting_or_die ("CHATTY_CONTEXT_RECENT_TURNS", 0);
+  session->context_relevant_messages = chatty_get_number_setting_or_die ("CHATTY_CONTEXT_RELEVANT_MESSAGES", 0);
+
+  // with $CHATTY_COMPACT_THRESHOLD set the older turns are summarized once the prompt grows beyond it
+  session->compact_threshold = chatty_get_number_setting_or_die ("CHATTY_COMPACT_THRESHOLD", 0);
+  session->compact_keep_turns = chatty_get_number_setting_or_die ("CHATTY_COMPACT_KEEP_TURNS", AICHAT_DEFAULT_COMPACT_KEEP_TURNS);
+}
+
+static void
+chatty_release_session (struct aichat_session *session)
+{
+  aichat_tokenizer_free (session->tokenizer);
+  session->tokenizer = NULL;
+
+  aichat_client_free (session->client);
+  session->client = NULL;
+  session->name = NULL;
+}
+
+// a summary that could not be made is only a warning, the turn was sent without it
 void
-chatty_import_session (const char *session)
+chatty_report_compaction (struct aichat_api_call_results *results, FILE *errors)
 {
-  FILE *file = chatty_open_session_file_or_die (session, "wx", "use the --session option to extend an existing session");
+  if (results->compact_error < 0 && results->compact_error != -AICHAT_ERROR_NOTHING_TO_COMPACT)
+    fprintf (errors, "%s: cannot summarize the older turns: %s\n", program_invocation_short_name, aichat_strerror (results->compact_error));
+}
 
-  struct aichat_session chat_session;
-  CHATTY_MAYBE_DIE (aichat_session_initialize_from_json_file (&chat_session, stdin));
-  struct aichat_message *last_message = chat_session.messages + chat_session.message_count - 1;
+static void
+chatty_extend_session_helper (struct aichat_session *session, const char *name)
+{
+  struct aichat_api_call_results results;
+
+  chatty_prepare_session (session, name);
 
-  if (last_message->role != AICHAT_ROLE_ASSISTANT)
+  // the response is printed piece by piece as it arrives, several candidates are printed once they are all there
+  session->stream_callback = chatty_stream_to_stdout;
+  session->stream_userdata = NULL;
+
+  CHATTY_MAYBE_DIE (aichat_session_extend (session, &results));
+  chatty_report_compaction (&results, stderr);
+
+  if (session->choices > 1)
+    chatty_print_alternatives (session);
+
+  chatty_stats_results = results;
+  chatty_stats_requested = true;
+
+  chatty_release_session (session);
+
+  putchar ('\n');
+  fflush (stdout);
+}
+
+// reports why a session could not be opened to errors, the daemon sends what is reported back to the chatty it serves
+static void
+chatty_session_error (const char *session, const char *err, FILE *errors)
+{
+  if (errno == EEXIST || errno == ENOENT)
   {
-    fprintf (stderr, "%s: last message in session must be from the assistant\n", program_invocation_short_name);
-    exit (1);
+    fprintf (errors, "%s", program_invocation_short_name);
+    
+    if (session)
+    {
+      if (errno == EEXIST) fprintf (errors, ": session '%s' already exists", session);
+      else                 fprintf (errors, ": session '%s' does not exist", session);
+    }
+    else
+    {
+      if (errno == EEXIST) fprintf (errors, ": last session already exists");
+      else                 fprintf (errors, ": there is no last session");
+    }
+
+    if (*err)
+    {
+      fprintf (errors, ": %s", err);
+    }
+
+    fprintf (errors, "\n");
+    return;
   }
 
-  CHATTY_MAYBE_DIE (aichat_session_write_to_json_file (&chat_session, file));
-  fclose (file);
+  fprintf (errors, "%s: cannot open session: %s\n", program_invocation_short_name, strerror (errno));
 }
 
-void
-chatty_export_session (const char *session)
+static void
+chatty_session_error_and_die (const char *session, const char *err)
 {
-  FILE *file = chatty_open_session_file_or_die (session, "r", "");
+  chatty_session_error (session, err, stderr);
+  exit (1);
+}
 
-  struct aichat_session chat_session;
-  CHATTY_MAYBE_DIE (aichat_session_initialize_from_json_file (&chat_session, file));
+static FILE *
+chatty_open_session_file (const char *session, const char *mode, const char *err, FILE *errors)
+{
+  char *session_path = chatty_get_session_path_or_die (session);
+  FILE *file = fopen (session_path, mode);
 
-  fclose (file);
+  free (session_path);
+  if (file == NULL)
+    chatty_session_error (session, err, errors);
 
-  CHATTY_MAYBE_DIE (aichat_session_write_to_json_file (&chat_session, stdout));
+  return file;
+}
+
+int
+chatty_stat_session (const char *session, struct stat *status)
+{
+  char *session_path = chatty_get_session_path_or_die (session);
+  int result = stat (session_path, status);
+
+  free (session_path);
+  return result;
 }
 
+void
+chatty_die (const char *what)
+{
+  fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, what, strerror (errno));
+  exit (1);
+}
+
+// in nanoseconds, a whole second is too coarse to tell two saves apart
+int64_t
+chatty_modification_time (const struct stat *status)
+{
+#ifdef __APPLE__
+  return (int64_t) status->st_mtimespec.tv_sec * 1000000000 + status->st_mtimespec.tv_nsec;
+#else
+  return (int64_t) status->st_mtim.tv_sec * 1000000000 + status->st_mtim.tv_nsec;
+#endif
+}
+
+// sessions are either replaced or appended to, so another writer always changes one of these. A replaced
+// session can get the inode number of the file it replaced and the same size, so the time counts to the nanosecond.
+bool
+chatty_session_changed (const struct stat *current, const struct stat *loaded)
+{
+  return current->st_ino != loaded->st_ino || current->st_size != loaded->st_size || chatty_modification_time (current) != chatty_modification_time (loaded);
+}
+
+// checked before anything is sent so that a session name that is taken is reported right away
+static void
+chatty_die_if_session_exists (const char *session, const char *err)
+{
+  char *session_path = chatty_get_session_path_or_die (session);
+  struct stat file_stat;
+  int result = lstat (session_path, &file_stat);
+
+  free (session_path);
+  if (result == 0)
+  {
+    errno = EEXIST;
+    chatty_session_error_and_die (session, err);
+  }
+}
+
+// $CHATTY_DURABILITY selects how hard a save tries to reach the disk before chatty exits:
+// "none" leaves it to the system, "data" flushes the session file and "full", the default,
+// also flushes the directory so that a renamed session survives a power loss
+enum chatty_durability
+chatty_get_durability (void)
+{
+  const char *durability = getenv ("CHATTY_DURABILITY");
+
+  if (durability == NULL || strcmp (durability, "full") == 0) return CHATTY_DURABILITY_FULL;
+  if (strcmp (durability, "data") == 0)                       return CHATTY_DURABILITY_DATA;
+  if (strcmp (durability, "none") == 0)                       return CHATTY_DURABILITY_NONE;
+
+  fprintf (stderr, "%s: invalid value '%s' for CHATTY_DURABILITY, expected one of none, data or full\n", program_invocation_short_name, durability);
+  exit (1);
+}
+
+static int
+chatty_sync_file (FILE *file, enum chatty_durability durability)
+{
+  if (fflush (file) != 0)
+    return -1;
+
+  if (durability == CHATTY_DURABILITY_DATA) return fdatasync (fileno (file));
+  if (durability == CHATTY_DURABILITY_FULL) return fsync (fileno (file));
+
+  return 0;
+}
+
+static int
+chatty_sync_directory (const char *directory, enum chatty_durability durability)
+{
+  if (durability != CHATTY_DURABILITY_FULL)
+    return 0;
+
+  int fd = open (directory, O_RDONLY | O_DIRECTORY);
+
+  if (fd < 0)
+    return -1;
+
+  int result = fsync (fd);
+  close (fd);
+
+  return result;
+}
+
+
+int
+chatty_link_last_session (const char *session, FILE *errors)
+{
+  char *session_path = chatty_get_session_path_or_die (session);
+  char *last_session_path = chatty_get_session_path_or_die (NULL);
+
+  char *temporary_path = NULL;
+
+  // the new link is made under a temporary name and renamed over the old one so that there is always a last session
+  if (asprintf (&temporary_path, "%s/.last_session.%d", chatty_home_directory, (int) getpid ()) < 0) goto chatty_link_last_session_error;
+
+  if (remove (temporary_path) != 0)
+  {
+    if (errno != ENOENT) goto chatty_link_last_session_error;
+  }
+
+  if (symlink (session_path, temporary_path) != 0) goto chatty_link_last_session_error;
+  if (rename (temporary_path, last_session_path) != 0) goto chatty_link_last_session_error;
+  if (chatty_sync_directory (chatty_home_directory, chatty_get_durability ()) != 0) goto chatty_link_last_session_error;
+
+  free (session_path);
+  free (last_session_path);
+  free (temporary_path);
+  return 0;
+
+chatty_link_last_session_error:
+  fprintf (errors, "%s: could not update last session: %s\n", program_invocation_short_name, strerror (errno));
+  if (temporary_path) remove (temporary_path);
+  free (session_path);
+  free (last_session_path);
+  free (temporary_path);
+  return -1;
+}
+
+static void
+chatty_set_last_session (const char *session)
+{
+  if (chatty_link_last_session (session, stderr) < 0)
+    exit (1);
+}
+
+// new sessions are written as journals when $CHATTY_SESSION_FORMAT is "journal",
+// existing sessions keep the format they are stored in
+static bool
+chatty_use_journal_format (void)
+{
+  const char *format = getenv ("CHATTY_SESSION_FORMAT");
+  return format && strcmp (format, "journal") == 0;
+}
+
+// writes the whole session to a temporary file next to the session and renames it into place, a crash
+// at any point leaves either the old or the new session behind. With exclusive set an existing session
+// is never replaced. The messages before first_message are the ones the session had when it was loaded.
+static int
+chatty_write_session_file (struct aichat_session *session, const char *sessionname, bool exclusive, unsigned int first_message, FILE *errors)
+{
+  enum chatty_durability durability = chatty_get_durability ();
+  char *session_path = chatty_get_session_path_or_die (sessionname);
+  char *temporary_path = NULL;
+  FILE *file = NULL;
+  int fd = -1;
+
+  // the last session is a symbolic link, the session it points to is the one that is replaced
+  char *target_path = realpath (session_path, NULL);
+
+  if (target_path == NULL)
+  {
+    if (errno != ENOENT) goto chatty_write_session_file_error;
+    target_path = strdup (session_path);
+    if (target_path == NULL) goto chatty_write_session_file_error;
+  }
+
+  char *base = strrchr (target_path, '/');
+  *base++ = '\0';
+
+  if (asprintf (&temporary_path, "%s/.%s.XXXXXX", target_path, base) < 0)
+  {
+    temporary_path = NULL;
+    goto chatty_write_session_file_error;
+  }
+
+  fd = mkstemp (temporary_path);
+  if (fd < 0) goto chatty_write_session_file_error;
+
+  // mkstemp creates the file private to the user, give it the permissions fopen would have
+  mode_t mask = umask (0);
+  umask (mask);
+  if (fchmod (fd, 0666 & ~mask) != 0) goto chatty_write_session_file_error;
+
+  file = fdopen (fd, "w");
+  if (file == NULL) goto chatty_write_session_file_error;
+  fd = -1;
+
+  int result;
+
+  if (session->journal || chatty_use_journal_format ())
+    result = aichat_session_write_to_journal_file (session, file);
+  else
+    result = aichat_session_write_to_json_file (session, file);
+
+  if (result < 0) goto chatty_write_session_file_error;
+  if (chatty_sync_file (file, durability) != 0) goto chatty_write_session_file_error;
+  if (fclose (file) != 0) { file = NULL; goto chatty_write_session_file_error; }
+  file = NULL;
+
+  base[-1] = '/';
+
+  if (exclusive)
+  {
+    // link fails instead of replacing a session that was created in the meantime
+    if (link (temporary_path, target_path) != 0)
+    {
+      if (errno == EEXIST)
+      {
+        chatty_session_error (sessionname, "", errors);
+        remove (temporary_path);
+        goto chatty_write_session_file_cleanup;
+      }
+
+      goto chatty_write_session_file_error;
+    }
+
+    remove (temporary_path);
+  }
+  else if (rename (temporary_path, target_path) != 0)
+  {
+    goto chatty_write_session_file_error;
+  }
+
+  struct stat status;
+
+  if (stat (target_path, &status) == 0)
+  {
+    chatty_catalog_update (base, session, &status);
+    chatty_index_update (base, session, first_message, &status);
+  }
+
+  base[-1] = '\0';
+  if (chatty_sync_directory (target_path, durability) != 0) goto chatty_write_session_file_error;
+
+  free (session_path);
+  free (target_path);
+  free (temporary_path);
+  return 0;
+
+chatty_write_session_file_error:
+  fprintf (errors, "%s: cannot save session: %s\n", program_invocation_short_name, strerror (errno));
+  if (file) fclose (file);
+  if (fd >= 0) close (fd);
+  if (temporary_path) remove (temporary_path);
+chatty_write_session_file_cleanup:
+  free (session_path);
+  free (target_path);
+  free (temporary_path);
+  return -1;
+}
+
+static void
+chatty_write_session_file_or_die (struct aichat_session *session, const char *sessionname, bool exclusive)
+{
+  double start = aichat_now ();
+
+  if (chatty_write_session_file (session, sessionname, exclusive, 0, stderr) < 0)
+    exit (1);
+
+  chatty_stats_save_time = aichat_now () - start;
+}
+
+// the last session is a link to a session in the session directory, its name is looked up once
+// so that the link can change while chatty runs without chatty switching sessions halfway
+char *
+chatty_resolve_session_name (const char *sessionname, const char *enoent, FILE *errors)
+{
+  if (sessionname)
+    return strdup (sessionname);
+
+  char *last_session_path = chatty_get_session_path_or_die (NULL);
+  char *target_path = realpath (last_session_path, NULL);
+
+  free (last_session_path);
+  if (target_path == NULL)
+  {
+    chatty_session_error (NULL, enoent, errors);
+    return NULL;
+  }
+
+  char *name = strdup (strrchr (target_path, '/') + 1);
+  free (target_path);
+
+  return name;
+}
+
+static char *
+chatty_resolve_session_name_or_die (const char *sessionname, const char *enoent)
+{
+  char *name = chatty_resolve_session_name (sessionname, enoent, stderr);
+
+  if (name == NULL)
+    exit (1);
+
+  return name;
+}
+
+// sessions are locked through a separate file because saving a session replaces its file.
+// With $CHATTY_LOCK set to "busy" chatty gives up when another chatty holds the lock instead
+// of waiting for it.
+int
+chatty_lock_session (const char *sessionname, FILE *errors)
+{
+  char *lock_directory = NULL;
+  char *lock_path = NULL;
+  int fd = -1;
+
+  if (asprintf (&lock_directory, "%s/locks", chatty_home_directory) < 0) { lock_directory = NULL; goto chatty_lock_session_error; }
+  if (asprintf (&lock_path, "%s/%s", lock_directory, sessionname) < 0) { lock_path = NULL; goto chatty_lock_session_error; }
+
+  if (mkdir (lock_directory, 0775) < 0)
+  {
+    if (errno != EEXIST) goto chatty_lock_session_error;
+  }
+
+  fd = open (lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+  if (fd < 0) goto chatty_lock_session_error;
+
+  const char *mode = getenv ("CHATTY_LOCK");
+  bool busy = mode && strcmp (mode, "busy") == 0;
+
+  while (flock (fd, busy ? LOCK_EX | LOCK_NB : LOCK_EX) != 0)
+  {
+    if (errno == EINTR)
+      continue;
+
+    if (errno == EWOULDBLOCK)
+    {
+      fprintf (errors, "%s: session '%s' is busy\n", program_invocation_short_name, sessionname);
+      close (fd);
+      fd = -1;
+      goto chatty_lock_session_cleanup;
+    }
+
+    goto chatty_lock_session_error;
+  }
+
+  free (lock_directory);
+  free (lock_path);
+  return fd;
+
+chatty_lock_session_error:
+  fprintf (errors, "%s: cannot lock session: %s\n", program_invocation_short_name, strerror (errno));
+  if (fd >= 0) close (fd);
+chatty_lock_session_cleanup:
+  free (lock_directory);
+  free (lock_path);
+  return -1;
+}
+
+static int
+chatty_lock_session_or_die (const char *sessionname)
+{
+  int fd = chatty_lock_session (sessionname, stderr);
+
+  if (fd < 0)
+    exit (1);
+
+  return fd;
+}
+
+void
+chatty_unlock_session (int lock)
+{
+  close (lock);
+}
+
+// reads the session while holding the lock, the state of the file is kept to notice other writers later
+int
+chatty_load_session (struct aichat_session *session, const char *sessionname, const char *enoent, struct stat *loaded, FILE *errors)
+{
+  FILE *file = chatty_open_session_file (sessionname, "r", enoent, errors);
+
+  if (file == NULL)
+    return -1;
+
+  int error = aichat_session_initialize_from_json_file_in_store (session, file, chatty_store_directory);
+
+  if (error < 0)
+  {
+    fprintf (errors, "%s: %s\n", program_invocation_short_name, aichat_strerror (error));
+    fclose (file);
+    return -1;
+  }
+
+  if (fstat (fileno (file), loaded) != 0)
+  {
+    fprintf (errors, "%s: cannot load session: %s\n", program_invocation_short_name, strerror (errno));
+    aichat_session_free (session);
+    fclose (file);
+    return -1;
+  }
+
+  fclose (file);
+  return 0;
+}
+
+static void
+chatty_load_session_or_die (struct aichat_session *session, const char *sessionname, const char *enoent, struct stat *loaded)
+{
+  double start = aichat_now ();
+
+  if (chatty_load_session (session, sessionname, enoent, loaded, stderr) < 0)
+    exit (1);
+
+  chatty_stats_load_time = aichat_now () - start;
+}
+
+// true when the first count messages of both sessions are the same
+static bool
+chatty_same_messages (struct aichat_session *session, struct aichat_session *other, unsigned int count)
+{
+  if (count > session->message_count || count > other->message_count)
+    return false;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    struct aichat_message *message = &session->messages[i];
+    struct aichat_message *other_message = &other->messages[i];
+
+    if (message->role != other_message->role || message->length != other_message->length ||
+        memcmp (message->text, other_message->text, message->length) != 0)
+      return false;
+  }
+
+  return true;
+}
+
+// saves a session that was loaded with chatty_load_session, the lock must be held. A journal only
+// gets the records for what changed since it was loaded. If another chatty saved the session in the
+// meantime the new messages are added after its messages when merge is set, otherwise nothing is saved.
+// A merge keeps the alternatives of the new messages and a new summary of messages that are unchanged.
+int
+chatty_save_session (struct aichat_session *session, const char *sessionname, struct stat *loaded, unsigned int removed, unsigned int first_message, bool merge, FILE *errors)
+{
+  FILE *file = chatty_open_session_file (sessionname, "r+", "", errors);
+  struct stat current;
+  int error;
+
+  if (file == NULL)
+    return -1;
+
+  if (fstat (fileno (file), &current) != 0)
+    goto chatty_save_session_error;
+
+  if (chatty_session_changed (&current, loaded))
+  {
+    if (merge == false)
+    {
+      fprintf (errors, "%s: session '%s' was changed by another chatty, the response was not saved\n", program_invocation_short_name, sessionname);
+      fclose (file);
+      return -1;
+    }
+
+    struct aichat_session latest;
+
+    if ((error = aichat_session_initialize_from_json_file_in_store (&latest, file, chatty_store_directory)) < 0)
+      goto chatty_save_session_aichat_error;
+
+    unsigned int latest_first_message = latest.message_count;
+
+    for (unsigned int i = first_message; i < session->message_count && error >= 0; i++)
+    {
+      unsigned int count;
+      struct aichat_alternative *alternatives = aichat_session_get_alternatives (session, i, &count);
+
+      error = aichat_session_add_message (&latest, session->messages[i].role, session->messages[i].text);
+
+      for (unsigned int j = 0; j < count && error >= 0; j++)
+        error = aichat_session_add_alternative (&latest, alternatives[j].text, alternatives[j].length);
+    }
+
+    // a summary made for this turn still holds when the messages it summarizes are unchanged, otherwise
+    // the next turn compacts the session again
+    if (error >= 0 && session->summary_unsaved && session->summary_messages > latest.summary_messages)
+    {
+      if (session->summary_messages <= first_message && chatty_same_messages (session, &latest, session->summary_messages))
+        error = aichat_session_set_summary (&latest, session->summary.text, session->summary.length, session->summary_messages);
+      else
+        fprintf (errors, "%s: session '%s' was changed by another chatty, the summary of this turn was not saved\n", program_invocation_short_name, sessionname);
+    }
+
+    if (error < 0)
+    {
+      aichat_session_free (&latest);
+      goto chatty_save_session_aichat_error;
+    }
+
+    int result = chatty_save_session (&latest, sessionname, &current, 0, latest_first_message, false, errors);
+
+    aichat_session_free (&latest);
+    fclose (file);
+    return result;
+  }
+
+  if (session->journal && aichat_session_journal_needs_compaction (session) == false)
+  {
+    // an append that is cut short is dropped the next time the journal is read
+    if ((error = aichat_session_append_to_journal_file (session, file, removed, first_message)) < 0)
+      goto chatty_save_session_aichat_error;
+
+    if (chatty_sync_file (file, chatty_get_durability ()) != 0)
+      goto chatty_save_session_error;
+
+    if (fflush (file) == 0 && fstat (fileno (file), &current) == 0)
+    {
+      chatty_catalog_update (sessionname, session, &current);
+      chatty_index_update (sessionname, session, first_message, &current);
+    }
+
+    fclose (file);
+    return 0;
+  }
+
+  fclose (file);
+  return chatty_write_session_file (session, sessionname, false, first_message, errors);
+
+chatty_save_session_error:
+  fprintf (errors, "%s: cannot save session: %s\n", program_invocation_short_name, strerror (errno));
+  fclose (file);
+  return -1;
+
+chatty_save_session_aichat_error:
+  fprintf (errors, "%s: %s\n", program_invocation_short_name, aichat_strerror (error));
+  fclose (file);
+  return -1;
+}
+
+static void
+chatty_save_session_or_die (struct aichat_session *session, const char *sessionname, struct stat *loaded, unsigned int removed, unsigned int first_message, bool merge)
+{
+  double start = aichat_now ();
+
+  if (chatty_save_session (session, sessionname, loaded, removed, first_message, merge, stderr) < 0)
+    exit (1);
+
+  chatty_stats_save_time = aichat_now () - start;
+}
+
+void
+chatty_extend_session (const char *sessionname)
+{
+  chatty_extend_session_from_file (sessionname, stdin);
+}
+
+void
+chatty_extend_session_from_file (const char *sessionname, FILE *input)
+{
+  const char *enoent = sessionname ? "use the --new-session option to create a new session" : "select a session using --session or create a new session using --new-session";
+  char *name = chatty_resolve_session_name_or_die (sessionname, enoent);
+
+  struct aichat_session session;
+  struct stat loaded;
+
+  // the lock is only held while the session is read and written, not while waiting for the response
+  int lock = chatty_lock_session_or_die (name);
+  chatty_load_session_or_die (&session, name, enoent, &loaded);
+  chatty_unlock_session (lock);
+
+  unsigned int first_message = session.message_count;
+  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_USER, input));
+
+  chatty_extend_session_helper (&session, name);
+
+  lock = chatty_lock_session_or_die (name);
+  chatty_save_session_or_die (&session, name, &loaded, 0, first_message, true);
+  chatty_unlock_session (lock);
+  aichat_session_free (&session);
+
+  if (sessionname) chatty_set_last_session (sessionname);
+  free (name);
+
+  chatty_finish_stats ();
+}
+
+
+void
+chatty_retry_session (const char *sessionname, unsigned int choices)
+{
+  const char *enoent = sessionname ? "" : "select a session using --session";
+  char *name = chatty_resolve_session_name_or_die (sessionname, enoent);
+
+  struct aichat_session session;
+  struct stat loaded;
+
+  int lock = chatty_lock_session_or_die (name);
+  chatty_load_session_or_die (&session, name, enoent, &loaded);
+  chatty_unlock_session (lock);
+
+  CHATTY_MAYBE_DIE (aichat_session_remove_last_message (&session));
+
+  // a retry asks for a different response than the one that may be cached
+  session.cache_bypass = true;
+  session.choices = choices;
+
+  unsigned int first_message = session.message_count;
+  chatty_extend_session_helper (&session, name);
+
+  // a retry replaces the last response, which cannot be merged with turns added in the meantime
+  lock = chatty_lock_session_or_die (name);
+  chatty_save_session_or_die (&session, name, &loaded, 1, first_message, false);
+  chatty_unlock_session (lock);
+  aichat_session_free (&session);
+
+  if (sessionname) chatty_set_last_session (sessionname);
+  free (name);
+
+  chatty_finish_stats ();
+}
+
+void
+chatty_rollback_session (const char *sessionname)
+{
+  const char *enoent = sessionname ? "" : "select a session using --session";
+  char *name = chatty_resolve_session_name_or_die (sessionname, enoent);
+
+  struct aichat_session session;
+  struct stat loaded;
+
+  int lock = chatty_lock_session_or_die (name);
+  chatty_load_session_or_die (&session, name, enoent, &loaded);
+
+  // the system prompt stays, only a user text and the response to it can be rolled back
+  unsigned int count = session.message_count;
+
+  if (count < 3 || session.messages[count - 1].role != AICHAT_ROLE_ASSISTANT || session.messages[count - 2].role != AICHAT_ROLE_USER)
+  {
+    fprintf (stderr, "%s: there is no user text and response to roll back\n", program_invocation_short_name);
+    exit (1);
+  }
+
+  CHATTY_MAYBE_DIE (aichat_session_remove_last_message (&session));
+  CHATTY_MAYBE_DIE (aichat_session_remove_last_message (&session));
+
+  chatty_save_session_or_die (&session, name, &loaded, 2, session.message_count, false);
+  chatty_unlock_session (lock);
+  aichat_session_free (&session);
+
+  if (sessionname) chatty_set_last_session (sessionname);
+  free (name);
+}
+
+void
+chatty_pick_alternative (const char *sessionname, unsigned int index)
+{
+  const char *enoent = sessionname ? "" : "select a session using --session";
+  char *name = chatty_resolve_session_name_or_die (sessionname, enoent);
+
+  struct aichat_session session;
+  struct stat loaded;
+
+  int lock = chatty_lock_session_or_die (name);
+  chatty_load_session_or_die (&session, name, enoent, &loaded);
+
+  CHATTY_MAYBE_DIE (aichat_session_pick_alternative (&session, index - 1));
+
+  // the last message is written again together with its alternatives
+  chatty_save_session_or_die (&session, name, &loaded, 1, session.message_count - 1, false);
+  chatty_unlock_session (lock);
+
+  aichat_session_print_last_message (&session, stdout);
+  putchar ('\n');
+  aichat_session_free (&session);
+
+  if (sessionname) chatty_set_last_session (sessionname);
+  free (name);
+}
+
+void
+chatty_compact_session (const char *sessionname)
+{
+  const char *enoent = sessionname ? "" : "select a session using --session";
+  char *name = chatty_resolve_session_name_or_die (sessionname, enoent);
+
+  struct aichat_session session;
+  struct aichat_api_call_results results;
+  struct stat loaded;
+
+  int lock = chatty_lock_session_or_die (name);
+  chatty_load_session_or_die (&session, name, enoent, &loaded);
+  chatty_unlock_session (lock);
+
+  chatty_prepare_session (&session, name);
+  CHATTY_MAYBE_DIE (aichat_session_compact (&session, session.compact_keep_turns, &results));
+  chatty_release_session (&session);
+
+  chatty_stats_results = results;
+  chatty_stats_requested = true;
+
+  // the messages stay as they are, only the summary is new
+  lock = chatty_lock_session_or_die (name);
+  chatty_save_session_or_die (&session, name, &loaded, 0, session.message_count, false);
+  chatty_unlock_session (lock);
+
+  fwrite (session.summary.text, 1, session.summary.length, stdout);
+  putchar ('\n');
+  aichat_session_free (&session);
+
+  if (sessionname) chatty_set_last_session (sessionname);
+  free (name);
+
+  chatty_finish_stats ();
+}
+
+void
+chatty_create_session (const char *sessionname, const char *promptfile)
+{
+  FILE *prompt = fopen (promptfile, "r");
+
+  if (prompt == NULL)
+  {
+    fprintf (stderr, "%s: cannot open '%s': %s\n", program_invocation_short_name, promptfile, strerror (errno));
+    exit (1);
+  }
+  
+  struct aichat_session session;
+  aichat_session_initialize (&session);
+  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_SYSTEM, prompt));
+  fclose (prompt);
+
+  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_USER, stdin));
+  chatty_die_if_session_exists (sessionname, "use the --session option to extend an existing session");
+
+  chatty_extend_session_helper (&session, sessionname);
+  chatty_write_session_file_or_die (&session, sessionname, true);
+  aichat_session_free (&session);
+
+  if (sessionname) chatty_set_last_session (sessionname);
+
+  chatty_finish_stats ();
+}
+
+void
+chatty_once (const char *promptfile)
+{
+  FILE *prompt = fopen (promptfile, "r");
+
+  if (prompt == NULL)
+  {
+    fprintf (stderr, "%s: cannot open '%s': %s\n", program_invocation_short_name, promptfile, strerror (errno));
+    exit (1);
+  }
+
+  struct aichat_session session;
+  aichat_session_initialize (&session);
+  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_SYSTEM, prompt));
+  fclose (prompt);
+
+  CHATTY_MAYBE_DIE (aichat_session_add_message_from_file (&session, AICHAT_ROLE_USER, stdin));
+  chatty_extend_session_helper (&session, NULL);
+  aichat_session_free (&session);
+
+  chatty_finish_stats ();
+}
+
+void
+chatty_import_session (const char *session)
+{
+  chatty_die_if_session_exists (session, "use the --session option to extend an existing session");
+
+  struct aichat_session chat_session;
+  CHATTY_MAYBE_DIE (aichat_session_initialize_from_json_file_in_store (&chat_session, stdin, chatty_store_directory));
+
+  if (chat_session.message_count == 0 || chat_session.messages[chat_session.message_count - 1].role != AICHAT_ROLE_ASSISTANT)
+  {
+    fprintf (stderr, "%s: last message in session must be from the assistant\n", program_invocation_short_name);
+    exit (1);
+  }
+
+  chatty_write_session_file_or_die (&chat_session, session, true);
+  aichat_session_free (&chat_session);
+}
+
+void
+chatty_export_session (const char *session)
+{
+  struct aichat_session chat_session;
+  struct stat loaded;
+
+  // a daemon saves a turn after it replied, the lock makes sure the turn is exported
+  int lock = chatty_lock_session_or_die (session);
+  chatty_load_session_or_die (&chat_session, session, "", &loaded);
+  chatty_unlock_session (lock);
+
+  // the messages of a fork are written out too, an exported session does not need the store
+  chat_session.base_messages = 0;
+
+  CHATTY_MAYBE_DIE (aichat_session_write_to_json_file (&chat_session, stdout));
+  aichat_session_free (&chat_session);
+}
+
+// forks hold the lock of the message store shared from adding runs until the sessions based on them are saved,
+// --gc holds it exclusively so that it never finds a run before the session that is based on it
+static int
+chatty_lock_store (int operation)
+{
+  char *path = NULL;
+
+  if (mkdir (chatty_store_directory, 0775) < 0 && errno != EEXIST)
+    chatty_die (chatty_store_directory);
+
+  if (asprintf (&path, "%s/.lock", chatty_store_directory) < 0)
+    chatty_die ("cannot lock the message store");
+
+  int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+  free (path);
+
+  while (fd >= 0 && flock (fd, operation) != 0)
+  {
+    if (errno != EINTR)
+      chatty_die ("cannot lock the message store");
+  }
+
+  if (fd < 0)
+    chatty_die ("cannot lock the message store");
+
+  return fd;
+}
+
+// keep counts the messages the fork starts with, all of them when it is 0
+void
+chatty_fork_session (const char *sessionname, const char *fork, unsigned int keep)
+{
+  const char *enoent = sessionname ? "" : "select a session using --session";
+  char *name = chatty_resolve_session_name_or_die (sessionname, enoent);
+
+  chatty_die_if_session_exists (fork, "choose another name for the fork");
+
+  struct aichat_session session;
+  struct stat loaded;
+
+  int lock = chatty_lock_session_or_die (name);
+  chatty_load_session_or_die (&session, name, enoent, &loaded);
+
+  if (keep > session.message_count)
+  {
+    fprintf (stderr, "%s: session '%s' has only %u messages\n", program_invocation_short_name, name, session.message_count);
+    exit (1);
+  }
+
+  if (keep == 0)
+    keep = session.message_count;
+
+  int store_lock = chatty_lock_store (LOCK_SH);
+
+  // the messages both sessions have are moved to the store once, the session then only refers to them
+  if (keep > session.base_messages)
+  {
+    CHATTY_MAYBE_DIE (aichat_session_freeze (&session, chatty_store_directory));
+
+    if (chatty_write_session_file (&session, name, false, session.message_count, stderr) < 0)
+      exit (1);
+  }
+
+  chatty_unlock_session (lock);
+
+  while (session.message_count > keep)
+    CHATTY_MAYBE_DIE (aichat_session_remove_last_message (&session));
+
+  chatty_write_session_file_or_die (&session, fork, true);
+  close (store_lock);
+  aichat_session_free (&session);
+
+  chatty_set_last_session (fork);
+  free (name);
+}
+
+// removes the runs of the message store that no session is based on any more, which deleting forked sessions
+// or rolling them back before the fork leaves behind
+void
+chatty_collect_store (void)
+{
+  int store_lock = chatty_lock_store (LOCK_EX);
+  DIR *directory = opendir (chatty_session_directory);
+
+  if (directory == NULL)
+    chatty_die ("cannot list sessions");
+
+  struct aichat_store_run *bases = NULL;
+  unsigned long int count = 0, capacity = 0;
+  struct dirent *entry;
+
+  // a session that is missed would lose its runs, so every entry must be known to be one or not
+  while ((errno = 0, entry = readdir (directory)))
+  {
+    if (entry->d_name[0] == '.') continue; // sessions that are being written
+
+    if (entry->d_type == DT_UNKNOWN)
+    {
+      struct stat status;
+
+      if (fstatat (dirfd (directory), entry->d_name, &status, AT_SYMLINK_NOFOLLOW) != 0)
+      {
+        fprintf (stderr, "%s: cannot read session '%s', the message store is left as it is\n", program_invocation_short_name, entry->d_name);
+        exit (1);
+      }
+
+      if (S_ISREG (status.st_mode) == false) continue;
+    }
+    else if (entry->d_type != DT_REG)
+    {
+      continue;
+    }
+
+    if (count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 256;
+
+      if ((bases = realloc (bases, capacity * sizeof (struct aichat_store_run))) == NULL)
+        chatty_die ("cannot list sessions");
+    }
+
+    int fd = openat (dirfd (directory), entry->d_name, O_RDONLY | O_CLOEXEC);
+    FILE *file = fd >= 0 ? fdopen (fd, "r") : NULL;
+    int found = file ? aichat_session_read_base (file, bases [count].key, &bases [count].messages) : -AICHAT_ERROR_IO;
+
+    if (file)
+      fclose (file);
+    else if (fd >= 0)
+      close (fd);
+
+    // the runs of a session that cannot be read might still be needed, so none are removed
+    if (found < 0)
+    {
+      fprintf (stderr, "%s: cannot read session '%s', the message store is left as it is\n", program_invocation_short_name, entry->d_name);
+      exit (1);
+    }
+
+    count += found > 0;
+  }
+
+  if (errno != 0)
+    chatty_die ("cannot list sessions");
+
+  closedir (directory);
+
+  long int removed = aichat_store_collect (chatty_store_directory, bases, count);
+
+  if (removed < 0)
+  {
+    fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, chatty_store_directory, aichat_strerror (removed));
+    exit (1);
+  }
+
+  close (store_lock);
+  free (bases);
+
+  printf ("removed %ld runs from the message store\n", removed);
+}
+
+void
+chatty_switch_session (const char *sessionname)
+{
+  struct stat status;
+
+  if (chatty_stat_session (sessionname, &status) != 0)
+    chatty_session_error_and_die (sessionname, "");
+
+  chatty_set_last_session (sessionname);
+}
@@ -1,15 +1,63 @@
 #pragma once
 
+#define CHATTY_CACHE_DEFAULT_MAX_SIZE 64 // megabytes
+#define CHATTY_CACHE_DEFAULT_TTL (7 * 24 * 60 * 60)
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+enum chatty_durability { CHATTY_DURABILITY_NONE, CHATTY_DURABILITY_DATA, CHATTY_DURABILITY_FULL };
+enum chatty_stats_mode { CHATTY_STATS_OFF, CHATTY_STATS_TEXT, CHATTY_STATS_JSON };
+
+struct aichat_api_call_results;
+struct aichat_client;
+struct aichat_session;
+struct aichat_tokenizer;
+struct json_object;
+
+// reports what could not be done together with errno and exits
+_Noreturn void chatty_die (const char *what);
 void chatty_initialize_directories (void);
-void chatty_list_sessions (void);
+const char * chatty_get_home_directory (void);
+const char * chatty_get_store_directory (void);
+char * chatty_get_ledger_path (void);
+struct aichat_client * chatty_client_initialize_or_die (void);
+struct aichat_tokenizer * chatty_load_tokenizer (void);
+int chatty_get_number_setting_or_die (const char *name, int fallback);
+enum chatty_durability chatty_get_durability (void);
+void chatty_set_stats_mode (enum chatty_stats_mode mode);
+enum chatty_stats_mode chatty_get_stats_mode (void);
+struct json_object * chatty_stats_to_json (struct aichat_api_call_results *results, double load_time, double save_time);
+void chatty_print_stats (struct json_object *jstats);
+void chatty_report_compaction (struct aichat_api_call_results *results, FILE *errors);
 void chatty_delete_all_sessions (void);
 void chatty_delete_session (const char *session);
 void chatty_extend_last_session (void);
 void chatty_extend_session (const char *session);
+void chatty_extend_session_from_file (const char *session, FILE *input);
 void chatty_create_session (const char *session, const char *promptfile);
 void chatty_once (const char *promptfile);
 void chatty_retry_last_session (void);
-void chatty_retry_session (const char *session);
+void chatty_retry_session (const char *session, unsigned int choices);
+void chatty_rollback_session (const char *session);
+void chatty_pick_alternative (const char *session, unsigned int index);
+void chatty_compact_session (const char *session);
 void chatty_import_session (const char *session);
 void chatty_export_session (const char *session);
+void chatty_fork_session (const char *session, const char *fork, unsigned int keep);
+void chatty_collect_store (void);
+void chatty_switch_session (const char *session);
+
+// used by the daemon, which must not exit when a request fails: errors are reported to errors and -1
+// or NULL is returned instead
+char * chatty_resolve_session_name (const char *session, const char *enoent, FILE *errors);
+int chatty_lock_session (const char *session, FILE *errors);
+void chatty_unlock_session (int lock);
+int chatty_stat_session (const char *session, struct stat *status);
+int64_t chatty_modification_time (const struct stat *status);
+bool chatty_session_changed (const struct stat *current, const struct stat *loaded);
+int chatty_load_session (struct aichat_session *chat_session, const char *session, const char *enoent, struct stat *loaded, FILE *errors);
+int chatty_save_session (struct aichat_session *chat_session, const char *session, struct stat *loaded, unsigned int removed, unsigned int first_message, bool merge, FILE *errors);
+int chatty_link_last_session (const char *session, FILE *errors);
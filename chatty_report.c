@@ -0,0 +1,422 @@
+// report mode: chatty --report summarizes the ledger that every request is recorded in
+//
+// The ledger is mapped into memory and read from front to back once. Latencies and token rates go into
+// histograms whose buckets grow with the value, like HDR histograms, so the percentiles are accurate to
+// within 1/64 of their value no matter how many requests there are and the memory the report needs only
+// depends on the number of sessions and days. Requests that were answered from the cache or a cassette
+// count towards the totals but not towards the latencies, and the connection phases only count the
+// requests that had to open a connection.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aichat.h"
+#include "chatty_methods.h"
+#include "chatty_report.h"
+
+#define CHATTY_REPORT_SUB_BUCKETS (1 << CHATTY_REPORT_SUB_BUCKET_BITS)
+#define CHATTY_REPORT_BUCKETS (CHATTY_REPORT_SUB_BUCKETS * (33 - CHATTY_REPORT_SUB_BUCKET_BITS))
+
+struct
+chatty_report_histogram
+{
+  unsigned long int counts [CHATTY_REPORT_BUCKETS];
+  unsigned long int total;
+  uint32_t max;
+};
+
+struct
+chatty_report_totals
+{
+  unsigned long int requests;
+  unsigned long int errors;
+  unsigned long int prompt_tokens;
+  unsigned long int completion_tokens;
+};
+
+// the totals of one session or one day, the key is the name of the session or the date
+struct
+chatty_report_group
+{
+  char key [sizeof (((struct aichat_ledger_record *) NULL)->session) + 1];
+  unsigned long int key_length;
+  struct chatty_report_totals totals;
+};
+
+struct
+chatty_report_groups
+{
+  struct chatty_report_group *groups;
+  unsigned long int count;
+  unsigned long int mask;
+};
+
+// values below 2 * CHATTY_REPORT_SUB_BUCKETS have a bucket of their own, above that every power of two
+// is split into CHATTY_REPORT_SUB_BUCKETS buckets
+static unsigned int
+chatty_report_bucket (uint32_t value)
+{
+  if (value < 2 * CHATTY_REPORT_SUB_BUCKETS)
+    return value;
+
+  unsigned int exponent = 31 - __builtin_clz (value);
+  unsigned int shift = exponent - CHATTY_REPORT_SUB_BUCKET_BITS;
+
+  return CHATTY_REPORT_SUB_BUCKETS * shift + (value >> shift);
+}
+
+// the middle of the values that fall into the bucket
+static double
+chatty_report_bucket_value (unsigned int bucket)
+{
+  if (bucket < 2 * CHATTY_REPORT_SUB_BUCKETS)
+    return bucket;
+
+  unsigned int shift = bucket / CHATTY_REPORT_SUB_BUCKETS - 1;
+  unsigned long int low = (unsigned long int) (bucket % CHATTY_REPORT_SUB_BUCKETS + CHATTY_REPORT_SUB_BUCKETS) << shift;
+
+  return low + ((1UL << shift) - 1) / 2.0;
+}
+
+static void
+chatty_report_histogram_add (struct chatty_report_histogram *histogram, uint32_t value)
+{
+  histogram->counts [chatty_report_bucket (value)]++;
+  histogram->total++;
+
+  if (value > histogram->max)
+    histogram->max = value;
+}
+
+static double
+chatty_report_percentile (struct chatty_report_histogram *histogram, double percentile)
+{
+  unsigned long int rank = (unsigned long int) (percentile / 100 * histogram->total + 0.999999);
+  unsigned long int seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (unsigned int bucket = 0; bucket < CHATTY_REPORT_BUCKETS; bucket++)
+  {
+    seen += histogram->counts [bucket];
+
+    if (seen >= rank)
+    {
+      double value = chatty_report_bucket_value (bucket);
+      return value > histogram->max ? histogram->max : value;
+    }
+  }
+
+  return histogram->max;
+}
+
+static uint64_t
+chatty_report_hash (const char *key, unsigned long int length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (unsigned long int i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char) key [i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static struct chatty_report_group *
+chatty_report_insert (struct chatty_report_group *groups, unsigned long int mask, const char *key, unsigned long int length)
+{
+  unsigned long int index = chatty_report_hash (key, length) & mask;
+
+  while (groups [index].key_length != 0 && (groups [index].key_length != length || memcmp (groups [index].key, key, length) != 0))
+    index = (index + 1) & mask;
+
+  return &groups [index];
+}
+
+// the group with the key, which is added when it is not there yet
+static struct chatty_report_group *
+chatty_report_group (struct chatty_report_groups *table, const char *key, unsigned long int length)
+{
+  // keep the table at most half full
+  if (2 * (table->count + 1) > table->mask + 1)
+  {
+    unsigned long int capacity = table->groups ? 2 * (table->mask + 1) : 64;
+    struct chatty_report_group *groups = calloc (capacity, sizeof (struct chatty_report_group));
+
+    if (groups == NULL)
+      chatty_die ("cannot summarize the ledger");
+
+    for (unsigned long int i = 0; table->groups && i <= table->mask; i++)
+    {
+      if (table->groups [i].key_length != 0)
+        *chatty_report_insert (groups, capacity - 1, table->groups [i].key, table->groups [i].key_length) = table->groups [i];
+    }
+
+    free (table->groups);
+    table->groups = groups;
+    table->mask = capacity - 1;
+  }
+
+  struct chatty_report_group *group = chatty_report_insert (table->groups, table->mask, key, length);
+
+  if (group->key_length == 0)
+  {
+    memcpy (group->key, key, length);
+    group->key [length] = '\0';
+    group->key_length = length;
+    table->count++;
+  }
+
+  return group;
+}
+
+static void
+chatty_report_count (struct chatty_report_totals *totals, const struct aichat_ledger_record *record)
+{
+  totals->requests++;
+  totals->errors += record->error != 0;
+  totals->prompt_tokens += record->prompt_tokens;
+  totals->completion_tokens += record->completion_tokens;
+}
+
+static int
+chatty_report_compare_groups (const void *a, const void *b)
+{
+  return strcmp (((const struct chatty_report_group *) a)->key, ((const struct chatty_report_group *) b)->key);
+}
+
+// the values of the histogram are divided by scale
+static void
+chatty_report_print_percentiles (const char *name, struct chatty_report_histogram *histogram, double scale)
+{
+  if (histogram->total == 0)
+  {
+    printf ("  %-18s %10d\n", name, 0);
+    return;
+  }
+
+  printf ("  %-18s %10lu %10.3f %10.3f %10.3f %10.3f\n", name, histogram->total, chatty_report_percentile (histogram, 50) / scale,
+          chatty_report_percentile (histogram, 95) / scale, chatty_report_percentile (histogram, 99) / scale, histogram->max / scale);
+}
+
+static void
+chatty_report_print_groups (const char *title, struct chatty_report_groups *table)
+{
+  unsigned long int count = 0;
+
+  // the groups are moved to the front of the table and sorted, the table is not used afterwards
+  for (unsigned long int i = 0; table->groups && i <= table->mask; i++)
+  {
+    if (table->groups [i].key_length != 0)
+      table->groups [count++] = table->groups [i];
+  }
+
+  qsort (table->groups, count, sizeof (struct chatty_report_group), chatty_report_compare_groups);
+
+  printf ("\n%-24s %10s %10s %15s %18s\n", title, "requests", "errors", "prompt tokens", "completion tokens");
+
+  for (unsigned long int i = 0; i < count; i++)
+  {
+    struct chatty_report_totals *totals = &table->groups [i].totals;
+    printf ("  %-22s %10lu %10lu %15lu %18lu\n", table->groups [i].key, totals->requests, totals->errors, totals->prompt_tokens, totals->completion_tokens);
+  }
+}
+
+static void
+chatty_report_format_time (int64_t microseconds, char *text, unsigned long int size)
+{
+  time_t seconds = microseconds / 1000000;
+  struct tm tm;
+
+  localtime_r (&seconds, &tm);
+  strftime (text, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+void
+chatty_report (void)
+{
+  char *path = chatty_get_ledger_path ();
+
+  if (path == NULL)
+  {
+    fprintf (stderr, "%s: requests are only recorded with $CHATTY_LEDGER set to 1 or to a file\n", program_invocation_short_name);
+    exit (1);
+  }
+
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  struct stat status;
+
+  if (fd < 0 && errno == ENOENT)
+  {
+    fprintf (stderr, "%s: no requests were recorded in '%s' yet\n", program_invocation_short_name, path);
+    exit (1);
+  }
+
+  if (fd < 0 || fstat (fd, &status) != 0)
+    chatty_die (path);
+
+  if ((unsigned long int) status.st_size < sizeof (struct aichat_ledger_header))
+  {
+    fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, path, aichat_strerror (-AICHAT_ERROR_LEDGER_FORMAT));
+    exit (1);
+  }
+
+  const char *data = mmap (NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    chatty_die (path);
+
+  madvise ((void *) data, status.st_size, MADV_SEQUENTIAL);
+
+  const struct aichat_ledger_header *header = (const struct aichat_ledger_header *) data;
+
+  if (memcmp (header->magic, AICHAT_LEDGER_MAGIC, sizeof (header->magic)) != 0 || header->version != AICHAT_LEDGER_VERSION ||
+      header->record_size != AICHAT_LEDGER_RECORD_SIZE)
+  {
+    fprintf (stderr, "%s: %s: %s\n", program_invocation_short_name, path, aichat_strerror (-AICHAT_ERROR_LEDGER_FORMAT));
+    exit (1);
+  }
+
+  // a record that is still being written is left out
+  const struct aichat_ledger_record *records = (const struct aichat_ledger_record *) (data + sizeof (struct aichat_ledger_header));
+  unsigned long int record_count = (status.st_size - sizeof (struct aichat_ledger_header)) / sizeof (struct aichat_ledger_record);
+
+  enum { SERIALIZE, NAME_LOOKUP, CONNECT, TLS, FIRST_BYTE, TOTAL, TOKEN_RATE, HISTOGRAM_COUNT };
+  struct chatty_report_histogram *histograms = calloc (HISTOGRAM_COUNT, sizeof (struct chatty_report_histogram));
+
+  if (histograms == NULL)
+    chatty_die ("cannot summarize the ledger");
+
+  struct chatty_report_totals totals = { 0 };
+  struct chatty_report_groups sessions = { NULL, 0, 0 }, days = { NULL, 0, 0 };
+  unsigned long int cached = 0, replayed = 0, hedged = 0, hedges_won = 0;
+  unsigned long int rate_tokens = 0, rate_time = 0;
+  int64_t first_time = INT64_MAX, last_time = INT64_MIN;
+
+  // records come in the order the requests finished, so the day and the session rarely change from one to the next
+  struct chatty_report_group *day = NULL, *session = NULL;
+  const char *session_name = NULL;
+  time_t day_start = 0, day_end = 0;
+
+  for (unsigned long int i = 0; i < record_count; i++)
+  {
+    const struct aichat_ledger_record *record = &records [i];
+    time_t seconds = record->time / 1000000;
+
+    if (record->time < first_time) first_time = record->time;
+    if (record->time > last_time) last_time = record->time;
+
+    if (day == NULL || seconds < day_start || seconds >= day_end)
+    {
+      struct tm tm;
+      char date [16];
+
+      localtime_r (&seconds, &tm);
+      strftime (date, sizeof (date), "%Y-%m-%d", &tm);
+      day = chatty_report_group (&days, date, strlen (date));
+
+      tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+      tm.tm_isdst = -1;
+      day_start = mktime (&tm);
+      tm.tm_mday++;
+      tm.tm_isdst = -1;
+      day_end = mktime (&tm);
+    }
+
+    if (session == NULL || memcmp (session_name, record->session, sizeof (record->session)) != 0)
+    {
+      unsigned long int length = strnlen (record->session, sizeof (record->session));
+
+      session = length > 0 ? chatty_report_group (&sessions, record->session, length) : chatty_report_group (&sessions, "(not saved)", 11);
+      session_name = record->session;
+    }
+
+    chatty_report_count (&totals, record);
+    chatty_report_count (&day->totals, record);
+    chatty_report_count (&session->totals, record);
+
+    if (record->flags & AICHAT_LEDGER_CACHED) cached++;
+    if (record->flags & AICHAT_LEDGER_REPLAYED) replayed++;
+    if (record->flags & AICHAT_LEDGER_HEDGED) hedged++;
+    if (record->flags & AICHAT_LEDGER_HEDGE_WON) hedges_won++;
+
+    chatty_report_histogram_add (&histograms [SERIALIZE], record->serialize_time);
+
+    if ((record->flags & (AICHAT_LEDGER_CACHED | AICHAT_LEDGER_REPLAYED)) || record->total_time == 0)
+      continue;
+
+    // a connection that was reused has no name lookup, connect or TLS phase
+    if (record->name_lookup_time) chatty_report_histogram_add (&histograms [NAME_LOOKUP], record->name_lookup_time);
+    if (record->connect_time) chatty_report_histogram_add (&histograms [CONNECT], record->connect_time);
+    if (record->tls_time) chatty_report_histogram_add (&histograms [TLS], record->tls_time);
+
+    chatty_report_histogram_add (&histograms [FIRST_BYTE], record->first_byte_time);
+    chatty_report_histogram_add (&histograms [TOTAL], record->total_time);
+
+    if (record->error == 0 && record->completion_tokens > 0)
+    {
+      double rate = record->completion_tokens * 1e6 / record->total_time;
+
+      chatty_report_histogram_add (&histograms [TOKEN_RATE], rate >= UINT32_MAX ? UINT32_MAX : (uint32_t) rate);
+      rate_tokens += record->completion_tokens;
+      rate_time += record->total_time;
+    }
+  }
+
+  printf ("ledger: %s\n", path);
+  printf ("%lu requests", totals.requests);
+
+  if (totals.requests > 0)
+  {
+    char first [32], last [32];
+
+    chatty_report_format_time (first_time, first, sizeof (first));
+    chatty_report_format_time (last_time, last, sizeof (last));
+    printf (" from %s to %s", first, last);
+  }
+
+  printf (", %lu failed, %lu answered from the cache, %lu replayed\n", totals.errors, cached, replayed);
+  printf ("%lu prompt tokens, %lu completion tokens\n", totals.prompt_tokens, totals.completion_tokens);
+
+  if (hedged > 0)
+    printf ("%lu requests were sent a second time, %lu of them answered by the duplicate first\n", hedged, hedges_won);
+
+  printf ("\n%-20s %10s %10s %10s %10s %10s\n", "latency (ms)", "requests", "p50", "p95", "p99", "max");
+  chatty_report_print_percentiles ("serialize", &histograms [SERIALIZE], 1e3);
+  chatty_report_print_percentiles ("dns", &histograms [NAME_LOOKUP], 1e3);
+  chatty_report_print_percentiles ("connect", &histograms [CONNECT], 1e3);
+  chatty_report_print_percentiles ("tls", &histograms [TLS], 1e3);
+  chatty_report_print_percentiles ("first byte", &histograms [FIRST_BYTE], 1e3);
+  chatty_report_print_percentiles ("total", &histograms [TOTAL], 1e3);
+
+  printf ("\n%-20s %10s %10s %10s %10s %10s\n", "tokens per second", "requests", "p50", "p95", "p99", "max");
+  chatty_report_print_percentiles ("per request", &histograms [TOKEN_RATE], 1);
+
+  if (rate_time > 0)
+    printf ("  %-18s %10s %10.3f\n", "overall", "", rate_tokens * 1e6 / rate_time);
+
+  chatty_report_print_groups ("per session", &sessions);
+  chatty_report_print_groups ("per day", &days);
+
+  munmap ((void *) data, status.st_size);
+  free (histograms);
+  free (sessions.groups);
+  free (days.groups);
+  free (path);
+}
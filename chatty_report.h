@@ -0,0 +1,6 @@
+#pragma once
+
+// every bucket of a histogram is at most 1/64 of its value wide
+#define CHATTY_REPORT_SUB_BUCKET_BITS 6
+
+void chatty_report (void);
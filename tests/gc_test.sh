@@ -0,0 +1,29 @@
+#!/bin/sh
+# forks a session, deletes the original and checks that chatty --gc keeps the messages the fork is based on
+set -e
+
+chatty=${CHATTY:-./chatty}
+
+XDG_DATA_HOME=$(mktemp -d)
+export XDG_DATA_HOME
+trap 'rm -rf "$XDG_DATA_HOME"' EXIT
+
+# a running daemon must not serve the sessions of this test
+export CHATTY_DAEMON=0
+
+"$chatty" --import=original <<'SESSION'
+{"model":"gpt-3.5-turbo","temperature":1,"messages":[{"role":"system","content":"You are a helpful assistant."},{"role":"user","content":"first question"},{"role":"assistant","content":"first answer"},{"role":"user","content":"second question"},{"role":"assistant","content":"second answer"}]}
+SESSION
+
+"$chatty" --session=original --fork=fork,3
+expected=$("$chatty" --export=fork)
+
+"$chatty" --delete=original
+"$chatty" --gc
+
+if [ "$("$chatty" --export=fork)" != "$expected" ]; then
+  echo "gc_test: the fork changed after --gc" >&2
+  exit 1
+fi
+
+echo "gc_test: ok"